@@ -1,5 +1,7 @@
 # Function to format and print a binary number
 def write_binary_strings_to_file(num_bits: int, count: int, file_name: str, remove_list: list):
+    legal_masks = []
+
     with open(file_name, "w") as file:
         state_num = 0
         for i in range(count):
@@ -19,13 +21,23 @@ def write_binary_strings_to_file(num_bits: int, count: int, file_name: str, remo
                 # binary_str[-5] = '1' and binary_str[-4] = '1'
                 binary_str = binary_str[:num_bits-5] + '11' + binary_str[-5+2:]
 
-            # Convert the string into the desired format
-            formatted_str = "{" + ", ".join(binary_str) + "}"
+            # Convert the string into the desired format (packed mask, output 1 in bit 0)
+            formatted_str = "0b" + binary_str
+            legal_masks.append(int(binary_str, 2))
 
             # Print the formatted string
             file.write(f'{formatted_str}, // state {state_num} -> GID {i} \n')
 
             state_num += 1
+
+        # bitmap of every legal output mask (bit [mask] set if the mask is a valid state)
+        bitmap = [0] * (2**num_bits // 8)
+        for mask in legal_masks:
+            bitmap[mask >> 3] |= 1 << (mask & 7)
+
+        file.write("\n// legalMaskBitmap\n")
+        for row in range(0, len(bitmap), 8):
+            file.write(", ".join(f"0x{b:02X}" for b in bitmap[row:row+8]) + ",\n")
     
     return state_num
 
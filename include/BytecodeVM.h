@@ -0,0 +1,143 @@
+#pragma once
+#include <Arduino.h>
+#include "ComsAPI.h"
+#include "OutputStateMachine.h"
+
+#define VM_STACK_DEPTH 16               // values on the operand stack
+#define VM_MAX_LOOPS 4                  // nested LOOPs
+#define VM_SLICE_US 200                 // time run() runs for, at most (the last instruction may run past it)
+#define VM_SPIN_US 150                  // waits ending sooner than this are busy-waited, for timing accuracy
+#define VM_BENCH_LOOPS 200              // iterations of the VM_BENCH program
+
+static_assert(VM_SPIN_US <= VM_SLICE_US, "a busy-wait is part of run()'s slice");
+
+// Opcodes. Operands follow the opcode, high byte first; addresses are offsets into the program.
+// Stack values are signed 16 bit.
+#define VM_OP_HALT          0x00    // end of the program
+#define VM_OP_PUSH8         0x01    // push the next byte (0 to 255)
+#define VM_OP_PUSH16        0x02    // push the next 2 bytes
+#define VM_OP_DUP           0x03    // push a copy of the top value
+#define VM_OP_DROP          0x04    // pop and discard
+#define VM_OP_ADD           0x05    // pop b, pop a, push a + b
+#define VM_OP_SUB           0x06    // pop b, pop a, push a - b
+#define VM_OP_JMP           0x07    // jump to the 2 byte address
+#define VM_OP_JZ            0x08    // pop; jump to the 2 byte address if it was 0
+#define VM_OP_LOOP          0x09    // pop n; run up to the matching END_LOOP n times (n <= 0: jump to the 2 byte
+                                    // address, just after END_LOOP)
+#define VM_OP_END_LOOP      0x0A    // back to the start of the innermost LOOP until it has run n times
+#define VM_OP_SET_STATE     0x10    // pop a state; MANUAL mode at that state
+#define VM_OP_STEP          0x11    // pop n; MANUAL mode n states on from the last state set (clamped)
+#define VM_OP_GET_STATE     0x12    // push the channel's current state
+#define VM_OP_SET_PERIOD    0x13    // pop the switching period in ms
+#define VM_OP_MODE          0x14    // pop a CycleMode (e.g. DECREASE_EZ to start a sweep)
+#define VM_OP_WAIT_SWEEP    0x15    // wait for the sweep to reach its end state
+#define VM_OP_WAIT_US       0x20    // pop a time in us (0 to 65535); wait that long after the last wait ended
+#define VM_OP_WAIT_MS       0x21    // pop a time in ms (0 to 65535); wait that long after the last wait ended
+#define VM_OP_EMIT          0x30    // pop a value and send it in a VM_EVENT
+
+// what run() stopped on
+enum VMStatus {
+    VM_IDLE = 0,        // no program running
+    VM_RUNNING,         // used up its time slice
+    VM_WAITING,         // in a wait
+    VM_EMITTED,         // EMIT: the value is in emitted()
+    VM_HALTED,          // reached HALT or the end of the program
+    VM_FAULTED,         // stopped by a fault (see fault())
+    VM_CANCELLED        // stopped by stop()
+};
+
+// why a program was stopped
+enum VMFault {
+    VM_FAULT_NONE = 0,
+    VM_FAULT_OPCODE = 1,    // unknown opcode
+    VM_FAULT_STACK = 2,     // stack overflow or underflow
+    VM_FAULT_ADDRESS = 3,   // jump or operand outside the program
+    VM_FAULT_LOOP = 4,      // LOOPs nested too deep, or END_LOOP outside a LOOP
+    VM_FAULT_CHANNEL = 5    // state or mode out of range, or no channel
+};
+
+/**************************************************************************/
+/*!
+    @brief  A LOOP being run.
+*/
+/**************************************************************************/
+struct VMLoop {
+    uint16_t start;         // address of the first instruction of the body
+    int16_t left;           // runs left, including the current one
+};
+
+/**************************************************************************/
+/*!
+    @brief  Class for a small stack based bytecode interpreter, so a test
+            sequence (loops, waits, state changes) runs on the Mega
+            without a serial round trip per step. Runs cooperatively: each
+            call to run() executes instructions for up to a time slice and
+            returns at a wait, an EMIT or the end of the program.
+            Waits run on the program's own clock, which advances by each
+            wait, so the time between waits does not add up as drift.
+            The program drives one channel through the same state machine
+            calls as the action codes.
+*/
+/**************************************************************************/
+class BytecodeVM {
+private:
+    const uint8_t *_code = NULL;
+    uint16_t _length = 0;
+    OutputStateMachineBase *_channel = NULL;
+    uint8_t _channelNum = 0;
+    uint16_t _numStates = 0;
+
+    bool _running = false;
+    bool _cancelled = false;                // stop() called, not yet reported by run()
+    bool _waitSweep = false;
+    unsigned long _clockUs = 0;             // the program's clock: micros() when the last wait ends
+    uint16_t _pc = 0;                       // next instruction
+    uint16_t _opPc = 0;                     // instruction being run
+    int16_t _stack[VM_STACK_DEPTH];
+    uint8_t _sp = 0;                        // values on the stack
+    VMLoop _loops[VM_MAX_LOOPS];
+    uint8_t _loopDepth = 0;
+    int16_t _stateNum = 0;                  // last state set, for STEP
+    int16_t _emitted = 0;
+    VMFault _fault = VM_FAULT_NONE;
+    uint32_t _executed = 0;                 // instructions run since start()
+
+    bool _fetch8(uint8_t &value);
+    bool _fetch16(uint16_t &value);
+    bool _push(int16_t value);
+    bool _pop(int16_t &value);
+    bool _waitDone(bool spin);
+    VMStatus _fail(VMFault fault);
+    VMStatus _execute();
+
+public:
+    void start(const uint8_t *code, uint16_t length, OutputStateMachineBase *channel, uint8_t channelNum,
+               uint16_t numStates);
+    void stop();
+    VMStatus run(uint16_t maxUs);
+
+    /*! @brief  Whether a program is driving a channel.
+        @param  channel channel to check
+        @return true if a program is running on that channel */
+    bool drives(uint8_t channel) { return _running && (channel == _channelNum); }
+
+    /*! @brief  Whether a program is running.
+        @return true until it halts, faults or is stopped */
+    bool running() { return _running; }
+
+    /*! @brief  Value of the last EMIT.
+        @return value */
+    int16_t emitted() { return _emitted; }
+
+    /*! @brief  Address of the last instruction run (EMIT, HALT or the
+                faulting one).
+        @return program address */
+    uint16_t pc() { return _opPc; }
+
+    /*! @brief  Why the program faulted.
+        @return fault, or VM_FAULT_NONE */
+    VMFault fault() { return _fault; }
+
+    static uint16_t benchNs();
+    void report();
+};
@@ -0,0 +1,118 @@
+#pragma once
+#include <Arduino.h>
+#include "ComsAPI.h"
+
+#define MAX_COMMAND_ARGS 8      // max number of argument frames an action code can take (checked by REGISTER_COMMAND)
+#define MAX_PENDING_COMMANDS 8  // complete action codes (with arguments) waiting to run
+
+// handler for an action code. args holds the argument frames received after the code.
+typedef void (*CommandHandler)(uint8_t code, const uint8_t *args);
+
+// called before the handler of every action code received. Returns true if it has taken the code
+// (the handler is not called).
+typedef bool (*CommandInterceptor)(uint8_t code, const uint8_t *args);
+
+/**************************************************************************/
+/*!
+    @brief  Entry in the action code dispatch table.
+*/
+/**************************************************************************/
+struct CommandEntry {
+    CommandHandler handler;
+    uint8_t numArgs;        // number of argument frames that follow the action code
+};
+
+/**************************************************************************/
+/*!
+    @brief  A complete action code waiting to run.
+*/
+/**************************************************************************/
+struct PendingCommand {
+    uint8_t code;
+    uint8_t args[MAX_COMMAND_ARGS];
+};
+
+void unknownCommand(uint8_t code, const uint8_t *args);
+
+/**************************************************************************/
+/*!
+    @brief  Compile-time registration of action code handlers.
+            Any action code without a REGISTER_COMMAND() resolves to
+            unknownCommand. Registrations can be made in any header or
+            source file, as long as they are visible where
+            DEFINE_COMMAND_TABLE() is expanded.
+*/
+/**************************************************************************/
+template <uint8_t CODE>
+struct CommandRegistration {
+    static constexpr CommandEntry entry() { return CommandEntry{ unknownCommand, 0 }; }
+};
+
+#define REGISTER_COMMAND(code, handler, numArgs)                                        \
+    template <>                                                                         \
+    struct CommandRegistration<(code)> {                                                \
+        static_assert((numArgs) <= MAX_COMMAND_ARGS, "action code takes more than MAX_COMMAND_ARGS args"); \
+        static constexpr CommandEntry entry() { return CommandEntry{ (handler), (numArgs) }; } \
+    };
+
+#define COMMAND_ENTRY(n)  CommandRegistration<(n)>::entry()
+#define COMMAND_REP4(n)   COMMAND_ENTRY(n), COMMAND_ENTRY(n+1), COMMAND_ENTRY(n+2), COMMAND_ENTRY(n+3)
+#define COMMAND_REP16(n)  COMMAND_REP4(n), COMMAND_REP4(n+4), COMMAND_REP4(n+8), COMMAND_REP4(n+12)
+#define COMMAND_REP64(n)  COMMAND_REP16(n), COMMAND_REP16(n+16), COMMAND_REP16(n+32), COMMAND_REP16(n+48)
+
+// Expand the flash-resident 256 entry dispatch table. Must come after every REGISTER_COMMAND().
+#define DEFINE_COMMAND_TABLE(name)                                                      \
+    const CommandEntry name[256] PROGMEM = {                                            \
+        COMMAND_REP64(0), COMMAND_REP64(64), COMMAND_REP64(128), COMMAND_REP64(192)     \
+    };
+
+
+/**************************************************************************/
+/*!
+    @brief  Class for dispatching action codes through a flash-resident
+            table of handlers, indexed directly by action code.
+            Codes that take arguments collect that many further frames
+            before their handler is called.
+            Complete action codes wait in a small queue and are run by
+            runNext() strictly in the order received, since many codes
+            depend on earlier ones (an upload before the code that uses it,
+            CHANNEL_SELECT before the codes it addresses). The emergency
+            stop doesn't wait in the queue: see EmergencyStop.
+*/
+/**************************************************************************/
+class CommandDispatcher {
+private:
+    const CommandEntry *_table;     // dispatch table in PROGMEM
+
+    uint8_t _pendingCode = NO_CODE; // code waiting for its argument frames
+    uint8_t _argsExpected = 0;
+    uint8_t _argsReceived = 0;
+    uint8_t _args[MAX_COMMAND_ARGS];
+
+    PendingCommand _ready[MAX_PENDING_COMMANDS];    // complete action codes, a ring in the order received
+    uint8_t _readyHead = 0;         // oldest complete action code
+    uint8_t _numReady = 0;
+
+    uint8_t _worstCode = NO_CODE;   // code with the slowest dispatch (lookup + handler) so far
+    unsigned long _worstUs = 0;
+
+    CommandInterceptor _interceptor = NULL;
+
+    void _enqueue(uint8_t code);
+    void _run(uint8_t code, const uint8_t *args);
+    void _execute(uint8_t code, CommandHandler handler, const uint8_t *args);
+
+public:
+    CommandDispatcher(const CommandEntry *table);
+    void dispatch(uint8_t frame);
+    bool runNext();
+    bool full();
+    void execute(uint8_t code);
+    void execute(uint8_t code, const uint8_t *args);
+    void executeIntercepted(uint8_t code, const uint8_t *args);
+    void setInterceptor(CommandInterceptor interceptor);
+    int8_t argCount(uint8_t code);
+    bool awaitingArgs();
+    void cancel();
+    void benchmark(uint8_t code);
+};
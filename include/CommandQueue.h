@@ -0,0 +1,25 @@
+#pragma once
+#include <Arduino.h>
+
+#define COMMAND_QUEUE_SIZE 16   // frames buffered between the serial reader and the dispatcher (power of 2)
+
+/**************************************************************************/
+/*!
+    @brief  Fixed size FIFO of received frames (action codes and their
+            arguments), waiting to be dispatched.
+*/
+/**************************************************************************/
+class CommandQueue {
+private:
+    uint8_t _frames[COMMAND_QUEUE_SIZE];
+    uint8_t _head = 0;      // next slot to write
+    uint8_t _tail = 0;      // next slot to read
+    uint8_t _count = 0;
+
+public:
+    bool push(uint8_t frame);
+    bool pop(uint8_t &frame);
+    uint8_t count();
+    uint8_t space();
+    void clear();
+};
@@ -16,8 +16,167 @@ enum CycleMode {
     IDLE            = 111
 };
 
+// Action codes that take arguments are followed by that many frames, each holding one byte (0-255).
+// Action codes run one at a time, in the order received, so a code can be sent straight after the ones it depends
+// on (e.g. VM_UPLOAD then VM_RUN, or CHANNEL_SELECT then the codes for that channel). Only ESTOP_BYTE overtakes them.
+
 // action code for changing switching time. Lets system know to interpret the next message as a time value.
 #define CHANGE_SWITCH_T 200
+#define DWELL_UPLOAD    201     // action code for setting dwell table entries. Args: first state (2 bytes), then
+                                // STATE_TABLE_UPLOAD_ENTRIES dwell times in ms (2 bytes each, 0 = use the switching time).
+                                // Reply: first state (2 bytes), or an [ERROR] line.
+#define DWELL_ENABLE    202     // action code for timing the selected channel's sweeps from the dwell table (1) or the
+                                // switching time (0). Args: 0 / 1. Reply: the setting in use.
+#define DWELL_SAVE      203     // action code for saving the dwell table to EEPROM (written in the background).
+                                // Reply: CRC-CCITT of the table (2 bytes).
+#define DWELL_CLEAR     204     // action code for dropping the dwell table (DWELL_SAVE to erase it from EEPROM too)
+#define EZ_UPLOAD       205     // action code for setting EZ calibration table values. Args: first state (2 bytes),
+                                // then STATE_TABLE_UPLOAD_ENTRIES measured EZ values (2 bytes each, EZ_UNITS_PER_EZ).
+                                // Reply: first state (2 bytes), or an [ERROR] line.
+#define EZ_SAVE         206     // action code for saving the EZ calibration table to EEPROM (written in the background).
+                                // Reply: CRC-CCITT of the table (2 bytes).
+#define GOTO_EZ         207     // action code for jumping the selected channel to the state nearest an EZ value. Args:
+                                // EZ (2 bytes). Reply: state (2 bytes), its calibrated EZ (2 bytes).
+#define EZ_SWEEP        208     // action code for sweeping the selected channel between two EZ values at a set rate,
+                                // timed from the EZ table (the dwell table is not touched). Args: start EZ (2 bytes),
+                                // end EZ (2 bytes), EZ per second (2 bytes). Reply: start state (2 bytes), end state
+                                // (2 bytes).
+
+// EZ values in action codes are fixed point, in 1/EZ_UNITS_PER_EZ steps (e.g. 5025 = EZ 50.25)
+#define EZ_UNITS_PER_EZ 100
+#define MEM_REPORT      210     // action code for requesting an SRAM usage report
+#define TIMING_REPORT   211     // action code for requesting step deadline and watchdog counters
+#define TASK_REPORT     212     // action code for requesting per-task CPU utilisation
+#define TELEMETRY_TOGGLE 213    // action code for toggling periodic state/mode telemetry
+#define DISPATCH_BENCH  214     // action code for benchmarking dispatch of the action code in the next frame
+#define VM_UPLOAD       215     // action code for uploading part of a bytecode test program (see BytecodeVM). Args:
+                                // offset (2 bytes), 6 program bytes. Offset 0 starts a new program. Not while one is
+                                // running. Reply: offset (2 bytes); or an [ERROR] line.
+#define VM_SAVE         216     // action code for saving the program to EEPROM (written in the background). Reply:
+                                // length (2 bytes), CRC-CCITT of the program (2 bytes).
+#define VM_RUN          217     // action code for running (1) or stopping (0) the program on the selected channel.
+                                // Reply: the arg; or an [ERROR] line.
+#define VM_EVENT        218     // sent by the Mega as the program runs. Followed by VMStatus (3 emit, 4 halted,
+                                // 5 faulted, 6 cancelled), program address (2 bytes), then the emitted value or the
+                                // VMFault (2 bytes).
+#define VM_BENCH        219     // action code for timing the interpreter. Reply: mean time per instruction in ns
+                                // (2 bytes).
+#define SET_RELAY_MASK  220     // action code for setting all relays at once (MANUAL mode). Args: mask, high byte first
+                                // (2 bytes, or 4 when the capability block reports more than 16 outputs).
+#define RELAY_OVERRIDE  221     // action code for disabling / forcing a relay. Args: output number (1 to the output
+                                // count, at most 16 as only those are saved), RelayOverride mode.
+#define SET_SWEEP_BOUNDS 222    // action code for setting the sweep start / end states. Args: start (2 bytes), end (2 bytes).
+#define CONFIG_SAVE     223     // action code for saving the current settings to EEPROM (written in the background)
+#define CONFIG_RESET    224     // action code for restoring and saving the default settings
+#define BAUD_PROPOSE    225     // action code for switching baud rate. Args: rate index (see baudRates in SerialPort.cpp).
+                                // The rate is not saved: the Mega always boots at 9600.
+#define BAUD_CONFIRM    226     // action code for confirming a new baud rate. Args: the 4 byte baudTestPattern.
+#define SEQ_RESET       227     // action code for enabling <seq,value> frames and restarting at seq 0. Args: window size.
+#define NO_OP           228     // action code that does nothing (link testing)
+#define FLOW_CONTROL    229     // action code for selecting flow control. Args: FlowControlMode (0 none, 1 XON/XOFF).
+#define LINK_STATS      230     // action code for requesting frame counters. Reply: received (2 bytes), dropped (2 bytes).
+#define CLOCK_SYNC      231     // action code for a clock sync exchange. Reply: receive time (4 bytes), send time (4 bytes).
+#define SCHEDULE_AT     232     // action code for running an action code at a set time. Args: micros() time (4 bytes), action code.
+#define SCHEDULE_DONE   233     // sent by the Mega when a scheduled action code has run. Followed by the action code and
+                                // the scheduling error in us (2 bytes, saturates at 65535)
+#define ESTOP_CLEAR     234     // action code for releasing the emergency stop latch
+#define ESTOP_TRIPPED   235     // sent by the Mega after an emergency stop. Followed by the RX interrupt to relays off
+                                // latency in us (2 bytes).
+#define HEARTBEAT       236     // action code the HMI sends to show it is alive (no reply). Any frame counts too.
+#define LINK_TIMEOUT    237     // action code for setting the link timeout. Args: timeout (x100 ms, 0 = off),
+                                // LinkLossAction (0 pause the sweep, 1 latch relays off). Reply: the same two values.
+#define LINK_LOST       238     // sent by the Mega when the link returns after timing out. Followed by the outage
+                                // length (x100 ms, 2 bytes, saturates at 65535) and the LinkLossAction applied.
+#define CHANNEL_SELECT  239     // action code for choosing the state machine channel that relay, mode, switching time,
+                                // sweep bound and SCHEDULE_AT codes address. Args: channel. Reply: selected channel.
+#define OUTPUT_BENCH    240     // action code for timing channel 0 output writes. Only with the e-stop latched.
+                                // Reply: output count, mean write time in ns (2 bytes).
+#define SYNC_ROLE       241     // action code for setting the sync line role. Args: SyncRole (0 standalone, 1 master,
+                                // 2 follower). Reply: the role in use.
+#define SYNC_AT         242     // sent by the sync master to followers on Serial1 only. Followed by the sync tick to run
+                                // on, the action code, its number of args and the args.
+#define SYNC_REPORT     243     // action code for requesting sync stats. Reply: role, sync edge to outputs written in us
+                                // (mean, 2 bytes; worst, 2 bytes), resyncs (2 bytes), missed edges (2 bytes),
+                                // late synced codes (2 bytes).
+#define TRAIN_START     244     // action code for simulating a train approaching the crossing on the selected channel
+                                // (MANUAL mode, states from the EZ calibration; any other mode stops it). Args:
+                                // speed in cm/s (2 bytes), acceleration in mm/s^2 (2 bytes, signed), distance from
+                                // the crossing in dm (2 bytes), approach length in dm (2 bytes). Reply: start state
+                                // (2 bytes), or an [ERROR] line.
+#define TRAIN_DONE      245     // sent by the Mega when a simulated train run ends. Followed by TrainModelEnd
+                                // (1 arrived, 2 stopped, 3 cancelled), elapsed ms (4 bytes), final state (2 bytes).
+#define TRAIN_BENCH     246     // action code for timing one train model update. Reply: mean time in ns (2 bytes).
+#define SCENARIO_UPLOAD 247     // action code for uploading part of a train scenario (see ScenarioStore). Args: slot,
+                                // index (0 header, 1 to 16 phase), 6 data bytes. Header: phases, trains (0 = until
+                                // stopped), start EZ (2 bytes), 2 unused. Phase: label, end EZ (2 bytes), duration in
+                                // ms (3 bytes). EZ in EZ_UNITS_PER_EZ. Reply: slot, index; or an [ERROR] line.
+#define SCENARIO_SAVE   248     // action code for saving the uploaded scenario to EEPROM. Args: slot. Reply: slot,
+                                // CRC-CCITT of the record (2 bytes); or an [ERROR] line.
+#define SCENARIO_START  249     // action code for playing a scenario on the selected channel (MANUAL mode, states from
+                                // the EZ calibration; any other mode cancels it). Args: slot, 1 to switch at the end of
+                                // the current train of a scenario already playing there (0 = now). Reply: slot,
+                                // 1 if the switch is pending; or an [ERROR] line. The sync master sends its scenario's
+                                // CRC with it; a follower whose scenario in that slot differs refuses it.
+#define SCENARIO_EVENT  250     // sent by the Mega as a scenario plays. Followed by ScenarioEventType (1 started,
+                                // 2 phase, 3 switched, 4 finished, 5 cancelled), slot, train, phase, phase label,
+                                // elapsed ms since the start (4 bytes).
+#define SEQ_ACK         252     // sent by the Mega: cumulative ACK, followed by the last in-order sequence number and
+                                // the number of credits (frames that may be sent after it without overrunning the
+                                // command queue or the serial RX buffer)
 #define HMI_ACK         253     // action code for acknowledging HMI hello
 #define HMI_HELLO       254     // action code for startup hello from HMI
-#define NO_CODE         255     // number used to signify when there is no current action code to execute
\ No newline at end of file
+#define NO_CODE         255     // number used to signify when there is no current action code to execute
+
+// Emergency stop: a single raw byte, sent on its own outside any <...> frame. It is acted on inside the
+// serial RX interrupt: every relay drops to off and stays off (and the state machine goes IDLE) until ESTOP_CLEAR.
+#define ESTOP_BYTE      '!'
+
+// ===================================
+//          Capability Block
+// ===================================
+// The HMI_ACK reply to HMI_HELLO is followed by a capability block, one byte per frame:
+//   <PROTOCOL_VERSION><block length N><N bytes, fields below in order>
+// Fields may be appended in later versions. Hosts should skip any bytes beyond those they know.
+//   feature bitmap          2 bytes (high byte first, FEATURE_* bits)
+//   state count             2 bytes (of the state table in use)
+//   output count            1 byte  (9, or SHIFT_REGISTER_OUTPUTS)
+//   min step period         2 bytes (ms)
+//   step period unit        1 byte  (ms per CHANGE_SWITCH_T count)
+//   step timing resolution  2 bytes (us)
+//   serial RX buffer        1 byte  (bytes)
+//   max command args        1 byte  (frames)
+//   command queue depth     1 byte  (action codes)
+//   max baud rate index     1 byte  (see BAUD_PROPOSE)
+//   schedule queue depth    1 byte  (action codes, see SCHEDULE_AT)
+//   channel count           1 byte  (state machines, see CHANNEL_SELECT)
+
+#define PROTOCOL_VERSION 2      // version 1: bare <HMI_ACK> with no capability block
+
+#define FEATURE_RELAY_MASK      0x0001  // SET_RELAY_MASK
+#define FEATURE_RELAY_OVERRIDE  0x0002  // RELAY_OVERRIDE
+#define FEATURE_SWEEP_BOUNDS    0x0004  // SET_SWEEP_BOUNDS
+#define FEATURE_CONFIG_STORE    0x0008  // CONFIG_SAVE / CONFIG_RESET
+#define FEATURE_BAUD_NEGOTIATE  0x0010  // BAUD_PROPOSE / BAUD_CONFIRM
+#define FEATURE_TELEMETRY       0x0020  // TELEMETRY_TOGGLE
+#define FEATURE_DIAGNOSTICS     0x0040  // MEM_REPORT / TIMING_REPORT / TASK_REPORT / DISPATCH_BENCH / OUTPUT_BENCH
+#define FEATURE_SEQUENCED       0x0080  // SEQ_RESET / <seq,value> frames / SEQ_ACK
+#define FEATURE_FLOW_CONTROL    0x0100  // FLOW_CONTROL / LINK_STATS / credits in SEQ_ACK
+#define FEATURE_SCHEDULING      0x0200  // CLOCK_SYNC / SCHEDULE_AT / SCHEDULE_DONE
+#define FEATURE_ESTOP           0x0400  // ESTOP_BYTE / ESTOP_CLEAR / ESTOP_TRIPPED
+#define FEATURE_HEARTBEAT       0x0800  // HEARTBEAT / LINK_TIMEOUT / LINK_LOST
+#define FEATURE_CHANNELS        0x1000  // CHANNEL_SELECT
+#define FEATURE_SYNC            0x2000  // SYNC_ROLE / SYNC_REPORT
+#define FEATURE_DWELL           0x4000  // DWELL_UPLOAD / DWELL_ENABLE / DWELL_SAVE / DWELL_CLEAR
+#define FEATURE_EZ_CALIBRATION  0x8000  // EZ_UPLOAD / EZ_SAVE / GOTO_EZ / EZ_SWEEP / TRAIN_START / TRAIN_DONE /
+                                        // TRAIN_BENCH / SCENARIO_* (no bits left: VM_* is not advertised)
+
+// ===================================
+//          Clock Sync
+// ===================================
+// Times are the Mega's micros(), sent high byte first, and wrap every ~71 minutes.
+// CLOCK_SYNC works like an NTP exchange. The HMI notes its send time t1 and receive time t4,
+// and the Mega replies with t2 (when the CLOCK_SYNC frame was received) and t3 (when the reply was queued):
+//   offset = ((t2 - t1) + (t3 - t4)) / 2        round trip = (t4 - t1) - (t3 - t2)
+// Send CLOCK_SYNC on its own and wait for the reply, so t2 belongs to it.
+// Repeated exchanges give the drift; samples with the shortest round trip are the most accurate.
+// SCHEDULE_AT only accepts action codes that take no arguments.
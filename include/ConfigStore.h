@@ -0,0 +1,78 @@
+#pragma once
+#include <Arduino.h>
+#include "EepromLayout.h"
+#include "EepromRecordWriter.h"
+
+#define CONFIG_VERSION 5            // bump when the layout of Config changes
+#define CONFIG_SAVE_HOLDOFF_MS 5000 // min time between deferred saves (limits EEPROM wear)
+#define CONFIG_OVERRIDE_OUTPUTS 16  // outputs whose overrides fit the relay* masks (a wider Config outgrows its slot)
+
+/**************************************************************************/
+/*!
+    @brief  Settings persisted across power cycles.
+*/
+/**************************************************************************/
+struct Config {
+    uint16_t switchTime;        // switching period, in ms
+    uint16_t sweepMin;          // sweep start state (highest EZ)
+    uint16_t sweepMax;          // sweep end state (lowest EZ)
+    uint16_t relayDisabled;     // RelayOutputs override masks (output 1 in bit 0)
+    uint16_t relayForcedOn;
+    uint16_t relayForcedOff;
+    uint8_t cycleMode;          // last cycle mode (see CycleMode)
+    uint16_t stateNum;          // last state number
+    uint8_t linkTimeout;        // HMI link timeout, x LINK_TIMEOUT_UNIT_MS (0 = off)
+    uint8_t linkLossAction;     // LinkLossAction applied when the link times out
+    uint8_t syncRole;           // SyncRole on the sync line
+    uint8_t dwellEnabled;       // sweeps timed from the dwell table (1) or switchTime (0)
+};
+
+/**************************************************************************/
+/*!
+    @brief  Layout of one slot in the EEPROM config ring.
+*/
+/**************************************************************************/
+struct ConfigRecord {
+    uint8_t magic;
+    uint8_t version;
+    uint16_t sequence;
+    Config config;
+    uint16_t crc;               // CRC-CCITT over every field above
+};
+
+/**************************************************************************/
+/*!
+    @brief  Class for persisting the Config in EEPROM.
+            Records are versioned and CRC-checked, and each save goes to
+            the next slot of a ring (see EepromLayout.h) so writes are
+            spread evenly over CONFIG_NUM_SLOTS slots. On load, the valid
+            record with the highest sequence number wins.
+            Saving writes one EEPROM byte per call to saveStep() (see
+            EepromRecordWriter), so a save never holds up loop().
+*/
+/**************************************************************************/
+class ConfigStore {
+private:
+    uint16_t _sequence = 0;     // sequence number of the newest record
+    uint8_t _slot = CONFIG_NUM_SLOTS - 1;   // slot holding the newest record
+    bool _dirty = false;
+    unsigned long _lastSaveMs = 0;
+    ConfigRecord _record;       // record being saved
+    EepromRecordWriter _writer;
+
+    static uint16_t _crc(const uint8_t *data, uint8_t len);
+    static uint8_t _saveByte(void *store, uint16_t pos);
+
+public:
+    Config data;
+
+    bool load(const Config &defaults);
+    void save();
+    bool saveStep();
+    bool saving();
+
+    void markDirty();
+    bool saveDue();
+
+    void report();
+};
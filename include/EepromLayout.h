@@ -0,0 +1,25 @@
+#pragma once
+
+// ==================================================
+//                  EEPROM Layout
+// ==================================================
+// ATmega2560 has 4 KB of EEPROM. Addresses below are byte offsets.
+
+#define EEPROM_MAGIC 0xA5                   // first byte of each record once it has been written
+
+// ring of configuration slots (see ConfigStore). Each save goes to the next slot.
+#define EEPROM_ADDR_CONFIG_RING 0
+#define CONFIG_SLOT_SIZE        32
+#define CONFIG_NUM_SLOTS        16          // 16 * 32 = 512 bytes
+
+// state value tables (see StateValueTable): 5 byte header, then one 16 bit value per state
+#define EEPROM_ADDR_DWELL_TABLE 512         // per-state dwell times, 512 to 1128
+#define EEPROM_ADDR_EZ_TABLE    1152        // EZ calibration, 1152 to 1768
+
+// train scenarios (see ScenarioStore): one record per slot
+#define EEPROM_ADDR_SCENARIOS   2048        // 2048 to 2559
+#define SCENARIO_SLOT_SIZE      128
+#define SCENARIO_SLOTS          4
+
+// bytecode test program (see VMProgram): 5 byte header, then the program
+#define EEPROM_ADDR_VM_PROGRAM  2560        // 2560 to 2820
@@ -0,0 +1,33 @@
+#pragma once
+#include <Arduino.h>
+
+#define EEPROM_WRITER_CHECKS 16     // unchanged bytes skipped per step(), bounding its run time
+
+// returns the byte of a record at an offset. context is the object passed to start().
+typedef uint8_t (*RecordByteFunction)(void *context, uint16_t pos);
+
+/**************************************************************************/
+/*!
+    @brief  Class for writing a record to EEPROM in the background, one
+            byte per call to step(), so loop() is never held up by the
+            ~3.3 ms each byte takes to write.
+            The record's first byte (its magic) is cleared first and
+            written last, so a save cut short by a reset leaves no record
+            rather than a half-written one. Bytes that already hold the
+            right value are not rewritten.
+*/
+/**************************************************************************/
+class EepromRecordWriter {
+private:
+    int _addr = 0;                          // EEPROM address of the record
+    uint16_t _size = 0;                     // bytes in the record
+    RecordByteFunction _recordByte = NULL;
+    void *_context = NULL;
+    int16_t _step = -1;                     // next step (-1: no save in progress)
+
+public:
+    void start(int addr, uint16_t size, RecordByteFunction recordByte, void *context);
+    bool step();
+    bool busy();
+    uint8_t percentDone();
+};
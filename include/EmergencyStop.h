@@ -0,0 +1,30 @@
+#pragma once
+#include <Arduino.h>
+#include "ComsAPI.h"
+#include "StepTimer.h"
+
+typedef void (*StopHandler)();
+
+/**************************************************************************/
+/*!
+    @brief  Emergency stop fast path. Replaces the Arduino core's Serial
+            (USART0) receive interrupt with one that checks every byte for
+            ESTOP_BYTE before it reaches the RX buffer, and calls the stop
+            handler straight from the interrupt. The relays are safe a few
+            microseconds after the byte arrives, however busy loop() is.
+            On sync followers Serial1 (USART1) gets the same fast path for
+            the ESTOP_BYTE passed on by the sync master.
+            All other bytes are buffered exactly as the core would.
+            The time from entering the interrupt to the stop handler
+            returning is measured with Timer1 (see StepTimer).
+*/
+/**************************************************************************/
+class EmergencyStop {
+public:
+    void begin(StopHandler handler);
+    bool triggered();
+    void stopOnSyncLink(bool enable);
+    bool syncTriggered();
+    uint16_t lastLatencyUs();
+    void report();
+};
@@ -0,0 +1,48 @@
+#pragma once
+#include <Arduino.h>
+
+#define LINK_TIMEOUT_UNIT_MS 100    // LINK_TIMEOUT is sent in units of this many ms
+
+// what to do when the HMI link times out
+enum LinkLossAction {
+    LINK_LOSS_PAUSE = 0,    // stop the sweep (IDLE), relays hold their current state
+    LINK_LOSS_SAFE  = 1     // stop the sweep and latch every relay off, as for an emergency stop
+};
+
+// result of LinkMonitor::check()
+enum LinkEvent {
+    LINK_NO_CHANGE = 0,
+    LINK_EXPIRED   = 1,     // nothing received for the timeout: apply the link loss action
+    LINK_RESTORED  = 2      // frames received again after expiring: report the outage
+};
+
+/**************************************************************************/
+/*!
+    @brief  Class for detecting loss of the HMI link. Any frame received
+            (HEARTBEAT being the cheapest) counts as a sign of life.
+            Only compares the received frame count against the last check,
+            so it costs nothing on the serial or step paths; call check()
+            from a slow task.
+            Monitoring starts with the first frame received after the
+            timeout is set, so a Mega with no HMI attached is left alone.
+*/
+/**************************************************************************/
+class LinkMonitor {
+private:
+    uint16_t _timeoutMs = 0;            // 0 = monitoring off
+    LinkLossAction _action = LINK_LOSS_PAUSE;
+
+    unsigned long _lastFrameStamp = 0;
+    unsigned long _lastSeenMs = 0;      // millis() timestamp frames were last seen
+    bool _armed = false;                // a frame has been seen since the timeout was set
+    bool _expired = false;
+    unsigned long _outageMs = 0;        // length of the last outage
+
+public:
+    void setTimeout(uint8_t timeoutUnits, LinkLossAction action);
+    uint8_t getTimeoutUnits();
+    LinkLossAction getAction();
+
+    LinkEvent check(unsigned long frameStamp);
+    unsigned long lastOutageMs();
+};
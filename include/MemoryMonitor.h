@@ -0,0 +1,23 @@
+#pragma once
+#include <Arduino.h>
+#include "CommandDispatcher.h"
+
+// byte pattern painted over free SRAM at startup. Stack usage overwrites it, which
+// lets the deepest point the stack has reached be recovered at runtime.
+#define STACK_CANARY 0xC5
+
+/**************************************************************************/
+/*!
+    @brief  Free-function helpers for monitoring SRAM use on the Mega.
+            The free SRAM between the heap and the stack is painted with
+            STACK_CANARY before any constructors run (see MemoryMonitor.cpp),
+            so the stack high-water mark can be read back at any time.
+*/
+/**************************************************************************/
+uint16_t freeMemory();
+uint16_t stackHighWaterMark();
+uint16_t stackHeadroom();
+void reportMemoryUsage();
+void memReportCommand(uint8_t code, const uint8_t *args);
+
+REGISTER_COMMAND(MEM_REPORT, memReportCommand, 0)
@@ -1,34 +1,363 @@
 #pragma once
 #include <Arduino.h>
+#include <util/atomic.h>
 #include "OutputStates.h"
 #include "PinMappings.h"
 #include "ComsAPI.h"
+#include "RelayOutputs.h"
+#include "StepTimer.h"
 
 #define MAX_STATE_NUM NUM_STATES-1
 
+// fields of an OutputFrame changed by the open transaction
+#define FRAME_STATE     0x01    // stateNum, endStateReached
+#define FRAME_MASK      0x02    // output mask (written to the outputs on commit)
+#define FRAME_MODE      0x04    // mode
+#define FRAME_PERIOD    0x08    // periodTicks, dwellTicks, ezValues, ezRateFactor, ezRateShift
+#define FRAME_BOUNDS    0x10    // sweepMin, sweepMax
+
+// changes that restart the step countdown, so the committed state is held for a full period
+#define FRAME_RESTART_STEP (FRAME_STATE | FRAME_MASK | FRAME_MODE | FRAME_PERIOD)
+
+/**************************************************************************/
+/*!
+    @brief  Everything the step timer needs to drive the outputs, apart
+            from the output mask (held by OutputStateMachine, as its width
+            depends on the output stage).
+*/
+/**************************************************************************/
+struct OutputFrame {
+    int stateNum;               // number of the current state (indexes the state table)
+    CycleMode mode;
+    uint16_t periodTicks;       // switching period, in step timer ticks
+    const uint16_t *dwellTicks; // per-state periods replacing periodTicks (0 entries: periodTicks), or NULL
+    const uint16_t *ezValues;   // EZ of each state, timing the sweeps at a constant EZ rate instead, or NULL
+    uint16_t ezRateFactor;      // ticks per EZ unit, scaled up by 2^ezRateShift and rounded
+    uint8_t ezRateShift;
+    int sweepMin;               // states the EZ sweeps start / end at
+    int sweepMax;
+    bool endStateReached;
+};
+
+/**************************************************************************/
+/*!
+    @brief  Part of the state machine that doesn't depend on the state
+            table or the output stage: cycle modes, sweep bounds, the
+            switching period and the shadow-frame transactions.
+            Stepping runs from the step timer interrupt (tick()). Changes
+            from loop() are written to a shadow frame and committed as one
+            transaction: the next tick swaps the shadow frame in and applies
+            its outputs, so the outputs never change between ticks and a
+            multi-field update is never seen half done.
+            Changes made between beginTransaction() and commitTransaction()
+            are committed together; a change made outside a transaction is
+            committed on its own.
+            After holdCommits(), commits are held back (and later ones
+            merged into them) until the step timer calls releaseCommits(),
+            so a change prepared ahead is committed on a chosen tick.
+*/
+/**************************************************************************/
+class OutputStateMachineBase {
+protected:
+    const int _maxStateNum;             // last state of the table
+
+    OutputFrame _frames[2];
+    volatile uint8_t _live = 0;         // index of the frame driving the outputs
+    volatile uint8_t _pendingFields = 0;// fields of the shadow frame waiting for the next tick (0: nothing to commit)
+    volatile uint8_t _heldFields = 0;   // fields of the shadow frame committed while commits are held
+    volatile bool _holdCommits = false; // commits go to _heldFields until releaseCommits()
+    uint8_t _openFields = 0;            // fields changed by the open transaction
+    volatile bool _transactionOpen = false;
+    bool _ownTransaction = false;       // transaction opened by _begin() for a single change
+    uint16_t _countdown = 1;            // ticks until the next step (ISR only)
+    uint16_t _ezCarry = 0;              // part of a tick owed to the next EZ rate hold, in 2^-ezRateShift ticks (ISR only)
+
+    OutputStateMachineBase(int maxStateNum);
+
+    OutputFrame &_begin();
+    void _end();
+    bool _stepFrame(OutputFrame &frame);
+    void _nextStateDecreaseEZ(OutputFrame &frame);
+    void _nextStateIncreaseEZ(OutputFrame &frame);
+
+    /*! @brief  Ticks to hold the frame's current state for.
+        @param  frame frame to time
+        @return time for the EZ to reach the next state's at the EZ rate,
+                the dwell table entry of the state, or the constant period */
+    uint16_t _stateTicks(const OutputFrame &frame) {
+        if (frame.ezValues) {
+            return _ezRateTicks(frame);
+        }
+        uint16_t ticks = frame.dwellTicks ? frame.dwellTicks[frame.stateNum] : 0;
+        return ticks ? ticks : frame.periodTicks;
+    }
+    uint16_t _ezRateTicks(const OutputFrame &frame);
+
+    /*! @brief  Set the shadow frame's mask to the outputs of its state.
+                Called from loop() only. */
+    virtual void _loadStateMask() = 0;
+
+public:
+    void changeCylceMode(uint8_t newMode);
+
+    void beginTransaction();
+    void commitTransaction();
+    void holdCommits();
+    bool releaseCommits();
+
+    int getStateNum();
+    CycleMode getCycleMode();
+    bool endStateReached();
+
+    /*! @brief  Whether a committed change is still waiting for the next
+                step timer tick (or is held), so getters still show the old
+                frame.
+        @return true until the tick applies it */
+    bool changePending() { return (_pendingFields | _heldFields) != 0; }
+
+    void restoreState(int stateNum, uint8_t mode);
+
+    void setPeriod(uint16_t periodMs);
+    uint16_t getPeriod();
+    void setDwellTable(const uint16_t *dwellTicks);
+    bool usesDwellTable();
+    void setEzRate(const uint16_t *ezValues, uint16_t ezPerSecond);
+
+    bool setSweepBounds(int sweepMin, int sweepMax);
+    int getSweepMin();
+    int getSweepMax();
+};
+
 /**************************************************************************/
 /*!
     @brief  Class for controlling digital outputs that interface to relays.
             Uses a state machine to cycle through list of valid output
             states.
+            Specialised at compile time on the state table and the output
+            stage, so the table lookups, mask width and output loops in the
+            step timer interrupt are fixed by the compiler and no virtual
+            call is made from it.
+    @param  Table
+            state table: Mask type, numStates, numOutputs, state(n) and
+            isLegal(mask) (see RelayStateTable)
+    @param  Outputs
+            output stage: Mask type, numOutputs and write(mask) (see
+            RelayOutputs)
 */
 /**************************************************************************/
-class OutputStateMachine {
+template <class Table, class Outputs>
+class OutputStateMachine : public OutputStateMachineBase {
+public:
+    typedef typename Table::Mask Mask;
+    static const int numStates = Table::numStates;
+
 private:
-    int _currentStateNum;       // number of the current state (indexes outputStateArray)
-    const bool* _currentStateOutputsArr;    // array of outputs for the current state
+    static_assert(Table::numOutputs == Outputs::numOutputs, "state table and output stage have different output counts");
+    static_assert(sizeof(typename Outputs::Mask) >= sizeof(Mask), "output stage mask narrower than the state table's");
+    static_assert(Table::numOutputs <= sizeof(Mask) * 8, "state table mask too narrow for its outputs");
 
-    CycleMode _cycleMode = MANUAL;
+    Outputs &_outputs;          // output stage the state masks are written to
+    Mask _masks[2];             // output mask of each frame (output 1 in bit 0, on=1)
 
-    void _applyStateOutputs();
-    void _nextStateDecreaseEZ();
-    void _nextStateIncreaseEZ();
+    void _swapFrames();
+    void _loadStateMask();
 
 public:
-    bool endStateReached = false;
+    OutputStateMachine(Outputs &outputs);
+    void tick();
+    bool driveState(int stateNum);
+    void commitNow();
 
-    OutputStateMachine();
-    void nextState();
-    void changeCylceMode(uint8_t newMode);
+    void setMask(Mask mask);
+    void toggleMask(Mask bits);
+
+    /*! @brief  Check whether an output mask matches one of the valid states.
+        @param  mask packed outputs (output 1 in bit 0, on=1)
+        @return true if the mask is a legal combination of outputs */
+    static bool isLegalMask(Mask mask) { return Table::isLegal(mask); }
 };
 
+// state machine for the relay board
+typedef OutputStateMachine<RelayStateTable, RelayOutputs> RelayStateMachine;
+
+
+/**************************************************************************/
+/*!
+    @brief  Constructor
+    @param  outputs
+            Output stage that drives the relays.
+*/
+/**************************************************************************/
+template <class Table, class Outputs>
+OutputStateMachine<Table, Outputs>::OutputStateMachine(Outputs &outputs)
+    : OutputStateMachineBase(Table::numStates - 1), _outputs(outputs) {
+    _masks[0] = BOOT_OUTPUT_MASK;
+    _masks[1] = BOOT_OUTPUT_MASK;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Step timer tick. Commits a pending transaction, otherwise counts
+            down to the next state step. Called from the timer interrupt.
+    @return void
+*/
+/**************************************************************************/
+template <class Table, class Outputs>
+void OutputStateMachine<Table, Outputs>::tick() {
+    if (_pendingFields) {
+        uint8_t fields = _pendingFields;
+        _swapFrames();
+        if (fields & FRAME_RESTART_STEP) return;
+    }
+
+    if (--_countdown > 0) {
+        return;
+    }
+
+    // a step in an EZ sweep moves to the next state: drive its outputs
+    OutputFrame &frame = _frames[_live];
+    if (_stepFrame(frame)) {
+        _masks[_live] = Table::state(frame.stateNum);
+        _outputs.write(_masks[_live]);
+    }
+    _countdown = _stateTicks(frame);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Step timer tick for a channel driven by a model (e.g.
+            TrainModel) rather than by the sweeps. Commits a pending
+            transaction, then, in MANUAL mode, moves to the given state and
+            drives its outputs if it differs from the current one. Called
+            from the timer interrupt in place of tick().
+    @param  stateNum
+            state the model wants (indexes the state table)
+    @return false if the channel has left MANUAL mode, so the model must
+            stop driving it
+*/
+/**************************************************************************/
+template <class Table, class Outputs>
+bool OutputStateMachine<Table, Outputs>::driveState(int stateNum) {
+    if (_pendingFields) {
+        _swapFrames();
+    }
+
+    OutputFrame &frame = _frames[_live];
+    if (frame.mode != MANUAL) {
+        return false;
+    }
+    if ((stateNum != frame.stateNum) && (stateNum >= 0) && (stateNum <= _maxStateNum)) {
+        frame.stateNum = stateNum;
+        _masks[_live] = Table::state(stateNum);
+        _outputs.write(_masks[_live]);
+    }
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Commit the open transaction (if any) and apply it straight away
+            rather than waiting for the next tick. Used before the step
+            timer is running, and for scheduled action codes that must take
+            effect at their exact time. The step countdown restarts from now.
+    @return void
+*/
+/**************************************************************************/
+template <class Table, class Outputs>
+void OutputStateMachine<Table, Outputs>::commitNow() {
+    commitTransaction();
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (_pendingFields) _swapFrames();
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Make the shadow frame live. Fields the transaction did not
+            change are carried over from the live frame, so steps taken
+            while the transaction was open are kept.
+            Must only be called with interrupts disabled.
+    @return void
+*/
+/**************************************************************************/
+template <class Table, class Outputs>
+void OutputStateMachine<Table, Outputs>::_swapFrames() {
+    uint8_t fields = _pendingFields;
+    uint8_t live = _live;
+    OutputFrame &next = _frames[live ^ 1];
+
+    if (!(fields & FRAME_STATE)) {
+        next.stateNum = _frames[live].stateNum;
+        next.endStateReached = (fields & FRAME_MODE) ? false : _frames[live].endStateReached;
+    }
+    if (!(fields & FRAME_MASK)) _masks[live ^ 1] = _masks[live];
+
+    _live = live ^ 1;
+    _pendingFields = 0;
+
+    if (fields & FRAME_MASK) _outputs.write(_masks[live ^ 1]);
+    if (fields & FRAME_PERIOD) _ezCarry = 0;
+    if (fields & FRAME_RESTART_STEP) _countdown = _stateTicks(next);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Set the shadow frame's mask to the outputs of its state.
+    @return void
+*/
+/**************************************************************************/
+template <class Table, class Outputs>
+void OutputStateMachine<Table, Outputs>::_loadStateMask() {
+    uint8_t shadow = _live ^ 1;
+    // disable / force overrides are applied by the output stage
+    _masks[shadow] = Table::state(_frames[shadow].stateNum);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Set every output at once, without changing state.
+    @param  mask
+            packed outputs (output 1 in bit 0, on=1)
+    @return void
+*/
+/**************************************************************************/
+template <class Table, class Outputs>
+void OutputStateMachine<Table, Outputs>::setMask(Mask mask) {
+    _begin();
+
+    _masks[_live ^ 1] = mask;
+    _openFields |= FRAME_MASK;
+
+    _end();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Toggle outputs, without changing state. Toggles made before the
+            previous change is committed are combined with it.
+    @param  bits
+            packed outputs to toggle (output 1 in bit 0)
+    @return void
+*/
+/**************************************************************************/
+template <class Table, class Outputs>
+void OutputStateMachine<Table, Outputs>::toggleMask(Mask bits) {
+    _begin();
+
+    // start from the live outputs unless the transaction has already set the mask
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (!(_openFields & FRAME_MASK)) _masks[_live ^ 1] = _masks[_live];
+    }
+    _masks[_live ^ 1] ^= bits;
+    _openFields |= FRAME_MASK;
+
+    _end();
+}
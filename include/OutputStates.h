@@ -7,319 +7,400 @@
 #define NUM_OUTPUTS 9
 
 /*
-    Holds list of output states.
-    Each row represents a set of outputs.
-    The values in each row represent the value of each output for that state (on=1, off=0).
-    First output is in the last position; last output is in the first position.
+    Holds list of output states, stored in flash (read with pgm_read_word).
+    Each entry is the packed set of outputs for that state (on=1, off=0).
+    Output 1 is bit 0; output 9 is bit 8.
 */
-const bool outputStateArray[NUM_STATES][NUM_OUTPUTS] = {
-//   9  8  7  6  5  4  3  2  1   Ouput Num
-    {0, 0, 0, 0, 0, 0, 0, 0, 0}, // state 0 -> GID 0 
-    {0, 0, 0, 0, 0, 0, 0, 0, 1}, // state 1 -> GID 1 
-    {0, 0, 0, 0, 0, 0, 0, 1, 0}, // state 2 -> GID 2 
-    {0, 0, 0, 0, 0, 0, 0, 1, 1}, // state 3 -> GID 3 
-    {0, 0, 0, 0, 0, 0, 1, 0, 0}, // state 4 -> GID 4 
-    {0, 0, 0, 0, 0, 0, 1, 0, 1}, // state 5 -> GID 5 
-    {0, 0, 0, 0, 0, 0, 1, 1, 0}, // state 6 -> GID 6 
-    {0, 0, 0, 0, 0, 0, 1, 1, 1}, // state 7 -> GID 7 
-    {0, 0, 0, 0, 0, 1, 0, 0, 0}, // state 8 -> GID 8 
-    {0, 0, 0, 0, 0, 1, 0, 0, 1}, // state 9 -> GID 9 
-    {0, 0, 0, 0, 0, 1, 0, 1, 0}, // state 10 -> GID 10 
-    {0, 0, 0, 0, 0, 1, 0, 1, 1}, // state 11 -> GID 11 
-    {0, 0, 0, 0, 0, 1, 1, 0, 0}, // state 12 -> GID 12 
-    {0, 0, 0, 0, 0, 1, 1, 0, 1}, // state 13 -> GID 13 
-    {0, 0, 0, 0, 0, 1, 1, 1, 0}, // state 14 -> GID 14 
-    {0, 0, 0, 0, 0, 1, 1, 1, 1}, // state 15 -> GID 15 
-    {0, 0, 0, 0, 1, 0, 0, 0, 0}, // state 16 -> GID 16 
-    {0, 0, 0, 0, 1, 0, 0, 0, 1}, // state 17 -> GID 17 
-    {0, 0, 0, 0, 1, 0, 0, 1, 0}, // state 18 -> GID 18 
-    {0, 0, 0, 0, 1, 0, 0, 1, 1}, // state 19 -> GID 19 
-    {0, 0, 0, 0, 1, 0, 1, 0, 0}, // state 20 -> GID 20 
-    {0, 0, 0, 0, 1, 0, 1, 0, 1}, // state 21 -> GID 21 
-    {0, 0, 0, 0, 1, 0, 1, 1, 0}, // state 22 -> GID 22 
-    {0, 0, 0, 0, 1, 0, 1, 1, 1}, // state 23 -> GID 23 
-    {0, 0, 0, 0, 1, 1, 0, 0, 0}, // state 24 -> GID 24 
-    {0, 0, 0, 0, 1, 1, 0, 0, 1}, // state 25 -> GID 25 
-    {0, 0, 0, 0, 1, 1, 0, 1, 0}, // state 26 -> GID 26 
-    {0, 0, 0, 0, 1, 1, 0, 1, 1}, // state 27 -> GID 27 
-    {0, 0, 0, 0, 1, 1, 1, 0, 0}, // state 28 -> GID 28 
-    {0, 0, 0, 0, 1, 1, 1, 0, 1}, // state 29 -> GID 29 
-    {0, 0, 0, 0, 1, 1, 1, 1, 0}, // state 30 -> GID 30 
-    {0, 0, 0, 0, 1, 1, 1, 1, 1}, // state 31 -> GID 31 
-    {0, 0, 0, 1, 1, 1, 0, 0, 0}, // state 32 -> GID 32 
-    {0, 0, 0, 1, 1, 1, 0, 0, 1}, // state 33 -> GID 33 
-    {0, 0, 0, 1, 1, 1, 0, 1, 0}, // state 34 -> GID 34 
-    {0, 0, 0, 1, 1, 1, 0, 1, 1}, // state 35 -> GID 35 
-    {0, 0, 0, 1, 1, 1, 1, 0, 0}, // state 36 -> GID 36 
-    {0, 0, 0, 1, 1, 1, 1, 0, 1}, // state 37 -> GID 37 
-    {0, 0, 0, 1, 1, 1, 1, 1, 0}, // state 38 -> GID 38 
-    {0, 0, 0, 1, 1, 1, 1, 1, 1}, // state 39 -> GID 39 
-    {0, 0, 1, 0, 0, 0, 0, 1, 0}, // state 40 -> GID 66 
-    {0, 0, 1, 0, 0, 0, 0, 1, 1}, // state 41 -> GID 67 
-    {0, 0, 1, 0, 0, 0, 1, 0, 0}, // state 42 -> GID 68 
-    {0, 0, 1, 0, 0, 0, 1, 0, 1}, // state 43 -> GID 69 
-    {0, 0, 1, 0, 0, 0, 1, 1, 0}, // state 44 -> GID 70 
-    {0, 0, 1, 0, 0, 0, 1, 1, 1}, // state 45 -> GID 71 
-    {0, 0, 1, 0, 0, 1, 0, 0, 0}, // state 46 -> GID 72 
-    {0, 0, 1, 0, 0, 1, 0, 0, 1}, // state 47 -> GID 73 
-    {0, 0, 1, 0, 0, 1, 0, 1, 0}, // state 48 -> GID 74 
-    {0, 0, 1, 0, 0, 1, 0, 1, 1}, // state 49 -> GID 75 
-    {0, 0, 1, 0, 0, 1, 1, 0, 0}, // state 50 -> GID 76 
-    {0, 0, 1, 0, 0, 1, 1, 0, 1}, // state 51 -> GID 77 
-    {0, 0, 1, 0, 0, 1, 1, 1, 0}, // state 52 -> GID 78 
-    {0, 0, 1, 0, 0, 1, 1, 1, 1}, // state 53 -> GID 79 
-    {0, 0, 1, 0, 1, 0, 0, 0, 0}, // state 54 -> GID 80 
-    {0, 0, 1, 0, 1, 0, 0, 0, 1}, // state 55 -> GID 81 
-    {0, 0, 1, 0, 1, 0, 0, 1, 0}, // state 56 -> GID 82 
-    {0, 0, 1, 0, 1, 0, 0, 1, 1}, // state 57 -> GID 83 
-    {0, 0, 1, 0, 1, 0, 1, 0, 0}, // state 58 -> GID 84 
-    {0, 0, 1, 0, 1, 0, 1, 0, 1}, // state 59 -> GID 85 
-    {0, 0, 1, 0, 1, 0, 1, 1, 0}, // state 60 -> GID 86 
-    {0, 0, 1, 0, 1, 0, 1, 1, 1}, // state 61 -> GID 87 
-    {0, 0, 1, 0, 1, 1, 0, 0, 0}, // state 62 -> GID 88 
-    {0, 0, 1, 0, 1, 1, 0, 0, 1}, // state 63 -> GID 89 
-    {0, 0, 1, 0, 1, 1, 0, 1, 0}, // state 64 -> GID 90 
-    {0, 0, 1, 0, 1, 1, 0, 1, 1}, // state 65 -> GID 91 
-    {0, 0, 1, 0, 1, 1, 1, 0, 0}, // state 66 -> GID 92 
-    {0, 0, 1, 0, 1, 1, 1, 0, 1}, // state 67 -> GID 93 
-    {0, 0, 1, 0, 1, 1, 1, 1, 0}, // state 68 -> GID 94 
-    {0, 0, 1, 0, 1, 1, 1, 1, 1}, // state 69 -> GID 95 
-    {0, 0, 1, 1, 1, 1, 0, 0, 0}, // state 70 -> GID 96 
-    {0, 0, 1, 1, 1, 1, 0, 0, 1}, // state 71 -> GID 97 
-    {0, 0, 1, 1, 1, 1, 0, 1, 0}, // state 72 -> GID 98 
-    {0, 0, 1, 1, 1, 1, 0, 1, 1}, // state 73 -> GID 99 
-    {0, 0, 1, 1, 1, 1, 1, 0, 0}, // state 74 -> GID 100 
-    {0, 0, 1, 1, 1, 1, 1, 0, 1}, // state 75 -> GID 101 
-    {0, 0, 1, 1, 1, 1, 1, 1, 0}, // state 76 -> GID 102 
-    {0, 0, 1, 1, 1, 1, 1, 1, 1}, // state 77 -> GID 103 
-    {0, 1, 0, 0, 0, 0, 0, 1, 0}, // state 78 -> GID 130 
-    {0, 1, 0, 0, 0, 0, 0, 1, 1}, // state 79 -> GID 131 
-    {0, 1, 0, 0, 0, 0, 1, 0, 0}, // state 80 -> GID 132 
-    {0, 1, 0, 0, 0, 0, 1, 0, 1}, // state 81 -> GID 133 
-    {0, 1, 0, 0, 0, 0, 1, 1, 0}, // state 82 -> GID 134 
-    {0, 1, 0, 0, 0, 0, 1, 1, 1}, // state 83 -> GID 135 
-    {0, 1, 0, 0, 0, 1, 0, 0, 0}, // state 84 -> GID 136 
-    {0, 1, 0, 0, 0, 1, 0, 0, 1}, // state 85 -> GID 137 
-    {0, 1, 0, 0, 0, 1, 0, 1, 0}, // state 86 -> GID 138 
-    {0, 1, 0, 0, 0, 1, 0, 1, 1}, // state 87 -> GID 139 
-    {0, 1, 0, 0, 0, 1, 1, 0, 0}, // state 88 -> GID 140 
-    {0, 1, 0, 0, 0, 1, 1, 0, 1}, // state 89 -> GID 141 
-    {0, 1, 0, 0, 0, 1, 1, 1, 0}, // state 90 -> GID 142 
-    {0, 1, 0, 0, 0, 1, 1, 1, 1}, // state 91 -> GID 143 
-    {0, 1, 0, 0, 1, 0, 0, 0, 0}, // state 92 -> GID 144 
-    {0, 1, 0, 0, 1, 0, 0, 0, 1}, // state 93 -> GID 145 
-    {0, 1, 0, 0, 1, 0, 0, 1, 0}, // state 94 -> GID 146 
-    {0, 1, 0, 0, 1, 0, 0, 1, 1}, // state 95 -> GID 147 
-    {0, 1, 0, 0, 1, 0, 1, 0, 0}, // state 96 -> GID 148 
-    {0, 1, 0, 0, 1, 0, 1, 0, 1}, // state 97 -> GID 149 
-    {0, 1, 0, 0, 1, 0, 1, 1, 0}, // state 98 -> GID 150 
-    {0, 1, 0, 0, 1, 0, 1, 1, 1}, // state 99 -> GID 151 
-    {0, 1, 0, 0, 1, 1, 0, 0, 0}, // state 100 -> GID 152 
-    {0, 1, 0, 0, 1, 1, 0, 0, 1}, // state 101 -> GID 153 
-    {0, 1, 0, 0, 1, 1, 0, 1, 0}, // state 102 -> GID 154 
-    {0, 1, 0, 0, 1, 1, 0, 1, 1}, // state 103 -> GID 155 
-    {0, 1, 0, 0, 1, 1, 1, 0, 0}, // state 104 -> GID 156 
-    {0, 1, 0, 0, 1, 1, 1, 0, 1}, // state 105 -> GID 157 
-    {0, 1, 0, 0, 1, 1, 1, 1, 0}, // state 106 -> GID 158 
-    {0, 1, 0, 0, 1, 1, 1, 1, 1}, // state 107 -> GID 159 
-    {0, 1, 0, 1, 1, 1, 0, 0, 0}, // state 108 -> GID 160 
-    {0, 1, 0, 1, 1, 1, 0, 0, 1}, // state 109 -> GID 161 
-    {0, 1, 0, 1, 1, 1, 0, 1, 0}, // state 110 -> GID 162 
-    {0, 1, 0, 1, 1, 1, 0, 1, 1}, // state 111 -> GID 163 
-    {0, 1, 0, 1, 1, 1, 1, 0, 0}, // state 112 -> GID 164 
-    {0, 1, 0, 1, 1, 1, 1, 0, 1}, // state 113 -> GID 165 
-    {0, 1, 0, 1, 1, 1, 1, 1, 0}, // state 114 -> GID 166 
-    {0, 1, 0, 1, 1, 1, 1, 1, 1}, // state 115 -> GID 167 
-    {0, 1, 1, 0, 0, 0, 0, 1, 0}, // state 116 -> GID 194 
-    {0, 1, 1, 0, 0, 0, 0, 1, 1}, // state 117 -> GID 195 
-    {0, 1, 1, 0, 0, 0, 1, 0, 0}, // state 118 -> GID 196 
-    {0, 1, 1, 0, 0, 0, 1, 0, 1}, // state 119 -> GID 197 
-    {0, 1, 1, 0, 0, 0, 1, 1, 0}, // state 120 -> GID 198 
-    {0, 1, 1, 0, 0, 0, 1, 1, 1}, // state 121 -> GID 199 
-    {0, 1, 1, 0, 0, 1, 0, 0, 0}, // state 122 -> GID 200 
-    {0, 1, 1, 0, 0, 1, 0, 0, 1}, // state 123 -> GID 201 
-    {0, 1, 1, 0, 0, 1, 0, 1, 0}, // state 124 -> GID 202 
-    {0, 1, 1, 0, 0, 1, 0, 1, 1}, // state 125 -> GID 203 
-    {0, 1, 1, 0, 0, 1, 1, 0, 0}, // state 126 -> GID 204 
-    {0, 1, 1, 0, 0, 1, 1, 0, 1}, // state 127 -> GID 205 
-    {0, 1, 1, 0, 0, 1, 1, 1, 0}, // state 128 -> GID 206 
-    {0, 1, 1, 0, 0, 1, 1, 1, 1}, // state 129 -> GID 207 
-    {0, 1, 1, 0, 1, 0, 0, 0, 0}, // state 130 -> GID 208 
-    {0, 1, 1, 0, 1, 0, 0, 0, 1}, // state 131 -> GID 209 
-    {0, 1, 1, 0, 1, 0, 0, 1, 0}, // state 132 -> GID 210 
-    {0, 1, 1, 0, 1, 0, 0, 1, 1}, // state 133 -> GID 211 
-    {0, 1, 1, 0, 1, 0, 1, 0, 0}, // state 134 -> GID 212 
-    {0, 1, 1, 0, 1, 0, 1, 0, 1}, // state 135 -> GID 213 
-    {0, 1, 1, 0, 1, 0, 1, 1, 0}, // state 136 -> GID 214 
-    {0, 1, 1, 0, 1, 0, 1, 1, 1}, // state 137 -> GID 215 
-    {0, 1, 1, 0, 1, 1, 0, 0, 0}, // state 138 -> GID 216 
-    {0, 1, 1, 0, 1, 1, 0, 0, 1}, // state 139 -> GID 217 
-    {0, 1, 1, 0, 1, 1, 0, 1, 0}, // state 140 -> GID 218 
-    {0, 1, 1, 0, 1, 1, 0, 1, 1}, // state 141 -> GID 219 
-    {0, 1, 1, 0, 1, 1, 1, 0, 0}, // state 142 -> GID 220 
-    {0, 1, 1, 0, 1, 1, 1, 0, 1}, // state 143 -> GID 221 
-    {0, 1, 1, 0, 1, 1, 1, 1, 0}, // state 144 -> GID 222 
-    {0, 1, 1, 0, 1, 1, 1, 1, 1}, // state 145 -> GID 223 
-    {0, 1, 1, 1, 1, 1, 0, 0, 0}, // state 146 -> GID 224 
-    {0, 1, 1, 1, 1, 1, 0, 0, 1}, // state 147 -> GID 225 
-    {0, 1, 1, 1, 1, 1, 0, 1, 0}, // state 148 -> GID 226 
-    {0, 1, 1, 1, 1, 1, 0, 1, 1}, // state 149 -> GID 227 
-    {0, 1, 1, 1, 1, 1, 1, 0, 0}, // state 150 -> GID 228 
-    {0, 1, 1, 1, 1, 1, 1, 0, 1}, // state 151 -> GID 229 
-    {0, 1, 1, 1, 1, 1, 1, 1, 0}, // state 152 -> GID 230 
-    {0, 1, 1, 1, 1, 1, 1, 1, 1}, // state 153 -> GID 231 
-    {1, 0, 0, 0, 0, 0, 0, 1, 0}, // state 154 -> GID 258 
-    {1, 0, 0, 0, 0, 0, 0, 1, 1}, // state 155 -> GID 259 
-    {1, 0, 0, 0, 0, 0, 1, 0, 0}, // state 156 -> GID 260 
-    {1, 0, 0, 0, 0, 0, 1, 0, 1}, // state 157 -> GID 261 
-    {1, 0, 0, 0, 0, 0, 1, 1, 0}, // state 158 -> GID 262 
-    {1, 0, 0, 0, 0, 0, 1, 1, 1}, // state 159 -> GID 263 
-    {1, 0, 0, 0, 0, 1, 0, 0, 0}, // state 160 -> GID 264 
-    {1, 0, 0, 0, 0, 1, 0, 0, 1}, // state 161 -> GID 265 
-    {1, 0, 0, 0, 0, 1, 0, 1, 0}, // state 162 -> GID 266 
-    {1, 0, 0, 0, 0, 1, 0, 1, 1}, // state 163 -> GID 267 
-    {1, 0, 0, 0, 0, 1, 1, 0, 0}, // state 164 -> GID 268 
-    {1, 0, 0, 0, 0, 1, 1, 0, 1}, // state 165 -> GID 269 
-    {1, 0, 0, 0, 0, 1, 1, 1, 0}, // state 166 -> GID 270 
-    {1, 0, 0, 0, 0, 1, 1, 1, 1}, // state 167 -> GID 271 
-    {1, 0, 0, 0, 1, 0, 0, 0, 0}, // state 168 -> GID 272 
-    {1, 0, 0, 0, 1, 0, 0, 0, 1}, // state 169 -> GID 273 
-    {1, 0, 0, 0, 1, 0, 0, 1, 0}, // state 170 -> GID 274 
-    {1, 0, 0, 0, 1, 0, 0, 1, 1}, // state 171 -> GID 275 
-    {1, 0, 0, 0, 1, 0, 1, 0, 0}, // state 172 -> GID 276 
-    {1, 0, 0, 0, 1, 0, 1, 0, 1}, // state 173 -> GID 277 
-    {1, 0, 0, 0, 1, 0, 1, 1, 0}, // state 174 -> GID 278 
-    {1, 0, 0, 0, 1, 0, 1, 1, 1}, // state 175 -> GID 279 
-    {1, 0, 0, 0, 1, 1, 0, 0, 0}, // state 176 -> GID 280 
-    {1, 0, 0, 0, 1, 1, 0, 0, 1}, // state 177 -> GID 281 
-    {1, 0, 0, 0, 1, 1, 0, 1, 0}, // state 178 -> GID 282 
-    {1, 0, 0, 0, 1, 1, 0, 1, 1}, // state 179 -> GID 283 
-    {1, 0, 0, 0, 1, 1, 1, 0, 0}, // state 180 -> GID 284 
-    {1, 0, 0, 0, 1, 1, 1, 0, 1}, // state 181 -> GID 285 
-    {1, 0, 0, 0, 1, 1, 1, 1, 0}, // state 182 -> GID 286 
-    {1, 0, 0, 0, 1, 1, 1, 1, 1}, // state 183 -> GID 287 
-    {1, 0, 0, 1, 1, 1, 0, 0, 0}, // state 184 -> GID 288 
-    {1, 0, 0, 1, 1, 1, 0, 0, 1}, // state 185 -> GID 289 
-    {1, 0, 0, 1, 1, 1, 0, 1, 0}, // state 186 -> GID 290 
-    {1, 0, 0, 1, 1, 1, 0, 1, 1}, // state 187 -> GID 291 
-    {1, 0, 0, 1, 1, 1, 1, 0, 0}, // state 188 -> GID 292 
-    {1, 0, 0, 1, 1, 1, 1, 0, 1}, // state 189 -> GID 293 
-    {1, 0, 0, 1, 1, 1, 1, 1, 0}, // state 190 -> GID 294 
-    {1, 0, 0, 1, 1, 1, 1, 1, 1}, // state 191 -> GID 295 
-    {1, 0, 1, 0, 0, 0, 0, 1, 0}, // state 192 -> GID 322 
-    {1, 0, 1, 0, 0, 0, 0, 1, 1}, // state 193 -> GID 323 
-    {1, 0, 1, 0, 0, 0, 1, 0, 0}, // state 194 -> GID 324 
-    {1, 0, 1, 0, 0, 0, 1, 0, 1}, // state 195 -> GID 325 
-    {1, 0, 1, 0, 0, 0, 1, 1, 0}, // state 196 -> GID 326 
-    {1, 0, 1, 0, 0, 0, 1, 1, 1}, // state 197 -> GID 327 
-    {1, 0, 1, 0, 0, 1, 0, 0, 0}, // state 198 -> GID 328 
-    {1, 0, 1, 0, 0, 1, 0, 0, 1}, // state 199 -> GID 329 
-    {1, 0, 1, 0, 0, 1, 0, 1, 0}, // state 200 -> GID 330 
-    {1, 0, 1, 0, 0, 1, 0, 1, 1}, // state 201 -> GID 331 
-    {1, 0, 1, 0, 0, 1, 1, 0, 0}, // state 202 -> GID 332 
-    {1, 0, 1, 0, 0, 1, 1, 0, 1}, // state 203 -> GID 333 
-    {1, 0, 1, 0, 0, 1, 1, 1, 0}, // state 204 -> GID 334 
-    {1, 0, 1, 0, 0, 1, 1, 1, 1}, // state 205 -> GID 335 
-    {1, 0, 1, 0, 1, 0, 0, 0, 0}, // state 206 -> GID 336 
-    {1, 0, 1, 0, 1, 0, 0, 0, 1}, // state 207 -> GID 337 
-    {1, 0, 1, 0, 1, 0, 0, 1, 0}, // state 208 -> GID 338 
-    {1, 0, 1, 0, 1, 0, 0, 1, 1}, // state 209 -> GID 339 
-    {1, 0, 1, 0, 1, 0, 1, 0, 0}, // state 210 -> GID 340 
-    {1, 0, 1, 0, 1, 0, 1, 0, 1}, // state 211 -> GID 341 
-    {1, 0, 1, 0, 1, 0, 1, 1, 0}, // state 212 -> GID 342 
-    {1, 0, 1, 0, 1, 0, 1, 1, 1}, // state 213 -> GID 343 
-    {1, 0, 1, 0, 1, 1, 0, 0, 0}, // state 214 -> GID 344 
-    {1, 0, 1, 0, 1, 1, 0, 0, 1}, // state 215 -> GID 345 
-    {1, 0, 1, 0, 1, 1, 0, 1, 0}, // state 216 -> GID 346 
-    {1, 0, 1, 0, 1, 1, 0, 1, 1}, // state 217 -> GID 347 
-    {1, 0, 1, 0, 1, 1, 1, 0, 0}, // state 218 -> GID 348 
-    {1, 0, 1, 0, 1, 1, 1, 0, 1}, // state 219 -> GID 349 
-    {1, 0, 1, 0, 1, 1, 1, 1, 0}, // state 220 -> GID 350 
-    {1, 0, 1, 0, 1, 1, 1, 1, 1}, // state 221 -> GID 351 
-    {1, 0, 1, 1, 1, 1, 0, 0, 0}, // state 222 -> GID 352 
-    {1, 0, 1, 1, 1, 1, 0, 0, 1}, // state 223 -> GID 353 
-    {1, 0, 1, 1, 1, 1, 0, 1, 0}, // state 224 -> GID 354 
-    {1, 0, 1, 1, 1, 1, 0, 1, 1}, // state 225 -> GID 355 
-    {1, 0, 1, 1, 1, 1, 1, 0, 0}, // state 226 -> GID 356 
-    {1, 0, 1, 1, 1, 1, 1, 0, 1}, // state 227 -> GID 357 
-    {1, 0, 1, 1, 1, 1, 1, 1, 0}, // state 228 -> GID 358 
-    {1, 0, 1, 1, 1, 1, 1, 1, 1}, // state 229 -> GID 359 
-    {1, 1, 0, 0, 0, 0, 0, 1, 0}, // state 230 -> GID 386 
-    {1, 1, 0, 0, 0, 0, 0, 1, 1}, // state 231 -> GID 387 
-    {1, 1, 0, 0, 0, 0, 1, 0, 0}, // state 232 -> GID 388 
-    {1, 1, 0, 0, 0, 0, 1, 0, 1}, // state 233 -> GID 389 
-    {1, 1, 0, 0, 0, 0, 1, 1, 0}, // state 234 -> GID 390 
-    {1, 1, 0, 0, 0, 0, 1, 1, 1}, // state 235 -> GID 391 
-    {1, 1, 0, 0, 0, 1, 0, 0, 0}, // state 236 -> GID 392 
-    {1, 1, 0, 0, 0, 1, 0, 0, 1}, // state 237 -> GID 393 
-    {1, 1, 0, 0, 0, 1, 0, 1, 0}, // state 238 -> GID 394 
-    {1, 1, 0, 0, 0, 1, 0, 1, 1}, // state 239 -> GID 395 
-    {1, 1, 0, 0, 0, 1, 1, 0, 0}, // state 240 -> GID 396 
-    {1, 1, 0, 0, 0, 1, 1, 0, 1}, // state 241 -> GID 397 
-    {1, 1, 0, 0, 0, 1, 1, 1, 0}, // state 242 -> GID 398 
-    {1, 1, 0, 0, 0, 1, 1, 1, 1}, // state 243 -> GID 399 
-    {1, 1, 0, 0, 1, 0, 0, 0, 0}, // state 244 -> GID 400 
-    {1, 1, 0, 0, 1, 0, 0, 0, 1}, // state 245 -> GID 401 
-    {1, 1, 0, 0, 1, 0, 0, 1, 0}, // state 246 -> GID 402 
-    {1, 1, 0, 0, 1, 0, 0, 1, 1}, // state 247 -> GID 403 
-    {1, 1, 0, 0, 1, 0, 1, 0, 0}, // state 248 -> GID 404 
-    {1, 1, 0, 0, 1, 0, 1, 0, 1}, // state 249 -> GID 405 
-    {1, 1, 0, 0, 1, 0, 1, 1, 0}, // state 250 -> GID 406 
-    {1, 1, 0, 0, 1, 0, 1, 1, 1}, // state 251 -> GID 407 
-    {1, 1, 0, 0, 1, 1, 0, 0, 0}, // state 252 -> GID 408 
-    {1, 1, 0, 0, 1, 1, 0, 0, 1}, // state 253 -> GID 409 
-    {1, 1, 0, 0, 1, 1, 0, 1, 0}, // state 254 -> GID 410 
-    {1, 1, 0, 0, 1, 1, 0, 1, 1}, // state 255 -> GID 411 
-    {1, 1, 0, 0, 1, 1, 1, 0, 0}, // state 256 -> GID 412 
-    {1, 1, 0, 0, 1, 1, 1, 0, 1}, // state 257 -> GID 413 
-    {1, 1, 0, 0, 1, 1, 1, 1, 0}, // state 258 -> GID 414 
-    {1, 1, 0, 0, 1, 1, 1, 1, 1}, // state 259 -> GID 415 
-    {1, 1, 0, 1, 1, 1, 0, 0, 0}, // state 260 -> GID 416 
-    {1, 1, 0, 1, 1, 1, 0, 0, 1}, // state 261 -> GID 417 
-    {1, 1, 0, 1, 1, 1, 0, 1, 0}, // state 262 -> GID 418 
-    {1, 1, 0, 1, 1, 1, 0, 1, 1}, // state 263 -> GID 419 
-    {1, 1, 0, 1, 1, 1, 1, 0, 0}, // state 264 -> GID 420 
-    {1, 1, 0, 1, 1, 1, 1, 0, 1}, // state 265 -> GID 421 
-    {1, 1, 0, 1, 1, 1, 1, 1, 0}, // state 266 -> GID 422 
-    {1, 1, 0, 1, 1, 1, 1, 1, 1}, // state 267 -> GID 423 
-    {1, 1, 1, 0, 0, 0, 0, 1, 0}, // state 268 -> GID 450 
-    {1, 1, 1, 0, 0, 0, 0, 1, 1}, // state 269 -> GID 451 
-    {1, 1, 1, 0, 0, 0, 1, 0, 0}, // state 270 -> GID 452 
-    {1, 1, 1, 0, 0, 0, 1, 0, 1}, // state 271 -> GID 453 
-    {1, 1, 1, 0, 0, 0, 1, 1, 0}, // state 272 -> GID 454 
-    {1, 1, 1, 0, 0, 0, 1, 1, 1}, // state 273 -> GID 455 
-    {1, 1, 1, 0, 0, 1, 0, 0, 0}, // state 274 -> GID 456 
-    {1, 1, 1, 0, 0, 1, 0, 0, 1}, // state 275 -> GID 457 
-    {1, 1, 1, 0, 0, 1, 0, 1, 0}, // state 276 -> GID 458 
-    {1, 1, 1, 0, 0, 1, 0, 1, 1}, // state 277 -> GID 459 
-    {1, 1, 1, 0, 0, 1, 1, 0, 0}, // state 278 -> GID 460 
-    {1, 1, 1, 0, 0, 1, 1, 0, 1}, // state 279 -> GID 461 
-    {1, 1, 1, 0, 0, 1, 1, 1, 0}, // state 280 -> GID 462 
-    {1, 1, 1, 0, 0, 1, 1, 1, 1}, // state 281 -> GID 463 
-    {1, 1, 1, 0, 1, 0, 0, 0, 0}, // state 282 -> GID 464 
-    {1, 1, 1, 0, 1, 0, 0, 0, 1}, // state 283 -> GID 465 
-    {1, 1, 1, 0, 1, 0, 0, 1, 0}, // state 284 -> GID 466 
-    {1, 1, 1, 0, 1, 0, 0, 1, 1}, // state 285 -> GID 467 
-    {1, 1, 1, 0, 1, 0, 1, 0, 0}, // state 286 -> GID 468 
-    {1, 1, 1, 0, 1, 0, 1, 0, 1}, // state 287 -> GID 469 
-    {1, 1, 1, 0, 1, 0, 1, 1, 0}, // state 288 -> GID 470 
-    {1, 1, 1, 0, 1, 0, 1, 1, 1}, // state 289 -> GID 471 
-    {1, 1, 1, 0, 1, 1, 0, 0, 0}, // state 290 -> GID 472 
-    {1, 1, 1, 0, 1, 1, 0, 0, 1}, // state 291 -> GID 473 
-    {1, 1, 1, 0, 1, 1, 0, 1, 0}, // state 292 -> GID 474 
-    {1, 1, 1, 0, 1, 1, 0, 1, 1}, // state 293 -> GID 475 
-    {1, 1, 1, 0, 1, 1, 1, 0, 0}, // state 294 -> GID 476 
-    {1, 1, 1, 0, 1, 1, 1, 0, 1}, // state 295 -> GID 477 
-    {1, 1, 1, 0, 1, 1, 1, 1, 0}, // state 296 -> GID 478 
-    {1, 1, 1, 0, 1, 1, 1, 1, 1}, // state 297 -> GID 479 
-    {1, 1, 1, 1, 1, 1, 0, 0, 0}, // state 298 -> GID 480 
-    {1, 1, 1, 1, 1, 1, 0, 0, 1}, // state 299 -> GID 481 
-    {1, 1, 1, 1, 1, 1, 0, 1, 0}, // state 300 -> GID 482 
-    {1, 1, 1, 1, 1, 1, 0, 1, 1}, // state 301 -> GID 483 
-    {1, 1, 1, 1, 1, 1, 1, 0, 0}, // state 302 -> GID 484 
-    {1, 1, 1, 1, 1, 1, 1, 0, 1}, // state 303 -> GID 485 
-    {1, 1, 1, 1, 1, 1, 1, 1, 0}, // state 304 -> GID 486 
-    {1, 1, 1, 1, 1, 1, 1, 1, 1}, // state 305 -> GID 487 
+const uint16_t outputStateArray[NUM_STATES] PROGMEM = {
+//    987654321   Ouput Num
+    0b000000000, // state 0 -> GID 0 
+    0b000000001, // state 1 -> GID 1 
+    0b000000010, // state 2 -> GID 2 
+    0b000000011, // state 3 -> GID 3 
+    0b000000100, // state 4 -> GID 4 
+    0b000000101, // state 5 -> GID 5 
+    0b000000110, // state 6 -> GID 6 
+    0b000000111, // state 7 -> GID 7 
+    0b000001000, // state 8 -> GID 8 
+    0b000001001, // state 9 -> GID 9 
+    0b000001010, // state 10 -> GID 10 
+    0b000001011, // state 11 -> GID 11 
+    0b000001100, // state 12 -> GID 12 
+    0b000001101, // state 13 -> GID 13 
+    0b000001110, // state 14 -> GID 14 
+    0b000001111, // state 15 -> GID 15 
+    0b000010000, // state 16 -> GID 16 
+    0b000010001, // state 17 -> GID 17 
+    0b000010010, // state 18 -> GID 18 
+    0b000010011, // state 19 -> GID 19 
+    0b000010100, // state 20 -> GID 20 
+    0b000010101, // state 21 -> GID 21 
+    0b000010110, // state 22 -> GID 22 
+    0b000010111, // state 23 -> GID 23 
+    0b000011000, // state 24 -> GID 24 
+    0b000011001, // state 25 -> GID 25 
+    0b000011010, // state 26 -> GID 26 
+    0b000011011, // state 27 -> GID 27 
+    0b000011100, // state 28 -> GID 28 
+    0b000011101, // state 29 -> GID 29 
+    0b000011110, // state 30 -> GID 30 
+    0b000011111, // state 31 -> GID 31 
+    0b000111000, // state 32 -> GID 32 
+    0b000111001, // state 33 -> GID 33 
+    0b000111010, // state 34 -> GID 34 
+    0b000111011, // state 35 -> GID 35 
+    0b000111100, // state 36 -> GID 36 
+    0b000111101, // state 37 -> GID 37 
+    0b000111110, // state 38 -> GID 38 
+    0b000111111, // state 39 -> GID 39 
+    0b001000010, // state 40 -> GID 66 
+    0b001000011, // state 41 -> GID 67 
+    0b001000100, // state 42 -> GID 68 
+    0b001000101, // state 43 -> GID 69 
+    0b001000110, // state 44 -> GID 70 
+    0b001000111, // state 45 -> GID 71 
+    0b001001000, // state 46 -> GID 72 
+    0b001001001, // state 47 -> GID 73 
+    0b001001010, // state 48 -> GID 74 
+    0b001001011, // state 49 -> GID 75 
+    0b001001100, // state 50 -> GID 76 
+    0b001001101, // state 51 -> GID 77 
+    0b001001110, // state 52 -> GID 78 
+    0b001001111, // state 53 -> GID 79 
+    0b001010000, // state 54 -> GID 80 
+    0b001010001, // state 55 -> GID 81 
+    0b001010010, // state 56 -> GID 82 
+    0b001010011, // state 57 -> GID 83 
+    0b001010100, // state 58 -> GID 84 
+    0b001010101, // state 59 -> GID 85 
+    0b001010110, // state 60 -> GID 86 
+    0b001010111, // state 61 -> GID 87 
+    0b001011000, // state 62 -> GID 88 
+    0b001011001, // state 63 -> GID 89 
+    0b001011010, // state 64 -> GID 90 
+    0b001011011, // state 65 -> GID 91 
+    0b001011100, // state 66 -> GID 92 
+    0b001011101, // state 67 -> GID 93 
+    0b001011110, // state 68 -> GID 94 
+    0b001011111, // state 69 -> GID 95 
+    0b001111000, // state 70 -> GID 96 
+    0b001111001, // state 71 -> GID 97 
+    0b001111010, // state 72 -> GID 98 
+    0b001111011, // state 73 -> GID 99 
+    0b001111100, // state 74 -> GID 100 
+    0b001111101, // state 75 -> GID 101 
+    0b001111110, // state 76 -> GID 102 
+    0b001111111, // state 77 -> GID 103 
+    0b010000010, // state 78 -> GID 130 
+    0b010000011, // state 79 -> GID 131 
+    0b010000100, // state 80 -> GID 132 
+    0b010000101, // state 81 -> GID 133 
+    0b010000110, // state 82 -> GID 134 
+    0b010000111, // state 83 -> GID 135 
+    0b010001000, // state 84 -> GID 136 
+    0b010001001, // state 85 -> GID 137 
+    0b010001010, // state 86 -> GID 138 
+    0b010001011, // state 87 -> GID 139 
+    0b010001100, // state 88 -> GID 140 
+    0b010001101, // state 89 -> GID 141 
+    0b010001110, // state 90 -> GID 142 
+    0b010001111, // state 91 -> GID 143 
+    0b010010000, // state 92 -> GID 144 
+    0b010010001, // state 93 -> GID 145 
+    0b010010010, // state 94 -> GID 146 
+    0b010010011, // state 95 -> GID 147 
+    0b010010100, // state 96 -> GID 148 
+    0b010010101, // state 97 -> GID 149 
+    0b010010110, // state 98 -> GID 150 
+    0b010010111, // state 99 -> GID 151 
+    0b010011000, // state 100 -> GID 152 
+    0b010011001, // state 101 -> GID 153 
+    0b010011010, // state 102 -> GID 154 
+    0b010011011, // state 103 -> GID 155 
+    0b010011100, // state 104 -> GID 156 
+    0b010011101, // state 105 -> GID 157 
+    0b010011110, // state 106 -> GID 158 
+    0b010011111, // state 107 -> GID 159 
+    0b010111000, // state 108 -> GID 160 
+    0b010111001, // state 109 -> GID 161 
+    0b010111010, // state 110 -> GID 162 
+    0b010111011, // state 111 -> GID 163 
+    0b010111100, // state 112 -> GID 164 
+    0b010111101, // state 113 -> GID 165 
+    0b010111110, // state 114 -> GID 166 
+    0b010111111, // state 115 -> GID 167 
+    0b011000010, // state 116 -> GID 194 
+    0b011000011, // state 117 -> GID 195 
+    0b011000100, // state 118 -> GID 196 
+    0b011000101, // state 119 -> GID 197 
+    0b011000110, // state 120 -> GID 198 
+    0b011000111, // state 121 -> GID 199 
+    0b011001000, // state 122 -> GID 200 
+    0b011001001, // state 123 -> GID 201 
+    0b011001010, // state 124 -> GID 202 
+    0b011001011, // state 125 -> GID 203 
+    0b011001100, // state 126 -> GID 204 
+    0b011001101, // state 127 -> GID 205 
+    0b011001110, // state 128 -> GID 206 
+    0b011001111, // state 129 -> GID 207 
+    0b011010000, // state 130 -> GID 208 
+    0b011010001, // state 131 -> GID 209 
+    0b011010010, // state 132 -> GID 210 
+    0b011010011, // state 133 -> GID 211 
+    0b011010100, // state 134 -> GID 212 
+    0b011010101, // state 135 -> GID 213 
+    0b011010110, // state 136 -> GID 214 
+    0b011010111, // state 137 -> GID 215 
+    0b011011000, // state 138 -> GID 216 
+    0b011011001, // state 139 -> GID 217 
+    0b011011010, // state 140 -> GID 218 
+    0b011011011, // state 141 -> GID 219 
+    0b011011100, // state 142 -> GID 220 
+    0b011011101, // state 143 -> GID 221 
+    0b011011110, // state 144 -> GID 222 
+    0b011011111, // state 145 -> GID 223 
+    0b011111000, // state 146 -> GID 224 
+    0b011111001, // state 147 -> GID 225 
+    0b011111010, // state 148 -> GID 226 
+    0b011111011, // state 149 -> GID 227 
+    0b011111100, // state 150 -> GID 228 
+    0b011111101, // state 151 -> GID 229 
+    0b011111110, // state 152 -> GID 230 
+    0b011111111, // state 153 -> GID 231 
+    0b100000010, // state 154 -> GID 258 
+    0b100000011, // state 155 -> GID 259 
+    0b100000100, // state 156 -> GID 260 
+    0b100000101, // state 157 -> GID 261 
+    0b100000110, // state 158 -> GID 262 
+    0b100000111, // state 159 -> GID 263 
+    0b100001000, // state 160 -> GID 264 
+    0b100001001, // state 161 -> GID 265 
+    0b100001010, // state 162 -> GID 266 
+    0b100001011, // state 163 -> GID 267 
+    0b100001100, // state 164 -> GID 268 
+    0b100001101, // state 165 -> GID 269 
+    0b100001110, // state 166 -> GID 270 
+    0b100001111, // state 167 -> GID 271 
+    0b100010000, // state 168 -> GID 272 
+    0b100010001, // state 169 -> GID 273 
+    0b100010010, // state 170 -> GID 274 
+    0b100010011, // state 171 -> GID 275 
+    0b100010100, // state 172 -> GID 276 
+    0b100010101, // state 173 -> GID 277 
+    0b100010110, // state 174 -> GID 278 
+    0b100010111, // state 175 -> GID 279 
+    0b100011000, // state 176 -> GID 280 
+    0b100011001, // state 177 -> GID 281 
+    0b100011010, // state 178 -> GID 282 
+    0b100011011, // state 179 -> GID 283 
+    0b100011100, // state 180 -> GID 284 
+    0b100011101, // state 181 -> GID 285 
+    0b100011110, // state 182 -> GID 286 
+    0b100011111, // state 183 -> GID 287 
+    0b100111000, // state 184 -> GID 288 
+    0b100111001, // state 185 -> GID 289 
+    0b100111010, // state 186 -> GID 290 
+    0b100111011, // state 187 -> GID 291 
+    0b100111100, // state 188 -> GID 292 
+    0b100111101, // state 189 -> GID 293 
+    0b100111110, // state 190 -> GID 294 
+    0b100111111, // state 191 -> GID 295 
+    0b101000010, // state 192 -> GID 322 
+    0b101000011, // state 193 -> GID 323 
+    0b101000100, // state 194 -> GID 324 
+    0b101000101, // state 195 -> GID 325 
+    0b101000110, // state 196 -> GID 326 
+    0b101000111, // state 197 -> GID 327 
+    0b101001000, // state 198 -> GID 328 
+    0b101001001, // state 199 -> GID 329 
+    0b101001010, // state 200 -> GID 330 
+    0b101001011, // state 201 -> GID 331 
+    0b101001100, // state 202 -> GID 332 
+    0b101001101, // state 203 -> GID 333 
+    0b101001110, // state 204 -> GID 334 
+    0b101001111, // state 205 -> GID 335 
+    0b101010000, // state 206 -> GID 336 
+    0b101010001, // state 207 -> GID 337 
+    0b101010010, // state 208 -> GID 338 
+    0b101010011, // state 209 -> GID 339 
+    0b101010100, // state 210 -> GID 340 
+    0b101010101, // state 211 -> GID 341 
+    0b101010110, // state 212 -> GID 342 
+    0b101010111, // state 213 -> GID 343 
+    0b101011000, // state 214 -> GID 344 
+    0b101011001, // state 215 -> GID 345 
+    0b101011010, // state 216 -> GID 346 
+    0b101011011, // state 217 -> GID 347 
+    0b101011100, // state 218 -> GID 348 
+    0b101011101, // state 219 -> GID 349 
+    0b101011110, // state 220 -> GID 350 
+    0b101011111, // state 221 -> GID 351 
+    0b101111000, // state 222 -> GID 352 
+    0b101111001, // state 223 -> GID 353 
+    0b101111010, // state 224 -> GID 354 
+    0b101111011, // state 225 -> GID 355 
+    0b101111100, // state 226 -> GID 356 
+    0b101111101, // state 227 -> GID 357 
+    0b101111110, // state 228 -> GID 358 
+    0b101111111, // state 229 -> GID 359 
+    0b110000010, // state 230 -> GID 386 
+    0b110000011, // state 231 -> GID 387 
+    0b110000100, // state 232 -> GID 388 
+    0b110000101, // state 233 -> GID 389 
+    0b110000110, // state 234 -> GID 390 
+    0b110000111, // state 235 -> GID 391 
+    0b110001000, // state 236 -> GID 392 
+    0b110001001, // state 237 -> GID 393 
+    0b110001010, // state 238 -> GID 394 
+    0b110001011, // state 239 -> GID 395 
+    0b110001100, // state 240 -> GID 396 
+    0b110001101, // state 241 -> GID 397 
+    0b110001110, // state 242 -> GID 398 
+    0b110001111, // state 243 -> GID 399 
+    0b110010000, // state 244 -> GID 400 
+    0b110010001, // state 245 -> GID 401 
+    0b110010010, // state 246 -> GID 402 
+    0b110010011, // state 247 -> GID 403 
+    0b110010100, // state 248 -> GID 404 
+    0b110010101, // state 249 -> GID 405 
+    0b110010110, // state 250 -> GID 406 
+    0b110010111, // state 251 -> GID 407 
+    0b110011000, // state 252 -> GID 408 
+    0b110011001, // state 253 -> GID 409 
+    0b110011010, // state 254 -> GID 410 
+    0b110011011, // state 255 -> GID 411 
+    0b110011100, // state 256 -> GID 412 
+    0b110011101, // state 257 -> GID 413 
+    0b110011110, // state 258 -> GID 414 
+    0b110011111, // state 259 -> GID 415 
+    0b110111000, // state 260 -> GID 416 
+    0b110111001, // state 261 -> GID 417 
+    0b110111010, // state 262 -> GID 418 
+    0b110111011, // state 263 -> GID 419 
+    0b110111100, // state 264 -> GID 420 
+    0b110111101, // state 265 -> GID 421 
+    0b110111110, // state 266 -> GID 422 
+    0b110111111, // state 267 -> GID 423 
+    0b111000010, // state 268 -> GID 450 
+    0b111000011, // state 269 -> GID 451 
+    0b111000100, // state 270 -> GID 452 
+    0b111000101, // state 271 -> GID 453 
+    0b111000110, // state 272 -> GID 454 
+    0b111000111, // state 273 -> GID 455 
+    0b111001000, // state 274 -> GID 456 
+    0b111001001, // state 275 -> GID 457 
+    0b111001010, // state 276 -> GID 458 
+    0b111001011, // state 277 -> GID 459 
+    0b111001100, // state 278 -> GID 460 
+    0b111001101, // state 279 -> GID 461 
+    0b111001110, // state 280 -> GID 462 
+    0b111001111, // state 281 -> GID 463 
+    0b111010000, // state 282 -> GID 464 
+    0b111010001, // state 283 -> GID 465 
+    0b111010010, // state 284 -> GID 466 
+    0b111010011, // state 285 -> GID 467 
+    0b111010100, // state 286 -> GID 468 
+    0b111010101, // state 287 -> GID 469 
+    0b111010110, // state 288 -> GID 470 
+    0b111010111, // state 289 -> GID 471 
+    0b111011000, // state 290 -> GID 472 
+    0b111011001, // state 291 -> GID 473 
+    0b111011010, // state 292 -> GID 474 
+    0b111011011, // state 293 -> GID 475 
+    0b111011100, // state 294 -> GID 476 
+    0b111011101, // state 295 -> GID 477 
+    0b111011110, // state 296 -> GID 478 
+    0b111011111, // state 297 -> GID 479 
+    0b111111000, // state 298 -> GID 480 
+    0b111111001, // state 299 -> GID 481 
+    0b111111010, // state 300 -> GID 482 
+    0b111111011, // state 301 -> GID 483 
+    0b111111100, // state 302 -> GID 484 
+    0b111111101, // state 303 -> GID 485 
+    0b111111110, // state 304 -> GID 486 
+    0b111111111, // state 305 -> GID 487 
 };
 
+/*
+    Bitmap of every legal output mask. Bit (mask & 7) of byte (mask >> 3) is set
+    if the mask matches a state in outputStateArray. Encodes the removed GIDs and
+    the R05/R06 linkage.
+*/
+const uint8_t legalMaskBitmap[(1 << NUM_OUTPUTS) / 8] PROGMEM = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0xFF,
+    0xFC, 0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0xFF,
+    0xFC, 0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0xFF,
+    0xFC, 0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0xFF,
+    0xFC, 0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0xFF,
+    0xFC, 0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0xFF,
+    0xFC, 0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0xFF,
+    0xFC, 0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0xFF,
+};
+
+
+/**************************************************************************/
+/*!
+    @brief  State table of the relay board, for OutputStateMachine.
+*/
+/**************************************************************************/
+struct RelayStateTable {
+    typedef uint16_t Mask;                          // packed outputs (output 1 in bit 0, on=1)
+    static const int numStates = NUM_STATES;
+    static const uint8_t numOutputs = NUM_OUTPUTS;
+
+    /*! @brief  Outputs of a state. @param stateNum state (0 to numStates - 1)
+        @return packed outputs */
+    static Mask state(int stateNum) {
+        return pgm_read_word(&outputStateArray[stateNum]);
+    }
+
+    /*! @brief  Check whether a mask matches one of the states.
+        @param  mask packed outputs @return true if the mask is legal */
+    static bool isLegal(Mask mask) {
+        if (mask >= (1 << NUM_OUTPUTS)) {
+            return false;
+        }
+        return pgm_read_byte(&legalMaskBitmap[mask >> 3]) & (1 << (mask & 7));
+    }
+};
 
+
+/**************************************************************************/
+/*!
+    @brief  Smallest unsigned type that holds a packed mask of N outputs.
+*/
+/**************************************************************************/
+template <uint8_t N, bool Byte = (N <= 8), bool Word = (N <= 16)>
+struct OutputMask { typedef uint32_t Type; };
+template <uint8_t N>
+struct OutputMask<N, false, true> { typedef uint16_t Type; };
+template <uint8_t N>
+struct OutputMask<N, true, true> { typedef uint8_t Type; };
+
+
+/**************************************************************************/
+/*!
+    @brief  State table for an output stage with no generated table (e.g.
+            the shift register outputs): a ladder where each state turns on
+            one more output. State 0 is every output off; state N is every
+            output on. Computed, so it takes no flash.
+*/
+/**************************************************************************/
+template <uint8_t N>
+struct LadderStateTable {
+    typedef typename OutputMask<N>::Type Mask;      // packed outputs (output 1 in bit 0, on=1)
+    static const int numStates = N + 1;
+    static const uint8_t numOutputs = N;
+
+    /*! @brief  Outputs of a state. @param stateNum state (0 to N)
+        @return packed outputs: the lowest stateNum outputs on */
+    static Mask state(int stateNum) {
+        return (stateNum == 0) ? 0 : (Mask)((Mask)~(Mask)0 >> ((sizeof(Mask) * 8) - stateNum));
+    }
+
+    /*! @brief  Check whether a mask matches one of the states.
+        @param  mask packed outputs @return true if the mask is legal */
+    static bool isLegal(Mask mask) {
+        return ((Mask)(mask & (Mask)(mask + 1)) == 0) && (mask <= state(N));
+    }
+};
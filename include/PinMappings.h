@@ -19,6 +19,26 @@
 #define R08 39
 #define R09 37
 
+// Port / bit of each relay pin, for direct register access before the Arduino
+// core is initialised (see earlyInitRelays). Must match the pin numbers above.
+#define R01_BIT PB0     // PORTB
+#define R02_BIT PB2     // PORTB
+#define R03_BIT PL0     // PORTL
+#define R04_BIT PL2     // PORTL
+#define R05_BIT PL4     // PORTL
+#define R06_BIT PL6     // PORTL
+#define R07_BIT PG0     // PORTG
+#define R08_BIT PG2     // PORTG
+#define R09_BIT PC0     // PORTC
+
+#define RELAY_PORTB_MASK (_BV(R01_BIT) | _BV(R02_BIT))
+#define RELAY_PORTL_MASK (_BV(R03_BIT) | _BV(R04_BIT) | _BV(R05_BIT) | _BV(R06_BIT))
+#define RELAY_PORTG_MASK (_BV(R07_BIT) | _BV(R08_BIT))
+#define RELAY_PORTC_MASK (_BV(R09_BIT))
+
+// Outputs driven straight after reset (output 1 in bit 0, on=1). 0 = state 0, all relays off.
+#define BOOT_OUTPUT_MASK 0b000000000
+
 // Map action codes to digital pin numbers
 const uint8_t pinMappings[NUM_OF_PINS] = {
     R09,
@@ -31,3 +51,66 @@ const uint8_t pinMappings[NUM_OF_PINS] = {
     R02,
     R01,
 };
+
+
+// ==================================================
+//                 Extra Channels
+// ==================================================
+
+// Independent state machines (one per simulated track). Channel 0 is the relay
+// set above; channels 1+ drive the spare pins below. Set with a build flag,
+// e.g. -DNUM_CHANNELS=4. Only channel 0 is driven to BOOT_OUTPUT_MASK by
+// earlyInitRelays(); the other channels' pins float (inputs) until
+// RelayOutputs::begin() drives them to BOOT_OUTPUT_MASK at the start of setup().
+#ifndef NUM_CHANNELS
+#define NUM_CHANNELS 1
+#endif
+#define MAX_CHANNELS 4
+
+static_assert((NUM_CHANNELS >= 1) && (NUM_CHANNELS <= MAX_CHANNELS), "NUM_CHANNELS must be 1 to MAX_CHANNELS");
+
+// Same order as pinMappings: output 9 first, output 1 last.
+// The extra channels leave pins 0/1 (Serial), 18/19 (Serial1) and 20/21 (I2C) free.
+const uint8_t channel1PinMappings[NUM_OF_PINS] = { 38, 36, 34, 32, 30, 28, 26, 24, 22 };    // PORTA / PORTC / PORTD
+const uint8_t channel2PinMappings[NUM_OF_PINS] = { A8, A7, A6, A5, A4, A3, A2, A1, A0 };    // PORTF / PORTK
+const uint8_t channel3PinMappings[NUM_OF_PINS] = { 42, 40, 35, 33, 31, 29, 27, 25, 23 };    // PORTA / PORTC / PORTG / PORTL
+
+const uint8_t *const channelPinMappings[MAX_CHANNELS] = {
+    pinMappings,
+    channel1PinMappings,
+    channel2PinMappings,
+    channel3PinMappings
+};
+
+
+// ==================================================
+//              Shift Register Outputs
+// ==================================================
+
+// Build with -DSHIFT_REGISTER_OUTPUTS=16 (or 24, 32) to drive that many outputs from
+// daisy-chained 74HC595s on hardware SPI instead of the relay pins above. SPI uses pins
+// 51 / 53, so the relay pins and the extra channels are not used in that build.
+// Output 1 is QA of the 74HC595 nearest the Mega.
+#define SR_PORTB_LATCH_BIT  PB0     // pin 53 (SS): RCLK of every 74HC595
+#define SR_PORTB_SCK_BIT    PB1     // pin 52: SRCLK of every 74HC595
+#define SR_PORTB_MOSI_BIT   PB2     // pin 51: SER of the first 74HC595
+#define SR_PORTL_OE_BIT     PL1     // pin 48: /OE of every 74HC595 (high = every output off).
+                                    // Relay drivers must hold their inputs off while /OE is high.
+
+#ifdef SHIFT_REGISTER_OUTPUTS
+static_assert((SHIFT_REGISTER_OUTPUTS % 8 == 0) && (SHIFT_REGISTER_OUTPUTS >= 16) && (SHIFT_REGISTER_OUTPUTS <= 32),
+              "SHIFT_REGISTER_OUTPUTS must be 16, 24 or 32");
+static_assert(NUM_CHANNELS == 1, "shift register outputs support one channel");
+#endif
+
+
+// ==================================================
+//                    Sync Line
+// ==================================================
+
+// Lock-step stepping of several Megas (see SyncLink). The master drives the sync line;
+// followers take their step ticks from it on INT4. Synced action codes go from the
+// master's TX1 (pin 18) to every follower's RX1 (pin 19). Join the grounds, and fit a
+// pull-down on each follower's sync input so a loose wire can't give false edges.
+#define SYNC_PIN        2
+#define SYNC_PORTE_BIT  PE4     // PORTE, INT4
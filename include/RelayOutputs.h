@@ -0,0 +1,77 @@
+#pragma once
+#include <Arduino.h>
+#include "PinMappings.h"
+
+#define MAX_RELAY_PORTS 4       // max number of AVR ports the relay pins can be spread across
+
+// per-relay override modes
+enum RelayOverride {
+    RELAY_NORMAL    = 0,    // relay follows the state machine
+    RELAY_DISABLED  = 1,    // relay pulled for maintenance. Held off.
+    RELAY_FORCE_ON  = 2,    // relay held on
+    RELAY_FORCE_OFF = 3     // relay held off
+};
+
+/**************************************************************************/
+/*!
+    @brief  Output stage for the relays. Writes a packed output mask
+            (output 1 in bit 0) to the relay pins by direct port access.
+            Every affected port register is written inside a single
+            critical section, so all relays change together and no
+            intermediate combination is driven.
+            Per-relay disable / force-on / force-off overrides are
+            applied to the mask with one AND and one OR in the same
+            critical section as the port write.
+            An emergency stop drops every relay and latches them off,
+            overriding everything else, until it is cleared.
+*/
+/**************************************************************************/
+class RelayOutputs {
+public:
+    typedef uint16_t Mask;                          // packed outputs (output 1 in bit 0, on=1)
+    static const uint8_t numOutputs = NUM_OF_PINS;
+
+private:
+    const uint8_t *_pinMappings;    // pinMappings[i] drives output (NUM_OF_PINS - i)
+
+    // ports used by the relay pins, and which bits of each port are relays
+    volatile uint8_t *_portRegs[MAX_RELAY_PORTS];
+    uint8_t _portMasks[MAX_RELAY_PORTS];
+    uint8_t _numPorts = 0;
+
+    // for each output (bit of the packed mask): which port it is on, and its bit in that port
+    uint8_t _outputPort[NUM_OF_PINS];
+    uint8_t _outputBit[NUM_OF_PINS];
+
+    // written from loop() and the step timer interrupt: only accessed with interrupts disabled
+    uint16_t _currentMask = 0;      // mask most recently requested (before overrides)
+    uint16_t _appliedMask = 0;      // mask actually driven on the pins
+
+    // override masks (output 1 in bit 0)
+    uint16_t _disabled = 0;
+    uint16_t _forcedOn = 0;
+    uint16_t _forcedOff = 0;
+    uint16_t _andMask = 0xFFFF;     // cleared bits are held off
+    uint16_t _orMask = 0;           // set bits are held on
+
+    volatile bool _stopped = false; // emergency stop latched
+
+    void _updateOverrideMasks();
+    void _apply();
+
+public:
+    RelayOutputs(const uint8_t *pinMappings);
+    void begin();
+    void write(uint16_t mask);
+    uint16_t read();
+    uint16_t readApplied();
+
+    void emergencyStop();
+    void clearEmergencyStop();
+    bool isStopped();
+
+    bool setOverride(uint8_t output, RelayOverride mode);
+    void setOverrideMasks(uint16_t disabled, uint16_t forcedOn, uint16_t forcedOff);
+    void getOverrideMasks(uint16_t &disabled, uint16_t &forcedOn, uint16_t &forcedOff);
+    void reportOverrides();
+};
@@ -0,0 +1,117 @@
+#pragma once
+#include <Arduino.h>
+#include <util/atomic.h>
+#include "ScenarioStore.h"
+#include "StateValueTable.h"
+#include "StepTimer.h"
+
+#define SCENARIO_EZ_FRAC_BITS 16        // EZ is stepped in 1/2^16 EZ units per tick
+#define SCENARIO_EVENT_QUEUE 8          // progress events waiting to be sent
+
+// scenario progress events (SCENARIO_EVENT)
+enum ScenarioEventType {
+    SCENARIO_STARTED   = 1,     // a scenario started on a channel that was not playing one
+    SCENARIO_PHASE     = 2,     // a phase started
+    SCENARIO_SWITCHED  = 3,     // another scenario took over the channel, straight away or at the end of a train
+    SCENARIO_FINISHED  = 4,     // every train has been played
+    SCENARIO_CANCELLED = 5      // another mode, a train run, an e-stop or a scenario on another channel took over
+};
+
+/**************************************************************************/
+/*!
+    @brief  A scenario progress event, queued by the step timer interrupt
+            for loop() to send.
+*/
+/**************************************************************************/
+struct ScenarioEvent {
+    uint8_t type;           // ScenarioEventType
+    uint8_t slot;           // scenario slot
+    uint8_t train;          // train number, from 0 (wraps after 255)
+    uint8_t phase;          // phase number, from 0
+    uint8_t label;          // the phase's label
+    uint32_t ticks;         // step timer ticks since the scenario started
+};
+
+/**************************************************************************/
+/*!
+    @brief  One phase of a scenario, ready for the step timer interrupt.
+*/
+/**************************************************************************/
+struct ScenarioStep {
+    uint32_t ticks;         // length, in step timer ticks (at least 1)
+    int32_t ezStep;         // EZ change per tick, in 1/2^SCENARIO_EZ_FRAC_BITS EZ units
+    uint16_t endEz;         // EZ at the end, in EZ units
+    uint8_t label;
+};
+
+/**************************************************************************/
+/*!
+    @brief  A scenario ready for the step timer interrupt.
+*/
+/**************************************************************************/
+struct ScenarioProgram {
+    uint8_t slot;
+    uint8_t numPhases;
+    uint8_t trains;
+    uint16_t startEz;
+    ScenarioStep steps[SCENARIO_MAX_PHASES];
+};
+
+/**************************************************************************/
+/*!
+    @brief  Class for playing a scenario (see ScenarioStore) on one channel
+            from the step timer interrupt, so every phase boundary falls
+            on an exact tick with no serial traffic. Each tick the EZ is
+            moved by the phase's fixed step and the channel is driven to
+            the state whose calibrated EZ (see GOTO_EZ) is nearest; a phase
+            ends on its last tick exactly at its end EZ.
+            The scenario is compiled into the spare of two programs in
+            loop(), then swapped in, straight away or at the end of the
+            current train (like the state machine's shadow frame).
+            Progress is queued as ScenarioEvents for loop() to send.
+*/
+/**************************************************************************/
+class ScenarioPlayer {
+private:
+    StateValueTable &_ezTable;
+    ScenarioProgram _programs[2];
+    uint8_t _active = 0;                    // program being played
+    volatile bool _switchPending = false;   // swap to the spare program at the end of the train
+    uint16_t _numStates = 0;
+    uint8_t _channel = 0;
+    volatile bool _running = false;
+
+    uint8_t _train = 0;
+    uint8_t _phase = 0;
+    uint32_t _phaseTicks = 0;               // ticks left in the phase
+    int32_t _ez = 0;                        // in 1/2^SCENARIO_EZ_FRAC_BITS EZ units
+    volatile uint32_t _ticks = 0;           // ticks since the start
+    volatile uint16_t _state = 0;           // state driven on the last tick
+
+    ScenarioEvent _events[SCENARIO_EVENT_QUEUE];
+    volatile uint8_t _eventHead = 0;
+    volatile uint8_t _eventTail = 0;
+    volatile uint8_t _eventCount = 0;
+    volatile uint16_t _eventsLost = 0;
+
+    void _push(ScenarioEventType type);
+    void _nextPhase();
+
+public:
+    ScenarioPlayer(StateValueTable &ezTable);
+
+    void prepare(const Scenario &scenario, uint8_t slot);
+    uint16_t begin(uint8_t channel, uint16_t numStates);
+    bool switchAtTrainEnd();
+    void stop();
+
+    /*! @brief  Whether a scenario is driving a channel.
+        @param  channel channel to check
+        @return true if a scenario is playing on that channel */
+    bool drives(uint8_t channel) { return _running && (channel == _channel); }
+
+    uint16_t tick();
+    bool takeEvent(ScenarioEvent &event);
+
+    void report();
+};
@@ -0,0 +1,71 @@
+#pragma once
+#include <Arduino.h>
+#include "ComsAPI.h"
+#include "EepromLayout.h"
+#include "EepromRecordWriter.h"
+
+#define SCENARIO_MAX_PHASES 16                  // phases per scenario (one train)
+#define SCENARIO_UPLOAD_SIZE 6                  // data bytes carried by one SCENARIO_UPLOAD
+#define SCENARIO_MAX_EZ (100 * EZ_UNITS_PER_EZ) // highest EZ a scenario may use, in EZ units
+
+/**************************************************************************/
+/*!
+    @brief  One phase of a scenario: the EZ moves in a straight line from
+            where the last phase left it to endEz over durationMs (a train
+            at constant speed), or holds there if it is already at endEz
+            (island occupancy, the gap between trains).
+*/
+/**************************************************************************/
+struct ScenarioPhase {
+    uint8_t label;          // reported in progress events (e.g. 1 approach, 2 island, 3 receding, 4 gap)
+    uint16_t endEz;         // EZ at the end of the phase, in EZ units
+    uint32_t durationMs;    // 1 ms to 24 bits (~4.6 hours)
+};
+
+/**************************************************************************/
+/*!
+    @brief  A stored train movement: the phases of one train, played for
+            each of a number of trains back to back. Every train starts
+            from startEz.
+*/
+/**************************************************************************/
+struct Scenario {
+    uint8_t numPhases;      // 1 to SCENARIO_MAX_PHASES
+    uint8_t trains;         // trains to play (0: until stopped)
+    uint16_t startEz;       // EZ at the start of each train, in EZ units
+    ScenarioPhase phases[SCENARIO_MAX_PHASES];
+};
+
+/**************************************************************************/
+/*!
+    @brief  Class for the scenarios saved in EEPROM slots (see
+            EepromLayout.h). The HMI uploads a scenario a header or phase
+            at a time into a RAM copy, which can be played straight away,
+            then saves it. Saving writes one EEPROM byte per call to
+            saveStep() (see EepromRecordWriter).
+*/
+/**************************************************************************/
+class ScenarioStore {
+private:
+    Scenario _edit;                 // scenario being uploaded
+    int8_t _editSlot = -1;          // its slot (-1: none uploaded since boot)
+    uint16_t _crc = 0;              // CRC of the record being saved
+    EepromRecordWriter _writer;
+
+    uint8_t _recordByte(const Scenario &scenario, uint16_t pos);
+    static uint8_t _saveByte(void *store, uint16_t pos);
+    bool _read(uint8_t slot, Scenario &scenario);
+
+public:
+    static bool isValid(const Scenario &scenario);
+    uint16_t recordCrc(const Scenario &scenario);
+
+    bool set(uint8_t slot, uint8_t index, const uint8_t *data);
+    bool load(uint8_t slot, Scenario &scenario);
+
+    bool save(uint8_t slot, uint16_t &crc);
+    bool saveStep();
+    bool saving();
+
+    void report();
+};
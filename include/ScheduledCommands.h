@@ -0,0 +1,42 @@
+#pragma once
+#include <Arduino.h>
+
+#define MAX_SCHEDULED_COMMANDS 8    // size of the time-ordered queue
+#define SCHEDULE_SPIN_US 1000       // busy-wait for a command due within this long (one step task period)
+
+/**************************************************************************/
+/*!
+    @brief  An action code waiting to be executed at a set time.
+*/
+/**************************************************************************/
+struct ScheduledCommand {
+    unsigned long dueUs;    // micros() timestamp to execute at
+    uint8_t code;           // action code (must take no arguments)
+    uint8_t channel;        // state machine channel the action code addresses
+};
+
+/**************************************************************************/
+/*!
+    @brief  Time-ordered queue of action codes to execute at specific
+            micros() timestamps. The HMI converts its own clock to the
+            Mega's using the CLOCK_SYNC exchange.
+            Tracks the scheduling error (actual - requested execution
+            time) of every command run.
+*/
+/**************************************************************************/
+class ScheduledCommandQueue {
+private:
+    ScheduledCommand _commands[MAX_SCHEDULED_COMMANDS];    // sorted, earliest first
+    uint8_t _count = 0;
+
+    uint16_t _executed = 0;
+    unsigned long _worstErrorUs = 0;
+    unsigned long _totalErrorUs = 0;
+
+public:
+    bool add(unsigned long dueUs, uint8_t code, uint8_t channel);
+    bool popDue(unsigned long horizonUs, ScheduledCommand &command);
+    unsigned long recordExecution(const ScheduledCommand &command, unsigned long executedUs);
+    void clear();
+    void report();
+};
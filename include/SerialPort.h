@@ -1,8 +1,31 @@
 #pragma once
 #include <Arduino.h>
 #include "ComsAPI.h"
+#include "CommandQueue.h"
 
-#define MAX_INPUT 4     // max length of input chars read from serial (allow for null termination char)
+#define MAX_INPUT 8     // max length of input chars read from serial, e.g. "255,255" (allow for null termination char)
+
+// XON/XOFF flow control thresholds
+#define XON  0x11
+#define XOFF 0x13
+#define FLOW_RX_HIGH_WATER  (SERIAL_RX_BUFFER_SIZE / 2)     // send XOFF once this many bytes wait in the RX buffer...
+#define FLOW_QUEUE_LOW_SPACE 4                              // ...or the queue has this few free slots
+#define FLOW_RX_LOW_WATER   8                               // send XON once below this and the queue has room again
+#define SEQ_FRAME_MAX_BYTES 9                               // longest sequenced frame, "<255,255>"
+#define SENT_FRAME_MAX_BYTES 5                              // longest frame sent by sendFrame(), "<255>"
+
+enum FlowControlMode {
+    FLOW_NONE     = 0,
+    FLOW_XON_XOFF = 1
+};
+
+#define BAUD_CONFIRM_TIMEOUT_MS 1000    // time allowed for the HMI to confirm a new baud rate
+#define NUM_BAUD_RATES 8
+#define BAUD_REJECT 255                 // sent in place of the rate index when a proposal is refused
+
+// test pattern the HMI must send (as BAUD_CONFIRM args) at the new baud rate
+#define BAUD_TEST_PATTERN_LEN 4
+const uint8_t baudTestPattern[BAUD_TEST_PATTERN_LEN] = { 0x55, 0xAA, 0x0F, 0xF0 };
 
 
 /**************************************************************************/
@@ -11,6 +34,19 @@
             Data packets to be enclosed with '<' and '>'.
             Data between < and > is to be an integer from 0-254, representing 
             an action code.
+            Once sequencing is enabled (SEQ_RESET), packets may carry a
+            sequence number as <seq,value>. In-order packets are queued and
+            acknowledged cumulatively with <SEQ_ACK><seq>. Out-of-order
+            packets are dropped and the last in-order sequence number is
+            re-sent, so the HMI detects a loss without waiting for a timeout.
+            Each ACK also grants the HMI credits: the number of frames it
+            may send beyond the acknowledged one without overrunning the
+            queue or the RX buffer.
+            Received frames are buffered in a CommandQueue. Optional XON/XOFF
+            flow control pauses the HMI when the queue or the RX buffer
+            fills up.
+            Also handles switching baud rate when the HMI negotiates a
+            faster link (see BAUD_PROPOSE / BAUD_CONFIRM in ComsAPI.h).
 */
 /**************************************************************************/
 class SerialPort {
@@ -18,11 +54,49 @@ private:
     char input_line[MAX_INPUT]; // Hold input chars read from serial
     uint8_t input_pos = 0;      // current index for input_line that should be written to
 
+    unsigned long _baudRate = 0;        // baud rate currently in use
+    unsigned long _fallbackBaud = 0;    // baud rate to return to if a new rate is not confirmed
+    bool _confirmPending = false;       // waiting for the HMI to confirm a new baud rate
+    unsigned long _proposedAtMs = 0;
+
+    CommandQueue _queue;
+
+    // sequencing (go-back-N with cumulative ACKs)
+    bool _sequenced = false;            // set by SEQ_RESET
+    uint8_t _window = 1;                // max frames the HMI may have in flight
+    uint8_t _expectedSeq = 0;           // sequence number of the next in-order frame
+    bool _ackPending = false;           // an ACK should be sent at the end of readFromSerial()
+    uint16_t _droppedFrames = 0;        // frames lost to a full queue or out of order
+    uint16_t _framesReceived = 0;       // frames accepted into the queue
+    unsigned long _lastFrameUs = 0;     // micros() timestamp the last frame was received at
+
+    FlowControlMode _flowMode = FLOW_NONE;
+    bool _xoffSent = false;             // HMI has been told to pause
+
     bool processIncomingByte(const byte inByte);
     void processData(const char * data);
+    void _switchBaud(unsigned long baudRate);
 
-public:
-    uint8_t actionCode = NO_CODE;   // 255 = invalid action code
+    void _acceptFrame(uint8_t value);
+    uint8_t _credits();
+    void _updateFlowControl();
 
+public:
+    void begin(unsigned long baudRate);
     void readFromSerial();
+    bool nextFrame(uint8_t &frame);
+    void sendFrame(uint8_t value);
+    bool canSend(uint8_t frames);
+    void sendTimestamp(unsigned long us);
+    unsigned long getLastFrameTime();
+
+    void resetSequence(uint8_t window);
+    uint16_t getDroppedFrames();
+    void setFlowControl(FlowControlMode mode);
+    void sendLinkStats();
+
+    void proposeBaud(uint8_t rateIndex);
+    void confirmBaud(const uint8_t *pattern);
+    bool checkBaudTimeout();
+    unsigned long getBaudRate();
 };
@@ -0,0 +1,338 @@
+#pragma once
+#include <Arduino.h>
+#include <util/atomic.h>
+#include "PinMappings.h"
+#include "OutputStates.h"
+#include "RelayOutputs.h"
+
+/**************************************************************************/
+/*!
+    @brief  Output stage for daisy-chained 74HC595 shift registers on
+            hardware SPI. Same interface as RelayOutputs, with the mask
+            widened to fit N outputs.
+            The whole chain is shifted in and then copied to the register
+            outputs with a single latch pulse, so all outputs change
+            together and no intermediate combination is driven.
+            An emergency stop raises /OE, turning every output off at once,
+            and latches them off until it is cleared.
+    @param  N
+            number of outputs (8 per 74HC595)
+*/
+/**************************************************************************/
+template <uint8_t N>
+class ShiftRegisterOutputs {
+public:
+    typedef typename OutputMask<N>::Type Mask;      // packed outputs (output 1 in bit 0, on=1)
+    static const uint8_t numOutputs = N;
+
+private:
+    static_assert(N % 8 == 0, "shift register outputs come in multiples of 8");
+
+    // written from loop() and the step timer interrupt: only accessed with interrupts disabled
+    Mask _currentMask = 0;          // mask most recently requested (before overrides)
+    Mask _appliedMask = 0;          // mask actually driven on the outputs
+
+    // override masks (output 1 in bit 0)
+    Mask _disabled = 0;
+    Mask _forcedOn = 0;
+    Mask _forcedOff = 0;
+    Mask _andMask = (Mask)~(Mask)0; // cleared bits are held off
+    Mask _orMask = 0;               // set bits are held on
+
+    volatile bool _stopped = false; // emergency stop latched
+
+    static void _shift(Mask mask);
+    void _updateOverrideMasks();
+    void _apply();
+
+public:
+    void begin();
+    void write(Mask mask);
+    Mask read();
+    Mask readApplied();
+
+    void emergencyStop();
+    void clearEmergencyStop();
+    bool isStopped();
+
+    bool setOverride(uint8_t output, RelayOverride mode);
+    void setOverrideMasks(Mask disabled, Mask forcedOn, Mask forcedOff);
+    void getOverrideMasks(Mask &disabled, Mask &forcedOn, Mask &forcedOff);
+    void reportOverrides();
+};
+
+
+/**************************************************************************/
+/*!
+    @brief  Shift a mask into the chain and latch it onto the register
+            outputs. Must only be called with interrupts disabled.
+    @param  mask
+            packed outputs (output 1 in bit 0, on=1)
+    @return void
+*/
+/**************************************************************************/
+template <uint8_t N>
+inline void ShiftRegisterOutputs<N>::_shift(Mask mask) {
+    // most significant byte first: it ends up in the register furthest down the chain
+    for (int8_t byte = (N / 8) - 1; byte >= 0; byte--) {
+        SPDR = (uint8_t)(mask >> (byte * 8));
+        while (!(SPSR & _BV(SPIF))) {}
+    }
+
+    // rising edge copies every shift register to its outputs at once
+    PORTB |= _BV(SR_PORTB_LATCH_BIT);
+    PORTB &= ~_BV(SR_PORTB_LATCH_BIT);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Start SPI and load BOOT_OUTPUT_MASK into the chain, then enable
+            the register outputs (held off by earlyInitShiftRegisters()
+            until now).
+    @return void
+*/
+/**************************************************************************/
+template <uint8_t N>
+void ShiftRegisterOutputs<N>::begin() {
+    SPCR = _BV(SPE) | _BV(MSTR);    // master, MSB first, mode 0
+    SPSR = _BV(SPI2X);              // clk/2 (8 MHz)
+
+    _currentMask = BOOT_OUTPUT_MASK;
+    write(BOOT_OUTPUT_MASK);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Drive all outputs to the given mask at once. Safe to call from
+            both loop() and the step timer interrupt.
+    @param  mask
+            packed outputs (output 1 in bit 0, on=1)
+    @return void
+*/
+/**************************************************************************/
+template <uint8_t N>
+void ShiftRegisterOutputs<N>::write(Mask mask) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        _currentMask = mask;
+        _apply();
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Shift the requested mask, with the overrides applied, into the
+            chain. The masks are read and the chain latched in one go, so a
+            write from the step timer interrupt can't be overwritten with a
+            stale mask, and an e-stop can't be undone by a write it
+            interrupted. Must only be called with interrupts disabled.
+    @return void
+*/
+/**************************************************************************/
+template <uint8_t N>
+void ShiftRegisterOutputs<N>::_apply() {
+    Mask applied = _stopped ? 0 : (_currentMask & _andMask) | _orMask;
+
+    _shift(applied);
+    if (!_stopped) {
+        PORTL &= ~_BV(SR_PORTL_OE_BIT);
+    }
+    _appliedMask = applied;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Turn every output off and latch it there. Raises /OE first, so
+            the outputs drop straight away, then clears the chain. Fast
+            enough to call from the serial RX interrupt.
+    @return void
+*/
+/**************************************************************************/
+template <uint8_t N>
+void ShiftRegisterOutputs<N>::emergencyStop() {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        PORTL |= _BV(SR_PORTL_OE_BIT);
+        _shift(0);
+        _stopped = true;
+        _appliedMask = 0;
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Release the emergency stop latch and drive the outputs back to
+            the most recently requested mask.
+    @return void
+*/
+/**************************************************************************/
+template <uint8_t N>
+void ShiftRegisterOutputs<N>::clearEmergencyStop() {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        _stopped = false;
+        _apply();
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Whether the emergency stop is latched.
+    @return true if the outputs are held off by an emergency stop
+*/
+/**************************************************************************/
+template <uint8_t N>
+bool ShiftRegisterOutputs<N>::isStopped() {
+    return _stopped;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Get the mask most recently written, before overrides were
+            applied.
+    @return packed outputs (output 1 in bit 0, on=1)
+*/
+/**************************************************************************/
+template <uint8_t N>
+typename ShiftRegisterOutputs<N>::Mask ShiftRegisterOutputs<N>::read() {
+    Mask mask;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        mask = _currentMask;
+    }
+    return mask;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Get the mask currently driven on the outputs, after overrides
+            were applied.
+    @return packed outputs (output 1 in bit 0, on=1)
+*/
+/**************************************************************************/
+template <uint8_t N>
+typename ShiftRegisterOutputs<N>::Mask ShiftRegisterOutputs<N>::readApplied() {
+    Mask mask;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        mask = _appliedMask;
+    }
+    return mask;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Set the override mode of one output. The outputs are updated
+            straight away.
+    @param  output
+            output number (1 to N)
+    @param  mode
+            new override mode for the output
+    @return false if the output number or mode is invalid
+*/
+/**************************************************************************/
+template <uint8_t N>
+bool ShiftRegisterOutputs<N>::setOverride(uint8_t output, RelayOverride mode) {
+    if ((output < 1) || (output > N) || (mode > RELAY_FORCE_OFF)) {
+        return false;
+    }
+
+    Mask bit = (Mask)1 << (output - 1);
+    _disabled &= ~bit;
+    _forcedOn &= ~bit;
+    _forcedOff &= ~bit;
+
+    switch (mode)
+    {
+    case RELAY_DISABLED:  _disabled |= bit;  break;
+    case RELAY_FORCE_ON:  _forcedOn |= bit;  break;
+    case RELAY_FORCE_OFF: _forcedOff |= bit; break;
+    default: break;
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        _updateOverrideMasks();
+        _apply();
+    }
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Rebuild the AND / OR masks from the override lists. Must only
+            be called with interrupts disabled, as write() reads them.
+    @return void
+*/
+/**************************************************************************/
+template <uint8_t N>
+void ShiftRegisterOutputs<N>::_updateOverrideMasks() {
+    _andMask = ~(_disabled | _forcedOff);
+    _orMask = _forcedOn & ~_disabled;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Replace all override masks at once (e.g. when restoring the
+            saved configuration) and apply them to the outputs.
+    @param  disabled
+            outputs pulled for maintenance (output 1 in bit 0)
+    @param  forcedOn
+            outputs held on
+    @param  forcedOff
+            outputs held off
+    @return void
+*/
+/**************************************************************************/
+template <uint8_t N>
+void ShiftRegisterOutputs<N>::setOverrideMasks(Mask disabled, Mask forcedOn, Mask forcedOff) {
+    _disabled = disabled;
+    _forcedOn = forcedOn;
+    _forcedOff = forcedOff;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        _updateOverrideMasks();
+        _apply();
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Get the override masks.
+    @param  disabled
+            set to the outputs pulled for maintenance (output 1 in bit 0)
+    @param  forcedOn
+            set to the outputs held on
+    @param  forcedOff
+            set to the outputs held off
+    @return void
+*/
+/**************************************************************************/
+template <uint8_t N>
+void ShiftRegisterOutputs<N>::getOverrideMasks(Mask &disabled, Mask &forcedOn, Mask &forcedOff) {
+    disabled = _disabled;
+    forcedOn = _forcedOn;
+    forcedOff = _forcedOff;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Print the override masks to serial.
+    @return void
+*/
+/**************************************************************************/
+template <uint8_t N>
+void ShiftRegisterOutputs<N>::reportOverrides() {
+    Serial.print(F("disabled: "));
+    Serial.print(_disabled, BIN);
+    Serial.print(F(", forced on: "));
+    Serial.print(_forcedOn, BIN);
+    Serial.print(F(", forced off: "));
+    Serial.print(_forcedOff, BIN);
+}
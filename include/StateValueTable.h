@@ -0,0 +1,66 @@
+#pragma once
+#include <Arduino.h>
+#include <util/atomic.h>
+#include "EepromLayout.h"
+#include "EepromRecordWriter.h"
+#include "OutputStates.h"
+
+#define STATE_TABLE_STATES NUM_STATES       // one entry per state of the relay state table
+#define STATE_TABLE_UPLOAD_ENTRIES 3        // entries carried by one DWELL_UPLOAD / EZ_UPLOAD
+
+/**************************************************************************/
+/*!
+    @brief  Class for a table of one 16 bit value per state, e.g. the dwell
+            time of each state (read by the state machine in place of its
+            constant switching period) or the measured EZ of each state.
+            The table is held in RAM, where the step timer interrupt can
+            read it, and persisted in EEPROM at the address it is given.
+            The interrupt can't read EEPROM instead: a read stalls for up
+            to 3.4 ms while a byte is being written, and would move the
+            address of a read or write loop() has in progress. Each table
+            therefore costs 2 bytes of RAM per state, so readers share
+            the tables in place (e.g. EZ_SWEEP times its steps from the
+            EZ table itself) rather than deriving new ones.
+            The HMI uploads it in blocks of STATE_TABLE_UPLOAD_ENTRIES, then
+            saves it. Saving writes one EEPROM byte per call to saveStep()
+            (see EepromRecordWriter), so loop() is never held up for the
+            ~2 s a full table takes to write.
+*/
+/**************************************************************************/
+class StateValueTable {
+private:
+    const int _addr;                        // EEPROM address of the record
+    uint16_t _values[STATE_TABLE_STATES];
+    bool _valid = false;                    // loaded from EEPROM or uploaded since boot
+    uint16_t _crc = 0;                      // CRC of the saved values
+    EepromRecordWriter _writer;
+
+    uint8_t _recordByte(uint16_t pos);
+    static uint8_t _saveByte(void *table, uint16_t pos);
+    uint16_t _valuesCrc();
+
+public:
+    StateValueTable(int eepromAddr);
+    void load();
+    bool set(uint16_t firstState, const uint16_t *values, uint8_t count);
+    void clear();
+
+    /*! @brief  Whether the table has been loaded or uploaded.
+        @return false if every value is 0 because there is no table */
+    bool valid() { return _valid; }
+
+    /*! @brief  Get the table, e.g. for OutputStateMachineBase::setDwellTable()
+                or setEzRate().
+        @return values, indexed by state number (all 0 if there is no table) */
+    const uint16_t *values() { return _values; }
+
+    uint16_t get(uint16_t state);
+    bool isMonotone(uint16_t numStates);
+    uint16_t nearestState(uint16_t value, uint16_t numStates);
+
+    uint16_t save();
+    bool saveStep();
+    bool saving();
+
+    void report(const __FlashStringHelper *tag);
+};
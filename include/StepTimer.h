@@ -0,0 +1,39 @@
+#pragma once
+#include <Arduino.h>
+#include <util/atomic.h>
+
+#define STEP_TICK_US 1000           // step timer tick period (in us). Switching periods are whole ticks.
+#define STEP_TIMER_PRESCALE 8       // Timer1 prescaler: 2 counts per us at 16 MHz
+#define STEP_TIMER_COUNTS_PER_US (F_CPU / 1000000UL / STEP_TIMER_PRESCALE)
+#define STEP_TIMER_COUNTS_PER_TICK (STEP_TICK_US * STEP_TIMER_COUNTS_PER_US)   // TCNT1 counts 0 to this - 1 each tick
+#define STEP_TICK_LATE_US 50        // a tick is counted as late if its handler starts this long after the tick edge
+#define STEP_EDGE_TIMEOUT_COUNTS (STEP_TIMER_COUNTS_PER_TICK * 3 / 2)   // external clock: tick locally if no edge this long
+
+typedef void (*TickHandler)();
+
+/**************************************************************************/
+/*!
+    @brief  Class for the hardware step timer. Timer1 runs in CTC mode and
+            calls a tick handler from its compare interrupt every
+            STEP_TICK_US, giving the state machine a fixed cadence that
+            does not depend on how busy loop() is.
+            Latency from the tick edge to the handler, and the time spent in
+            the handler, are measured from the timer count itself so the
+            bookkeeping costs only a few cycles per tick.
+            With an external clock (see SyncLink), ticks come from sync
+            edges instead: each edge restarts Timer1, and Timer1 only ticks
+            on its own when an edge is overdue.
+*/
+/**************************************************************************/
+class StepTimer {
+public:
+    void begin(TickHandler handler);
+    void stop();
+    void setExternalClock(bool external);
+    static void externalTick();
+    static bool edgeStarted();
+    uint16_t missedEdges();
+    uint16_t worstHandlerUs();
+    uint16_t meanHandlerNs();
+    void report();
+};
@@ -0,0 +1,110 @@
+#pragma once
+#include <Arduino.h>
+#include <util/atomic.h>
+#include "ComsAPI.h"
+#include "PinMappings.h"
+#include "StepTimer.h"
+
+#define SYNC_BAUD 250000            // Serial1 baud rate between the master and followers
+#define SYNC_LEAD_TICKS 20          // ticks between a synced command being sent and every node applying it
+#define SYNC_MAX_ARGS 8             // most args a synced action code can take
+#define MAX_SYNC_COMMANDS 4         // synced action codes waiting for their tick
+#define SYNC_MAX_TRANSIT_TICKS 8    // most ticks a <SYNC_AT> can take to reach a follower's parser
+
+// role of this Mega on the sync line
+enum SyncRole {
+    SYNC_STANDALONE = 0,    // steps from its own Timer1, sync line unused
+    SYNC_MASTER     = 1,    // steps from its own Timer1, drives the sync line and sends synced codes on Serial1
+    SYNC_FOLLOWER   = 2     // steps on sync line edges, runs the synced codes received on Serial1
+};
+
+/**************************************************************************/
+/*!
+    @brief  An action code that every node runs on the same sync tick.
+*/
+/**************************************************************************/
+struct SyncCommand {
+    uint8_t tick;                   // sync tick (low byte) to run on
+    uint8_t code;
+    uint8_t numArgs;
+    uint8_t args[SYNC_MAX_ARGS];
+};
+
+/**************************************************************************/
+/*!
+    @brief  Class for stepping several Megas in lock step.
+            The master raises the sync line at the start of every step tick
+            and drops it at the end. Sync ticks are numbered 0-255; on sync
+            tick 0 the master gives a second rising edge straight after the
+            first, so followers can number their ticks the same way.
+            Followers take their step ticks from the rising edges (INT4),
+            falling back to their own Timer1 if an edge is overdue.
+            A follower only renumbers from the marker until it is aligned.
+            After that, every <SYNC_AT> received is checked against its own
+            numbering (the tick should be about SYNC_LEAD_TICKS ahead), and
+            only a mismatch lets the next marker renumber it again. A late
+            edge straight after a missed one can't then pass for a marker.
+            Action codes that change the state machine are sent from the
+            master to the followers on Serial1 as
+            <SYNC_AT><tick><code><number of args><args...>, and every node
+            (the master included) commits them on that sync tick. Codes
+            that only change the state machine are run as soon as they are
+            received with its commits held (see armNext()), and the tick
+            handler commits them when the tick starts; the rest are run
+            from loop() once their tick is reached.
+            An emergency stop on the master is passed on as ESTOP_BYTE,
+            which followers act on straight from the USART1 RX interrupt
+            (see EmergencyStop::stopOnSyncLink).
+            The time from the sync edge to the end of the tick handler
+            (where the outputs have been written) is measured on every
+            node; the difference between a follower and the master is the
+            inter-node skew.
+*/
+/**************************************************************************/
+class SyncLink {
+private:
+    SyncRole _role = SYNC_STANDALONE;
+    StepTimer &_stepTimer;
+
+    SyncCommand _commands[MAX_SYNC_COMMANDS];   // in tick order
+    uint8_t _count = 0;
+    volatile bool _armed = false;               // a prepared action code is waiting for the tick handler to commit it
+    volatile uint8_t _armedTick = 0;            // sync tick to commit it on
+    volatile uint16_t _lateCommands = 0;        // committed after their tick had passed
+
+    // Serial1 frame parser
+    char _input[4];
+    uint8_t _inputPos = 0;
+    bool _inFrame = false;
+    SyncCommand _receiving;
+    uint8_t _received = 0;                      // frames of the SYNC_AT being received so far (0: waiting for SYNC_AT)
+
+    void _receiveFrame(uint8_t value);
+    void _checkNumbering(uint8_t tick);
+    void _pop();
+    void _sendFrame(uint8_t value);
+
+public:
+    SyncLink(StepTimer &stepTimer);
+    void begin(SyncRole role);
+    SyncRole getRole();
+
+    void tickStart();
+    void tickEnd();
+    uint8_t tick();
+
+    bool send(uint8_t code, const uint8_t *args, uint8_t numArgs);
+    void forwardStop();
+    void poll();
+    bool peekNext(SyncCommand &command);
+    bool popDue(SyncCommand &command);
+    void armNext();
+    bool commitDue();
+    void commitDone();
+
+    uint16_t worstPulseToOutputsUs();
+    uint16_t meanPulseToOutputsUs();
+    uint16_t resyncs();
+    uint16_t lateCommands();
+    void report();
+};
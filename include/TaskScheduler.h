@@ -0,0 +1,52 @@
+#pragma once
+#include <Arduino.h>
+
+#define MAX_TASKS 8         // size of the static task table
+#define NO_TASK   255       // returned by addTask() when the table is full
+
+typedef void (*TaskCallback)();
+
+/**************************************************************************/
+/*!
+    @brief  A periodic task registered with the TaskScheduler.
+*/
+/**************************************************************************/
+struct Task {
+    TaskCallback callback;
+    const char *name;
+    unsigned long periodUs;     // time between runs, in us
+    unsigned long nextRunUs;    // micros() timestamp of the next run
+    uint8_t priority;           // 0 = highest
+    unsigned long busyUs;       // time spent in callback during the current window (saturates)
+    uint32_t runCount;          // runs during the current window
+    unsigned long worstUs;      // longest single run since reset
+};
+
+/**************************************************************************/
+/*!
+    @brief  Cooperative, non-preemptive scheduler for loop().
+            Tasks are registered with a period and a priority. Each call to
+            run() executes every task that is due, once each, highest
+            priority first. If no task is due the CPU sleeps in idle mode
+            until the next interrupt.
+            Time spent in each task is measured, so the CPU utilisation of
+            each task can be reported.
+*/
+/**************************************************************************/
+class TaskScheduler {
+private:
+    Task _tasks[MAX_TASKS];
+    uint8_t _numTasks = 0;
+    unsigned long _windowStartMs = 0;   // start of the utilisation measurement window (millis(), so it
+                                        // can run for days between reports)
+    unsigned long _idleUs = 0;          // time spent asleep during the current window (saturates)
+
+    void _runTask(Task &task);
+    void _idle(unsigned long untilUs);
+
+public:
+    uint8_t addTask(TaskCallback callback, const char *name, unsigned long periodUs, uint8_t priority);
+    void setPeriod(uint8_t taskId, unsigned long periodUs);
+    void run();
+    void report();
+};
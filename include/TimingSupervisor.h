@@ -0,0 +1,26 @@
+#pragma once
+#include <Arduino.h>
+#include <avr/wdt.h>
+#include "PinMappings.h"
+
+// watchdog timeout. loop() must call kick() at least this often.
+#define WATCHDOG_TIMEOUT WDTO_500MS
+
+/**************************************************************************/
+/*!
+    @brief  Class for supervising loop() with the AVR watchdog. If loop()
+            stalls, the watchdog interrupt stops the step timer and drops
+            all relays to the safe (off) state, and the following timeout
+            resets the MCU.
+            Step timing itself is measured by the StepTimer.
+*/
+/**************************************************************************/
+class TimingSupervisor {
+public:
+    void begin();
+    void kick();
+
+    bool resetByWatchdog();
+    uint16_t watchdogResetCount();
+    void report();
+};
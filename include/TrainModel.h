@@ -0,0 +1,89 @@
+#pragma once
+#include <Arduino.h>
+#include <util/atomic.h>
+#include "ComsAPI.h"
+#include "StateValueTable.h"
+#include "StepTimer.h"
+
+// fixed point formats of the model (all per step timer tick)
+#define TRAIN_FRAC_BITS 24                  // speed and acceleration are in 1/2^24 mm per tick (per tick)
+#define TRAIN_EZ_SCALE_BITS 16              // remaining mm to EZ units multiplier, in 1/2^16
+#define TRAIN_EZ_FULL (100 * EZ_UNITS_PER_EZ)   // EZ with the train at (or beyond) the end of the approach
+#define TRAIN_MAX_SPEED_CMS 12000           // fastest speed (432 km/h): faster starts are refused, accelerating trains held at it
+// TRAIN_MAX_SPEED_CMS in the model's speed units (mm per tick, in 1/2^TRAIN_FRAC_BITS)
+#define TRAIN_MAX_SPEED ((int32_t)((int64_t)TRAIN_MAX_SPEED_CMS * 10 * STEP_TICK_US * (1LL << TRAIN_FRAC_BITS) / 1000000LL))
+#define TRAIN_BENCH_STEPS 256               // model updates timed by TRAIN_BENCH
+
+// why a model run ended
+enum TrainModelEnd {
+    TRAIN_NOT_ENDED = 0,    // still running, or the end has already been taken
+    TRAIN_ARRIVED   = 1,    // reached the crossing (EZ 0)
+    TRAIN_STOPPED   = 2,    // came to a stand before the crossing
+    TRAIN_CANCELLED = 3     // another mode or an e-stop took over the channel
+};
+
+/**************************************************************************/
+/*!
+    @brief  Integer state of a train on the approach, advanced one step
+            timer tick at a time. Kept apart from TrainModel so it can be
+            copied and stepped by the benchmark.
+*/
+/**************************************************************************/
+struct TrainState {
+    int32_t speed;              // mm per tick, in 1/2^TRAIN_FRAC_BITS (0 to TRAIN_MAX_SPEED)
+    int32_t accel;              // mm per tick per tick, in 1/2^TRAIN_FRAC_BITS
+    int32_t travelledMm;        // distance covered since the start, whole mm
+    uint32_t travelledFrac;     // and the fraction of a mm, in 1/2^TRAIN_FRAC_BITS
+    int32_t startMm;            // distance from the crossing at the start
+    int32_t approachMm;         // length of the approach (EZ 100 at this distance)
+    uint32_t ezPerMm;           // EZ units per mm of remaining distance, in 1/2^TRAIN_EZ_SCALE_BITS
+};
+
+/**************************************************************************/
+/*!
+    @brief  Class for simulating a train approaching the crossing on one
+            channel, with no serial traffic during the approach.
+            Every step timer tick the train's kinematics are advanced
+            (exactly, for constant acceleration), the EZ is taken as
+            proportional to its distance from the crossing, and the channel
+            is driven to the state whose calibrated EZ (see GOTO_EZ) is
+            nearest. Only integer adds, one 32 x 32 bit multiply and a
+            binary search run in the interrupt.
+            The run ends when the train reaches the crossing or stops, or
+            when the channel is taken out of MANUAL mode.
+*/
+/**************************************************************************/
+class TrainModel {
+private:
+    StateValueTable &_ezTable;
+    TrainState _train;
+    uint16_t _numStates = 0;
+    uint8_t _channel = 0;
+    volatile bool _running = false;
+    volatile TrainModelEnd _end = TRAIN_NOT_ENDED;     // end of the last run, until taken by takeEnd()
+    volatile uint32_t _ticks = 0;           // ticks since the start
+    volatile uint16_t _ez = TRAIN_EZ_FULL;  // EZ of the last tick, in EZ units
+    volatile uint16_t _state = 0;           // state driven on the last tick
+
+public:
+    TrainModel(StateValueTable &ezTable);
+
+    uint16_t start(uint8_t channel, const TrainState &train, uint16_t numStates);
+    void stop();
+
+    /*! @brief  Whether the model is driving a channel.
+        @param  channel channel to check
+        @return true if the model is running on that channel */
+    bool drives(uint8_t channel) { return _running && (channel == _channel); }
+
+    uint16_t tick();
+    uint16_t state();
+    static uint16_t step(TrainState &train);
+    static bool initState(TrainState &train, uint16_t speedCmS, int16_t accelMmS2, uint16_t distanceDm,
+                          uint16_t approachDm);
+    TrainModelEnd takeEnd();
+    uint32_t elapsedMs();
+
+    uint16_t benchNs(uint16_t numStates);
+    void report();
+};
@@ -0,0 +1,47 @@
+#pragma once
+#include <Arduino.h>
+#include "EepromLayout.h"
+#include "EepromRecordWriter.h"
+
+#define VM_PROGRAM_SIZE 256             // bytes of bytecode held in RAM and EEPROM
+#define VM_UPLOAD_SIZE 6                // program bytes carried by one VM_UPLOAD
+
+/**************************************************************************/
+/*!
+    @brief  Class for the bytecode program run by BytecodeVM. The program
+            is held in RAM and persisted in EEPROM. The HMI uploads it
+            VM_UPLOAD_SIZE bytes at a time, then saves it. Saving writes
+            one EEPROM byte per call to saveStep() (see
+            EepromRecordWriter).
+*/
+/**************************************************************************/
+class VMProgram {
+private:
+    uint8_t _code[VM_PROGRAM_SIZE];     // unused bytes are VM_OP_HALT (0)
+    uint16_t _length = 0;               // bytes uploaded or loaded
+    uint16_t _crc = 0;                  // CRC of the saved program
+    EepromRecordWriter _writer;
+
+    uint8_t _recordByte(uint16_t pos);
+    static uint8_t _saveByte(void *program, uint16_t pos);
+    uint16_t _codeCrc();
+
+public:
+    VMProgram();
+    void load();
+    bool set(uint16_t offset, const uint8_t *bytes, uint8_t count);
+
+    /*! @brief  Get the program.
+        @return bytecode, VM_PROGRAM_SIZE bytes */
+    const uint8_t *code() { return _code; }
+
+    /*! @brief  Get the program length.
+        @return bytes uploaded or loaded (0: no program) */
+    uint16_t length() { return _length; }
+
+    uint16_t save();
+    bool saveStep();
+    bool saving();
+
+    void report();
+};
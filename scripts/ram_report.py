@@ -0,0 +1,98 @@
+# PlatformIO post-build script: break down static SRAM use (.data + .bss + .noinit)
+# by subsystem, using the linker map file written by the -Wl,-Map build flag.
+#
+# Each project source file is reported as its own subsystem (e.g. OutputStateMachine,
+# SerialPort). Objects pulled in from the Arduino framework or avr-libc are grouped.
+
+import os
+import re
+
+Import("env")
+
+RAM_SIZE = 8192     # ATmega2560 SRAM in bytes
+RAM_SECTIONS = (".data", ".bss", ".noinit")
+
+# input section entry inside an output section, e.g.
+#  .bss.serialPort  0x0000000000800312  0x6 .pio/build/megaatmega2560/src/main.cpp.o
+entry_re = re.compile(r"^\s+(\S+)?\s*0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(\S+)$")
+
+
+def subsystem_name(obj_path: str) -> str:
+    if "libFrameworkArduino" in obj_path or "FrameworkArduino" in obj_path:
+        return "Arduino core"
+    if "libc.a" in obj_path or "libgcc.a" in obj_path or "libm.a" in obj_path:
+        return "avr-libc"
+
+    name = os.path.basename(obj_path)
+    for ext in (".o", ".cpp", ".c", ".S"):
+        if name.endswith(ext):
+            name = name[:-len(ext)]
+    return name
+
+
+def parse_map(map_file: str) -> dict:
+    usage = {}      # subsystem -> {section: bytes}
+    section = None
+    pending_name = False
+
+    with open(map_file, "r") as file:
+        for line in file:
+            line = line.rstrip("\n")
+
+            # output section headers start in column 0
+            if line.startswith("."):
+                section = line.split()[0]
+                section = section if section in RAM_SECTIONS else None
+                continue
+
+            if section is None:
+                continue
+
+            # long input section names are printed on their own line
+            if re.match(r"^\s\.\S+$", line):
+                pending_name = True
+                continue
+
+            match = entry_re.match(line)
+            if (match is None) or (match.group(1) is None and not pending_name):
+                pending_name = False
+                continue
+            pending_name = False
+
+            size = int(match.group(3), 16)
+            if size == 0:
+                continue
+
+            subsystem = subsystem_name(match.group(4))
+            usage.setdefault(subsystem, {s: 0 for s in RAM_SECTIONS})
+            usage[subsystem][section] += size
+
+    return usage
+
+
+def ram_report(source, target, env):
+    map_file = os.path.join(env.subst("$BUILD_DIR"), "firmware.map")
+    if not os.path.isfile(map_file):
+        print(f"[RAM REPORT] map file not found: {map_file}")
+        return
+
+    usage = parse_map(map_file)
+    rows = sorted(usage.items(), key=lambda item: sum(item[1].values()), reverse=True)
+
+    print("")
+    print("Static SRAM usage by subsystem")
+    print(f"  {'subsystem':<24}{'.data':>8}{'.bss':>8}{'.noinit':>9}{'total':>8}")
+
+    grand_total = 0
+    for subsystem, sections in rows:
+        total = sum(sections.values())
+        grand_total += total
+        print(f"  {subsystem:<24}{sections['.data']:>8}{sections['.bss']:>8}"
+              f"{sections['.noinit']:>9}{total:>8}")
+
+    print(f"  {'TOTAL':<24}{'':>8}{'':>8}{'':>9}{grand_total:>8}")
+    print(f"  heap + stack headroom: {RAM_SIZE - grand_total} of {RAM_SIZE} bytes")
+    print("")
+
+
+env.AddPostAction("$BUILD_DIR/${PROGNAME}.elf", ram_report)
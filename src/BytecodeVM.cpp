@@ -0,0 +1,421 @@
+#include "BytecodeVM.h"
+
+
+/**************************************************************************/
+/*!
+    @brief  Start running a program from its first instruction, replacing
+            any program running.
+    @param  code
+            bytecode (see VM_OP_*)
+    @param  length
+            program length in bytes; running past it halts
+    @param  channel
+            state machine the program drives (NULL: channel opcodes fault)
+    @param  channelNum
+            its channel number, for drives()
+    @param  numStates
+            number of states of the channel's state table
+    @return void
+*/
+/**************************************************************************/
+void BytecodeVM::start(const uint8_t *code, uint16_t length, OutputStateMachineBase *channel, uint8_t channelNum,
+                       uint16_t numStates) {
+    _code = code;
+    _length = length;
+    _channel = channel;
+    _channelNum = channelNum;
+    _numStates = numStates;
+
+    _pc = 0;
+    _opPc = 0;
+    _sp = 0;
+    _loopDepth = 0;
+    _stateNum = channel ? channel->getStateNum() : 0;
+    _fault = VM_FAULT_NONE;
+    _executed = 0;
+    _waitSweep = false;
+    _cancelled = false;
+    _clockUs = micros();
+    _running = true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Stop the program, if one is running. The channel keeps its
+            state and mode. The next run() returns VM_CANCELLED.
+    @return void
+*/
+/**************************************************************************/
+void BytecodeVM::stop() {
+    if (_running) {
+        _running = false;
+        _cancelled = true;
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Read a 1 byte operand.
+    @param  value
+            set to the operand
+    @return false if it is past the end of the program
+*/
+/**************************************************************************/
+bool BytecodeVM::_fetch8(uint8_t &value) {
+    if (_pc >= _length) {
+        return false;
+    }
+    value = _code[_pc++];
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Read a 2 byte operand, high byte first.
+    @param  value
+            set to the operand
+    @return false if it is past the end of the program
+*/
+/**************************************************************************/
+bool BytecodeVM::_fetch16(uint16_t &value) {
+    if (_pc + 2 > _length) {
+        return false;
+    }
+    value = ((uint16_t)_code[_pc] << 8) | _code[_pc + 1];
+    _pc += 2;
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Push a value on the stack.
+    @param  value
+            value to push
+    @return false if the stack is full
+*/
+/**************************************************************************/
+bool BytecodeVM::_push(int16_t value) {
+    if (_sp >= VM_STACK_DEPTH) {
+        return false;
+    }
+    _stack[_sp++] = value;
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Pop a value off the stack.
+    @param  value
+            set to the value
+    @return false if the stack is empty
+*/
+/**************************************************************************/
+bool BytecodeVM::_pop(int16_t &value) {
+    if (_sp == 0) {
+        return false;
+    }
+    value = _stack[--_sp];
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Whether the program's clock has been reached. Busy-waits for
+            it if it is less than VM_SPIN_US away and spinning is allowed.
+    @param  spin
+            true to busy-wait a short remainder, false to only check
+    @return false if the wait has further to go
+*/
+/**************************************************************************/
+bool BytecodeVM::_waitDone(bool spin) {
+    long remainingUs = (long)(_clockUs - micros());
+    if (remainingUs > (spin ? VM_SPIN_US : 0)) {
+        return false;
+    }
+    while ((long)(_clockUs - micros()) > 0) {
+    }
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Stop the program on a fault.
+    @param  fault
+            why
+    @return VM_FAULTED
+*/
+/**************************************************************************/
+VMStatus BytecodeVM::_fail(VMFault fault) {
+    _fault = fault;
+    _running = false;
+    return VM_FAULTED;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Run one instruction.
+    @return VM_RUNNING to carry on, VM_WAITING after a wait instruction,
+            or why the program stopped
+*/
+/**************************************************************************/
+VMStatus BytecodeVM::_execute() {
+    _opPc = _pc;
+    if (_pc >= _length) {
+        _running = false;
+        return VM_HALTED;
+    }
+    uint8_t op = _code[_pc++];
+    _executed++;
+
+    int16_t a, b;
+    uint8_t byte;
+    uint16_t word;
+
+    switch (op)
+    {
+    case VM_OP_HALT:
+        _running = false;
+        return VM_HALTED;
+
+    case VM_OP_PUSH8:
+        if (!_fetch8(byte)) return _fail(VM_FAULT_ADDRESS);
+        if (!_push(byte)) return _fail(VM_FAULT_STACK);
+        break;
+
+    case VM_OP_PUSH16:
+        if (!_fetch16(word)) return _fail(VM_FAULT_ADDRESS);
+        if (!_push((int16_t)word)) return _fail(VM_FAULT_STACK);
+        break;
+
+    case VM_OP_DUP:
+        if (!_pop(a) || !_push(a) || !_push(a)) return _fail(VM_FAULT_STACK);
+        break;
+
+    case VM_OP_DROP:
+        if (!_pop(a)) return _fail(VM_FAULT_STACK);
+        break;
+
+    case VM_OP_ADD:
+    case VM_OP_SUB:
+        if (!_pop(b) || !_pop(a)) return _fail(VM_FAULT_STACK);
+        // wrap in unsigned: signed overflow is undefined
+        _push((int16_t)((op == VM_OP_ADD) ? (uint16_t)a + (uint16_t)b : (uint16_t)a - (uint16_t)b));
+        break;
+
+    case VM_OP_JMP:
+        if (!_fetch16(word) || (word >= _length)) return _fail(VM_FAULT_ADDRESS);
+        _pc = word;
+        break;
+
+    case VM_OP_JZ:
+        if (!_fetch16(word) || (word >= _length)) return _fail(VM_FAULT_ADDRESS);
+        if (!_pop(a)) return _fail(VM_FAULT_STACK);
+        if (a == 0) _pc = word;
+        break;
+
+    case VM_OP_LOOP:
+        if (!_fetch16(word) || (word > _length)) return _fail(VM_FAULT_ADDRESS);
+        if (!_pop(a)) return _fail(VM_FAULT_STACK);
+        if (a <= 0) {
+            _pc = word;
+        } else if (_loopDepth >= VM_MAX_LOOPS) {
+            return _fail(VM_FAULT_LOOP);
+        } else {
+            _loops[_loopDepth].start = _pc;
+            _loops[_loopDepth].left = a;
+            _loopDepth++;
+        }
+        break;
+
+    case VM_OP_END_LOOP:
+        if (_loopDepth == 0) return _fail(VM_FAULT_LOOP);
+        if (--_loops[_loopDepth - 1].left > 0) {
+            _pc = _loops[_loopDepth - 1].start;
+        } else {
+            _loopDepth--;
+        }
+        break;
+
+    case VM_OP_SET_STATE:
+    case VM_OP_STEP:
+        if (!_pop(a)) return _fail(VM_FAULT_STACK);
+        if (!_channel) return _fail(VM_FAULT_CHANNEL);
+        if (op == VM_OP_STEP) {
+            a = constrain((long)_stateNum + a, 0L, (long)_numStates - 1);
+        } else if ((a < 0) || (a >= (int16_t)_numStates)) {
+            return _fail(VM_FAULT_CHANNEL);
+        }
+        _stateNum = a;
+        _channel->restoreState(a, MANUAL);
+        break;
+
+    case VM_OP_GET_STATE:
+        if (!_channel) return _fail(VM_FAULT_CHANNEL);
+        if (!_push(_channel->getStateNum())) return _fail(VM_FAULT_STACK);
+        break;
+
+    case VM_OP_SET_PERIOD:
+        if (!_pop(a)) return _fail(VM_FAULT_STACK);
+        if (!_channel || (a <= 0)) return _fail(VM_FAULT_CHANNEL);
+        _channel->setPeriod(a);
+        break;
+
+    case VM_OP_MODE:
+        if (!_pop(a)) return _fail(VM_FAULT_STACK);
+        if (!_channel) return _fail(VM_FAULT_CHANNEL);
+        switch (a)
+        {
+        case DECREASE_EZ:
+        case INCREASE_EZ:
+        case RESET_HIGH_EZ:
+        case RESET_LOW_EZ:
+        case MANUAL:
+        case IDLE:
+            _channel->changeCylceMode(a);
+            break;
+
+        default:
+            return _fail(VM_FAULT_CHANNEL);
+        }
+        break;
+
+    case VM_OP_WAIT_SWEEP:
+        if (!_channel) return _fail(VM_FAULT_CHANNEL);
+        _waitSweep = true;
+        return VM_WAITING;
+
+    case VM_OP_WAIT_US:
+    case VM_OP_WAIT_MS:
+        if (!_pop(a)) return _fail(VM_FAULT_STACK);
+        _clockUs += (op == VM_OP_WAIT_MS) ? (uint16_t)a * 1000UL : (uint16_t)a;
+        return VM_WAITING;
+
+    case VM_OP_EMIT:
+        if (!_pop(a)) return _fail(VM_FAULT_STACK);
+        _emitted = a;
+        return VM_EMITTED;
+
+    default:
+        return _fail(VM_FAULT_OPCODE);
+    }
+    return VM_RUNNING;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Run the program for up to a time slice. Call regularly from a
+            task while running() is true.
+    @param  maxUs
+            time to run for, at most, including any busy-wait. The last
+            instruction may finish past it.
+    @return what the program stopped on: VM_RUNNING or VM_WAITING to be
+            called again, VM_EMITTED to send emitted() and call again, or
+            VM_HALTED, VM_FAULTED, VM_CANCELLED (once each) or VM_IDLE
+*/
+/**************************************************************************/
+VMStatus BytecodeVM::run(uint16_t maxUs) {
+    unsigned long startUs = micros();
+
+    if (!_running) {
+        if (_cancelled) {
+            _cancelled = false;
+            return VM_CANCELLED;
+        }
+        return VM_IDLE;
+    }
+
+    // a sweep has no fixed length: restart the program's clock when it ends
+    if (_waitSweep) {
+        if (_channel->changePending() || !_channel->endStateReached()) {
+            return VM_WAITING;
+        }
+        _waitSweep = false;
+        _stateNum = _channel->getStateNum();
+        _clockUs = micros();
+    }
+    // spin at most once per slice, here: a wait reached in the loop below
+    // is left to the next call, so a run of short waits can't hold the task
+    if (!_waitDone(true)) {
+        return VM_WAITING;
+    }
+
+    do {
+        VMStatus status = _execute();
+        if (status == VM_WAITING) {
+            if (_waitSweep || !_waitDone(false)) {
+                return VM_WAITING;
+            }
+        } else if (status != VM_RUNNING) {
+            return status;
+        }
+    } while ((micros() - startUs) < maxUs);
+    return VM_RUNNING;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Time the interpreter on a program of stack, arithmetic and
+            loop instructions (no channel or wait opcodes), on a scratch
+            VM. Runs with interrupts enabled, so the result includes a
+            share of interrupt load, and includes run()'s check of its
+            time slice after each instruction.
+    @return mean time per instruction, in ns
+*/
+/**************************************************************************/
+uint16_t BytecodeVM::benchNs() {
+    static const uint8_t program[] = {
+        VM_OP_PUSH16, highByte(VM_BENCH_LOOPS), lowByte(VM_BENCH_LOOPS),
+        VM_OP_LOOP, 0, 15,                  // 3: exit to HALT at 15
+        VM_OP_PUSH8, 1,                     // 6: loop body
+        VM_OP_DUP,
+        VM_OP_ADD,
+        VM_OP_PUSH8, 2,
+        VM_OP_SUB,
+        VM_OP_DROP,
+        VM_OP_END_LOOP,                     // 14
+        VM_OP_HALT                          // 15
+    };
+    BytecodeVM vm;
+    vm.start(program, sizeof(program), NULL, 0, 0);
+
+    unsigned long start = micros();
+    while (vm.run(0xFFFF) == VM_RUNNING) {
+    }
+    unsigned long elapsed = micros() - start;
+
+    return min(elapsed * 1000UL / vm._executed, 65535UL);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Print the VM state to serial.
+    @return void
+*/
+/**************************************************************************/
+void BytecodeVM::report() {
+    Serial.print(F("[VM] running: "));
+    Serial.print(_running);
+    Serial.print(F(", ch: "));
+    Serial.print(_channelNum);
+    Serial.print(F(", pc: "));
+    Serial.print(_pc);
+    Serial.print(F(", stack: "));
+    Serial.print(_sp);
+    Serial.print(F(", loops: "));
+    Serial.print(_loopDepth);
+    Serial.print(F(", fault: "));
+    Serial.print(_fault);
+    Serial.print(F(", executed: "));
+    Serial.println(_executed);
+}
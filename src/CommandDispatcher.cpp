@@ -0,0 +1,314 @@
+#include "CommandDispatcher.h"
+
+#define BENCHMARK_ITERATIONS 256    // table lookups timed by benchmark()
+
+
+/**************************************************************************/
+/*!
+    @brief  Default handler for action codes with no registration.
+    @param  code
+            action code received
+    @param  args
+            unused
+    @return void
+*/
+/**************************************************************************/
+void unknownCommand(uint8_t code, const uint8_t *args) {
+    Serial.print("[ERROR] invalid serialPort.actionCode: ");
+    Serial.println(code);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Constructor
+    @param  table
+            256 entry dispatch table in PROGMEM (see DEFINE_COMMAND_TABLE)
+*/
+/**************************************************************************/
+CommandDispatcher::CommandDispatcher(const CommandEntry *table) {
+    _table = table;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Process one frame received from serial. The frame is either an
+            action code or an argument for the pending action code.
+            Complete action codes are queued to be run by runNext(). Check
+            full() before calling.
+    @param  frame
+            value of the frame received
+    @return void
+*/
+/**************************************************************************/
+void CommandDispatcher::dispatch(uint8_t frame) {
+    if (_argsReceived < _argsExpected) {
+        _args[_argsReceived++] = frame;
+
+        if (_argsReceived == _argsExpected) {
+            _argsExpected = 0;
+            _enqueue(_pendingCode);
+        }
+        return;
+    }
+
+    uint8_t numArgs = pgm_read_byte(&_table[frame].numArgs);
+
+    if (numArgs > 0) {
+        _pendingCode = frame;
+        _argsExpected = numArgs;    // at most MAX_COMMAND_ARGS, checked by REGISTER_COMMAND
+        _argsReceived = 0;
+        return;
+    }
+
+    _enqueue(frame);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Queue a complete action code, with the arguments collected for
+            it. If the queue is full the action code is rejected: it is
+            not run and its usual reply is never sent.
+            Running it straight away here would let it overtake the codes
+            already waiting.
+    @param  code
+            action code to queue
+    @return void
+*/
+/**************************************************************************/
+void CommandDispatcher::_enqueue(uint8_t code) {
+    if (_numReady == MAX_PENDING_COMMANDS) {
+        Serial.print(F("[ERROR] command queue full, dropped action code: "));
+        Serial.println(code);
+        return;
+    }
+
+    PendingCommand &command = _ready[(_readyHead + _numReady++) % MAX_PENDING_COMMANDS];
+    command.code = code;
+    memcpy(command.args, _args, pgm_read_byte(&_table[code].numArgs));
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Run the oldest action code waiting.
+    @return false if no action code was waiting
+*/
+/**************************************************************************/
+bool CommandDispatcher::runNext() {
+    if (_numReady == 0) {
+        return false;
+    }
+
+    PendingCommand command = _ready[_readyHead];
+    _readyHead = (_readyHead + 1) % MAX_PENDING_COMMANDS;
+    _numReady--;
+
+    _run(command.code, command.args);
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Run a received action code: offer it to the interceptor, then
+            call its handler if the interceptor didn't take it.
+    @param  code
+            action code to run
+    @param  args
+            argument frames received with it
+    @return void
+*/
+/**************************************************************************/
+void CommandDispatcher::_run(uint8_t code, const uint8_t *args) {
+    if (_interceptor && _interceptor(code, args)) {
+        return;
+    }
+
+    _execute(code, (CommandHandler)pgm_read_ptr(&_table[code].handler), args);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Whether the queue of complete action codes is full. Stop
+            feeding frames to dispatch() until runNext() has made room.
+    @return true if no more action codes can be queued
+*/
+/**************************************************************************/
+bool CommandDispatcher::full() {
+    return _numReady == MAX_PENDING_COMMANDS;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Run an action code that takes no arguments straight away,
+            without disturbing any arguments being collected by dispatch().
+            It is offered to the interceptor first, as a received code
+            would be. Used for scheduled action codes.
+    @param  code
+            action code to execute
+    @return void
+*/
+/**************************************************************************/
+void CommandDispatcher::execute(uint8_t code) {
+    if (pgm_read_byte(&_table[code].numArgs) != 0) {
+        return;
+    }
+
+    _run(code, _args);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Run an action code with the given arguments straight away,
+            without disturbing any arguments being collected by dispatch().
+            It is offered to the interceptor first, as a received code
+            would be.
+    @param  code
+            action code to execute
+    @param  args
+            its argument frames (as many as the code takes)
+    @return void
+*/
+/**************************************************************************/
+void CommandDispatcher::execute(uint8_t code, const uint8_t *args) {
+    _run(code, args);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Run an action code the interceptor has already dealt with,
+            straight away and without offering it to the interceptor again.
+            Used for synced action codes, which the interceptor sent to
+            every node and which now run here.
+    @param  code
+            action code to execute
+    @param  args
+            its argument frames (as many as the code takes)
+    @return void
+*/
+/**************************************************************************/
+void CommandDispatcher::executeIntercepted(uint8_t code, const uint8_t *args) {
+    _execute(code, (CommandHandler)pgm_read_ptr(&_table[code].handler), args);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Set the function offered every received action code before its
+            handler runs (e.g. to forward it to other nodes).
+    @param  interceptor
+            interceptor, or NULL for none
+    @return void
+*/
+/**************************************************************************/
+void CommandDispatcher::setInterceptor(CommandInterceptor interceptor) {
+    _interceptor = interceptor;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Get the number of argument frames an action code takes.
+    @param  code
+            action code to look up
+    @return number of arguments, or -1 if the code has no registration
+*/
+/**************************************************************************/
+int8_t CommandDispatcher::argCount(uint8_t code) {
+    if ((CommandHandler)pgm_read_ptr(&_table[code].handler) == unknownCommand) {
+        return -1;
+    }
+
+    return pgm_read_byte(&_table[code].numArgs);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Call the handler of an action code, timing the call.
+    @param  code
+            action code to execute
+    @param  handler
+            handler read from the dispatch table
+    @param  args
+            argument frames received with the action code
+    @return void
+*/
+/**************************************************************************/
+void CommandDispatcher::_execute(uint8_t code, CommandHandler handler, const uint8_t *args) {
+    unsigned long start = micros();
+
+    handler(code, args);
+
+    unsigned long elapsed = micros() - start;
+    if (elapsed > _worstUs) {
+        _worstUs = elapsed;
+        _worstCode = code;
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Whether the dispatcher is part way through collecting the
+            argument frames of an action code.
+    @return true if the next frame will be taken as an argument
+*/
+/**************************************************************************/
+bool CommandDispatcher::awaitingArgs() {
+    return _argsReceived < _argsExpected;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Drop any partly received action code and its arguments.
+    @return void
+*/
+/**************************************************************************/
+void CommandDispatcher::cancel() {
+    _argsExpected = 0;
+    _argsReceived = 0;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Time the table lookup for an action code (without running its
+            handler) and print it, along with the slowest full dispatch
+            seen so far.
+    @param  code
+            action code to benchmark
+    @return void
+*/
+/**************************************************************************/
+void CommandDispatcher::benchmark(uint8_t code) {
+    volatile CommandHandler handler;
+    volatile uint8_t numArgs;
+
+    unsigned long start = micros();
+    for (uint16_t i = 0; i < BENCHMARK_ITERATIONS; i++) {
+        handler = (CommandHandler)pgm_read_ptr(&_table[code].handler);
+        numArgs = pgm_read_byte(&_table[code].numArgs);
+    }
+    unsigned long elapsed = micros() - start;
+    (void)handler;
+    (void)numArgs;
+
+    Serial.print(F("[DISPATCH] code: "));
+    Serial.print(code);
+    Serial.print(F(", lookup: "));
+    Serial.print(elapsed * 1000UL / BENCHMARK_ITERATIONS);
+    Serial.print(F(" ns, worst dispatch: "));
+    Serial.print(_worstUs);
+    Serial.print(F(" us (code "));
+    Serial.print(_worstCode);
+    Serial.println(F(")"));
+}
@@ -0,0 +1,78 @@
+#include "CommandQueue.h"
+
+static_assert((COMMAND_QUEUE_SIZE & (COMMAND_QUEUE_SIZE - 1)) == 0, "COMMAND_QUEUE_SIZE must be a power of 2");
+
+
+/**************************************************************************/
+/*!
+    @brief  Add a frame to the back of the queue.
+    @param  frame
+            frame value to add
+    @return false if the queue was full and the frame was dropped
+*/
+/**************************************************************************/
+bool CommandQueue::push(uint8_t frame) {
+    if (_count == COMMAND_QUEUE_SIZE) {
+        return false;
+    }
+
+    _frames[_head] = frame;
+    _head = (_head + 1) & (COMMAND_QUEUE_SIZE - 1);
+    _count++;
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Take the frame at the front of the queue.
+    @param  frame
+            set to the frame removed
+    @return false if the queue was empty
+*/
+/**************************************************************************/
+bool CommandQueue::pop(uint8_t &frame) {
+    if (_count == 0) {
+        return false;
+    }
+
+    frame = _frames[_tail];
+    _tail = (_tail + 1) & (COMMAND_QUEUE_SIZE - 1);
+    _count--;
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Number of frames waiting in the queue.
+    @return frame count
+*/
+/**************************************************************************/
+uint8_t CommandQueue::count() {
+    return _count;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Number of frames that can be added before the queue is full.
+    @return free slots
+*/
+/**************************************************************************/
+uint8_t CommandQueue::space() {
+    return COMMAND_QUEUE_SIZE - _count;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Drop every frame in the queue.
+    @return void
+*/
+/**************************************************************************/
+void CommandQueue::clear() {
+    _head = 0;
+    _tail = 0;
+    _count = 0;
+}
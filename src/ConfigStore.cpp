@@ -0,0 +1,189 @@
+#include "ConfigStore.h"
+#include <EEPROM.h>
+#include <util/crc16.h>
+
+static_assert(sizeof(ConfigRecord) <= CONFIG_SLOT_SIZE, "ConfigRecord does not fit in a config slot");
+
+#define SLOT_ADDR(slot) (EEPROM_ADDR_CONFIG_RING + (slot) * CONFIG_SLOT_SIZE)
+
+
+/**************************************************************************/
+/*!
+    @brief  CRC-CCITT of a block of bytes.
+    @param  data
+            bytes to check
+    @param  len
+            number of bytes
+    @return crc
+*/
+/**************************************************************************/
+uint16_t ConfigStore::_crc(const uint8_t *data, uint8_t len) {
+    uint16_t crc = 0xFFFF;
+
+    for (uint8_t i = 0; i < len; i++) {
+        crc = _crc_ccitt_update(crc, data[i]);
+    }
+    return crc;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Load the newest valid record from the EEPROM ring.
+            If no valid record is found, the defaults are used.
+    @param  defaults
+            config to use if nothing valid has been saved
+    @return true if a saved config was restored
+*/
+/**************************************************************************/
+bool ConfigStore::load(const Config &defaults) {
+    ConfigRecord record;
+    bool found = false;
+
+    for (uint8_t slot = 0; slot < CONFIG_NUM_SLOTS; slot++) {
+        EEPROM.get(SLOT_ADDR(slot), record);
+
+        if ((record.magic != EEPROM_MAGIC) || (record.version != CONFIG_VERSION)) continue;
+        if (record.crc != _crc((const uint8_t *)&record, offsetof(ConfigRecord, crc))) continue;
+
+        // sequence numbers wrap, so compare by signed difference
+        if (!found || ((int16_t)(record.sequence - _sequence) > 0)) {
+            found = true;
+            _sequence = record.sequence;
+            _slot = slot;
+            data = record.config;
+        }
+    }
+
+    if (!found) {
+        data = defaults;
+    }
+    return found;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Byte of the record being saved, for the EepromRecordWriter.
+    @param  store
+            the ConfigStore saving its record
+    @param  pos
+            offset into the record
+    @return byte to save at that offset
+*/
+/**************************************************************************/
+uint8_t ConfigStore::_saveByte(void *store, uint16_t pos) {
+    return ((const uint8_t *)&((ConfigStore *)store)->_record)[pos];
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Start writing the config to the next slot of the ring, written
+            by saveStep(). If a save is still in progress, its slot is
+            rewritten with the newer config instead.
+    @return void
+*/
+/**************************************************************************/
+void ConfigStore::save() {
+    uint8_t slot = saving() ? _slot : (_slot + 1) % CONFIG_NUM_SLOTS;
+    uint16_t sequence = saving() ? _sequence : _sequence + 1;
+
+    _record.magic = EEPROM_MAGIC;
+    _record.version = CONFIG_VERSION;
+    _record.sequence = sequence;
+    _record.config = data;
+    _record.crc = _crc((const uint8_t *)&_record, offsetof(ConfigRecord, crc));
+    _writer.start(SLOT_ADDR(slot), sizeof(ConfigRecord), _saveByte, this);
+
+    _slot = slot;
+    _sequence = sequence;
+    _dirty = false;
+    _lastSaveMs = millis();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Carry on with a save, one EEPROM byte per call (see
+            EepromRecordWriter::step()). Call regularly from a task.
+    @return true while the save is still in progress
+*/
+/**************************************************************************/
+bool ConfigStore::saveStep() {
+    return _writer.step();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Whether a save is in progress. Until it ends, a reset loads
+            the record saved before it.
+    @return true until the last byte of the save has been started
+*/
+/**************************************************************************/
+bool ConfigStore::saving() {
+    return _writer.busy();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Flag the config as changed, to be saved by a later call to
+            save() once saveDue() returns true.
+    @return void
+*/
+/**************************************************************************/
+void ConfigStore::markDirty() {
+    _dirty = true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Whether a deferred save is due. Saves are held off for
+            CONFIG_SAVE_HOLDOFF_MS after the previous one, so a burst of
+            changes only costs one write.
+    @return true if the config has changed and should be saved now
+*/
+/**************************************************************************/
+bool ConfigStore::saveDue() {
+    return _dirty && ((millis() - _lastSaveMs) >= CONFIG_SAVE_HOLDOFF_MS);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Print the config and the slot it was last saved to.
+    @return void
+*/
+/**************************************************************************/
+void ConfigStore::report() {
+    Serial.print(F("[CONFIG] slot: "));
+    Serial.print(_slot);
+    Serial.print(F(", seq: "));
+    Serial.print(_sequence);
+    if (saving()) {
+        Serial.print(F(", saving: "));
+        Serial.print(_writer.percentDone());
+        Serial.print(F("%"));
+    }
+    Serial.print(F(", switch time: "));
+    Serial.print(data.switchTime);
+    Serial.print(F(" ms, sweep: "));
+    Serial.print(data.sweepMin);
+    Serial.print(F("-"));
+    Serial.print(data.sweepMax);
+    Serial.print(F(", mode: "));
+    Serial.print(data.cycleMode);
+    Serial.print(F(", state: "));
+    Serial.print(data.stateNum);
+    Serial.print(F(", link timeout: "));
+    Serial.print(data.linkTimeout);
+    Serial.print(F(" x100 ms, link loss action: "));
+    Serial.print(data.linkLossAction);
+    Serial.print(F(", sync role: "));
+    Serial.print(data.syncRole);
+    Serial.print(F(", dwell table: "));
+    Serial.println(data.dwellEnabled);
+}
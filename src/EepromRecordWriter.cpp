@@ -0,0 +1,88 @@
+#include "EepromRecordWriter.h"
+#include <avr/eeprom.h>
+
+
+/**************************************************************************/
+/*!
+    @brief  Start writing a record, replacing any write in progress (which
+            starts again from its magic byte). The bytes are read from
+            recordByte as they are written, so the data must stay put
+            until busy() returns false.
+    @param  addr
+            EEPROM address of the record
+    @param  size
+            bytes in the record, including its magic byte at offset 0
+    @param  recordByte
+            returns each byte of the record
+    @param  context
+            passed to recordByte
+    @return void
+*/
+/**************************************************************************/
+void EepromRecordWriter::start(int addr, uint16_t size, RecordByteFunction recordByte, void *context) {
+    _addr = addr;
+    _size = size;
+    _recordByte = recordByte;
+    _context = context;
+    _step = 0;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Carry on with the write. Starts at most one EEPROM byte write
+            (in the background) per call, skipping up to
+            EEPROM_WRITER_CHECKS bytes that are already correct. Call
+            regularly from a task.
+    @return true while the write is still in progress
+*/
+/**************************************************************************/
+bool EepromRecordWriter::step() {
+    if (!busy()) {
+        return false;
+    }
+    if (!eeprom_is_ready()) {
+        return true;
+    }
+
+    // write order: magic cleared (step 0), the rest of the record (steps 1 to size-1), magic set (last step)
+    for (uint8_t checked = 0; checked < EEPROM_WRITER_CHECKS; checked++) {
+        if (_step > (int16_t)_size) {
+            _step = -1;
+            return false;
+        }
+
+        uint16_t pos = (_step == (int16_t)_size) ? 0 : _step;
+        uint8_t value = (_step == 0) ? 0xFF : _recordByte(_context, pos);
+        _step++;
+
+        uint8_t *addr = (uint8_t *)(uintptr_t)(_addr + pos);
+        if (eeprom_read_byte(addr) != value) {
+            eeprom_write_byte(addr, value);     // EEPROM is ready, so this starts the write and returns
+            return true;
+        }
+    }
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Whether a write is in progress.
+    @return true until the last byte of the record has been started
+*/
+/**************************************************************************/
+bool EepromRecordWriter::busy() {
+    return _step >= 0;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Progress of the write in progress, for reports.
+    @return percentage of the steps done
+*/
+/**************************************************************************/
+uint8_t EepromRecordWriter::percentDone() {
+    return busy() ? (uint32_t)_step * 100UL / (_size + 1) : 100;
+}
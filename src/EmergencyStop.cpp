@@ -0,0 +1,267 @@
+#include "EmergencyStop.h"
+#include "HardwareSerial_private.h"
+
+// Serial and Serial1 are defined here rather than by the core's
+// HardwareSerial0.cpp and HardwareSerial1.cpp, so that the USART0 and USART1
+// receive interrupts below can replace the core's.
+//
+// This relies on the linker never pulling HardwareSerial0.o or
+// HardwareSerial1.o out of the core archive. Each is only pulled in to resolve
+// a symbol it defines, and every one of them (Serial, Serial0_available,
+// __vector_25 and __vector_26; Serial1, Serial1_available, __vector_36 and
+// __vector_37) is defined in this file, so nothing ever needs them. If
+// something did pull one in, its definitions would clash with these and the
+// link would fail with "multiple definition of `Serial'" (and of the USART
+// vectors) rather than quietly building with two receive interrupts. Keep all
+// eight definitions together.
+HardwareSerial Serial(&UBRR0H, &UBRR0L, &UCSR0A, &UCSR0B, &UCSR0C, &UDR0);
+HardwareSerial Serial1(&UBRR1H, &UBRR1L, &UCSR1A, &UCSR1B, &UCSR1C, &UDR1);
+
+// shared with the RX ISR
+static volatile StopHandler stopHandler = NULL;
+static volatile bool stopPending = false;           // set by the ISR, cleared by triggered()
+static volatile bool syncStops = false;             // ESTOP_BYTE on Serial1 stops too (sync followers)
+static volatile bool syncStopPending = false;       // set by the USART1 ISR, cleared by syncTriggered()
+static volatile uint16_t stopCount = 0;
+static volatile uint16_t lastLatencyCounts = 0;     // ISR entry to relays safe, in Timer1 counts
+static volatile uint16_t worstLatencyCounts = 0;
+
+
+/**************************************************************************/
+/*!
+    @brief  Access to the RX buffer of a HardwareSerial, which the core
+            keeps protected. Only used to form member pointers.
+*/
+/**************************************************************************/
+struct SerialRxAccess : public HardwareSerial {
+    // same as HardwareSerial::_rx_complete_irq() once the byte has been read
+    static inline void store(HardwareSerial &port, unsigned char c) {
+        auto head = &SerialRxAccess::_rx_buffer_head;
+        auto tail = &SerialRxAccess::_rx_buffer_tail;
+        auto buffer = &SerialRxAccess::_rx_buffer;
+
+        rx_buffer_index_t i = (unsigned int)(port.*head + 1) % SERIAL_RX_BUFFER_SIZE;
+
+        // if the buffer is full the byte is dropped, as in the core
+        if (i != port.*tail) {
+            (port.*buffer)[port.*head] = c;
+            port.*head = i;
+        }
+    }
+};
+
+
+/**************************************************************************/
+/*!
+    @brief  Run the stop handler and time it. Only called from the RX
+            interrupts.
+    @param  start
+            TCNT1 on entering the interrupt
+    @return void
+*/
+/**************************************************************************/
+static inline void stopFromIsr(uint16_t start) {
+    if (stopHandler) stopHandler();
+
+    uint16_t latency = (TCNT1 + STEP_TIMER_COUNTS_PER_TICK - start) % STEP_TIMER_COUNTS_PER_TICK;
+    lastLatencyCounts = latency;
+    if (latency > worstLatencyCounts) worstLatencyCounts = latency;
+    stopCount++;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  USART0 receive interrupt. ESTOP_BYTE runs the stop handler and
+            is not buffered; any other byte goes to the Serial RX buffer.
+*/
+/**************************************************************************/
+ISR(USART0_RX_vect) {
+    uint16_t start = TCNT1;
+
+    if (UCSR0A & _BV(UPE0)) {
+        (void)UDR0;     // parity error: discard, as the core does
+        return;
+    }
+
+    unsigned char c = UDR0;
+    if (c != ESTOP_BYTE) {
+        SerialRxAccess::store(Serial, c);
+        return;
+    }
+
+    stopFromIsr(start);
+    stopPending = true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  USART1 (sync link) receive interrupt. On a sync follower,
+            ESTOP_BYTE passed on by the master runs the stop handler and is
+            not buffered; any other byte goes to the Serial1 RX buffer.
+*/
+/**************************************************************************/
+ISR(USART1_RX_vect) {
+    uint16_t start = TCNT1;
+
+    if (UCSR1A & _BV(UPE1)) {
+        (void)UDR1;     // parity error: discard, as the core does
+        return;
+    }
+
+    unsigned char c = UDR1;
+    if ((c != ESTOP_BYTE) || !syncStops) {
+        SerialRxAccess::store(Serial1, c);
+        return;
+    }
+
+    stopFromIsr(start);
+    syncStopPending = true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Whether Serial has bytes waiting, as in the core. Referenced
+            (weakly) by the core's serialEventRun(), so serialEvent() keeps
+            working without HardwareSerial0.o.
+    @return true if Serial.available() is non-zero
+*/
+/**************************************************************************/
+bool Serial0_available() {
+    return Serial.available();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  USART0 data register empty interrupt, as in the core.
+*/
+/**************************************************************************/
+ISR(USART0_UDRE_vect) {
+    Serial._tx_udr_empty_irq();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Whether Serial1 has bytes waiting, as in the core.
+    @return true if Serial1.available() is non-zero
+*/
+/**************************************************************************/
+bool Serial1_available() {
+    return Serial1.available();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  USART1 data register empty interrupt, as in the core.
+*/
+/**************************************************************************/
+ISR(USART1_UDRE_vect) {
+    Serial1._tx_udr_empty_irq();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Set the function called from the RX interrupt when ESTOP_BYTE
+            is received. Call before Serial is started.
+    @param  handler
+            stop handler. Must be short and must not use Serial.
+    @return void
+*/
+/**************************************************************************/
+void EmergencyStop::begin(StopHandler handler) {
+    stopHandler = handler;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Whether an emergency stop has been received since the last
+            call.
+    @return true once for each emergency stop
+*/
+/**************************************************************************/
+bool EmergencyStop::triggered() {
+    bool pending;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        pending = stopPending;
+        stopPending = false;
+    }
+    return pending;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Set whether ESTOP_BYTE received on Serial1 (passed on by the
+            sync master) runs the stop handler. Only sync followers should.
+    @param  enable
+            true to stop on ESTOP_BYTE from Serial1
+    @return void
+*/
+/**************************************************************************/
+void EmergencyStop::stopOnSyncLink(bool enable) {
+    syncStops = enable;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Whether an emergency stop has been passed on by the sync master
+            since the last call.
+    @return true once for each emergency stop from the sync link
+*/
+/**************************************************************************/
+bool EmergencyStop::syncTriggered() {
+    bool pending;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        pending = syncStopPending;
+        syncStopPending = false;
+    }
+    return pending;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Time from the RX interrupt starting to the relays being safe,
+            for the last emergency stop.
+    @return latency in us
+*/
+/**************************************************************************/
+uint16_t EmergencyStop::lastLatencyUs() {
+    uint16_t counts;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        counts = lastLatencyCounts;
+    }
+    return counts / STEP_TIMER_COUNTS_PER_US;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Print the number of emergency stops and their latency.
+    @return void
+*/
+/**************************************************************************/
+void EmergencyStop::report() {
+    uint16_t count, last, worst;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        count = stopCount;
+        last = lastLatencyCounts;
+        worst = worstLatencyCounts;
+    }
+
+    Serial.print(F("[E-STOP] stops: "));
+    Serial.print(count);
+    Serial.print(F(", last latency: "));
+    Serial.print(last / STEP_TIMER_COUNTS_PER_US);
+    Serial.print(F(" us, worst latency: "));
+    Serial.print(worst / STEP_TIMER_COUNTS_PER_US);
+    Serial.println(F(" us"));
+}
@@ -0,0 +1,91 @@
+#include "LinkMonitor.h"
+
+
+/**************************************************************************/
+/*!
+    @brief  Set the link timeout and the action taken when it expires.
+            Monitoring restarts from the next frame received.
+    @param  timeoutUnits
+            timeout, in units of LINK_TIMEOUT_UNIT_MS. 0 turns monitoring
+            off.
+    @param  action
+            action taken when the timeout expires
+    @return void
+*/
+/**************************************************************************/
+void LinkMonitor::setTimeout(uint8_t timeoutUnits, LinkLossAction action) {
+    _timeoutMs = timeoutUnits * LINK_TIMEOUT_UNIT_MS;
+    _action = (action == LINK_LOSS_SAFE) ? LINK_LOSS_SAFE : LINK_LOSS_PAUSE;
+    _armed = false;
+    _expired = false;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Get the link timeout.
+    @return timeout, in units of LINK_TIMEOUT_UNIT_MS (0: off)
+*/
+/**************************************************************************/
+uint8_t LinkMonitor::getTimeoutUnits() {
+    return _timeoutMs / LINK_TIMEOUT_UNIT_MS;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Get the action taken when the link times out.
+    @return link loss action
+*/
+/**************************************************************************/
+LinkLossAction LinkMonitor::getAction() {
+    return _action;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Check whether the link has timed out or come back.
+    @param  frameStamp
+            any value that changes whenever a frame arrives (e.g. the
+            time of the last frame)
+    @return LINK_EXPIRED or LINK_RESTORED once per outage, otherwise
+            LINK_NO_CHANGE
+*/
+/**************************************************************************/
+LinkEvent LinkMonitor::check(unsigned long frameStamp) {
+    unsigned long now = millis();
+
+    if (frameStamp != _lastFrameStamp) {
+        unsigned long silentMs = now - _lastSeenMs;
+        _lastFrameStamp = frameStamp;
+        _lastSeenMs = now;
+
+        if (_expired) {
+            _expired = false;
+            _outageMs = silentMs;
+            return LINK_RESTORED;
+        }
+        _armed = (_timeoutMs > 0);
+        return LINK_NO_CHANGE;
+    }
+
+    if (_armed && !_expired && ((now - _lastSeenMs) >= _timeoutMs)) {
+        _expired = true;
+        return LINK_EXPIRED;
+    }
+
+    return LINK_NO_CHANGE;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Length of the last outage, from the last frame before it to
+            the first frame after it.
+    @return outage length in ms
+*/
+/**************************************************************************/
+unsigned long LinkMonitor::lastOutageMs() {
+    return _outageMs;
+}
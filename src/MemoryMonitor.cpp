@@ -0,0 +1,115 @@
+#include "MemoryMonitor.h"
+
+// symbols provided by the avr-libc linker script / malloc implementation
+extern uint8_t _end;            // end of .bss/.noinit. Heap starts here.
+extern uint8_t __stack;         // top of SRAM (RAMEND)
+extern uint8_t __heap_start;    // first address available to the heap
+extern char *__brkval;          // current top of the heap (0 until malloc is first used)
+
+// Runs from .init5, after .data/.bss are initialised but before any constructors.
+// Kept out of .init3 so it doesn't delay earlyInitRelays(). Must not call other functions.
+void paintStack() __attribute__((naked, used, section(".init5")));
+
+
+/**************************************************************************/
+/*!
+    @brief  Fill all SRAM between the end of .bss and the top of the stack
+            with STACK_CANARY.
+    @return void
+*/
+/**************************************************************************/
+void paintStack() {
+    uint8_t *p = &_end;
+
+    while (p <= &__stack) {
+        *p = STACK_CANARY;
+        p++;
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Get the address of the current top of the heap.
+    @return pointer to the first byte above the heap
+*/
+/**************************************************************************/
+static uint8_t *heapTop() {
+    return (__brkval == 0) ? &__heap_start : (uint8_t *)__brkval;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Number of bytes currently free between the heap and the stack.
+    @return free SRAM in bytes
+*/
+/**************************************************************************/
+uint16_t freeMemory() {
+    uint8_t top;    // lives on the stack, so its address approximates SP
+
+    return (uint16_t)(&top - heapTop());
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Number of bytes above the heap that have never been written since
+            reset. This is the minimum free SRAM seen so far.
+    @return smallest heap/stack gap observed, in bytes
+*/
+/**************************************************************************/
+uint16_t stackHeadroom() {
+    const uint8_t *p = heapTop();
+    uint16_t count = 0;
+
+    while ((p <= &__stack) && (*p == STACK_CANARY)) {
+        p++;
+        count++;
+    }
+
+    return count;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Deepest the stack has grown since reset.
+    @return peak stack usage in bytes
+*/
+/**************************************************************************/
+uint16_t stackHighWaterMark() {
+    return (uint16_t)(&__stack - heapTop()) + 1 - stackHeadroom();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Print static, heap and stack usage to serial.
+    @return void
+*/
+/**************************************************************************/
+void reportMemoryUsage() {
+    Serial.print(F("[MEM] static: "));
+    Serial.print((uint16_t)(&_end - (uint8_t *)RAMSTART));
+    Serial.print(F(" B, heap: "));
+    Serial.print((uint16_t)(heapTop() - &__heap_start));
+    Serial.print(F(" B, free: "));
+    Serial.print(freeMemory());
+    Serial.print(F(" B, stack peak: "));
+    Serial.print(stackHighWaterMark());
+    Serial.print(F(" B, min headroom: "));
+    Serial.print(stackHeadroom());
+    Serial.println(F(" B"));
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Handler for the MEM_REPORT action code.
+    @return void
+*/
+/**************************************************************************/
+void memReportCommand(uint8_t code, const uint8_t *args) {
+    reportMemoryUsage();
+}
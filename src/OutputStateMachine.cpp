@@ -1,105 +1,221 @@
 #include "OutputStateMachine.h"
+#include "ShiftRegisterOutputs.h"
 
-#define DEBUG
+// #define DEBUG   // log every cycle mode change (blocking serial prints)
 
 /**************************************************************************/
 /*!
     @brief  Constructor
+    @param  maxStateNum
+            Number of the last state in the state table.
 */
 /**************************************************************************/
-OutputStateMachine::OutputStateMachine() {
-    _currentStateNum = 0;
-    _currentStateOutputsArr = outputStateArray[_currentStateNum];
+OutputStateMachineBase::OutputStateMachineBase(int maxStateNum) : _maxStateNum(maxStateNum) {
+    for (uint8_t i = 0; i < 2; i++) {
+        _frames[i].stateNum = 0;
+        _frames[i].mode = MANUAL;
+        _frames[i].periodTicks = 1;
+        _frames[i].dwellTicks = NULL;
+        _frames[i].ezValues = NULL;
+        _frames[i].ezRateFactor = 0;
+        _frames[i].ezRateShift = 0;
+        _frames[i].sweepMin = 0;
+        _frames[i].sweepMax = maxStateNum;
+        _frames[i].endStateReached = false;
+    }
 }
 
 
 /**************************************************************************/
 /*!
-    @brief  Transition outputs to next state, dependent on cycle mode.
-    @return void
+    @brief  Step a frame to its next state, dependent on cycle mode.
+            Must only be called with interrupts disabled (i.e. from tick()).
+    @param  frame
+            frame to step
+    @return true if the frame moved to a new state, whose outputs must be
+            applied
 */
 /**************************************************************************/
-void OutputStateMachine::nextState() {
-
-    if (endStateReached) {      // TODO: REVIEW - send signal on completion
-        return; // do nothing
+bool OutputStateMachineBase::_stepFrame(OutputFrame &frame) {
+    if (frame.endStateReached) {      // TODO: REVIEW - send signal on completion
+        return false; // do nothing
     }
 
-    switch (_cycleMode)
+    switch (frame.mode)
     {
     case DECREASE_EZ:
-        _nextStateDecreaseEZ();
-        _applyStateOutputs();
-        break;
+        _nextStateDecreaseEZ(frame);
+        return true;
         
     case INCREASE_EZ:
-        _nextStateIncreaseEZ();
-        _applyStateOutputs();
-        break;
+        _nextStateIncreaseEZ(frame);
+        return true;
         
-    case MANUAL:
-        // _applyStateOutputs();
-        break;
-    
-    default:    // Other: IDLE, RESET_HIGH_EZ, RESET_LOW_EZ
-        // pass
-        break;
+    default:    // Other: MANUAL, IDLE, RESET_HIGH_EZ, RESET_LOW_EZ
+        return false;
     }
 }
 
 /**************************************************************************/
 /*!
     @brief  Transition outputs to the next state, giving a decrease in EZ.
+    @param  frame
+            frame to step
     @return void
 */
 /**************************************************************************/
-void OutputStateMachine::_nextStateDecreaseEZ() {
-    if (_currentStateNum == MAX_STATE_NUM) {
-        endStateReached = true;
+void OutputStateMachineBase::_nextStateDecreaseEZ(OutputFrame &frame) {
+    if (frame.stateNum >= frame.sweepMax) {
+        frame.endStateReached = true;
         return;
-    } else if (_currentStateNum == (MAX_STATE_NUM-1)) {
-        endStateReached = true;
+    } else if (frame.stateNum == (frame.sweepMax-1)) {
+        frame.endStateReached = true;
     }
 
-    _currentStateNum = _currentStateNum + 1;
-    _currentStateOutputsArr = outputStateArray[_currentStateNum];
+    frame.stateNum = frame.stateNum + 1;
 }
 
 /**************************************************************************/
 /*!
     @brief  Transition outputs to the next state, giving an increase in EZ.
+    @param  frame
+            frame to step
     @return void
 */
 /**************************************************************************/
-void OutputStateMachine::_nextStateIncreaseEZ() {
-    if (_currentStateNum == 0) {
-        endStateReached = true;
+void OutputStateMachineBase::_nextStateIncreaseEZ(OutputFrame &frame) {
+    if (frame.stateNum <= frame.sweepMin) {
+        frame.endStateReached = true;
         return;
-    } else if (_currentStateNum == 1) {
-        endStateReached = true;
+    } else if (frame.stateNum == (frame.sweepMin+1)) {
+        frame.endStateReached = true;
     }
 
-    _currentStateNum = _currentStateNum - 1;
-    _currentStateOutputsArr = outputStateArray[_currentStateNum];
+    frame.stateNum = frame.stateNum - 1;
 }
 
 /**************************************************************************/
 /*!
-    @brief  Change the digital outputs to align with the state.
+    @brief  Open a transaction. Changes made until commitTransaction() is
+            called are committed together. A commit the step timer has not
+            taken yet (or a held one) is folded into the new transaction.
     @return void
 */
 /**************************************************************************/
-void OutputStateMachine::_applyStateOutputs() {
-    int pinNumber;
-    int val;
+void OutputStateMachineBase::beginTransaction() {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        _openFields = _pendingFields | _heldFields;
+        _pendingFields = 0;
+        _heldFields = 0;
+        _transactionOpen = true;    // with the fields taken, so releaseCommits() can't find the frame empty and unheld
+
+        // start from the live values of every field not already changed
+        // (the mask is carried over by toggleMask() and the commit)
+        OutputFrame &live = _frames[_live];
+        OutputFrame &shadow = _frames[_live ^ 1];
+        if (!(_openFields & FRAME_STATE)) {
+            shadow.stateNum = live.stateNum;
+            shadow.endStateReached = live.endStateReached;
+        }
+        if (!(_openFields & FRAME_MODE)) shadow.mode = live.mode;
+        if (!(_openFields & FRAME_PERIOD)) {
+            shadow.periodTicks = live.periodTicks;
+            shadow.dwellTicks = live.dwellTicks;
+            shadow.ezValues = live.ezValues;
+            shadow.ezRateFactor = live.ezRateFactor;
+            shadow.ezRateShift = live.ezRateShift;
+        }
+        if (!(_openFields & FRAME_BOUNDS)) {
+            shadow.sweepMin = live.sweepMin;
+            shadow.sweepMax = live.sweepMax;
+        }
+    }
+}
 
-    for (int i; i < NUM_OUTPUTS; i++) {
-        val = _currentStateOutputsArr[i];
-        pinNumber = pinMappings[i];
-        digitalWrite(pinNumber, val);
+
+/**************************************************************************/
+/*!
+    @brief  Commit the open transaction. It is applied by the next step
+            timer tick, or, while commits are held, by the tick that
+            releases them.
+    @return void
+*/
+/**************************************************************************/
+void OutputStateMachineBase::commitTransaction() {
+    if (!_transactionOpen) {
+        return;
+    }
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        _transactionOpen = false;
+        if (_holdCommits) {
+            _heldFields = _openFields;
+        } else {
+            _pendingFields = _openFields;
+        }
     }
+}
 
-    // TODO: add disable list here
+
+/**************************************************************************/
+/*!
+    @brief  Hold back every commit from now on (commitNow() included)
+            until releaseCommits() is called, so changes can be prepared
+            ahead of the tick they are to take effect on. Called from
+            loop().
+    @return void
+*/
+/**************************************************************************/
+void OutputStateMachineBase::holdCommits() {
+    _holdCommits = true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Stop holding commits, passing the held ones to this tick.
+            Called from the timer interrupt before tick() or driveState().
+    @return false if a transaction is open, so nothing could be released
+            (try again next tick)
+*/
+/**************************************************************************/
+bool OutputStateMachineBase::releaseCommits() {
+    if (_transactionOpen) {
+        return false;
+    }
+    _pendingFields |= _heldFields;
+    _heldFields = 0;
+    _holdCommits = false;
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Get the shadow frame, opening a transaction for a single change
+            if none is open.
+    @return shadow frame
+*/
+/**************************************************************************/
+OutputFrame &OutputStateMachineBase::_begin() {
+    if (!_transactionOpen) {
+        beginTransaction();
+        _ownTransaction = true;
+    }
+    return _frames[_live ^ 1];
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Commit the transaction opened by _begin(), if it opened one.
+    @return void
+*/
+/**************************************************************************/
+void OutputStateMachineBase::_end() {
+    if (_ownTransaction) {
+        _ownTransaction = false;
+        commitTransaction();
+    }
 }
 
 
@@ -111,59 +227,65 @@ void OutputStateMachine::_applyStateOutputs() {
     @return void
 */
 /**************************************************************************/
-void OutputStateMachine::changeCylceMode(uint8_t newMode) {
-    endStateReached = false;
+void OutputStateMachineBase::changeCylceMode(uint8_t newMode) {
+    OutputFrame &frame = _begin();
 
     switch (newMode)
     {
     case DECREASE_EZ:
-        _cycleMode = DECREASE_EZ;
+        frame.mode = DECREASE_EZ;
+        _openFields |= FRAME_MODE;
         #ifdef DEBUG 
             Serial.println("Mode changed: DECREASE_EZ"); 
         #endif
         break;
         
     case INCREASE_EZ:
-        _cycleMode = INCREASE_EZ;
+        frame.mode = INCREASE_EZ;
+        _openFields |= FRAME_MODE;
         #ifdef DEBUG 
             Serial.println("Mode changed: INCREASE_EZ");
         #endif
         break;
 
     case RESET_HIGH_EZ:
-        _cycleMode = RESET_HIGH_EZ;
+        frame.mode = RESET_HIGH_EZ;
         #ifdef DEBUG 
             Serial.println("Mode changed: RESET_HIGH_EZ");
         #endif
-        _currentStateNum = 0;
-        _currentStateOutputsArr = outputStateArray[_currentStateNum];
-        _applyStateOutputs();
+        frame.stateNum = frame.sweepMin;
+        frame.endStateReached = false;
+        _loadStateMask();
+        _openFields |= FRAME_MODE | FRAME_STATE | FRAME_MASK;
         break;
 
     case RESET_LOW_EZ:
-        _cycleMode = RESET_LOW_EZ;
+        frame.mode = RESET_LOW_EZ;
         #ifdef DEBUG 
             Serial.println("Mode changed: RESET_LOW_EZ");
         #endif
-        _currentStateNum = MAX_STATE_NUM;
-        _currentStateOutputsArr = outputStateArray[_currentStateNum];
-        _applyStateOutputs();
+        frame.stateNum = frame.sweepMax;
+        frame.endStateReached = false;
+        _loadStateMask();
+        _openFields |= FRAME_MODE | FRAME_STATE | FRAME_MASK;
         break;
 
     case IDLE:
-        _cycleMode = IDLE;
+        frame.mode = IDLE;
+        _openFields |= FRAME_MODE;
         #ifdef DEBUG 
             Serial.println("Mode changed: IDLE");
         #endif
         break;
     
     case MANUAL:
-        _cycleMode = MANUAL;
+        frame.mode = MANUAL;
         #ifdef DEBUG 
             Serial.println("Mode changed: MANUAL");
         #endif
-        _currentStateNum = 0;
-        _currentStateOutputsArr = outputStateArray[_currentStateNum];
+        frame.stateNum = 0;
+        frame.endStateReached = false;
+        _openFields |= FRAME_MODE | FRAME_STATE;
         break;
 
     default:
@@ -171,4 +293,294 @@ void OutputStateMachine::changeCylceMode(uint8_t newMode) {
         Serial.println(newMode);
         break;
     }
-}
\ No newline at end of file
+
+    _end();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Get the number of the current state.
+    @return current state number (indexes the state table)
+*/
+/**************************************************************************/
+int OutputStateMachineBase::getStateNum() {
+    int stateNum;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        stateNum = _frames[_live].stateNum;
+    }
+    return stateNum;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Get the current cycle mode of the statemachine.
+    @return current cycle mode
+*/
+/**************************************************************************/
+CycleMode OutputStateMachineBase::getCycleMode() {
+    return _frames[_live].mode;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Whether the current sweep has reached its end state.
+    @return true once the sweep has ended
+*/
+/**************************************************************************/
+bool OutputStateMachineBase::endStateReached() {
+    return _frames[_live].endStateReached;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Jump straight to a state and cycle mode without any debug
+            output, e.g. when restoring the saved configuration at boot.
+            The state's outputs are applied when the change is committed.
+    @param  stateNum
+            state to jump to (indexes the state table)
+    @param  mode
+            cycle mode to resume in (see CycleMode)
+    @return void
+*/
+/**************************************************************************/
+void OutputStateMachineBase::restoreState(int stateNum, uint8_t mode) {
+    OutputFrame &frame = _begin();
+
+    if ((stateNum < 0) || (stateNum > _maxStateNum)) {
+        stateNum = 0;
+    }
+
+    switch (mode)
+    {
+    case DECREASE_EZ:
+    case INCREASE_EZ:
+    case RESET_HIGH_EZ:
+    case RESET_LOW_EZ:
+    case MANUAL:
+    case IDLE:
+        frame.mode = (CycleMode)mode;
+        break;
+
+    default:
+        frame.mode = MANUAL;
+        break;
+    }
+
+    frame.endStateReached = false;
+    frame.stateNum = stateNum;
+    _loadStateMask();
+    _openFields |= FRAME_MODE | FRAME_STATE | FRAME_MASK;
+
+    _end();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Set the switching period. Takes effect from the commit, with a
+            full period before the next step.
+    @param  periodMs
+            time between state steps, in milliseconds (rounded down to
+            whole step timer ticks)
+    @return void
+*/
+/**************************************************************************/
+void OutputStateMachineBase::setPeriod(uint16_t periodMs) {
+    OutputFrame &frame = _begin();
+
+    frame.periodTicks = max((uint32_t)periodMs * 1000UL / STEP_TICK_US, 1UL);
+    _openFields |= FRAME_PERIOD;
+
+    _end();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Get the switching period.
+    @return time between state steps, in milliseconds
+*/
+/**************************************************************************/
+uint16_t OutputStateMachineBase::getPeriod() {
+    uint16_t periodTicks;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        periodTicks = _frames[_live].periodTicks;
+    }
+    return (uint32_t)periodTicks * STEP_TICK_US / 1000UL;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Time each state of the sweeps from a dwell table instead of the
+            constant period. States whose entry is 0 keep the constant
+            period. Replaces any EZ rate (see setEzRate()). Takes effect
+            from the commit, like setPeriod().
+    @param  dwellTicks
+            ticks to hold each state for (indexed by state number, at
+            least as long as the state table), or NULL for the constant
+            period only
+    @return void
+*/
+/**************************************************************************/
+void OutputStateMachineBase::setDwellTable(const uint16_t *dwellTicks) {
+    OutputFrame &frame = _begin();
+
+    frame.dwellTicks = dwellTicks;
+    frame.ezValues = NULL;
+    _openFields |= FRAME_PERIOD;
+
+    _end();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Time each state of the sweeps so the EZ changes at a constant
+            rate: a state is held for the time the EZ takes to reach the
+            next state's at that rate. The hold is worked out as each state
+            is reached, so no per-channel table is needed. Replaces any
+            dwell table. Takes effect from the commit, like setPeriod().
+    @param  ezValues
+            EZ of each state (indexed by state number, at least as long
+            as the state table), e.g. the EZ calibration table
+    @param  ezPerSecond
+            rate of change, in the units of ezValues per second (0 is
+            taken as 1)
+    @return void
+*/
+/**************************************************************************/
+void OutputStateMachineBase::setEzRate(const uint16_t *ezValues, uint16_t ezPerSecond) {
+    // ticks per EZ unit in 16 bits, as precise as fits and rounded, so the ISR only multiplies and shifts
+    uint16_t rate = ezPerSecond ? ezPerSecond : 1;
+    uint8_t shift = 16;
+    uint32_t factor;
+    while ((factor = (((1000000UL / STEP_TICK_US) << shift) + rate / 2) / rate) > 0xFFFF) {
+        shift--;
+    }
+
+    OutputFrame &frame = _begin();
+
+    frame.ezValues = ezValues;
+    frame.ezRateFactor = factor;
+    frame.ezRateShift = shift;
+    frame.dwellTicks = NULL;
+    _openFields |= FRAME_PERIOD;
+
+    _end();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Ticks to hold the frame's current state for at its EZ rate:
+            the time for the EZ to reach that of the state the sweep steps
+            to next. The part of a tick left over is carried into the next
+            hold, so the sweep as a whole keeps to the rate. A hold that
+            comes to under a tick is one tick (dropping the carry), as is
+            the last state of the sweep.
+            Called from the timer interrupt.
+    @param  frame
+            frame to time (ezValues set)
+    @return ticks, 1 to 65535
+*/
+/**************************************************************************/
+uint16_t OutputStateMachineBase::_ezRateTicks(const OutputFrame &frame) {
+    int next = (frame.mode == INCREASE_EZ) ? frame.stateNum - 1 : frame.stateNum + 1;
+    if (frame.endStateReached || (next < frame.sweepMin) || (next > frame.sweepMax)) {
+        return 1;
+    }
+
+    uint16_t ez = frame.ezValues[frame.stateNum];
+    uint16_t nextEz = frame.ezValues[next];
+    uint16_t diff = (ez > nextEz) ? ez - nextEz : nextEz - ez;
+    uint32_t scaled = (uint32_t)diff * frame.ezRateFactor + _ezCarry;    // at most 0xFFFF * 0xFFFF + 0xFFFF
+    uint32_t ticks = scaled >> frame.ezRateShift;
+    _ezCarry = scaled & ((1UL << frame.ezRateShift) - 1);
+
+    if (ticks == 0) {
+        _ezCarry = 0;
+        return 1;
+    }
+    if (ticks > 0xFFFF) return 0xFFFF;
+    return ticks;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Whether the sweeps are timed from a dwell table.
+    @return true if a dwell table is in use
+*/
+/**************************************************************************/
+bool OutputStateMachineBase::usesDwellTable() {
+    return _frames[_live].dwellTicks != NULL;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Set the states the EZ sweeps start and end at.
+    @param  sweepMin
+            lowest state number (highest EZ) the sweeps reach
+    @param  sweepMax
+            highest state number (lowest EZ) the sweeps reach
+    @return true if the bounds were valid and have been applied
+*/
+/**************************************************************************/
+bool OutputStateMachineBase::setSweepBounds(int sweepMin, int sweepMax) {
+    if ((sweepMin < 0) || (sweepMax > _maxStateNum) || (sweepMin >= sweepMax)) {
+        return false;
+    }
+
+    OutputFrame &frame = _begin();
+
+    frame.sweepMin = sweepMin;
+    frame.sweepMax = sweepMax;
+    _openFields |= FRAME_BOUNDS;
+
+    _end();
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Get the lowest state number the sweeps reach.
+    @return sweep start state (highest EZ)
+*/
+/**************************************************************************/
+int OutputStateMachineBase::getSweepMin() {
+    int sweepMin;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        sweepMin = _frames[_live].sweepMin;
+    }
+    return sweepMin;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Get the highest state number the sweeps reach.
+    @return sweep end state (lowest EZ)
+*/
+/**************************************************************************/
+int OutputStateMachineBase::getSweepMax() {
+    int sweepMax;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        sweepMax = _frames[_live].sweepMax;
+    }
+    return sweepMax;
+}
+
+
+// The 16 and 32 output configurations are instantiated here whatever the build
+// flags, so a change that breaks either one fails every build rather than only
+// the board that uses it. Nothing references them in other builds, so the
+// linker drops their code (-ffunction-sections / --gc-sections).
+template class OutputStateMachine<LadderStateTable<16>, ShiftRegisterOutputs<16>>;
+template class OutputStateMachine<LadderStateTable<32>, ShiftRegisterOutputs<32>>;
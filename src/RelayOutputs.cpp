@@ -0,0 +1,333 @@
+#include "RelayOutputs.h"
+#include <util/atomic.h>
+
+// bit of the packed output mask, moved to a port bit
+#define BOOT_BIT(out, portBit) (((BOOT_OUTPUT_MASK >> ((out) - 1)) & 1) << (portBit))
+
+#ifndef SHIFT_REGISTER_OUTPUTS   // relay pins not used (see earlyInitShiftRegisters)
+
+// Runs from .init3, straight after reset and before .data/.bss are set up,
+// so the relays never float while the rest of the system initialises.
+void earlyInitRelays() __attribute__((naked, used, section(".init3")));
+
+
+/**************************************************************************/
+/*!
+    @brief  Drive every relay pin to BOOT_OUTPUT_MASK and make it an output.
+            PORT is written before DDR so each pin goes straight from
+            high-impedance to its boot level.
+    @return void
+*/
+/**************************************************************************/
+void earlyInitRelays() {
+    PORTB = (PORTB & ~RELAY_PORTB_MASK) | BOOT_BIT(1, R01_BIT) | BOOT_BIT(2, R02_BIT);
+    PORTL = (PORTL & ~RELAY_PORTL_MASK) | BOOT_BIT(3, R03_BIT) | BOOT_BIT(4, R04_BIT)
+                                        | BOOT_BIT(5, R05_BIT) | BOOT_BIT(6, R06_BIT);
+    PORTG = (PORTG & ~RELAY_PORTG_MASK) | BOOT_BIT(7, R07_BIT) | BOOT_BIT(8, R08_BIT);
+    PORTC = (PORTC & ~RELAY_PORTC_MASK) | BOOT_BIT(9, R09_BIT);
+
+    DDRB |= RELAY_PORTB_MASK;
+    DDRL |= RELAY_PORTL_MASK;
+    DDRG |= RELAY_PORTG_MASK;
+    DDRC |= RELAY_PORTC_MASK;
+}
+
+#endif
+
+
+/**************************************************************************/
+/*!
+    @brief  Constructor
+    @param  pinMappings
+            Array of digital pins used for relays. The first entry drives
+            the highest numbered output.
+*/
+/**************************************************************************/
+RelayOutputs::RelayOutputs(const uint8_t *pinMappings) {
+    _pinMappings = pinMappings;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Look up the port register and bit of each relay pin, grouping
+            the pins by port, then drive every pin to BOOT_OUTPUT_MASK and
+            make it an output. As in earlyInitRelays(), PORT is written
+            before DDR so each pin goes straight from high-impedance to its
+            boot level. Channel 0's pins are already driven by then; the
+            other channels' pins are set up here.
+    @return void
+*/
+/**************************************************************************/
+void RelayOutputs::begin() {
+    volatile uint8_t *modeRegs[MAX_RELAY_PORTS];
+    uint8_t bootVals[MAX_RELAY_PORTS];
+
+    _numPorts = 0;
+    _currentMask = BOOT_OUTPUT_MASK;
+    _appliedMask = BOOT_OUTPUT_MASK;
+
+    for (uint8_t out = 0; out < NUM_OF_PINS; out++) {
+        uint8_t pin = _pinMappings[NUM_OF_PINS - 1 - out];
+        volatile uint8_t *reg = portOutputRegister(digitalPinToPort(pin));
+
+        uint8_t port = 0;
+        while ((port < _numPorts) && (_portRegs[port] != reg)) {
+            port++;
+        }
+        if (port == _numPorts) {
+            if (_numPorts == MAX_RELAY_PORTS) {
+                Serial.println(F("[ERROR] relay pins span too many ports"));
+                return;
+            }
+            _portRegs[port] = reg;
+            _portMasks[port] = 0;
+            modeRegs[port] = portModeRegister(digitalPinToPort(pin));
+            bootVals[port] = 0;
+            _numPorts++;
+        }
+
+        _outputPort[out] = port;
+        _outputBit[out] = digitalPinToBitMask(pin);
+        _portMasks[port] |= _outputBit[out];
+        if ((BOOT_OUTPUT_MASK >> out) & 1) {
+            bootVals[port] |= _outputBit[out];
+        }
+    }
+
+    // ports can be shared with other channels, which the step timer interrupt may be writing
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        for (uint8_t port = 0; port < _numPorts; port++) {
+            *_portRegs[port] = (*_portRegs[port] & ~_portMasks[port]) | bootVals[port];
+            *modeRegs[port] |= _portMasks[port];
+        }
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Drive all relays to the given mask at once. Safe to call from
+            both loop() and the step timer interrupt.
+    @param  mask
+            packed outputs (output 1 in bit 0, on=1)
+    @return void
+*/
+/**************************************************************************/
+void RelayOutputs::write(uint16_t mask) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        _currentMask = mask;
+        _apply();
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Drive the relays to the requested mask with the overrides
+            applied. The masks are read and the ports written in one go, so
+            a write from the step timer interrupt can't be overwritten with
+            a stale mask. Must only be called with interrupts disabled.
+    @return void
+*/
+/**************************************************************************/
+void RelayOutputs::_apply() {
+    uint8_t portVals[MAX_RELAY_PORTS] = {0};
+    uint16_t applied = _stopped ? 0 : (_currentMask & _andMask) | _orMask;
+
+    for (uint8_t out = 0; out < NUM_OF_PINS; out++) {
+        if (applied & (1 << out)) {
+            portVals[_outputPort[out]] |= _outputBit[out];
+        }
+    }
+    for (uint8_t port = 0; port < _numPorts; port++) {
+        *_portRegs[port] = (*_portRegs[port] & ~_portMasks[port]) | portVals[port];
+    }
+    _appliedMask = applied;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Drop every relay to the safe (off) state and latch it there.
+            Writes only the port registers, so it is fast enough to call
+            from the serial RX interrupt.
+    @return void
+*/
+/**************************************************************************/
+void RelayOutputs::emergencyStop() {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        for (uint8_t port = 0; port < _numPorts; port++) {
+            *_portRegs[port] &= ~_portMasks[port];
+        }
+        _stopped = true;
+        _appliedMask = 0;
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Release the emergency stop latch and drive the relays back to
+            the most recently requested mask.
+    @return void
+*/
+/**************************************************************************/
+void RelayOutputs::clearEmergencyStop() {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        _stopped = false;
+        _apply();
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Whether the emergency stop is latched.
+    @return true if the relays are held off by an emergency stop
+*/
+/**************************************************************************/
+bool RelayOutputs::isStopped() {
+    return _stopped;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Get the mask most recently written to the relays, before
+            overrides were applied.
+    @return packed outputs (output 1 in bit 0, on=1)
+*/
+/**************************************************************************/
+uint16_t RelayOutputs::read() {
+    uint16_t mask;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        mask = _currentMask;
+    }
+    return mask;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Get the mask currently driven on the relay pins, after
+            overrides were applied.
+    @return packed outputs (output 1 in bit 0, on=1)
+*/
+/**************************************************************************/
+uint16_t RelayOutputs::readApplied() {
+    uint16_t mask;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        mask = _appliedMask;
+    }
+    return mask;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Set the override mode of one relay. The relays are updated
+            straight away.
+    @param  output
+            output number (1 to NUM_OF_PINS, i.e. R01 to R09)
+    @param  mode
+            new override mode for the relay
+    @return false if the output number or mode is invalid
+*/
+/**************************************************************************/
+bool RelayOutputs::setOverride(uint8_t output, RelayOverride mode) {
+    if ((output < 1) || (output > NUM_OF_PINS) || (mode > RELAY_FORCE_OFF)) {
+        return false;
+    }
+
+    uint16_t bit = 1 << (output - 1);
+    _disabled &= ~bit;
+    _forcedOn &= ~bit;
+    _forcedOff &= ~bit;
+
+    switch (mode)
+    {
+    case RELAY_DISABLED:  _disabled |= bit;  break;
+    case RELAY_FORCE_ON:  _forcedOn |= bit;  break;
+    case RELAY_FORCE_OFF: _forcedOff |= bit; break;
+    default: break;
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        _updateOverrideMasks();
+        _apply();
+    }
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Rebuild the AND / OR masks from the override lists. Must only
+            be called with interrupts disabled, as write() reads them.
+    @return void
+*/
+/**************************************************************************/
+void RelayOutputs::_updateOverrideMasks() {
+    _andMask = ~(_disabled | _forcedOff);
+    _orMask = _forcedOn & ~_disabled;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Replace all override masks at once (e.g. when restoring the
+            saved configuration) and apply them to the relays.
+    @param  disabled
+            relays pulled for maintenance (output 1 in bit 0)
+    @param  forcedOn
+            relays held on
+    @param  forcedOff
+            relays held off
+    @return void
+*/
+/**************************************************************************/
+void RelayOutputs::setOverrideMasks(uint16_t disabled, uint16_t forcedOn, uint16_t forcedOff) {
+    _disabled = disabled;
+    _forcedOn = forcedOn;
+    _forcedOff = forcedOff;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        _updateOverrideMasks();
+        _apply();
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Get the override masks.
+    @param  disabled
+            set to the relays pulled for maintenance (output 1 in bit 0)
+    @param  forcedOn
+            set to the relays held on
+    @param  forcedOff
+            set to the relays held off
+    @return void
+*/
+/**************************************************************************/
+void RelayOutputs::getOverrideMasks(uint16_t &disabled, uint16_t &forcedOn, uint16_t &forcedOff) {
+    disabled = _disabled;
+    forcedOn = _forcedOn;
+    forcedOff = _forcedOff;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Print the override masks to serial.
+    @return void
+*/
+/**************************************************************************/
+void RelayOutputs::reportOverrides() {
+    Serial.print(F("disabled: "));
+    Serial.print(_disabled, BIN);
+    Serial.print(F(", forced on: "));
+    Serial.print(_forcedOn, BIN);
+    Serial.print(F(", forced off: "));
+    Serial.print(_forcedOff, BIN);
+}
@@ -0,0 +1,279 @@
+#include "ScenarioPlayer.h"
+
+
+/**************************************************************************/
+/*!
+    @brief  Constructor
+    @param  ezTable
+            EZ calibration table, used to turn the scenario's EZ into a
+            state
+*/
+/**************************************************************************/
+ScenarioPlayer::ScenarioPlayer(StateValueTable &ezTable) : _ezTable(ezTable) {
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Compile a scenario into the spare program, for begin() or
+            switchAtTrainEnd(). Cancels any switch still pending. Uses 64
+            bit maths, so call from loop() only.
+    @param  scenario
+            valid scenario (see ScenarioStore::isValid())
+    @param  slot
+            its slot, reported in events
+    @return void
+*/
+/**************************************************************************/
+void ScenarioPlayer::prepare(const Scenario &scenario, uint8_t slot) {
+    // once no switch is pending, the interrupt never touches the spare program
+    _switchPending = false;
+    ScenarioProgram &program = _programs[_active ^ 1];
+
+    program.slot = slot;
+    program.numPhases = scenario.numPhases;
+    program.trains = scenario.trains;
+    program.startEz = scenario.startEz;
+
+    int32_t ez = scenario.startEz;
+    for (uint8_t i = 0; i < scenario.numPhases; i++) {
+        const ScenarioPhase &phase = scenario.phases[i];
+        ScenarioStep &step = program.steps[i];
+
+        step.ticks = (uint64_t)phase.durationMs * 1000ULL / STEP_TICK_US;
+        if (step.ticks == 0) {
+            step.ticks = 1;
+        }
+        step.ezStep = ((int64_t)phase.endEz - ez) * (1LL << SCENARIO_EZ_FRAC_BITS) / (int64_t)step.ticks;
+        step.endEz = phase.endEz;
+        step.label = phase.label;
+        ez = phase.endEz;
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Play the prepared program from its first train, on a channel.
+            The EZ table must be valid and monotone. The caller puts the
+            channel in MANUAL mode at the returned state, inside the same
+            atomic block, so the first tick finds it there; the scenario is
+            cancelled if the channel leaves MANUAL. A scenario already
+            playing on the same channel is switched; one playing on
+            another channel is cancelled, leaving that channel at its last
+            state.
+    @param  channel
+            channel to drive
+    @param  numStates
+            number of states of the channel's state table
+    @return state for the scenario's start EZ
+*/
+/**************************************************************************/
+uint16_t ScenarioPlayer::begin(uint8_t channel, uint16_t numStates) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        bool switching = _running && (channel == _channel);
+        if (_running && !switching) {
+            _push(SCENARIO_CANCELLED);  // reported against the old scenario, before it is replaced
+        }
+
+        _switchPending = false;
+        _active ^= 1;
+        const ScenarioProgram &program = _programs[_active];
+        _numStates = numStates;
+        _channel = channel;
+        _train = 0;
+        _phase = 0;
+        _phaseTicks = program.steps[0].ticks;
+        _ez = (int32_t)program.startEz << SCENARIO_EZ_FRAC_BITS;
+        _ticks = 0;
+        _state = _ezTable.nearestState(program.startEz, numStates);
+        _running = true;
+
+        _push(switching ? SCENARIO_SWITCHED : SCENARIO_STARTED);
+        _push(SCENARIO_PHASE);
+    }
+    return _state;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Swap to the prepared program when the train being played
+            ends, so the next train is the first of the new scenario.
+    @return false if no scenario is playing (call begin() instead)
+*/
+/**************************************************************************/
+bool ScenarioPlayer::switchAtTrainEnd() {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (!_running) {
+            return false;
+        }
+        _switchPending = true;
+    }
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Cancel the scenario, if one is playing. The channel keeps its
+            last state.
+    @return void
+*/
+/**************************************************************************/
+void ScenarioPlayer::stop() {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (_running) {
+            _running = false;
+            _switchPending = false;
+            _push(SCENARIO_CANCELLED);
+        }
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Queue a progress event for the current train and phase. Drops
+            it (and counts it) if the queue is full. Interrupts must be off.
+    @param  type
+            event to queue
+    @return void
+*/
+/**************************************************************************/
+void ScenarioPlayer::_push(ScenarioEventType type) {
+    if (_eventCount == SCENARIO_EVENT_QUEUE) {
+        _eventsLost++;
+        return;
+    }
+
+    const ScenarioProgram &program = _programs[_active];
+    ScenarioEvent &event = _events[_eventTail];
+    event.type = type;
+    event.slot = program.slot;
+    event.train = _train;
+    event.phase = _phase;
+    event.label = program.steps[_phase].label;
+    event.ticks = _ticks;
+    _eventTail = (_eventTail + 1) % SCENARIO_EVENT_QUEUE;
+    _eventCount++;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Move on to the next phase, the next train (from the start EZ),
+            the pending program or the end of the scenario. Called from
+            tick().
+    @return void
+*/
+/**************************************************************************/
+void ScenarioPlayer::_nextPhase() {
+    _ez = (int32_t)_programs[_active].steps[_phase].endEz << SCENARIO_EZ_FRAC_BITS;
+    _phase++;
+
+    if (_phase >= _programs[_active].numPhases) {
+        _phase = 0;
+        _train++;
+        if (_switchPending) {
+            _switchPending = false;
+            _active ^= 1;
+            _train = 0;
+            _push(SCENARIO_SWITCHED);
+        } else if ((_programs[_active].trains != 0) && (_train >= _programs[_active].trains)) {
+            _running = false;
+            _push(SCENARIO_FINISHED);
+            return;
+        }
+        _ez = (int32_t)_programs[_active].startEz << SCENARIO_EZ_FRAC_BITS;
+    }
+
+    _phaseTicks = _programs[_active].steps[_phase].ticks;
+    _push(SCENARIO_PHASE);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Advance the scenario by one step timer tick. Called from the
+            timer interrupt, while drives() is true.
+    @return state the channel must be driven to
+*/
+/**************************************************************************/
+uint16_t ScenarioPlayer::tick() {
+    if (!_running) {
+        return _state;
+    }
+
+    _ticks++;
+    const ScenarioStep &step = _programs[_active].steps[_phase];
+    if (--_phaseTicks > 0) {
+        _ez += step.ezStep;
+        uint16_t ez = (_ez + (1L << (SCENARIO_EZ_FRAC_BITS - 1))) >> SCENARIO_EZ_FRAC_BITS;
+        _state = _ezTable.nearestState(ez, _numStates);
+    } else {
+        // last tick of the phase: land exactly on its end EZ
+        _state = _ezTable.nearestState(step.endEz, _numStates);
+        _nextPhase();
+    }
+    return _state;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Take the oldest queued progress event. Call from loop() to send
+            it.
+    @param  event
+            set to the event
+    @return false if there is none
+*/
+/**************************************************************************/
+bool ScenarioPlayer::takeEvent(ScenarioEvent &event) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (_eventCount == 0) {
+            return false;
+        }
+        event = _events[_eventHead];
+        _eventHead = (_eventHead + 1) % SCENARIO_EVENT_QUEUE;
+        _eventCount--;
+    }
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Print the player state to serial.
+    @return void
+*/
+/**************************************************************************/
+void ScenarioPlayer::report() {
+    bool running;
+    uint8_t slot, train, phase;
+    uint32_t ticks;
+    uint16_t lost;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        running = _running;
+        slot = _programs[_active].slot;
+        train = _train;
+        phase = _phase;
+        ticks = _ticks;
+        lost = _eventsLost;
+    }
+
+    Serial.print(F("[SCENARIO] playing: "));
+    Serial.print(running);
+    Serial.print(F(", ch: "));
+    Serial.print(_channel);
+    Serial.print(F(", slot: "));
+    Serial.print(slot);
+    Serial.print(F(", train: "));
+    Serial.print(train);
+    Serial.print(F(", phase: "));
+    Serial.print(phase);
+    Serial.print(F(", elapsed: "));
+    Serial.print(ticks * STEP_TICK_US / 1000UL);
+    Serial.print(F(" ms, events lost: "));
+    Serial.println(lost);
+}
@@ -0,0 +1,289 @@
+#include "ScenarioStore.h"
+#include <EEPROM.h>
+#include <util/crc16.h>
+
+// EEPROM record: magic, CRC-CCITT of the rest (2 bytes), number of phases, trains, start EZ (2 bytes),
+// then each phase: label, end EZ (2 bytes), duration in ms (3 bytes). Multi-byte values are stored
+// low byte first.
+#define SCENARIO_HEADER_SIZE 7
+#define SCENARIO_PHASE_SIZE 6
+#define SCENARIO_RECORD_SIZE (SCENARIO_HEADER_SIZE + SCENARIO_MAX_PHASES * SCENARIO_PHASE_SIZE)
+#define SCENARIO_CRC_START 3                    // first byte covered by the CRC
+
+static_assert(SCENARIO_RECORD_SIZE <= SCENARIO_SLOT_SIZE, "scenario record does not fit its slot");
+static_assert(EEPROM_ADDR_SCENARIOS + SCENARIO_SLOTS * SCENARIO_SLOT_SIZE <= 4096, "scenarios do not fit in EEPROM");
+
+
+/**************************************************************************/
+/*!
+    @brief  Whether a scenario can be played: it has 1 to
+            SCENARIO_MAX_PHASES phases, no EZ above SCENARIO_MAX_EZ and no
+            phase shorter than 1 ms.
+    @param  scenario
+            scenario to check
+    @return true if it is valid
+*/
+/**************************************************************************/
+bool ScenarioStore::isValid(const Scenario &scenario) {
+    if ((scenario.numPhases == 0) || (scenario.numPhases > SCENARIO_MAX_PHASES) ||
+        (scenario.startEz > SCENARIO_MAX_EZ)) {
+        return false;
+    }
+    for (uint8_t i = 0; i < scenario.numPhases; i++) {
+        if ((scenario.phases[i].endEz > SCENARIO_MAX_EZ) || (scenario.phases[i].durationMs == 0)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Byte of the EEPROM record for a scenario.
+    @param  scenario
+            scenario to encode
+    @param  pos
+            offset into the record
+    @return byte to save at that offset
+*/
+/**************************************************************************/
+uint8_t ScenarioStore::_recordByte(const Scenario &scenario, uint16_t pos) {
+    switch (pos)
+    {
+    case 0: return EEPROM_MAGIC;
+    case 1: return lowByte(_crc);
+    case 2: return highByte(_crc);
+    case 3: return scenario.numPhases;
+    case 4: return scenario.trains;
+    case 5: return lowByte(scenario.startEz);
+    case 6: return highByte(scenario.startEz);
+    default: break;
+    }
+
+    const ScenarioPhase &phase = scenario.phases[(pos - SCENARIO_HEADER_SIZE) / SCENARIO_PHASE_SIZE];
+    switch ((pos - SCENARIO_HEADER_SIZE) % SCENARIO_PHASE_SIZE)
+    {
+    case 0: return phase.label;
+    case 1: return lowByte(phase.endEz);
+    case 2: return highByte(phase.endEz);
+    default: return (phase.durationMs >> (8 * ((pos - SCENARIO_HEADER_SIZE) % SCENARIO_PHASE_SIZE - 3))) & 0xFF;
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  CRC-CCITT of the part of a scenario's record after the CRC,
+            as saved in its slot and returned by save(). Two scenarios
+            with the same CRC play the same way.
+    @param  scenario
+            scenario to encode
+    @return crc
+*/
+/**************************************************************************/
+uint16_t ScenarioStore::recordCrc(const Scenario &scenario) {
+    uint16_t crc = 0xFFFF;
+
+    for (uint16_t pos = SCENARIO_CRC_START; pos < SCENARIO_RECORD_SIZE; pos++) {
+        crc = _crc_ccitt_update(crc, _recordByte(scenario, pos));
+    }
+    return crc;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Read the scenario saved in a slot.
+    @param  slot
+            slot to read (below SCENARIO_SLOTS)
+    @param  scenario
+            set to the saved scenario
+    @return false if no valid scenario has been saved there
+*/
+/**************************************************************************/
+bool ScenarioStore::_read(uint8_t slot, Scenario &scenario) {
+    int addr = EEPROM_ADDR_SCENARIOS + slot * SCENARIO_SLOT_SIZE;
+    uint8_t record[SCENARIO_RECORD_SIZE];
+
+    for (uint16_t pos = 0; pos < SCENARIO_RECORD_SIZE; pos++) {
+        record[pos] = EEPROM.read(addr + pos);
+    }
+    if (record[0] != EEPROM_MAGIC) {
+        return false;
+    }
+
+    uint16_t crc = 0xFFFF;
+    for (uint16_t pos = SCENARIO_CRC_START; pos < SCENARIO_RECORD_SIZE; pos++) {
+        crc = _crc_ccitt_update(crc, record[pos]);
+    }
+    if (crc != (record[1] | (record[2] << 8))) {
+        Serial.print(F("[WARNING] scenario CRC mismatch, slot ignored: "));
+        Serial.println(slot);
+        return false;
+    }
+
+    scenario.numPhases = record[3];
+    scenario.trains = record[4];
+    scenario.startEz = record[5] | (record[6] << 8);
+    const uint8_t *bytes = record + SCENARIO_HEADER_SIZE;
+    for (uint8_t i = 0; i < SCENARIO_MAX_PHASES; i++, bytes += SCENARIO_PHASE_SIZE) {
+        scenario.phases[i].label = bytes[0];
+        scenario.phases[i].endEz = bytes[1] | (bytes[2] << 8);
+        scenario.phases[i].durationMs = bytes[3] | ((uint32_t)bytes[4] << 8) | ((uint32_t)bytes[5] << 16);
+    }
+    return isValid(scenario);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Set the header or one phase of a scenario. The first upload to
+            a slot starts from the scenario saved there (or an empty one),
+            so a single phase can be changed.
+    @param  slot
+            slot being uploaded (below SCENARIO_SLOTS)
+    @param  index
+            0 for the header, 1 to SCENARIO_MAX_PHASES for a phase
+    @param  data
+            SCENARIO_UPLOAD_SIZE bytes, high byte first.
+            Header: number of phases, trains, start EZ (2 bytes), 2 unused.
+            Phase: label, end EZ (2 bytes), duration in ms (3 bytes).
+    @return false if the slot or index is out of range, or a save is in
+            progress
+*/
+/**************************************************************************/
+bool ScenarioStore::set(uint8_t slot, uint8_t index, const uint8_t *data) {
+    if ((slot >= SCENARIO_SLOTS) || (index > SCENARIO_MAX_PHASES) || saving()) {
+        return false;
+    }
+
+    if (slot != _editSlot) {
+        if (!_read(slot, _edit)) {
+            memset(&_edit, 0, sizeof(_edit));
+        }
+        _editSlot = slot;
+    }
+
+    if (index == 0) {
+        _edit.numPhases = data[0];
+        _edit.trains = data[1];
+        _edit.startEz = (data[2] << 8) | data[3];
+    } else {
+        ScenarioPhase &phase = _edit.phases[index - 1];
+        phase.label = data[0];
+        phase.endEz = (data[1] << 8) | data[2];
+        phase.durationMs = ((uint32_t)data[3] << 16) | ((uint32_t)data[4] << 8) | data[5];
+    }
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Get a scenario to play: the copy uploaded since boot, whether
+            saved or not, or else the one saved in EEPROM.
+    @param  slot
+            slot to load
+    @param  scenario
+            set to the scenario
+    @return false if the slot is out of range or holds no valid scenario
+*/
+/**************************************************************************/
+bool ScenarioStore::load(uint8_t slot, Scenario &scenario) {
+    if (slot >= SCENARIO_SLOTS) {
+        return false;
+    }
+    if (slot == _editSlot) {
+        scenario = _edit;
+        return isValid(scenario);
+    }
+    return _read(slot, scenario);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Byte of the record being saved, for the EepromRecordWriter.
+    @param  store
+            the ScenarioStore saving its uploaded scenario
+    @param  pos
+            offset into the record
+    @return byte to save at that offset
+*/
+/**************************************************************************/
+uint8_t ScenarioStore::_saveByte(void *store, uint16_t pos) {
+    ScenarioStore *self = (ScenarioStore *)store;
+    return self->_recordByte(self->_edit, pos);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Start saving the uploaded scenario to its slot, written by
+            saveStep().
+    @param  slot
+            slot to save, which must be the one uploaded
+    @param  crc
+            set to the CRC of the record being saved
+    @return false if the slot was not uploaded, the scenario is not valid
+            or a save is already in progress
+*/
+/**************************************************************************/
+bool ScenarioStore::save(uint8_t slot, uint16_t &crc) {
+    if ((slot != _editSlot) || !isValid(_edit) || saving()) {
+        return false;
+    }
+    _crc = recordCrc(_edit);
+    _writer.start(EEPROM_ADDR_SCENARIOS + _editSlot * SCENARIO_SLOT_SIZE, SCENARIO_RECORD_SIZE, _saveByte, this);
+    crc = _crc;
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Carry on with a save, one EEPROM byte per call (see
+            EepromRecordWriter::step()). Call regularly from loop().
+    @return true while the save is still in progress
+*/
+/**************************************************************************/
+bool ScenarioStore::saveStep() {
+    return _writer.step();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Whether a save is in progress.
+    @return true until the last byte of the save has been started
+*/
+/**************************************************************************/
+bool ScenarioStore::saving() {
+    return _writer.busy();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Print the upload and save state to serial.
+    @return void
+*/
+/**************************************************************************/
+void ScenarioStore::report() {
+    Serial.print(F("[SCENARIO] uploaded slot: "));
+    Serial.print(_editSlot);
+    if (_editSlot >= 0) {
+        Serial.print(F(", phases: "));
+        Serial.print(_edit.numPhases);
+        Serial.print(F(", trains: "));
+        Serial.print(_edit.trains);
+        Serial.print(isValid(_edit) ? F(", valid") : F(", not valid"));
+    }
+    if (saving()) {
+        Serial.print(F(", saving: "));
+        Serial.print(_writer.percentDone());
+        Serial.print(F("%"));
+    }
+    Serial.println();
+}
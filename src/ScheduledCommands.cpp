@@ -0,0 +1,110 @@
+#include "ScheduledCommands.h"
+
+
+/**************************************************************************/
+/*!
+    @brief  Insert a command, keeping the queue in time order. Commands due
+            at the same time run in the order they were added.
+    @param  dueUs
+            micros() timestamp to execute at
+    @param  code
+            action code to execute
+    @param  channel
+            state machine channel the action code addresses
+    @return false if the queue is full
+*/
+/**************************************************************************/
+bool ScheduledCommandQueue::add(unsigned long dueUs, uint8_t code, uint8_t channel) {
+    if (_count == MAX_SCHEDULED_COMMANDS) {
+        return false;
+    }
+
+    // shift later commands up (timestamps compared by signed difference, so micros() wrap is handled)
+    uint8_t i = _count;
+    while ((i > 0) && ((long)(_commands[i - 1].dueUs - dueUs) > 0)) {
+        _commands[i] = _commands[i - 1];
+        i--;
+    }
+
+    _commands[i].dueUs = dueUs;
+    _commands[i].code = code;
+    _commands[i].channel = channel;
+    _count++;
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Remove the earliest command if it is due before the horizon.
+    @param  horizonUs
+            micros() timestamp up to which commands are taken
+    @param  command
+            set to the command removed
+    @return true if a command was removed
+*/
+/**************************************************************************/
+bool ScheduledCommandQueue::popDue(unsigned long horizonUs, ScheduledCommand &command) {
+    if ((_count == 0) || ((long)(horizonUs - _commands[0].dueUs) < 0)) {
+        return false;
+    }
+
+    command = _commands[0];
+    _count--;
+    for (uint8_t i = 0; i < _count; i++) {
+        _commands[i] = _commands[i + 1];
+    }
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Record the scheduling error of a command that has just run.
+    @param  command
+            the command executed
+    @param  executedUs
+            micros() timestamp it was executed at
+    @return scheduling error (lateness) in microseconds
+*/
+/**************************************************************************/
+unsigned long ScheduledCommandQueue::recordExecution(const ScheduledCommand &command, unsigned long executedUs) {
+    unsigned long errorUs = executedUs - command.dueUs;
+
+    _executed++;
+    _totalErrorUs += errorUs;
+    if (errorUs > _worstErrorUs) _worstErrorUs = errorUs;
+
+    return errorUs;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Drop every queued command.
+    @return void
+*/
+/**************************************************************************/
+void ScheduledCommandQueue::clear() {
+    _count = 0;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Print the number of commands queued and run, and their
+            scheduling error.
+    @return void
+*/
+/**************************************************************************/
+void ScheduledCommandQueue::report() {
+    Serial.print(F("[SCHEDULE] queued: "));
+    Serial.print(_count);
+    Serial.print(F(", executed: "));
+    Serial.print(_executed);
+    Serial.print(F(", mean error: "));
+    Serial.print(_executed ? (_totalErrorUs / _executed) : 0);
+    Serial.print(F(" us, worst error: "));
+    Serial.print(_worstErrorUs);
+    Serial.println(F(" us"));
+}
@@ -1,23 +1,141 @@
 #include "SerialPort.h"
 
-#define DEBUG
+// #define DEBUG   // log every frame received (blocks on ~29 bytes of TX per frame, so it throttles the link)
+
+// baud rates the HMI can select with BAUD_PROPOSE, by index. 250k, 500k and 1M are exact at 16 MHz.
+const uint32_t baudRates[NUM_BAUD_RATES] PROGMEM = {
+    9600, 19200, 38400, 57600, 115200, 250000, 500000, 1000000
+};
+
 
 /**************************************************************************/
 /*!
-    @brief  If serial data is available, read byte stream until a full action
-            has been recieved.
-            Once an action code has been read, save the code to the [actionCode]
-            attribute and exit the function. 
+    @brief  Open the serial port.
+    @param  baudRate
+            baud rate to use. Also the rate fallen back to if a negotiated
+            rate is not confirmed.
+    @return void
+*/
+/**************************************************************************/
+void SerialPort::begin(unsigned long baudRate) {
+    _baudRate = baudRate;
+    _fallbackBaud = baudRate;
+    Serial.begin(baudRate);
+}
 
+/**************************************************************************/
+/*!
+    @brief  If serial data is available, read the byte stream and queue
+            every complete frame received. Stops early if the queue is full,
+            leaving the rest in the serial RX buffer.
+            Sends a cumulative ACK if any sequenced frames were processed,
+            and updates XON/XOFF flow control.
     @return void
 */
 /**************************************************************************/
 void SerialPort::readFromSerial() {
-    bool code_received = false;
+    while ((Serial.available() > 0) && (_queue.space() > 0)) {
+        processIncomingByte(Serial.read());
+    }
 
-    while ((Serial.available() > 0) && (!code_received)) {
-        code_received = processIncomingByte(Serial.read());
+    if (_ackPending) {
+        _ackPending = false;
+        sendFrame(SEQ_ACK);
+        sendFrame(_expectedSeq - 1);
+        sendFrame(_credits());
     }
+
+    _updateFlowControl();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Frames the HMI may send beyond the last one acknowledged. The
+            queue is only filled once per serial task pass, so the frames
+            must also fit, at their longest, in the free RX buffer.
+    @return credits
+*/
+/**************************************************************************/
+uint8_t SerialPort::_credits() {
+    int rxFree = (SERIAL_RX_BUFFER_SIZE - 1) - Serial.available();
+    uint8_t rxFrames = (rxFree > 0) ? rxFree / SEQ_FRAME_MAX_BYTES : 0;
+
+    return min(_queue.space(), rxFrames);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Send XOFF when the RX buffer or the queue is close to full, and
+            XON once both have drained.
+    @return void
+*/
+/**************************************************************************/
+void SerialPort::_updateFlowControl() {
+    if (_flowMode != FLOW_XON_XOFF) {
+        return;
+    }
+
+    int rxWaiting = Serial.available();
+    uint8_t space = _queue.space();
+
+    if (!_xoffSent && ((rxWaiting >= FLOW_RX_HIGH_WATER) || (space <= FLOW_QUEUE_LOW_SPACE))) {
+        Serial.write(XOFF);
+        _xoffSent = true;
+    } else if (_xoffSent && (rxWaiting < FLOW_RX_LOW_WATER) && (space > FLOW_QUEUE_LOW_SPACE)) {
+        Serial.write(XON);
+        _xoffSent = false;
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Select the flow control mode. Replies with <FLOW_CONTROL><mode>.
+    @param  mode
+            new flow control mode
+    @return void
+*/
+/**************************************************************************/
+void SerialPort::setFlowControl(FlowControlMode mode) {
+    if (_xoffSent) {
+        Serial.write(XON);  // never leave the HMI paused
+        _xoffSent = false;
+    }
+    _flowMode = (mode == FLOW_XON_XOFF) ? FLOW_XON_XOFF : FLOW_NONE;
+
+    sendFrame(FLOW_CONTROL);
+    sendFrame(_flowMode);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Send frame counters: <LINK_STATS><received hi><received lo>
+            <dropped hi><dropped lo>.
+    @return void
+*/
+/**************************************************************************/
+void SerialPort::sendLinkStats() {
+    sendFrame(LINK_STATS);
+    sendFrame(highByte(_framesReceived));
+    sendFrame(lowByte(_framesReceived));
+    sendFrame(highByte(_droppedFrames));
+    sendFrame(lowByte(_droppedFrames));
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Take the next received frame from the queue.
+    @param  frame
+            set to the frame value
+    @return false if no frame is waiting
+*/
+/**************************************************************************/
+bool SerialPort::nextFrame(uint8_t &frame) {
+    return _queue.pop(frame);
 }
 
 
@@ -58,19 +176,253 @@ bool SerialPort::processIncomingByte(const byte inByte) {
 /**************************************************************************/
 /*!
     @brief  Processes the char-array read from the comm serial port.
-            Saves the action code received to object's attribute.
+            Queues the frame received, checking its sequence number if it
+            has one.
     @param  data
             Char-array read from the serial port.
     @return void
 */
 /**************************************************************************/
 void SerialPort::processData(const char * data) {
-    // Store action code read from serial as attribute
-    actionCode = atoi(data);
+    const char *comma = strchr(data, ',');
+
+    if (comma == NULL) {
+        _acceptFrame(atoi(data));   // unsequenced frame
+        return;
+    }
+
+    uint8_t seq = atoi(data);
+    uint8_t value = atoi(comma + 1);
+
+    if (!_sequenced || (seq != _expectedSeq)) {
+        // out of order (or a duplicate): drop it and repeat the last ACK
+        _droppedFrames++;
+        _ackPending = _sequenced;
+        return;
+    }
+
+    _expectedSeq++;
+    _ackPending = true;
+    _acceptFrame(value);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Add a received frame to the queue.
+    @param  value
+            frame value
+    @return void
+*/
+/**************************************************************************/
+void SerialPort::_acceptFrame(uint8_t value) {
+    _lastFrameUs = micros();
+
+    if (!_queue.push(value)) {
+        _droppedFrames++;
+        return;
+    }
+    _framesReceived++;
 
     #ifdef DEBUG
         // DEBUG: log action code received to Serial 
         Serial.print("[ACTION CODE RECEIVED] :: ");
-        Serial.println(actionCode);
+        Serial.println(value);
     #endif
-}
\ No newline at end of file
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Enable sequenced frames and restart the sequence at 0.
+            Replies with <SEQ_RESET><window>.
+            Frame counters are reset too.
+    @param  window
+            max frames the HMI will have in flight. Limited to the queue
+            size so in-order frames always fit.
+    @return void
+*/
+/**************************************************************************/
+void SerialPort::resetSequence(uint8_t window) {
+    _window = constrain(window, 1, COMMAND_QUEUE_SIZE);
+    _expectedSeq = 0;
+    _sequenced = true;
+    _ackPending = false;
+    _framesReceived = 0;
+    _droppedFrames = 0;
+
+    sendFrame(SEQ_RESET);
+    sendFrame(_window);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Number of frames dropped because the queue was full or they
+            arrived out of order.
+    @return dropped frame count
+*/
+/**************************************************************************/
+uint16_t SerialPort::getDroppedFrames() {
+    return _droppedFrames;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Send a single value as a data packet (e.g. <253>).
+    @param  value
+            value to send (0-255)
+    @return void
+*/
+/**************************************************************************/
+void SerialPort::sendFrame(uint8_t value) {
+    Serial.print('<');
+    Serial.print(value);
+    Serial.print('>');
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Whether frames can be sent without waiting for room in the TX
+            buffer, i.e. without blocking in sendFrame().
+    @param  frames
+            number of frames to send
+    @return true if the TX buffer has room for them
+*/
+/**************************************************************************/
+bool SerialPort::canSend(uint8_t frames) {
+    return Serial.availableForWrite() >= frames * SENT_FRAME_MAX_BYTES;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Send a micros() timestamp as 4 frames, high byte first.
+    @param  us
+            timestamp to send
+    @return void
+*/
+/**************************************************************************/
+void SerialPort::sendTimestamp(unsigned long us) {
+    for (int8_t shift = 24; shift >= 0; shift -= 8) {
+        sendFrame((uint8_t)(us >> shift));
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Get the time the last frame was received, i.e. when its '>'
+            was read from the RX buffer.
+    @return micros() timestamp
+*/
+/**************************************************************************/
+unsigned long SerialPort::getLastFrameTime() {
+    return _lastFrameUs;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Handle a baud rate proposal from the HMI. The proposal is
+            answered at the current rate with <BAUD_PROPOSE><rateIndex>,
+            then the port switches to the new rate and waits up to
+            BAUD_CONFIRM_TIMEOUT_MS for the test pattern.
+    @param  rateIndex
+            index into baudRates
+    @return void
+*/
+/**************************************************************************/
+void SerialPort::proposeBaud(uint8_t rateIndex) {
+    sendFrame(BAUD_PROPOSE);
+
+    if (rateIndex >= NUM_BAUD_RATES) {
+        sendFrame(BAUD_REJECT);
+        return;
+    }
+
+    sendFrame(rateIndex);
+    Serial.flush();     // reply must leave at the old rate
+
+    _switchBaud(pgm_read_dword(&baudRates[rateIndex]));
+    _confirmPending = true;
+    _proposedAtMs = millis();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Check the test pattern sent by the HMI at the new baud rate.
+            A correct pattern is echoed back and the new rate kept;
+            anything else falls back to the previous rate.
+    @param  pattern
+            BAUD_TEST_PATTERN_LEN bytes received with BAUD_CONFIRM
+    @return void
+*/
+/**************************************************************************/
+void SerialPort::confirmBaud(const uint8_t *pattern) {
+    if (!_confirmPending) {
+        return;
+    }
+    _confirmPending = false;
+
+    if (memcmp(pattern, baudTestPattern, BAUD_TEST_PATTERN_LEN) != 0) {
+        _switchBaud(_fallbackBaud);
+        return;
+    }
+
+    sendFrame(BAUD_CONFIRM);
+    for (uint8_t i = 0; i < BAUD_TEST_PATTERN_LEN; i++) {
+        sendFrame(baudTestPattern[i]);
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Fall back to the previous baud rate if the HMI has not
+            confirmed a new rate in time. Call regularly.
+    @return true if the port has just fallen back to the previous rate
+*/
+/**************************************************************************/
+bool SerialPort::checkBaudTimeout() {
+    if (_confirmPending && ((millis() - _proposedAtMs) >= BAUD_CONFIRM_TIMEOUT_MS)) {
+        _confirmPending = false;
+        _switchBaud(_fallbackBaud);
+        return true;
+    }
+    return false;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Restart the serial port at a new baud rate. Any partly received
+            data packet is discarded.
+    @param  baudRate
+            new baud rate
+    @return void
+*/
+/**************************************************************************/
+void SerialPort::_switchBaud(unsigned long baudRate) {
+    Serial.flush();
+    Serial.end();
+    Serial.begin(baudRate);
+
+    _baudRate = baudRate;
+    input_pos = 0;
+    _queue.clear();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Get the baud rate currently in use.
+    @return baud rate
+*/
+/**************************************************************************/
+unsigned long SerialPort::getBaudRate() {
+    return _baudRate;
+}
@@ -0,0 +1,24 @@
+#include "ShiftRegisterOutputs.h"
+
+#ifdef SHIFT_REGISTER_OUTPUTS
+
+// Runs from .init3, straight after reset, so the shift register outputs stay off until
+// begin() has loaded the chain. Fit a pull-up on /OE to hold them off through reset too.
+void earlyInitShiftRegisters() __attribute__((naked, used, section(".init3")));
+
+
+/**************************************************************************/
+/*!
+    @brief  Raise /OE and make the SPI and latch pins outputs.
+    @return void
+*/
+/**************************************************************************/
+void earlyInitShiftRegisters() {
+    PORTL |= _BV(SR_PORTL_OE_BIT);
+    DDRL |= _BV(SR_PORTL_OE_BIT);
+
+    PORTB &= ~(_BV(SR_PORTB_LATCH_BIT) | _BV(SR_PORTB_SCK_BIT) | _BV(SR_PORTB_MOSI_BIT));
+    DDRB |= _BV(SR_PORTB_LATCH_BIT) | _BV(SR_PORTB_SCK_BIT) | _BV(SR_PORTB_MOSI_BIT);
+}
+
+#endif
@@ -0,0 +1,293 @@
+#include "StateValueTable.h"
+#include <EEPROM.h>
+#include <util/crc16.h>
+
+// EEPROM record: magic, number of values (2 bytes), CRC-CCITT of the values (2 bytes),
+// then each value (2 bytes). Multi-byte values are stored low byte first.
+#define STATE_TABLE_HEADER_SIZE 5
+#define STATE_TABLE_RECORD_SIZE (STATE_TABLE_HEADER_SIZE + STATE_TABLE_STATES * 2)
+
+static_assert(EEPROM_ADDR_DWELL_TABLE + STATE_TABLE_RECORD_SIZE <= EEPROM_ADDR_EZ_TABLE, "dwell table overlaps the EZ table");
+static_assert(EEPROM_ADDR_EZ_TABLE + STATE_TABLE_RECORD_SIZE <= 4096, "EZ table does not fit in EEPROM");
+
+
+/**************************************************************************/
+/*!
+    @brief  Constructor
+    @param  eepromAddr
+            EEPROM address of the saved table (see EepromLayout.h)
+*/
+/**************************************************************************/
+StateValueTable::StateValueTable(int eepromAddr) : _addr(eepromAddr) {
+    memset(_values, 0, sizeof(_values));
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  CRC-CCITT of the values, low byte first.
+    @return crc
+*/
+/**************************************************************************/
+uint16_t StateValueTable::_valuesCrc() {
+    uint16_t crc = 0xFFFF;
+
+    for (uint16_t state = 0; state < STATE_TABLE_STATES; state++) {
+        crc = _crc_ccitt_update(crc, lowByte(_values[state]));
+        crc = _crc_ccitt_update(crc, highByte(_values[state]));
+    }
+    return crc;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Byte of the EEPROM record for the table in RAM. With no table
+            the magic byte stays clear, so the saved table is erased.
+    @param  pos
+            offset into the record
+    @return byte to save at that offset
+*/
+/**************************************************************************/
+uint8_t StateValueTable::_recordByte(uint16_t pos) {
+    switch (pos)
+    {
+    case 0: return _valid ? EEPROM_MAGIC : 0xFF;
+    case 1: return lowByte(STATE_TABLE_STATES);
+    case 2: return highByte(STATE_TABLE_STATES);
+    case 3: return lowByte(_crc);
+    case 4: return highByte(_crc);
+    default: break;
+    }
+
+    uint16_t value = _values[(pos - STATE_TABLE_HEADER_SIZE) / 2];
+    return ((pos - STATE_TABLE_HEADER_SIZE) & 1) ? highByte(value) : lowByte(value);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Byte of the record being saved, for the EepromRecordWriter.
+    @param  table
+            the StateValueTable being saved
+    @param  pos
+            offset into the record
+    @return byte to save at that offset
+*/
+/**************************************************************************/
+uint8_t StateValueTable::_saveByte(void *table, uint16_t pos) {
+    return ((StateValueTable *)table)->_recordByte(pos);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Load the table from EEPROM. If no valid table has been saved
+            there, every value is 0 and valid() is false.
+    @return void
+*/
+/**************************************************************************/
+void StateValueTable::load() {
+    uint16_t count = EEPROM.read(_addr + 1) | (EEPROM.read(_addr + 2) << 8);
+    uint16_t crc = EEPROM.read(_addr + 3) | (EEPROM.read(_addr + 4) << 8);
+
+    if ((EEPROM.read(_addr) != EEPROM_MAGIC) || (count != STATE_TABLE_STATES)) {
+        clear();
+        return;
+    }
+
+    int addr = _addr + STATE_TABLE_HEADER_SIZE;
+    for (uint16_t state = 0; state < STATE_TABLE_STATES; state++, addr += 2) {
+        _values[state] = EEPROM.read(addr) | (EEPROM.read(addr + 1) << 8);
+    }
+
+    _crc = _valuesCrc();
+    if (_crc != crc) {
+        Serial.print(F("[WARNING] state table CRC mismatch, table ignored: "));
+        Serial.println(_addr);
+        clear();
+        return;
+    }
+    _valid = true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Set a block of values. The first upload after boot (or after
+            clear()) starts from a table of zeros.
+    @param  firstState
+            state number of the first value
+    @param  values
+            values to set
+    @param  count
+            number of values
+    @return false if the block runs past the last state or a save is in
+            progress
+*/
+/**************************************************************************/
+bool StateValueTable::set(uint16_t firstState, const uint16_t *values, uint8_t count) {
+    if ((firstState + count > STATE_TABLE_STATES) || saving()) {
+        return false;
+    }
+
+    for (uint8_t i = 0; i < count; i++) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            _values[firstState + i] = values[i];
+        }
+    }
+    _valid = true;
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Drop the table (in RAM only; save() to clear it in EEPROM too).
+    @return void
+*/
+/**************************************************************************/
+void StateValueTable::clear() {
+    _valid = false;
+    for (uint16_t state = 0; state < STATE_TABLE_STATES; state++) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            _values[state] = 0;
+        }
+    }
+    _crc = _valuesCrc();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Get the value of one state. Call from loop() only.
+    @param  state
+            state number
+    @return value (0 if the state is out of range)
+*/
+/**************************************************************************/
+uint16_t StateValueTable::get(uint16_t state) {
+    if (state >= STATE_TABLE_STATES) {
+        return 0;
+    }
+    return _values[state];  // only loop() writes the table, so no torn read here
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Whether the first numStates values only ever rise, or only
+            ever fall, as required by nearestState().
+    @param  numStates
+            number of states in use
+    @return true if the table is monotone
+*/
+/**************************************************************************/
+bool StateValueTable::isMonotone(uint16_t numStates) {
+    bool rising = false;
+    bool falling = false;
+
+    for (uint16_t state = 1; (state < numStates) && (state < STATE_TABLE_STATES); state++) {
+        if (_values[state] > _values[state - 1]) rising = true;
+        if (_values[state] < _values[state - 1]) falling = true;
+    }
+    return !(rising && falling);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Find the state whose value is nearest to the one given, by
+            binary search. The table must be monotone (see isMonotone()),
+            rising or falling. Fast enough for the step timer interrupt.
+    @param  value
+            value to look for
+    @param  numStates
+            number of states in use
+    @return state number (the lower one on a tie)
+*/
+/**************************************************************************/
+uint16_t StateValueTable::nearestState(uint16_t value, uint16_t numStates) {
+    if (numStates > STATE_TABLE_STATES) numStates = STATE_TABLE_STATES;
+    if (numStates < 2) {
+        return 0;
+    }
+
+    uint16_t lo = 0;
+    uint16_t hi = numStates - 1;
+    bool falling = _values[lo] > _values[hi];
+
+    // narrow to the two neighbouring states either side of the value
+    while (hi - lo > 1) {
+        uint16_t mid = (lo + hi) / 2;
+        bool beforeValue = falling ? (_values[mid] > value) : (_values[mid] < value);
+        if (beforeValue) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    uint16_t loDiff = (_values[lo] > value) ? _values[lo] - value : value - _values[lo];
+    uint16_t hiDiff = (_values[hi] > value) ? _values[hi] - value : value - _values[hi];
+    return (loDiff <= hiDiff) ? lo : hi;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Start saving the table to EEPROM, written by saveStep().
+    @return CRC of the table being saved
+*/
+/**************************************************************************/
+uint16_t StateValueTable::save() {
+    _crc = _valuesCrc();
+    _writer.start(_addr, STATE_TABLE_RECORD_SIZE, _saveByte, this);
+    return _crc;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Carry on with a save, one EEPROM byte per call (see
+            EepromRecordWriter::step()). Call regularly from loop().
+    @return true while the save is still in progress
+*/
+/**************************************************************************/
+bool StateValueTable::saveStep() {
+    return _writer.step();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Whether a save is in progress.
+    @return true until the last byte of the save has been started
+*/
+/**************************************************************************/
+bool StateValueTable::saving() {
+    return _writer.busy();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Print the table state to serial.
+    @param  tag
+            line prefix, e.g. F("[DWELL]")
+    @return void
+*/
+/**************************************************************************/
+void StateValueTable::report(const __FlashStringHelper *tag) {
+    Serial.print(tag);
+    Serial.print(F(" table: "));
+    Serial.print(_valid ? F("loaded") : F("none"));
+    Serial.print(F(", crc: "));
+    Serial.print(_crc, HEX);
+    if (saving()) {
+        Serial.print(F(", saving: "));
+        Serial.print(_writer.percentDone());
+        Serial.print(F("%"));
+    }
+    Serial.println();
+}
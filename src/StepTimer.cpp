@@ -0,0 +1,220 @@
+#include "StepTimer.h"
+
+// shared with the compare ISR
+static volatile TickHandler tickHandler = NULL;
+static volatile uint32_t tickCount = 0;
+static volatile uint16_t lateTicks = 0;
+static volatile uint16_t worstLatencyCounts = 0;    // tick edge to handler start, in timer counts
+static volatile uint16_t worstEndCounts = 0;        // tick edge to handler end, in timer counts
+static volatile uint16_t worstHandlerCounts = 0;    // time spent in the handler, in timer counts
+static volatile uint32_t totalHandlerCounts = 0;
+static volatile bool externalClock = false;
+static volatile uint16_t missedEdgeCount = 0;       // ticks run from Timer1 because a sync edge was overdue
+static volatile bool edgeTick = false;              // the current tick was started by a sync edge
+
+
+/**************************************************************************/
+/*!
+    @brief  Run the tick handler and update the statistics. Interrupt
+            context only.
+    @param  latency
+            timer counts from the tick edge to now
+    @return void
+*/
+/**************************************************************************/
+static inline void runTick(uint16_t latency) {
+    tickHandler();
+
+    uint16_t end = TCNT1;
+    uint16_t handler = end - latency;
+    tickCount++;
+    totalHandlerCounts += handler;
+    if (latency > worstLatencyCounts) worstLatencyCounts = latency;
+    if (latency > (STEP_TICK_LATE_US * STEP_TIMER_COUNTS_PER_US)) lateTicks++;
+    if (end > worstEndCounts) worstEndCounts = end;
+    if (handler > worstHandlerCounts) worstHandlerCounts = handler;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Timer1 compare interrupt: one step tick. TCNT1 restarted from 0
+            at the compare match, so it holds the time since the tick edge.
+            With an external clock this only fires when a sync edge is
+            overdue; ticks then run every STEP_TICK_US until edges return.
+*/
+/**************************************************************************/
+ISR(TIMER1_COMPA_vect) {
+    uint16_t latency = TCNT1;
+
+    if (externalClock) {
+        missedEdgeCount++;
+        OCR1A = STEP_TIMER_COUNTS_PER_TICK - 1;
+    }
+    edgeTick = false;
+    runTick(latency);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Run a tick for an external sync edge. Restarts Timer1, so the
+            latency is counted from the edge interrupt. Call from the edge
+            interrupt only.
+    @return void
+*/
+/**************************************************************************/
+void StepTimer::externalTick() {
+    TCNT1 = 0;
+    OCR1A = STEP_EDGE_TIMEOUT_COUNTS - 1;
+    TIFR1 = _BV(OCF1A);
+    edgeTick = true;
+    runTick(0);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Whether the current tick was started by an external sync edge
+            rather than by Timer1 (e.g. because the edge was overdue).
+    @return true if the last tick came from externalTick()
+*/
+/**************************************************************************/
+bool StepTimer::edgeStarted() {
+    return edgeTick;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Start the step timer. Call once from setup(), after the
+            handler's state is ready.
+    @param  handler
+            function called from the timer interrupt every tick. Must be
+            short and must not use Serial.
+    @return void
+*/
+/**************************************************************************/
+void StepTimer::begin(TickHandler handler) {
+    tickHandler = handler;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        TCCR1A = 0;
+        TCCR1B = _BV(WGM12) | _BV(CS11);    // CTC on OCR1A, clk/8
+        OCR1A = STEP_TIMER_COUNTS_PER_TICK - 1;
+        TCNT1 = 0;
+        TIFR1 = _BV(OCF1A);
+        TIMSK1 |= _BV(OCIE1A);
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Take ticks from external sync edges (externalTick()) rather
+            than Timer1, or go back to Timer1.
+    @param  external
+            true to follow external edges
+    @return void
+*/
+/**************************************************************************/
+void StepTimer::setExternalClock(bool external) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        externalClock = external;
+        OCR1A = (external ? STEP_EDGE_TIMEOUT_COUNTS : STEP_TIMER_COUNTS_PER_TICK) - 1;
+        TCNT1 = 0;
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Number of ticks run from Timer1 while following an external
+            clock, because the sync edge was overdue.
+    @return missed edges
+*/
+/**************************************************************************/
+uint16_t StepTimer::missedEdges() {
+    uint16_t missed;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        missed = missedEdgeCount;
+    }
+    return missed;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Stop the tick interrupt. Safe to call from an ISR.
+    @return void
+*/
+/**************************************************************************/
+void StepTimer::stop() {
+    TIMSK1 &= ~_BV(OCIE1A);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Longest time spent in the tick handler.
+    @return handler time in us
+*/
+/**************************************************************************/
+uint16_t StepTimer::worstHandlerUs() {
+    uint16_t counts;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        counts = worstHandlerCounts;
+    }
+    return counts / STEP_TIMER_COUNTS_PER_US;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Mean time spent in the tick handler.
+    @return handler time in ns
+*/
+/**************************************************************************/
+uint16_t StepTimer::meanHandlerNs() {
+    uint32_t ticks, total;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        ticks = tickCount;
+        total = totalHandlerCounts;
+    }
+    if (ticks == 0) {
+        return 0;
+    }
+    return (float)total * (1000.0 / STEP_TIMER_COUNTS_PER_US) / ticks;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Print the tick count and the worst tick latency / handler time.
+    @return void
+*/
+/**************************************************************************/
+void StepTimer::report() {
+    uint32_t ticks;
+    uint16_t late, latency, end;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        ticks = tickCount;
+        late = lateTicks;
+        latency = worstLatencyCounts;
+        end = worstEndCounts;
+    }
+
+    Serial.print(F("[STEP TIMER] ticks: "));
+    Serial.print(ticks);
+    Serial.print(F(", late: "));
+    Serial.print(late);
+    Serial.print(F(", worst latency: "));
+    Serial.print(latency / STEP_TIMER_COUNTS_PER_US);
+    Serial.print(F(" us, worst tick end: "));
+    Serial.print(end / STEP_TIMER_COUNTS_PER_US);
+    Serial.print(F(" us, handler mean: "));
+    Serial.print(meanHandlerNs());
+    Serial.print(F(" ns, worst: "));
+    Serial.print(worstHandlerUs());
+    Serial.println(F(" us"));
+}
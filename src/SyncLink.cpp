@@ -0,0 +1,534 @@
+#include "SyncLink.h"
+
+// shared with the tick handler and the sync edge ISR
+static volatile uint8_t syncTick = 0;               // number of the current tick (0-255), the same on every node
+static volatile uint16_t pulseStartCounts = 0;      // TCNT1 when this tick's sync edge was raised / received
+static volatile uint16_t worstPulseCounts = 0;      // sync edge to tick handler end, in Timer1 counts
+static volatile uint32_t totalPulseCounts = 0;
+static volatile uint32_t pulseCount = 0;
+static volatile uint16_t resyncCount = 0;           // times a follower's tick numbering was corrected by the marker
+static volatile bool numberingAligned = false;      // follower's ticks numbered from a marker, and no <SYNC_AT> disagrees
+
+
+/**************************************************************************/
+/*!
+    @brief  Sync line rising edge (followers only). An edge within half a
+            tick of the last edge is the master's sync tick 0 marker;
+            otherwise it is a step tick. An edge soon after a tick Timer1
+            ran on its own (a missed edge) is a step tick arriving late,
+            not a marker. The marker only renumbers the ticks while the
+            numbering is not aligned (see SyncLink::_receiveFrame).
+*/
+/**************************************************************************/
+ISR(INT4_vect) {
+    // TCNT1 restarts at every tick (see StepTimer::externalTick)
+    if ((TCNT1 < STEP_TIMER_COUNTS_PER_TICK / 2) && StepTimer::edgeStarted()) {
+        if (!numberingAligned) {
+            if (syncTick != 0) {
+                syncTick = 0;
+                resyncCount++;
+            }
+            numberingAligned = true;
+        }
+        return;
+    }
+
+    StepTimer::externalTick();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Constructor
+    @param  stepTimer
+            Step timer, switched to the sync line's clock on followers.
+*/
+/**************************************************************************/
+SyncLink::SyncLink(StepTimer &stepTimer) : _stepTimer(stepTimer) {
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Take up a role on the sync line. Call from setup() after the
+            step timer has started, or at any time to change role.
+    @param  role
+            SyncRole to take up
+    @return void
+*/
+/**************************************************************************/
+void SyncLink::begin(SyncRole role) {
+    if (role > SYNC_FOLLOWER) {
+        role = SYNC_STANDALONE;
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        _role = role;
+        _count = 0;
+        _received = 0;
+        numberingAligned = false;
+
+        EIMSK &= ~_BV(INT4);
+        PORTE &= ~_BV(SYNC_PORTE_BIT);
+        if (role == SYNC_MASTER) {
+            DDRE |= _BV(SYNC_PORTE_BIT);
+        } else {
+            DDRE &= ~_BV(SYNC_PORTE_BIT);
+        }
+        if (role == SYNC_FOLLOWER) {
+            EICRB |= _BV(ISC41) | _BV(ISC40);  // INT4 on rising edges
+            EIFR = _BV(INTF4);
+            EIMSK |= _BV(INT4);
+        }
+    }
+
+    _stepTimer.setExternalClock(role == SYNC_FOLLOWER);
+    if (role == SYNC_STANDALONE) {
+        Serial1.end();
+    } else {
+        Serial1.begin(SYNC_BAUD);
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Get the role on the sync line.
+    @return current SyncRole
+*/
+/**************************************************************************/
+SyncRole SyncLink::getRole() {
+    return _role;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Start of a step tick. Numbers the tick and, on the master,
+            raises the sync line (twice on sync tick 0). Call first thing in
+            the tick handler.
+    @return void
+*/
+/**************************************************************************/
+void SyncLink::tickStart() {
+    uint8_t tick = syncTick + 1;
+    syncTick = tick;
+
+    if (_role != SYNC_MASTER) {
+        pulseStartCounts = 0;
+        return;
+    }
+
+    PORTE |= _BV(SYNC_PORTE_BIT);
+    pulseStartCounts = TCNT1;
+    if (tick == 0) {
+        // marker: a second rising edge, taken by followers while they handle the first
+        delayMicroseconds(1);
+        PORTE &= ~_BV(SYNC_PORTE_BIT);
+        delayMicroseconds(1);
+        PORTE |= _BV(SYNC_PORTE_BIT);
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  End of a step tick, once the outputs have been written. Drops
+            the sync line on the master and times the tick from the sync
+            edge. Call last thing in the tick handler.
+    @return void
+*/
+/**************************************************************************/
+void SyncLink::tickEnd() {
+    if (_role == SYNC_STANDALONE) {
+        return;
+    }
+
+    uint16_t counts = TCNT1 - pulseStartCounts;
+    if (_role == SYNC_MASTER) {
+        PORTE &= ~_BV(SYNC_PORTE_BIT);
+    }
+
+    pulseCount++;
+    totalPulseCounts += counts;
+    if (counts > worstPulseCounts) worstPulseCounts = counts;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Get the number of the current sync tick.
+    @return sync tick (0-255)
+*/
+/**************************************************************************/
+uint8_t SyncLink::tick() {
+    return syncTick;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Send an action code to the followers, to be run by every node
+            SYNC_LEAD_TICKS from now. Master only.
+    @param  code
+            action code
+    @param  args
+            its argument frames
+    @param  numArgs
+            number of argument frames (up to SYNC_MAX_ARGS)
+    @return false if this node is not the master, the code has too many
+            args or the queue is full
+*/
+/**************************************************************************/
+bool SyncLink::send(uint8_t code, const uint8_t *args, uint8_t numArgs) {
+    if ((_role != SYNC_MASTER) || (numArgs > SYNC_MAX_ARGS) || (_count == MAX_SYNC_COMMANDS)) {
+        return false;
+    }
+
+    SyncCommand &command = _commands[_count++];
+    command.tick = syncTick + SYNC_LEAD_TICKS;
+    command.code = code;
+    command.numArgs = numArgs;
+    memcpy(command.args, args, numArgs);
+
+    _sendFrame(SYNC_AT);
+    _sendFrame(command.tick);
+    _sendFrame(code);
+    _sendFrame(numArgs);
+    for (uint8_t i = 0; i < numArgs; i++) {
+        _sendFrame(args[i]);
+    }
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Write one <value> frame to Serial1.
+    @param  value
+            frame value
+    @return void
+*/
+/**************************************************************************/
+void SyncLink::_sendFrame(uint8_t value) {
+    Serial1.write('<');
+    Serial1.print(value);
+    Serial1.write('>');
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Pass an emergency stop on to the followers. Master only; safe
+            to call from the e-stop interrupt.
+    @return void
+*/
+/**************************************************************************/
+void SyncLink::forwardStop() {
+    if (_role == SYNC_MASTER) {
+        Serial1.write(ESTOP_BYTE);
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Read the synced action codes sent by the master. Followers
+            only; call from the serial task. An emergency stop passed on by
+            the master never reaches here: it is taken in the USART1 RX
+            interrupt (see EmergencyStop).
+    @return void
+*/
+/**************************************************************************/
+void SyncLink::poll() {
+    if (_role != SYNC_FOLLOWER) {
+        return;
+    }
+
+    while (Serial1.available() > 0) {
+        char c = Serial1.read();
+
+        if (c == '<') {
+            _inFrame = true;
+            _inputPos = 0;
+        } else if (!_inFrame) {
+            // noise between frames
+        } else if (c == '>') {
+            _input[_inputPos] = '\0';
+            _inFrame = false;
+            _receiveFrame(atoi(_input));
+        } else if (_inputPos < sizeof(_input) - 1) {
+            _input[_inputPos++] = c;
+        } else {
+            _inFrame = false;   // too long: drop it
+            _received = 0;
+        }
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Take one frame of a <SYNC_AT> message and queue the action code
+            once every frame has arrived.
+    @param  value
+            frame value
+    @return void
+*/
+/**************************************************************************/
+void SyncLink::_receiveFrame(uint8_t value) {
+    switch (_received)
+    {
+    case 0:
+        if (value != SYNC_AT) return;
+        break;
+    case 1:
+        _receiving.tick = value;
+        _checkNumbering(value);
+        break;
+    case 2:
+        _receiving.code = value;
+        break;
+    case 3:
+        if (value > SYNC_MAX_ARGS) {
+            _received = 0;
+            return;
+        }
+        _receiving.numArgs = value;
+        break;
+    default:
+        _receiving.args[_received - 4] = value;
+        break;
+    }
+    _received++;
+
+    if ((_received < 4) || (_received - 4 < _receiving.numArgs)) {
+        return;
+    }
+    _received = 0;
+
+    if (_count == MAX_SYNC_COMMANDS) {
+        Serial.println(F("[ERROR] sync queue full"));
+        return;
+    }
+    _commands[_count++] = _receiving;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Check the tick of a <SYNC_AT> against this follower's tick
+            numbering. The master stamps it SYNC_LEAD_TICKS ahead of its
+            own tick, so on arrival it should be up to
+            SYNC_MAX_TRANSIT_TICKS less than that ahead of ours. If not,
+            the numbering is wrong and the next marker renumbers it.
+    @param  tick
+            sync tick the action code is to run on
+    @return void
+*/
+/**************************************************************************/
+void SyncLink::_checkNumbering(uint8_t tick) {
+    uint8_t lead = tick - syncTick;
+
+    if ((lead > SYNC_LEAD_TICKS) || (lead < SYNC_LEAD_TICKS - SYNC_MAX_TRANSIT_TICKS)) {
+        numberingAligned = false;
+        Serial.print(F("[ERROR] sync tick numbering off, <SYNC_AT> lead: "));
+        Serial.println(lead);
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Look at the next synced action code, to decide whether to
+            prepare it ahead of its tick (armNext()) or run it once it is
+            due (popDue()).
+    @param  command
+            set to the next action code
+    @return false if there is none, or the last one prepared has not been
+            committed yet
+*/
+/**************************************************************************/
+bool SyncLink::peekNext(SyncCommand &command) {
+    if ((_count == 0) || _armed) {
+        return false;
+    }
+    command = _commands[0];
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Remove the first action code from the queue. Loop only.
+    @return void
+*/
+/**************************************************************************/
+void SyncLink::_pop() {
+    _count--;
+    for (uint8_t i = 0; i < _count; i++) {
+        _commands[i] = _commands[i + 1];
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Take the next synced action code once its tick is reached. Its
+            changes are committed on the following tick on every node.
+    @param  command
+            set to the action code to run
+    @return true if an action code is due
+*/
+/**************************************************************************/
+bool SyncLink::popDue(SyncCommand &command) {
+    if (!peekNext(command)) {
+        return false;
+    }
+
+    int8_t ticksPast = syncTick - command.tick;
+    if (ticksPast < 0) {
+        return false;
+    }
+    if (ticksPast > 0) {
+        _lateCommands++;    // committed a tick or more after the other nodes
+    }
+
+    _pop();
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Take the next synced action code (from peekNext()) once it has
+            been run with the state machine's commits held, and have the
+            tick handler commit it on its tick (see commitDue()). Nothing
+            else is taken from the queue until then.
+    @return void
+*/
+/**************************************************************************/
+void SyncLink::armNext() {
+    _armedTick = _commands[0].tick;
+    _armed = true;
+    _pop();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Whether the prepared action code is to be committed on this
+            tick (or is overdue). Call from the tick handler after
+            tickStart(), and release the held commits if so. Not cleared
+            by begin(), so held commits are always released.
+    @return true if there is a prepared action code to commit
+*/
+/**************************************************************************/
+bool SyncLink::commitDue() {
+    return _armed && ((int8_t)(syncTick - _armedTick) >= 0);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  The tick handler has released the prepared action code's
+            commits. Counts it as late if its tick has passed.
+    @return void
+*/
+/**************************************************************************/
+void SyncLink::commitDone() {
+    if (syncTick != _armedTick) {
+        _lateCommands++;
+    }
+    _armed = false;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Longest time from a sync edge to the end of the tick handler.
+    @return time in us
+*/
+/**************************************************************************/
+uint16_t SyncLink::worstPulseToOutputsUs() {
+    uint16_t counts;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        counts = worstPulseCounts;
+    }
+    return counts / STEP_TIMER_COUNTS_PER_US;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Mean time from a sync edge to the end of the tick handler.
+    @return time in us
+*/
+/**************************************************************************/
+uint16_t SyncLink::meanPulseToOutputsUs() {
+    uint32_t pulses, total;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        pulses = pulseCount;
+        total = totalPulseCounts;
+    }
+    if (pulses == 0) {
+        return 0;
+    }
+    return total / pulses / STEP_TIMER_COUNTS_PER_US;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Number of times a follower's tick numbering was corrected by
+            the master's marker (the first alignment included).
+    @return resync count
+*/
+/**************************************************************************/
+uint16_t SyncLink::resyncs() {
+    uint16_t count;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        count = resyncCount;
+    }
+    return count;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Number of synced action codes committed after their tick had
+            passed, i.e. later than on the other nodes.
+    @return late count
+*/
+/**************************************************************************/
+uint16_t SyncLink::lateCommands() {
+    uint16_t count;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        count = _lateCommands;
+    }
+    return count;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Print the role and the sync stats to serial.
+    @return void
+*/
+/**************************************************************************/
+void SyncLink::report() {
+    Serial.print(F("[SYNC] role: "));
+    Serial.print(_role);
+    Serial.print(F(", tick: "));
+    Serial.print(tick());
+    Serial.print(F(", edge to outputs mean: "));
+    Serial.print(meanPulseToOutputsUs());
+    Serial.print(F(" us, worst: "));
+    Serial.print(worstPulseToOutputsUs());
+    Serial.print(F(" us, resyncs: "));
+    Serial.print(resyncs());
+    Serial.print(F(", missed edges: "));
+    Serial.print(_stepTimer.missedEdges());
+    Serial.print(F(", late codes: "));
+    Serial.println(lateCommands());
+}
@@ -0,0 +1,223 @@
+#include "TaskScheduler.h"
+#include <avr/sleep.h>
+
+// don't bother sleeping if the next task is due sooner than this (in us)
+#define MIN_SLEEP_US 50
+
+static_assert(MAX_TASKS <= 8, "run() keeps one bit per task in a uint8_t");
+
+
+/**************************************************************************/
+/*!
+    @brief  Add to a time accumulator, sticking at its maximum (about 71
+            minutes) rather than wrapping.
+    @param  total
+            accumulator, in us
+    @param  us
+            time to add
+    @return void
+*/
+/**************************************************************************/
+static void addSaturating(unsigned long &total, unsigned long us) {
+    total = (us > 0xFFFFFFFFUL - total) ? 0xFFFFFFFFUL : total + us;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Register a periodic task.
+    @param  callback
+            function to call each time the task runs
+    @param  name
+            short name used in reports (must be a string literal)
+    @param  periodUs
+            time between runs, in microseconds. 0 runs the task every pass.
+    @param  priority
+            0 is the highest priority. Sets the order tasks due at the
+            same time run in.
+    @return id of the task, or NO_TASK if the task table is full
+*/
+/**************************************************************************/
+uint8_t TaskScheduler::addTask(TaskCallback callback, const char *name, unsigned long periodUs, uint8_t priority) {
+    if (_numTasks >= MAX_TASKS) {
+        return NO_TASK;
+    }
+
+    Task &task = _tasks[_numTasks];
+    task.callback = callback;
+    task.name = name;
+    task.periodUs = periodUs;
+    task.nextRunUs = micros();
+    task.priority = priority;
+    task.busyUs = 0;
+    task.runCount = 0;
+    task.worstUs = 0;
+
+    if (_numTasks == 0) {
+        _windowStartMs = millis();
+    }
+
+    return _numTasks++;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Change the period of a registered task. A shorter period
+            brings the next run forward, so it takes effect straight away.
+    @param  taskId
+            id returned by addTask()
+    @param  periodUs
+            new time between runs, in microseconds
+    @return void
+*/
+/**************************************************************************/
+void TaskScheduler::setPeriod(uint8_t taskId, unsigned long periodUs) {
+    if (taskId < _numTasks) {
+        Task &task = _tasks[taskId];
+        unsigned long soonestUs = micros() + periodUs;
+
+        task.periodUs = periodUs;
+        if ((long)(task.nextRunUs - soonestUs) > 0) {
+            task.nextRunUs = soonestUs;
+        }
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Run every task that is due, highest priority first, or sleep
+            until the next one is due. Call from loop().
+            Each task runs at most once per call, so a task that is always
+            due (e.g. one that has fallen behind) can't starve the lower
+            priority ones.
+    @return void
+*/
+/**************************************************************************/
+void TaskScheduler::run() {
+    unsigned long passStart = micros();
+    uint8_t ran = 0;    // bit per task, set once it has run this pass
+    unsigned long nextWakeUs = passStart + 1000000UL;
+
+    for (;;) {
+        Task *next = NULL;
+        uint8_t nextId = 0;
+
+        for (uint8_t i = 0; i < _numTasks; i++) {
+            Task &task = _tasks[i];
+
+            if (ran & _BV(i)) {
+                continue;
+            }
+            if ((long)(passStart - task.nextRunUs) >= 0) {
+                if ((next == NULL) || (task.priority < next->priority)) {
+                    next = &task;
+                    nextId = i;
+                }
+            } else if ((long)(task.nextRunUs - nextWakeUs) < 0) {
+                nextWakeUs = task.nextRunUs;
+            }
+        }
+
+        if (next == NULL) {
+            break;
+        }
+        ran |= _BV(nextId);
+        _runTask(*next);
+    }
+
+    if (ran == 0) {
+        _idle(nextWakeUs);
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Run a task that is due, schedule its next run and time it.
+    @param  task
+            task to run
+    @return void
+*/
+/**************************************************************************/
+void TaskScheduler::_runTask(Task &task) {
+    unsigned long now = micros();
+
+    // schedule relative to the previous run to keep the cadence, unless we have fallen behind
+    task.nextRunUs += task.periodUs;
+    if ((long)(now - task.nextRunUs) >= 0) {
+        task.nextRunUs = now + task.periodUs;
+    }
+
+    task.callback();
+
+    unsigned long elapsed = micros() - now;
+    addSaturating(task.busyUs, elapsed);
+    task.runCount++;
+    if (elapsed > task.worstUs) task.worstUs = elapsed;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Sleep in idle mode until an interrupt wakes the CPU. Timer0
+            interrupts every ~1 ms and serial RX interrupts both wake it,
+            so no task is delayed by more than one timer0 tick.
+    @param  untilUs
+            micros() timestamp when the next task is due
+    @return void
+*/
+/**************************************************************************/
+void TaskScheduler::_idle(unsigned long untilUs) {
+    unsigned long start = micros();
+
+    if ((long)(untilUs - start) < MIN_SLEEP_US) {
+        return;
+    }
+
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_mode();
+
+    addSaturating(_idleUs, micros() - start);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Print the CPU utilisation of each task since the last report,
+            then start a new measurement window.
+    @return void
+*/
+/**************************************************************************/
+void TaskScheduler::report() {
+    // busy us / window ms is permille of the window
+    unsigned long windowMs = millis() - _windowStartMs;
+    if (windowMs == 0) windowMs = 1;
+
+    Serial.print(F("[TASKS] window: "));
+    Serial.print(windowMs);
+    Serial.print(F(" ms, idle: "));
+    Serial.print((uint16_t)(_idleUs / windowMs));
+    Serial.println(F(" permille"));
+
+    for (uint8_t i = 0; i < _numTasks; i++) {
+        Task &task = _tasks[i];
+
+        Serial.print(F("  "));
+        Serial.print(task.name);
+        Serial.print(F(": "));
+        Serial.print((uint16_t)(task.busyUs / windowMs));
+        Serial.print(F(" permille, runs: "));
+        Serial.print(task.runCount);
+        Serial.print(F(", worst: "));
+        Serial.print(task.worstUs);
+        Serial.println(F(" us"));
+
+        task.busyUs = 0;
+        task.runCount = 0;
+    }
+
+    _idleUs = 0;
+    _windowStartMs = millis();
+}
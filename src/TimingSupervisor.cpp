@@ -0,0 +1,115 @@
+#include "TimingSupervisor.h"
+
+#define NOINIT_MAGIC 0x5AFE     // marks the .noinit counters below as valid
+
+// .noinit variables survive a watchdog reset (but not a power cycle)
+static uint8_t resetFlags __attribute__((section(".noinit")));
+static uint16_t noinitMagic __attribute__((section(".noinit")));
+static uint16_t wdtResetCount __attribute__((section(".noinit")));
+
+// Runs from .init3, before the Arduino core is initialised. The watchdog stays
+// enabled after a watchdog reset, so it must be stopped before setup() is reached.
+void captureResetFlags() __attribute__((naked, used, section(".init3")));
+
+
+/**************************************************************************/
+/*!
+    @brief  Save and clear the MCU reset flags and disable the watchdog.
+    @return void
+*/
+/**************************************************************************/
+void captureResetFlags() {
+    resetFlags = MCUSR;
+    MCUSR = 0;
+    wdt_disable();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Watchdog interrupt. loop() has stalled: stop the step timer and
+            drive every relay to the safe (off) state. WDE remains set, so
+            the next timeout resets the MCU.
+*/
+/**************************************************************************/
+ISR(WDT_vect) {
+    TIMSK1 &= ~_BV(OCIE1A);     // stop the step timer re-applying outputs
+    EIMSK &= ~_BV(INT4);        // and the sync line, on a follower
+
+#ifdef SHIFT_REGISTER_OUTPUTS
+    PORTL |= _BV(SR_PORTL_OE_BIT);  // every shift register output off
+#else
+    for (uint8_t ch = 0; ch < NUM_CHANNELS; ch++) {
+        for (uint8_t i = 0; i < NUM_OF_PINS; i++) {
+            digitalWrite(channelPinMappings[ch][i], LOW);
+        }
+    }
+#endif
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Update the watchdog reset counter and start the watchdog in
+            interrupt-then-reset mode. Call once from setup().
+    @return void
+*/
+/**************************************************************************/
+void TimingSupervisor::begin() {
+    if ((resetFlags & _BV(PORF)) || (noinitMagic != NOINIT_MAGIC)) {
+        noinitMagic = NOINIT_MAGIC;
+        wdtResetCount = 0;
+    }
+    if (resetByWatchdog()) {
+        wdtResetCount++;
+    }
+
+    wdt_enable(WATCHDOG_TIMEOUT);
+    WDTCSR |= _BV(WDIE);    // first timeout fires WDT_vect, second one resets
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Reset the watchdog timer. Must be called every pass of loop().
+    @return void
+*/
+/**************************************************************************/
+void TimingSupervisor::kick() {
+    wdt_reset();
+    WDTCSR |= _BV(WDIE);    // re-arm interrupt mode (hardware clears WDIE after a WDT interrupt)
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Whether the last reset was caused by the watchdog.
+    @return true if the watchdog reset the MCU
+*/
+/**************************************************************************/
+bool TimingSupervisor::resetByWatchdog() {
+    return (resetFlags & _BV(WDRF)) != 0;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Number of watchdog resets since the last power-on.
+    @return watchdog reset count
+*/
+/**************************************************************************/
+uint16_t TimingSupervisor::watchdogResetCount() {
+    return wdtResetCount;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Print watchdog counters to serial.
+    @return void
+*/
+/**************************************************************************/
+void TimingSupervisor::report() {
+    Serial.print(F("[TIMING] watchdog resets: "));
+    Serial.println(wdtResetCount);
+}
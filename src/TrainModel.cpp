@@ -0,0 +1,283 @@
+#include "TrainModel.h"
+
+#define TRAIN_FRAC_MASK ((1UL << TRAIN_FRAC_BITS) - 1)
+#define TRAIN_MAX_ACCEL ((int64_t)32767 * STEP_TICK_US * STEP_TICK_US * (1LL << TRAIN_FRAC_BITS) / 1000000000000LL)
+
+// step() adds up to 1.5 ticks of the largest acceleration to a speed held at TRAIN_MAX_SPEED
+static_assert((int64_t)TRAIN_MAX_SPEED + 2 * TRAIN_MAX_ACCEL <= INT32_MAX, "TRAIN_MAX_SPEED too fast for 32 bit speeds");
+
+
+/**************************************************************************/
+/*!
+    @brief  Constructor
+    @param  ezTable
+            EZ calibration table, used to turn the model's EZ into a state
+*/
+/**************************************************************************/
+TrainModel::TrainModel(StateValueTable &ezTable) : _ezTable(ezTable) {
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Convert a train's start conditions to the model's fixed point
+            state. Uses 64 bit maths, so call from loop() only.
+    @param  train
+            state to set
+    @param  speedCmS
+            speed at the start, in cm/s (up to TRAIN_MAX_SPEED_CMS)
+    @param  accelMmS2
+            acceleration, in mm/s^2 (negative to brake)
+    @param  distanceDm
+            distance from the crossing at the start, in dm
+    @param  approachDm
+            length of the approach, in dm
+    @return false if the approach length is 0, the speed is too high or
+            the train would never move
+*/
+/**************************************************************************/
+bool TrainModel::initState(TrainState &train, uint16_t speedCmS, int16_t accelMmS2, uint16_t distanceDm,
+                           uint16_t approachDm) {
+    if ((approachDm == 0) || (speedCmS > TRAIN_MAX_SPEED_CMS) || ((speedCmS == 0) && (accelMmS2 <= 0))) {
+        return false;
+    }
+    const int64_t tickUs = STEP_TICK_US;
+
+    // cm/s -> mm per tick: x 10 x tick / 1e6
+    train.speed = (int64_t)speedCmS * 10 * tickUs * (1LL << TRAIN_FRAC_BITS) / 1000000LL;
+    // mm/s^2 -> mm per tick^2: x tick^2 / 1e12
+    train.accel = (int64_t)accelMmS2 * tickUs * tickUs * (1LL << TRAIN_FRAC_BITS) / 1000000000000LL;
+    train.travelledMm = 0;
+    train.travelledFrac = 0;
+    train.startMm = (int32_t)distanceDm * 100;
+    train.approachMm = (int32_t)approachDm * 100;
+    train.ezPerMm = ((uint32_t)TRAIN_EZ_FULL << TRAIN_EZ_SCALE_BITS) / (uint32_t)train.approachMm;
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Advance a train by one step timer tick. Exact for constant
+            acceleration: the distance covered in a tick is the speed at
+            its start plus half the acceleration. An accelerating train
+            is held at TRAIN_MAX_SPEED, so the speed never overflows.
+    @param  train
+            state to advance
+    @return EZ after the tick, in EZ units (TRAIN_EZ_FULL at or beyond the
+            end of the approach, 0 at the crossing)
+*/
+/**************************************************************************/
+uint16_t TrainModel::step(TrainState &train) {
+    int32_t delta = train.speed + (train.accel >> 1);
+    if (delta < 0) {
+        delta = 0;  // stopped part way through the tick
+    }
+
+    uint32_t frac = train.travelledFrac + ((uint32_t)delta & TRAIN_FRAC_MASK);
+    train.travelledMm += (delta >> TRAIN_FRAC_BITS) + (int32_t)(frac >> TRAIN_FRAC_BITS);
+    train.travelledFrac = frac & TRAIN_FRAC_MASK;
+
+    train.speed += train.accel;
+    if (train.speed < 0) {
+        train.speed = 0;
+    } else if (train.speed > TRAIN_MAX_SPEED) {
+        train.speed = TRAIN_MAX_SPEED;
+    }
+
+    int32_t remaining = train.startMm - train.travelledMm;
+    if (remaining <= 0) {
+        return 0;
+    }
+    if (remaining >= train.approachMm) {
+        return TRAIN_EZ_FULL;
+    }
+    return ((uint32_t)remaining * train.ezPerMm) >> TRAIN_EZ_SCALE_BITS;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Start a train on the approach, driving one channel. The EZ
+            table must be valid and monotone. The caller puts the channel
+            in MANUAL mode at the returned state, inside the same atomic
+            block, so the first tick finds it there; the model stops if the
+            channel leaves MANUAL.
+    @param  channel
+            channel to drive
+    @param  train
+            train at the start (see initState())
+    @param  numStates
+            number of states of the channel's state table
+    @return state for the train's starting distance
+*/
+/**************************************************************************/
+uint16_t TrainModel::start(uint8_t channel, const TrainState &train, uint16_t numStates) {
+    // state at the start, before the first tick
+    uint16_t ez = TRAIN_EZ_FULL;
+    if (train.startMm < train.approachMm) {
+        ez = ((uint32_t)train.startMm * train.ezPerMm) >> TRAIN_EZ_SCALE_BITS;
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        _train = train;
+        _numStates = numStates;
+        _channel = channel;
+        _ticks = 0;
+        _ez = ez;
+        _state = _ezTable.nearestState(ez, numStates);
+        _end = TRAIN_NOT_ENDED;
+        _running = true;
+    }
+    return _state;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Cancel the run, if any. The channel keeps its last state.
+    @return void
+*/
+/**************************************************************************/
+void TrainModel::stop() {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (_running) {
+            _running = false;
+            _end = TRAIN_CANCELLED;
+        }
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Advance the model by one step timer tick. Called from the timer
+            interrupt, while drives() is true.
+    @return state the channel must be driven to
+*/
+/**************************************************************************/
+uint16_t TrainModel::tick() {
+    if (!_running) {
+        return _state;
+    }
+
+    uint16_t ez = step(_train);
+    _ticks++;
+    _ez = ez;
+    _state = _ezTable.nearestState(ez, _numStates);
+
+    if (_train.travelledMm >= _train.startMm) {
+        _running = false;
+        _end = TRAIN_ARRIVED;
+    } else if ((_train.speed == 0) && (_train.accel <= 0)) {
+        _running = false;
+        _end = TRAIN_STOPPED;
+    }
+    return _state;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Get the state the model drives (or last drove) its channel to.
+    @return state number
+*/
+/**************************************************************************/
+uint16_t TrainModel::state() {
+    uint16_t state;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        state = _state;
+    }
+    return state;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Take the end of the last run, once. Call from loop() to report
+            it.
+    @return why the run ended, or TRAIN_NOT_ENDED if it is still running or
+            has already been taken
+*/
+/**************************************************************************/
+TrainModelEnd TrainModel::takeEnd() {
+    TrainModelEnd end;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        end = _end;
+        _end = TRAIN_NOT_ENDED;
+    }
+    return end;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Time since the start of the (last) run.
+    @return elapsed time, in ms
+*/
+/**************************************************************************/
+uint32_t TrainModel::elapsedMs() {
+    uint32_t ticks;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        ticks = _ticks;
+    }
+    return ticks * STEP_TICK_US / 1000UL;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Time the model's per-tick work (kinematics, EZ and state
+            search) on a scratch train: 100 km/h braking at 0.5 m/s^2 from
+            1 km out on a 1 km approach. Runs with interrupts enabled, so
+            the result includes a share of interrupt load.
+    @param  numStates
+            number of states searched
+    @return mean time per update, in ns
+*/
+/**************************************************************************/
+uint16_t TrainModel::benchNs(uint16_t numStates) {
+    TrainState train;
+    initState(train, 2778, -500, 10000, 10000);
+
+    volatile uint16_t sink = 0;     // keeps the search from being optimised away
+    unsigned long start = micros();
+    for (uint16_t i = 0; i < TRAIN_BENCH_STEPS; i++) {
+        sink = _ezTable.nearestState(step(train), numStates);
+    }
+    unsigned long elapsed = micros() - start;
+    (void)sink;
+
+    return min(elapsed * 1000UL / TRAIN_BENCH_STEPS, 65535UL);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Print the model state to serial.
+    @return void
+*/
+/**************************************************************************/
+void TrainModel::report() {
+    bool running;
+    uint16_t ez;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        running = _running;
+        ez = _ez;
+    }
+
+    Serial.print(F("[TRAIN] running: "));
+    Serial.print(running);
+    Serial.print(F(", ch: "));
+    Serial.print(_channel);
+    Serial.print(F(", EZ: "));
+    Serial.print(ez / EZ_UNITS_PER_EZ);
+    Serial.print(F("."));
+    if (ez % EZ_UNITS_PER_EZ < 10) Serial.print(F("0"));
+    Serial.print(ez % EZ_UNITS_PER_EZ);
+    Serial.print(F(", state: "));
+    Serial.print(state());
+    Serial.print(F(", elapsed: "));
+    Serial.print(elapsedMs());
+    Serial.println(F(" ms"));
+}
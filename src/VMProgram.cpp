@@ -0,0 +1,188 @@
+#include "VMProgram.h"
+#include <EEPROM.h>
+#include <util/crc16.h>
+
+// EEPROM record: magic, program length (2 bytes), CRC-CCITT of the program (2 bytes), then the program.
+// Multi-byte values are stored low byte first. Only the program's length is saved.
+#define VM_RECORD_HEADER_SIZE 5
+
+static_assert(EEPROM_ADDR_SCENARIOS + SCENARIO_SLOTS * SCENARIO_SLOT_SIZE <= EEPROM_ADDR_VM_PROGRAM, "scenarios overlap the VM program");
+static_assert(EEPROM_ADDR_VM_PROGRAM + VM_RECORD_HEADER_SIZE + VM_PROGRAM_SIZE <= 4096, "VM program does not fit in EEPROM");
+
+
+/**************************************************************************/
+/*!
+    @brief  Constructor
+*/
+/**************************************************************************/
+VMProgram::VMProgram() {
+    memset(_code, 0, sizeof(_code));
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  CRC-CCITT of the program.
+    @return crc
+*/
+/**************************************************************************/
+uint16_t VMProgram::_codeCrc() {
+    uint16_t crc = 0xFFFF;
+
+    for (uint16_t pos = 0; pos < _length; pos++) {
+        crc = _crc_ccitt_update(crc, _code[pos]);
+    }
+    return crc;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Byte of the EEPROM record for the program in RAM.
+    @param  pos
+            offset into the record
+    @return byte to save at that offset
+*/
+/**************************************************************************/
+uint8_t VMProgram::_recordByte(uint16_t pos) {
+    switch (pos)
+    {
+    case 0: return EEPROM_MAGIC;
+    case 1: return lowByte(_length);
+    case 2: return highByte(_length);
+    case 3: return lowByte(_crc);
+    case 4: return highByte(_crc);
+    default: return _code[pos - VM_RECORD_HEADER_SIZE];
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Load the program from EEPROM. If no valid program has been
+            saved there, the program is empty.
+    @return void
+*/
+/**************************************************************************/
+void VMProgram::load() {
+    uint16_t length = EEPROM.read(EEPROM_ADDR_VM_PROGRAM + 1) | (EEPROM.read(EEPROM_ADDR_VM_PROGRAM + 2) << 8);
+    uint16_t crc = EEPROM.read(EEPROM_ADDR_VM_PROGRAM + 3) | (EEPROM.read(EEPROM_ADDR_VM_PROGRAM + 4) << 8);
+
+    if ((EEPROM.read(EEPROM_ADDR_VM_PROGRAM) != EEPROM_MAGIC) || (length > VM_PROGRAM_SIZE)) {
+        return;
+    }
+
+    for (uint16_t pos = 0; pos < length; pos++) {
+        _code[pos] = EEPROM.read(EEPROM_ADDR_VM_PROGRAM + VM_RECORD_HEADER_SIZE + pos);
+    }
+    _length = length;
+
+    _crc = _codeCrc();
+    if (_crc != crc) {
+        Serial.println(F("[WARNING] VM program CRC mismatch, program ignored"));
+        memset(_code, 0, sizeof(_code));
+        _length = 0;
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Set a block of the program. An upload at offset 0 starts a new
+            program, clearing the old one. Do not call while the program
+            is running.
+    @param  offset
+            address of the first byte
+    @param  bytes
+            bytecode to set
+    @param  count
+            number of bytes
+    @return false if the block runs past VM_PROGRAM_SIZE or a save is in
+            progress
+*/
+/**************************************************************************/
+bool VMProgram::set(uint16_t offset, const uint8_t *bytes, uint8_t count) {
+    if ((offset + count > VM_PROGRAM_SIZE) || saving()) {
+        return false;
+    }
+
+    if (offset == 0) {
+        memset(_code, 0, sizeof(_code));
+        _length = 0;
+    }
+    memcpy(_code + offset, bytes, count);
+    _length = max(_length, (uint16_t)(offset + count));
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Byte of the record being saved, for the EepromRecordWriter.
+    @param  program
+            the VMProgram being saved
+    @param  pos
+            offset into the record
+    @return byte to save at that offset
+*/
+/**************************************************************************/
+uint8_t VMProgram::_saveByte(void *program, uint16_t pos) {
+    return ((VMProgram *)program)->_recordByte(pos);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Start saving the program to EEPROM, written by saveStep().
+            Only the program's length is saved.
+    @return CRC of the program being saved
+*/
+/**************************************************************************/
+uint16_t VMProgram::save() {
+    _crc = _codeCrc();
+    _writer.start(EEPROM_ADDR_VM_PROGRAM, VM_RECORD_HEADER_SIZE + _length, _saveByte, this);
+    return _crc;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Carry on with a save, one EEPROM byte per call (see
+            EepromRecordWriter::step()). Call regularly from loop().
+    @return true while the save is still in progress
+*/
+/**************************************************************************/
+bool VMProgram::saveStep() {
+    return _writer.step();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Whether a save is in progress.
+    @return true until the last byte of the save has been started
+*/
+/**************************************************************************/
+bool VMProgram::saving() {
+    return _writer.busy();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Print the program state to serial.
+    @return void
+*/
+/**************************************************************************/
+void VMProgram::report() {
+    Serial.print(F("[VM] program: "));
+    Serial.print(_length);
+    Serial.print(F(" bytes, crc: "));
+    Serial.print(_crc, HEX);
+    if (saving()) {
+        Serial.print(F(", saving: "));
+        Serial.print(_writer.percentDone());
+        Serial.print(F("%"));
+    }
+    Serial.println();
+}
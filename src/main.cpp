@@ -2,14 +2,100 @@
 #include "SerialPort.h"
 #include "PinMappings.h"
 #include "OutputStateMachine.h"
+#include "ShiftRegisterOutputs.h"
+#include "MemoryMonitor.h"
+#include "TimingSupervisor.h"
+#include "TaskScheduler.h"
+#include "CommandDispatcher.h"
+#include "ConfigStore.h"
+#include "ScheduledCommands.h"
+#include "StepTimer.h"
+#include "EmergencyStop.h"
+#include "LinkMonitor.h"
+#include "SyncLink.h"
+#include "StateValueTable.h"
+#include "TrainModel.h"
+#include "ScenarioStore.h"
+#include "ScenarioPlayer.h"
+#include "VMProgram.h"
+#include "BytecodeVM.h"
 
 // ==================================================
 //                 Function Prototypes
 // ==================================================
 
-void setupOutputPinModes(const uint8_t *pinMappings);
-void processRelayActionCode(SerialPort &serialPort, const uint8_t *pinMappings);
-void toggleDigitalPin(const uint8_t &pin);
+void restoreConfig(bool resume);
+void restoreChannel(uint8_t ch, const Config &cfg, bool resume);
+void syncConfig();
+void sendCapabilities();
+void runScheduledCommands();
+void stopRelays();
+void handleLinkLoss();
+void handleLinkRestored();
+void reportChannels();
+void uploadStateValues(StateValueTable &table, uint8_t code, const uint8_t *args, bool msToTicks);
+bool startEzSweep(uint8_t ch, uint16_t startEz, uint16_t endEz, uint16_t ezPerSecond,
+                  uint16_t &startState, uint16_t &endState);
+void runSyncedCommands();
+void runSyncedCommand(const SyncCommand &command);
+bool isPreparedCode(uint8_t code);
+bool isSyncedCode(uint8_t code);
+bool interceptCommand(uint8_t code, const uint8_t *args);
+bool scenarioCrc(uint8_t slot, uint16_t &crc);
+
+void cmdRelayToggle(uint8_t code, const uint8_t *args);
+void cmdSetRelayMask(uint8_t code, const uint8_t *args);
+void cmdRelayOverride(uint8_t code, const uint8_t *args);
+void cmdChangeMode(uint8_t code, const uint8_t *args);
+void cmdChangeSwitchTime(uint8_t code, const uint8_t *args);
+void cmdHmiHello(uint8_t code, const uint8_t *args);
+void cmdTimingReport(uint8_t code, const uint8_t *args);
+void cmdTaskReport(uint8_t code, const uint8_t *args);
+void cmdTelemetryToggle(uint8_t code, const uint8_t *args);
+void cmdDispatchBench(uint8_t code, const uint8_t *args);
+void cmdSetSweepBounds(uint8_t code, const uint8_t *args);
+void cmdConfigSave(uint8_t code, const uint8_t *args);
+void cmdConfigReset(uint8_t code, const uint8_t *args);
+void cmdBaudPropose(uint8_t code, const uint8_t *args);
+void cmdBaudConfirm(uint8_t code, const uint8_t *args);
+void cmdSeqReset(uint8_t code, const uint8_t *args);
+void cmdNoOp(uint8_t code, const uint8_t *args);
+void cmdFlowControl(uint8_t code, const uint8_t *args);
+void cmdLinkStats(uint8_t code, const uint8_t *args);
+void cmdClockSync(uint8_t code, const uint8_t *args);
+void cmdScheduleAt(uint8_t code, const uint8_t *args);
+void cmdEStopClear(uint8_t code, const uint8_t *args);
+void cmdHeartbeat(uint8_t code, const uint8_t *args);
+void cmdLinkTimeout(uint8_t code, const uint8_t *args);
+void cmdChannelSelect(uint8_t code, const uint8_t *args);
+void cmdOutputBench(uint8_t code, const uint8_t *args);
+void cmdSyncRole(uint8_t code, const uint8_t *args);
+void cmdSyncReport(uint8_t code, const uint8_t *args);
+void cmdDwellUpload(uint8_t code, const uint8_t *args);
+void cmdDwellEnable(uint8_t code, const uint8_t *args);
+void cmdDwellSave(uint8_t code, const uint8_t *args);
+void cmdDwellClear(uint8_t code, const uint8_t *args);
+void cmdEzUpload(uint8_t code, const uint8_t *args);
+void cmdEzSave(uint8_t code, const uint8_t *args);
+void cmdGotoEz(uint8_t code, const uint8_t *args);
+void cmdEzSweep(uint8_t code, const uint8_t *args);
+void cmdTrainStart(uint8_t code, const uint8_t *args);
+void cmdTrainBench(uint8_t code, const uint8_t *args);
+void cmdScenarioUpload(uint8_t code, const uint8_t *args);
+void cmdScenarioSave(uint8_t code, const uint8_t *args);
+void cmdScenarioStart(uint8_t code, const uint8_t *args);
+void cmdVmUpload(uint8_t code, const uint8_t *args);
+void cmdVmSave(uint8_t code, const uint8_t *args);
+void cmdVmRun(uint8_t code, const uint8_t *args);
+void cmdVmBench(uint8_t code, const uint8_t *args);
+
+void serialTask();
+void stepTask();
+void stepTick();
+void supervisionTask();
+void telemetryTask();
+void vmTask();
+void saveTask();
 
 
 // ==================================================
@@ -19,11 +105,178 @@ void toggleDigitalPin(const uint8_t &pin);
 #define BAUD_RATE 9600
 #define DEFAULT_WAIT_TIME 600       // in milliseconds
 
+// task periods (in microseconds)
+#define SERIAL_TASK_PERIOD      1000UL
+#define STEP_TASK_PERIOD        1000UL
+#define SUPERVISION_TASK_PERIOD 100000UL
+#define TELEMETRY_TASK_PERIOD   1000000UL
+#define VM_TASK_PERIOD          250UL       // while a bytecode program runs
+#define VM_IDLE_TASK_PERIOD     100000UL
+#define SAVE_TASK_PERIOD        4000UL      // while a background save runs: a little over one EEPROM byte write
+#define SAVE_IDLE_TASK_PERIOD   100000UL
+
+static_assert(VM_SLICE_US < VM_TASK_PERIOD, "a VM slice must leave time for the other tasks");
+
+#define VM_EVENT_FRAMES 6           // <VM_EVENT><VMStatus><address (2 bytes)><value (2 bytes)>
+
+#define OUTPUT_BENCH_WRITES 256     // output writes timed by OUTPUT_BENCH
+
+// output stage and state machine of each channel
+#ifdef SHIFT_REGISTER_OUTPUTS
+typedef ShiftRegisterOutputs<SHIFT_REGISTER_OUTPUTS> ChannelOutputs;
+typedef OutputStateMachine<LadderStateTable<SHIFT_REGISTER_OUTPUTS>, ChannelOutputs> ChannelStateMachine;
+#else
+typedef RelayOutputs ChannelOutputs;
+typedef RelayStateMachine ChannelStateMachine;
+#endif
+typedef ChannelOutputs::Mask ChannelMask;
+
+// features advertised in the HMI_HELLO capability block
+#define SUPPORTED_FEATURES (FEATURE_RELAY_MASK | FEATURE_RELAY_OVERRIDE | FEATURE_SWEEP_BOUNDS | \
+                            FEATURE_CONFIG_STORE | FEATURE_BAUD_NEGOTIATE | FEATURE_TELEMETRY | \
+                            FEATURE_DIAGNOSTICS | FEATURE_SEQUENCED | FEATURE_FLOW_CONTROL | \
+                            FEATURE_SCHEDULING | FEATURE_ESTOP | FEATURE_HEARTBEAT | \
+                            FEATURE_CHANNELS | FEATURE_SYNC | FEATURE_DWELL | \
+                            FEATURE_EZ_CALIBRATION)
+
+// ==================================================
+//                  Command Table
+// ==================================================
+
+// relay action codes (toggle the relay at pinMappings[code])
+REGISTER_COMMAND(0, cmdRelayToggle, 0)
+REGISTER_COMMAND(1, cmdRelayToggle, 0)
+REGISTER_COMMAND(2, cmdRelayToggle, 0)
+REGISTER_COMMAND(3, cmdRelayToggle, 0)
+REGISTER_COMMAND(4, cmdRelayToggle, 0)
+REGISTER_COMMAND(5, cmdRelayToggle, 0)
+REGISTER_COMMAND(6, cmdRelayToggle, 0)
+REGISTER_COMMAND(7, cmdRelayToggle, 0)
+REGISTER_COMMAND(8, cmdRelayToggle, 0)
+REGISTER_COMMAND(SET_RELAY_MASK, cmdSetRelayMask, sizeof(ChannelMask))
+REGISTER_COMMAND(RELAY_OVERRIDE, cmdRelayOverride, 2)
+REGISTER_COMMAND(ESTOP_CLEAR, cmdEStopClear, 0)
+
+// cycle modes
+REGISTER_COMMAND(DECREASE_EZ, cmdChangeMode, 0)
+REGISTER_COMMAND(INCREASE_EZ, cmdChangeMode, 0)
+REGISTER_COMMAND(RESET_HIGH_EZ, cmdChangeMode, 0)
+REGISTER_COMMAND(RESET_LOW_EZ, cmdChangeMode, 0)
+REGISTER_COMMAND(MANUAL, cmdChangeMode, 0)
+REGISTER_COMMAND(IDLE, cmdChangeMode, 0)
+
+REGISTER_COMMAND(CHANGE_SWITCH_T, cmdChangeSwitchTime, 1)
+REGISTER_COMMAND(SET_SWEEP_BOUNDS, cmdSetSweepBounds, 4)
+REGISTER_COMMAND(DWELL_ENABLE, cmdDwellEnable, 1)
+REGISTER_COMMAND(GOTO_EZ, cmdGotoEz, 2)
+REGISTER_COMMAND(EZ_SWEEP, cmdEzSweep, 6)
+REGISTER_COMMAND(TRAIN_START, cmdTrainStart, 8)
+REGISTER_COMMAND(TRAIN_BENCH, cmdTrainBench, 0)
+REGISTER_COMMAND(SCENARIO_START, cmdScenarioStart, 2)
+REGISTER_COMMAND(VM_RUN, cmdVmRun, 1)
+REGISTER_COMMAND(CLOCK_SYNC, cmdClockSync, 0)
+REGISTER_COMMAND(SCHEDULE_AT, cmdScheduleAt, 5)
+REGISTER_COMMAND(CHANNEL_SELECT, cmdChannelSelect, 1)
+REGISTER_COMMAND(CONFIG_SAVE, cmdConfigSave, 0)
+REGISTER_COMMAND(CONFIG_RESET, cmdConfigReset, 0)
+REGISTER_COMMAND(DWELL_UPLOAD, cmdDwellUpload, 2 + 2 * STATE_TABLE_UPLOAD_ENTRIES)
+REGISTER_COMMAND(DWELL_SAVE, cmdDwellSave, 0)
+REGISTER_COMMAND(DWELL_CLEAR, cmdDwellClear, 0)
+REGISTER_COMMAND(EZ_UPLOAD, cmdEzUpload, 2 + 2 * STATE_TABLE_UPLOAD_ENTRIES)
+REGISTER_COMMAND(EZ_SAVE, cmdEzSave, 0)
+REGISTER_COMMAND(SCENARIO_UPLOAD, cmdScenarioUpload, 2 + SCENARIO_UPLOAD_SIZE)
+REGISTER_COMMAND(SCENARIO_SAVE, cmdScenarioSave, 1)
+REGISTER_COMMAND(VM_UPLOAD, cmdVmUpload, 2 + VM_UPLOAD_SIZE)
+REGISTER_COMMAND(VM_SAVE, cmdVmSave, 0)
+REGISTER_COMMAND(VM_BENCH, cmdVmBench, 0)
+REGISTER_COMMAND(TIMING_REPORT, cmdTimingReport, 0)
+REGISTER_COMMAND(TASK_REPORT, cmdTaskReport, 0)
+REGISTER_COMMAND(TELEMETRY_TOGGLE, cmdTelemetryToggle, 0)
+REGISTER_COMMAND(DISPATCH_BENCH, cmdDispatchBench, 1)
+REGISTER_COMMAND(OUTPUT_BENCH, cmdOutputBench, 0)
+REGISTER_COMMAND(SYNC_ROLE, cmdSyncRole, 1)
+REGISTER_COMMAND(SYNC_REPORT, cmdSyncReport, 0)
+REGISTER_COMMAND(HMI_HELLO, cmdHmiHello, 0)
+REGISTER_COMMAND(BAUD_PROPOSE, cmdBaudPropose, 1)
+REGISTER_COMMAND(BAUD_CONFIRM, cmdBaudConfirm, BAUD_TEST_PATTERN_LEN)
+REGISTER_COMMAND(SEQ_RESET, cmdSeqReset, 1)
+REGISTER_COMMAND(NO_OP, cmdNoOp, 0)
+REGISTER_COMMAND(FLOW_CONTROL, cmdFlowControl, 1)
+REGISTER_COMMAND(LINK_STATS, cmdLinkStats, 0)
+REGISTER_COMMAND(HEARTBEAT, cmdHeartbeat, 0)
+REGISTER_COMMAND(LINK_TIMEOUT, cmdLinkTimeout, 2)
+
+DEFINE_COMMAND_TABLE(commandTable)
+
+
+// ==================================================
+//                  Global Objects
+// ==================================================
+
 SerialPort serialPort = SerialPort();   // Custom Serial Port object
-OutputStateMachine outputSM = OutputStateMachine();
+// one relay output stage and state machine per channel (see NUM_CHANNELS in PinMappings.h)
+#ifdef SHIFT_REGISTER_OUTPUTS
+ChannelOutputs relayOutputs[NUM_CHANNELS];
+#else
+ChannelOutputs relayOutputs[NUM_CHANNELS] = {
+    RelayOutputs(channelPinMappings[0]),
+#if NUM_CHANNELS > 1
+    RelayOutputs(channelPinMappings[1]),
+#endif
+#if NUM_CHANNELS > 2
+    RelayOutputs(channelPinMappings[2]),
+#endif
+#if NUM_CHANNELS > 3
+    RelayOutputs(channelPinMappings[3]),
+#endif
+};
+#endif
+ChannelStateMachine outputSM[NUM_CHANNELS] = {
+    ChannelStateMachine(relayOutputs[0]),
+#if NUM_CHANNELS > 1
+    ChannelStateMachine(relayOutputs[1]),
+#endif
+#if NUM_CHANNELS > 2
+    ChannelStateMachine(relayOutputs[2]),
+#endif
+#if NUM_CHANNELS > 3
+    ChannelStateMachine(relayOutputs[3]),
+#endif
+};
+TimingSupervisor timingSupervisor = TimingSupervisor();
+StepTimer stepTimer = StepTimer();
+EmergencyStop eStop = EmergencyStop();
+LinkMonitor linkMonitor = LinkMonitor();
+TaskScheduler scheduler = TaskScheduler();
+CommandDispatcher dispatcher = CommandDispatcher(commandTable);
+ConfigStore config = ConfigStore();
+ScheduledCommandQueue scheduledCommands = ScheduledCommandQueue();
+SyncLink syncLink = SyncLink(stepTimer);
+StateValueTable dwellTable = StateValueTable(EEPROM_ADDR_DWELL_TABLE);  // in step timer ticks
+StateValueTable ezTable = StateValueTable(EEPROM_ADDR_EZ_TABLE);        // in EZ_UNITS_PER_EZ
+TrainModel trainModel = TrainModel(ezTable);
+ScenarioStore scenarios = ScenarioStore();
+ScenarioPlayer scenarioPlayer = ScenarioPlayer(ezTable);
+VMProgram vmProgram = VMProgram();
+BytecodeVM vm = BytecodeVM();
+
+// used when no valid config has been saved to EEPROM
+const Config defaultConfig = {
+    DEFAULT_WAIT_TIME,              // switchTime
+    0, ChannelStateMachine::numStates - 1,  // sweepMin, sweepMax
+    0, 0, 0,                        // relay disabled, forced on, forced off
+    MANUAL,                         // cycleMode
+    0,                              // stateNum
+    0, LINK_LOSS_PAUSE,             // linkTimeout (off), linkLossAction
+    SYNC_STANDALONE,                // syncRole
+    0                               // dwellEnabled
+};
 
-int switch_time = DEFAULT_WAIT_TIME;
-bool switch_t_flag = false;
+unsigned long boot_state_valid_us = 0;  // time from startup to the restored relay state being applied
+bool telemetry_enabled = false;
+uint8_t selected_channel = 0;           // channel addressed by relay / state machine action codes (CHANNEL_SELECT)
+uint8_t vm_task_id = NO_TASK;           // sped up while a bytecode program runs
+uint8_t save_task_id = NO_TASK;         // sped up while the config, a table, scenario or program is being saved
 
 
 // ==================================================
@@ -31,49 +284,305 @@ bool switch_t_flag = false;
 // ==================================================
 
 void setup() {
-    // setup pins
-    setupOutputPinModes(pinMappings);
+    // channel 0 relay pins were driven to BOOT_OUTPUT_MASK by earlyInitRelays() during startup;
+    // begin() drives the other channels' pins to it and makes them outputs
+    for (uint8_t ch = 0; ch < NUM_CHANNELS; ch++) {
+        relayOutputs[ch].begin();
+    }
+
+    // restore saved settings and relay state before bringing up serial
+    dwellTable.load();
+    ezTable.load();
+    vmProgram.load();
+    bool restored = config.load(defaultConfig);
+    // after a watchdog reset the supervisor has just dropped the relays: don't start them switching again
+    bool resume = !timingSupervisor.resetByWatchdog();
+    restoreConfig(resume);
+    boot_state_valid_us = micros();
 
-    // begin serial
-    Serial.begin(BAUD_RATE);
+    // begin serial, with the e-stop fast path armed
+    eStop.begin(stopRelays);
+    serialPort.begin(BAUD_RATE);    // the HMI negotiates a faster rate each session (BAUD_PROPOSE)
     Serial.println("=== System Start ===");
+    Serial.print(F("[BOOT] relays at boot state from reset, restored state after "));
+    Serial.print(boot_state_valid_us);
+    Serial.println(F(" us"));
+    if (restored) {
+        config.report();
+    }
+    if (!resume) {
+        Serial.println(F("[WARNING] recovered from watchdog reset: every channel IDLE at the boot state"));
+    }
+
+    timingSupervisor.begin();
+    stepTimer.begin(stepTick);
+    syncLink.begin((SyncRole)config.data.syncRole);
+    eStop.stopOnSyncLink(syncLink.getRole() == SYNC_FOLLOWER);
+    dispatcher.setInterceptor(interceptCommand);
+
+    // register tasks (priority 0 is highest)
+    scheduler.addTask(stepTask, "step", STEP_TASK_PERIOD, 0);
+    scheduler.addTask(serialTask, "serial", SERIAL_TASK_PERIOD, 1);
+    vm_task_id = scheduler.addTask(vmTask, "vm", VM_IDLE_TASK_PERIOD, 2);
+    scheduler.addTask(telemetryTask, "telemetry", TELEMETRY_TASK_PERIOD, 3);
+    save_task_id = scheduler.addTask(saveTask, "save", SAVE_IDLE_TASK_PERIOD, 4);
+    scheduler.addTask(supervisionTask, "supervision", SUPERVISION_TASK_PERIOD, 5);
 }
 
 void loop() {
-    // read data from the serial
+    // fed every pass, so only a task that blocks (not one that is merely busy) trips the watchdog
+    timingSupervisor.kick();
+    scheduler.run();
+}
+
+
+// ==================================================
+//                      Tasks
+// ==================================================
+
+/**************************************************************************/
+/*!
+    @brief  Read data from the serial, report any emergency stop, and run
+            every action code received.
+    @return void
+*/
+/**************************************************************************/
+void serialTask() {
+    if (serialPort.checkBaudTimeout()) {
+        dispatcher.cancel();    // arguments from the failed rate are garbage
+    }
     serialPort.readFromSerial();
 
-    // if an action code was recieved, process it
-    if (serialPort.actionCode != NO_CODE) {
+    // relays were dropped by the RX interrupt. Stop the sweep too, then report.
+    if (eStop.triggered()) {
+        vm.stop();
+        for (uint8_t ch = 0; ch < NUM_CHANNELS; ch++) {
+            outputSM[ch].changeCylceMode(IDLE);
+        }
+        uint16_t latencyUs = eStop.lastLatencyUs();
+        serialPort.sendFrame(ESTOP_TRIPPED);
+        serialPort.sendFrame(highByte(latencyUs));
+        serialPort.sendFrame(lowByte(latencyUs));
+    }
 
-        if (switch_t_flag == true) {
-            switch_time = serialPort.actionCode * SWITCH_T_MULT;
-            if (switch_time < SWITCH_T_MIN) switch_time = SWITCH_T_MIN;
-            switch_t_flag = false;
-            Serial.println("Updating Switching time to: " + String(switch_time) + " ms");
+    // emergency stop passed on by the sync master: relays dropped by the USART1 RX interrupt. Stop the sweep too.
+    syncLink.poll();
+    if (eStop.syncTriggered()) {
+        vm.stop();
+        for (uint8_t ch = 0; ch < NUM_CHANNELS; ch++) {
+            outputSM[ch].changeCylceMode(IDLE);
         }
-        else if (serialPort.actionCode == CHANGE_SWITCH_T) {
-            switch_t_flag = true;
+        Serial.println(F("[E-STOP] from sync master"));
+    }
+
+    // collect every action code (and argument) recieved, then run them in the order received
+    uint8_t frame;
+    while (!dispatcher.full() && serialPort.nextFrame(frame)) {
+        dispatcher.dispatch(frame);
+    }
+    while (dispatcher.runNext()) {
+    }
+}
+
+/**************************************************************************/
+/*!
+    @brief  Run any scheduled action codes that are due, report the end
+            of a train model run and scenario progress, and save the final
+            state of a channel 0 sweep once the step timer reaches it.
+    @return void
+*/
+/**************************************************************************/
+void stepTask() {
+    static bool wasEnd = false;
+
+    runScheduledCommands();
+    runSyncedCommands();
+
+    // report the end of a simulated train run
+    TrainModelEnd trainEnd = trainModel.takeEnd();
+    if (trainEnd != TRAIN_NOT_ENDED) {
+        uint32_t elapsedMs = trainModel.elapsedMs();
+        uint16_t state = trainModel.state();
+        serialPort.sendFrame(TRAIN_DONE);
+        serialPort.sendFrame(trainEnd);
+        for (int8_t shift = 24; shift >= 0; shift -= 8) {
+            serialPort.sendFrame((elapsedMs >> shift) & 0xFF);
         }
-        else if (serialPort.actionCode == HMI_HELLO) {
-            Serial.print('<' + String(HMI_ACK) + '>');
-        } 
-        else if (serialPort.actionCode < NUM_OUTPUTS) {  // relay action code
-            processRelayActionCode(serialPort, pinMappings);
+        serialPort.sendFrame(highByte(state));
+        serialPort.sendFrame(lowByte(state));
+    }
+
+    // report scenario progress, one event per pass
+    ScenarioEvent event;
+    if (scenarioPlayer.takeEvent(event)) {
+        uint32_t elapsedMs = event.ticks * STEP_TICK_US / 1000UL;
+        serialPort.sendFrame(SCENARIO_EVENT);
+        serialPort.sendFrame(event.type);
+        serialPort.sendFrame(event.slot);
+        serialPort.sendFrame(event.train);
+        serialPort.sendFrame(event.phase);
+        serialPort.sendFrame(event.label);
+        for (int8_t shift = 24; shift >= 0; shift -= 8) {
+            serialPort.sendFrame((elapsedMs >> shift) & 0xFF);
         }
-        else {
-            outputSM.changeCylceMode(serialPort.actionCode);
+    }
+
+    // persist the final state of a sweep
+    bool isEnd = outputSM[0].endStateReached();
+    if (!wasEnd && isEnd) config.markDirty();
+    wasEnd = isEnd;
+}
+
+/**************************************************************************/
+/*!
+    @brief  Step timer tick (timer interrupt, every STEP_TICK_US). Commits
+            pending state machine changes and steps every channel, or
+            advances the train model or scenario on the channel it drives.
+    @return void
+*/
+/**************************************************************************/
+void stepTick() {
+    syncLink.tickStart();
+    // a synced change prepared ahead is committed on its tick, by this tick's step
+    if (syncLink.commitDue() && outputSM[0].releaseCommits()) {
+        syncLink.commitDone();
+    }
+    for (uint8_t ch = 0; ch < NUM_CHANNELS; ch++) {
+        if (trainModel.drives(ch)) {
+            if (!outputSM[ch].driveState(trainModel.tick())) {
+                trainModel.stop();  // taken out of MANUAL (mode change, e-stop or link loss)
+            }
+        } else if (scenarioPlayer.drives(ch)) {
+            if (!outputSM[ch].driveState(scenarioPlayer.tick())) {
+                scenarioPlayer.stop();
+            }
+        } else {
+            outputSM[ch].tick();
         }
+    }
+    syncLink.tickEnd();
+}
+
+/**************************************************************************/
+/*!
+    @brief  Check the HMI link and start saving any config changes to
+            EEPROM (written by saveTask()).
+    @return void
+*/
+/**************************************************************************/
+void supervisionTask() {
+    switch (linkMonitor.check(serialPort.getLastFrameTime()))
+    {
+    case LINK_EXPIRED:
+        handleLinkLoss();
+        break;
+
+    case LINK_RESTORED:
+        handleLinkRestored();
+        break;
+
+    default:
+        break;
+    }
+
+    if (config.saveDue()) {
+        syncConfig();
+        config.save();
+        scheduler.setPeriod(save_task_id, SAVE_TASK_PERIOD);
+    }
+}
+
+/**************************************************************************/
+/*!
+    @brief  Write the next byte of any background EEPROM save (config,
+            dwell and EZ tables, scenarios, bytecode program). Each saveStep() writes
+            at most one byte and returns at once while the EEPROM is busy,
+            so the task stays short. Runs every SAVE_TASK_PERIOD while a
+            save is in progress (a 612 byte table takes about 2.5 s) and
+            drops back to a slow period once they are all done.
+    @return void
+*/
+/**************************************************************************/
+void saveTask() {
+    bool saving = config.saveStep();
+    saving |= dwellTable.saveStep();
+    saving |= ezTable.saveStep();
+    saving |= scenarios.saveStep();
+    saving |= vmProgram.saveStep();
+
+    if (!saving) {
+        scheduler.setPeriod(save_task_id, SAVE_IDLE_TASK_PERIOD);
+    }
+}
 
-        // clear the action-code
-        serialPort.actionCode = NO_CODE;
+/**************************************************************************/
+/*!
+    @brief  Periodically print the current state number and cycle mode
+            of each channel, if telemetry has been enabled.
+    @return void
+*/
+/**************************************************************************/
+void telemetryTask() {
+    if (!telemetry_enabled) {
+        return;
+    }
+
+    for (uint8_t ch = 0; ch < NUM_CHANNELS; ch++) {
+        Serial.print(F("[TELEMETRY] ch: "));
+        Serial.print(ch);
+        Serial.print(F(", state: "));
+        Serial.print(outputSM[ch].getStateNum());
+        Serial.print(F(", mode: "));
+        Serial.print(outputSM[ch].getCycleMode());
+        Serial.print(F(", outputs: "));
+        Serial.print(relayOutputs[ch].readApplied(), BIN);
+        Serial.print(F(", "));
+        relayOutputs[ch].reportOverrides();
+        Serial.println();
     }
+}
 
-    // increment state machine
-    outputSM.nextState();
+/**************************************************************************/
+/*!
+    @brief  Run a slice of the bytecode program, if one is running, and
+            send <VM_EVENT><VMStatus><address (2 bytes)><value (2 bytes)>
+            when it emits a value or stops. An event waits for room in the
+            TX buffer, and the program waits with it, so a program that
+            emits in a loop is paced by the link instead of blocking the
+            task in Serial. Drops back to a slow period once the program
+            has stopped and its last event has been sent.
+    @return void
+*/
+/**************************************************************************/
+void vmTask() {
+    static VMStatus eventStatus = VM_IDLE;  // event not sent yet, VM_IDLE for none
+    static uint16_t eventPc = 0;
+    static int16_t eventValue = 0;
+
+    if (eventStatus == VM_IDLE) {
+        VMStatus status = vm.run(VM_SLICE_US);
+        if (status >= VM_EMITTED) {
+            eventStatus = status;
+            eventPc = vm.pc();
+            eventValue = (status == VM_EMITTED) ? vm.emitted() : (status == VM_FAULTED) ? (int16_t)vm.fault() : 0;
+        }
+    }
 
-    // temp
-    delay(switch_time);
+    if (eventStatus != VM_IDLE) {
+        if (!serialPort.canSend(VM_EVENT_FRAMES)) {
+            return;
+        }
+        serialPort.sendFrame(VM_EVENT);
+        serialPort.sendFrame(eventStatus);
+        serialPort.sendFrame(highByte(eventPc));
+        serialPort.sendFrame(lowByte(eventPc));
+        serialPort.sendFrame(highByte(eventValue));
+        serialPort.sendFrame(lowByte(eventValue));
+        eventStatus = VM_IDLE;
+    }
+    if (!vm.running()) {
+        scheduler.setPeriod(vm_task_id, VM_IDLE_TASK_PERIOD);
+    }
 }
 
 
@@ -83,47 +592,1503 @@ void loop() {
 
 /**************************************************************************/
 /*!
-    @brief  Set all required digital pins to OUTPUT mode
-    @param  pinMappings
-            Array containing digital pins to be used as output.
+    @brief  Emergency stop handler, called from the Serial (and, on sync
+            followers, Serial1) RX interrupt.
+            Also stops any sync followers.
+    @return void
+*/
+/**************************************************************************/
+void stopRelays() {
+    for (uint8_t ch = 0; ch < NUM_CHANNELS; ch++) {
+        relayOutputs[ch].emergencyStop();
+    }
+    syncLink.forwardStop();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  The HMI link has timed out: stop any bytecode program, pause
+            every sweep and, if configured, latch the relays off (cleared
+            with ESTOP_CLEAR). On the sync master the pause is passed on
+            to the followers too (the latch already is, see stopRelays()).
+    @return void
+*/
+/**************************************************************************/
+void handleLinkLoss() {
+    vm.stop();
+    for (uint8_t ch = 0; ch < NUM_CHANNELS; ch++) {
+        outputSM[ch].changeCylceMode(IDLE);
+    }
+    if ((syncLink.getRole() == SYNC_MASTER) && !syncLink.send(IDLE, NULL, 0)) {
+        Serial.println(F("[ERROR] sync queue full"));
+    }
+    if (linkMonitor.getAction() == LINK_LOSS_SAFE) {
+        stopRelays();
+    }
+
+    Serial.println(F("[LINK] HMI link timed out"));
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  The HMI link is back after timing out: report the outage with
+            <LINK_LOST><outage hi><outage lo><action>.
     @return void
 */
 /**************************************************************************/
-void setupOutputPinModes(const uint8_t *pinMappings) {
-    for (int i; i < NUM_OF_PINS; i++) {
-        pinMode(pinMappings[i], OUTPUT);
+void handleLinkRestored() {
+    unsigned long outage = min(linkMonitor.lastOutageMs() / LINK_TIMEOUT_UNIT_MS, 0xFFFFUL);
+
+    serialPort.sendFrame(LINK_LOST);
+    serialPort.sendFrame(highByte(outage));
+    serialPort.sendFrame(lowByte(outage));
+    serialPort.sendFrame(linkMonitor.getAction());
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Apply the loaded config to channel 0 and the link monitor.
+            The other channels start from the defaults.
+    @param  resume
+            true to restore each channel's state and cycle mode, false
+            to leave them IDLE with the relays as they are
+    @return void
+*/
+/**************************************************************************/
+void restoreConfig(bool resume) {
+    linkMonitor.setTimeout(config.data.linkTimeout, (LinkLossAction)config.data.linkLossAction);
+
+    restoreChannel(0, config.data, resume);
+    for (uint8_t ch = 1; ch < NUM_CHANNELS; ch++) {
+        restoreChannel(ch, defaultConfig, resume);
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Apply a config to the state machine and relays of one channel.
+    @param  ch
+            channel to restore
+    @param  cfg
+            settings to apply
+    @param  resume
+            true to restore the state and cycle mode too, false to go
+            IDLE with the relays as they are
+    @return void
+*/
+/**************************************************************************/
+void restoreChannel(uint8_t ch, const Config &cfg, bool resume) {
+    relayOutputs[ch].setOverrideMasks(cfg.relayDisabled, cfg.relayForcedOn, cfg.relayForcedOff);
+
+    outputSM[ch].beginTransaction();
+    outputSM[ch].setPeriod(cfg.switchTime);
+    outputSM[ch].setDwellTable(cfg.dwellEnabled ? dwellTable.values() : NULL);
+    outputSM[ch].setSweepBounds(cfg.sweepMin, cfg.sweepMax);
+    if (resume) {
+        outputSM[ch].restoreState(cfg.stateNum, cfg.cycleMode);
+    } else {
+        outputSM[ch].changeCylceMode(IDLE);
+    }
+    outputSM[ch].commitNow();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Copy the live settings (of channel 0) into the config, ready to
+            be saved.
+    @return void
+*/
+/**************************************************************************/
+void syncConfig() {
+    config.data.switchTime = outputSM[0].getPeriod();
+    config.data.sweepMin = outputSM[0].getSweepMin();
+    config.data.sweepMax = outputSM[0].getSweepMax();
+    // cmdRelayOverride() refuses overrides above CONFIG_OVERRIDE_OUTPUTS, so the masks fit
+    ChannelMask disabled, forcedOn, forcedOff;
+    relayOutputs[0].getOverrideMasks(disabled, forcedOn, forcedOff);
+    config.data.relayDisabled = disabled;
+    config.data.relayForcedOn = forcedOn;
+    config.data.relayForcedOff = forcedOff;
+    config.data.cycleMode = outputSM[0].getCycleMode();
+    config.data.stateNum = outputSM[0].getStateNum();
+    config.data.linkTimeout = linkMonitor.getTimeoutUnits();
+    config.data.linkLossAction = linkMonitor.getAction();
+    config.data.syncRole = syncLink.getRole();
+    config.data.dwellEnabled = outputSM[0].usesDwellTable();
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Send the capability block that follows HMI_ACK
+            (layout documented in ComsAPI.h).
+    @return void
+*/
+/**************************************************************************/
+void sendCapabilities() {
+    const uint8_t caps[] = {
+        highByte(SUPPORTED_FEATURES), lowByte(SUPPORTED_FEATURES),
+        highByte(ChannelStateMachine::numStates), lowByte(ChannelStateMachine::numStates),
+        ChannelOutputs::numOutputs,
+        highByte(SWITCH_T_MIN), lowByte(SWITCH_T_MIN),
+        SWITCH_T_MULT,
+        highByte(STEP_TICK_US), lowByte(STEP_TICK_US),
+        SERIAL_RX_BUFFER_SIZE,
+        MAX_COMMAND_ARGS,
+        COMMAND_QUEUE_SIZE,
+        NUM_BAUD_RATES - 1,
+        MAX_SCHEDULED_COMMANDS,
+        NUM_CHANNELS
+    };
+
+    serialPort.sendFrame(PROTOCOL_VERSION);
+    serialPort.sendFrame(sizeof(caps));
+    for (uint8_t i = 0; i < sizeof(caps); i++) {
+        serialPort.sendFrame(caps[i]);
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Run every scheduled action code due within the next step task
+            period. The last stretch is spun out so each runs as close to
+            its requested time as micros() allows. State machine changes
+            are committed immediately rather than at the next tick, which
+            also re-phases the stepping so the first step follows exactly
+            one switching period later.
+            Scheduled codes go through the interceptor like received ones:
+            on the sync master a synced code is sent to the followers at
+            its due time and runs on every node SYNC_LEAD_TICKS later.
+            Each action code run is reported with
+            <SCHEDULE_DONE><code><error hi><error lo>.
+    @return void
+*/
+/**************************************************************************/
+void runScheduledCommands() {
+    ScheduledCommand command;
+
+    while (scheduledCommands.popDue(micros() + SCHEDULE_SPIN_US, command)) {
+        while ((long)(micros() - command.dueUs) < 0) {
+            // spin until the requested time
+        }
+
+        unsigned long errorUs = scheduledCommands.recordExecution(command, micros());
+        uint8_t previousChannel = selected_channel;
+        selected_channel = command.channel;
+        dispatcher.execute(command.code);
+        outputSM[command.channel].commitNow();
+        selected_channel = previousChannel;
+
+        serialPort.sendFrame(SCHEDULE_DONE);
+        serialPort.sendFrame(command.code);
+        errorUs = min(errorUs, 0xFFFFUL);
+        serialPort.sendFrame(highByte(errorUs));
+        serialPort.sendFrame(lowByte(errorUs));
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Run the synced action codes received. They address channel 0
+            on every node. Those that only change its state machine are
+            run straight away with its commits held, and the step timer
+            commits them on their sync tick; the rest are run once their
+            sync tick has been reached and committed by the next tick.
+            Changes to channel 0 made while a prepared code is held are
+            committed with it.
+    @return void
+*/
+/**************************************************************************/
+void runSyncedCommands() {
+    SyncCommand command;
+
+    while (syncLink.peekNext(command)) {
+        if (isPreparedCode(command.code) && !trainModel.drives(0) && !scenarioPlayer.drives(0) && !vm.drives(0)) {
+            outputSM[0].holdCommits();
+            runSyncedCommand(command);
+            syncLink.armNext();
+            return;     // the next waits until this one is committed
+        }
+        if (!syncLink.popDue(command)) {
+            return;
+        }
+        runSyncedCommand(command);
     }
 }
 
 
 /**************************************************************************/
 /*!
-    @brief  Toggle the relay corresponding to the currently
-            received action code.
-    @param  SerialPort
-            Object for reading data from serial Comm port and processing the data.
-    @param  pinMappings
-            Array mapping action codes to digital pins used for relays.
+    @brief  Run a synced action code on channel 0. A SCENARIO_START is
+            only run if this node's scenario matches the CRC the master
+            sent with it, so no node plays a different scenario in lock
+            step.
+    @param  command
+            synced action code
     @return void
 */
 /**************************************************************************/
-void processRelayActionCode(SerialPort &serialPort, const uint8_t *pinMappings) {
-    // toggle the digital pin that corrsponds to the action-code recieved.
-    toggleDigitalPin(pinMappings[serialPort.actionCode]);
+void runSyncedCommand(const SyncCommand &command) {
+    if (command.code == SCENARIO_START) {
+        uint16_t crc;
+        if ((command.numArgs != 4) || !scenarioCrc(command.args[0], crc) ||
+            (crc != ((command.args[2] << 8) | command.args[3]))) {
+            Serial.print(F("[ERROR] scenario differs from the sync master's, not started: "));
+            Serial.println(command.args[0]);
+            return;
+        }
+    }
+
+    uint8_t previousChannel = selected_channel;
+    selected_channel = 0;
+    dispatcher.executeIntercepted(command.code, command.args);
+    selected_channel = previousChannel;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Whether a synced action code only changes the state machine of
+            the channel it addresses, so it can be run ahead of its sync
+            tick with the commit held back until then. Not train, scenario
+            or e-stop codes, which hand the channel over or switch the
+            relays themselves.
+    @param  code
+            synced action code
+    @return true for the mode, period, dwell, EZ and sweep bound codes
+*/
+/**************************************************************************/
+bool isPreparedCode(uint8_t code) {
+    switch (code)
+    {
+    case TRAIN_START:
+    case SCENARIO_START:
+    case ESTOP_CLEAR:
+        return false;
+
+    default:
+        return isSyncedCode(code);
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Whether an action code is run in lock step on every node of
+            the sync line.
+    @param  code
+            action code
+    @return true for the state machine mode, period, dwell, EZ, sweep
+            bound, train and scenario start codes and ESTOP_CLEAR
+*/
+/**************************************************************************/
+bool isSyncedCode(uint8_t code) {
+    switch (code)
+    {
+    case DECREASE_EZ:
+    case INCREASE_EZ:
+    case RESET_HIGH_EZ:
+    case RESET_LOW_EZ:
+    case MANUAL:
+    case IDLE:
+    case CHANGE_SWITCH_T:
+    case SET_SWEEP_BOUNDS:
+    case DWELL_ENABLE:
+    case GOTO_EZ:
+    case EZ_SWEEP:
+    case TRAIN_START:
+    case SCENARIO_START:
+    case ESTOP_CLEAR:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Offered every action code received from the HMI before its
+            handler runs. On the sync master, synced codes are sent to the
+            followers and run on every node at the same sync tick. On a
+            follower they are refused, as the master drives the state
+            machine.
+    @param  code
+            action code received
+    @param  args
+            its argument frames
+    @return true if the code has been taken (its handler must not run now)
+*/
+/**************************************************************************/
+bool interceptCommand(uint8_t code, const uint8_t *args) {
+    SyncRole role = syncLink.getRole();
+    if ((role == SYNC_STANDALONE) || !isSyncedCode(code)) {
+        return false;
+    }
+
+    if (role == SYNC_FOLLOWER) {
+        Serial.print(F("[ERROR] sync follower, action code ignored: "));
+        Serial.println(code);
+        return true;
+    }
+
+    uint8_t numArgs = dispatcher.argCount(code);
+    uint8_t syncArgs[SYNC_MAX_ARGS];
+    memcpy(syncArgs, args, numArgs);
+
+    // scenarios are uploaded to each node separately: send the CRC of the master's, for followers to check
+    if (code == SCENARIO_START) {
+        uint16_t crc;
+        if (!scenarioCrc(args[0], crc)) {
+            Serial.println(F("[ERROR] no valid scenario in slot"));
+            return true;
+        }
+        syncArgs[numArgs++] = highByte(crc);
+        syncArgs[numArgs++] = lowByte(crc);
+    }
+
+    if (!syncLink.send(code, syncArgs, numArgs)) {
+        Serial.println(F("[ERROR] sync queue full"));
+    }
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Get the CRC of the scenario SCENARIO_START would play from a
+            slot (the uploaded copy, if that slot was uploaded since boot).
+    @param  slot
+            scenario slot
+    @param  crc
+            set to the scenario's CRC (see ScenarioStore::recordCrc())
+    @return false if there is no valid scenario in the slot
+*/
+/**************************************************************************/
+bool scenarioCrc(uint8_t slot, uint16_t &crc) {
+    Scenario scenario;
+    if (!scenarios.load(slot, scenario)) {
+        return false;
+    }
+    crc = scenarios.recordCrc(scenario);
+    return true;
 }
 
 
 /**************************************************************************/
 /*!
-    @brief  Toggle the specified digital pin.
-    @param  pin
-            number of the digital pin to activate.  
+    @brief  Set a block of a state value table from an upload action code.
+            Replies with <code><first state (2 bytes)> so the HMI can pace
+            a bulk upload.
+    @param  table
+            table to set
+    @param  code
+            upload action code, echoed in the reply
+    @param  args
+            args[0..1]: first state, high byte first
+            args[2..]: STATE_TABLE_UPLOAD_ENTRIES values, high byte first
+    @param  msToTicks
+            convert the values from ms to step timer ticks (0 stays 0)
     @return void
 */
 /**************************************************************************/
-void toggleDigitalPin(const uint8_t &pin) {
-    int state = digitalRead(pin);
-    digitalWrite(pin, !state);
+void uploadStateValues(StateValueTable &table, uint8_t code, const uint8_t *args, bool msToTicks) {
+    uint16_t firstState = (args[0] << 8) | args[1];
+    uint16_t values[STATE_TABLE_UPLOAD_ENTRIES];
+
+    for (uint8_t i = 0; i < STATE_TABLE_UPLOAD_ENTRIES; i++) {
+        values[i] = (args[2 + 2 * i] << 8) | args[3 + 2 * i];
+        if (msToTicks && (values[i] > 0)) {
+            values[i] = max((uint32_t)values[i] * 1000UL / STEP_TICK_US, 1UL);
+        }
+    }
+
+    // the last block may run past the last state: keep the values that fit
+    uint8_t count = STATE_TABLE_UPLOAD_ENTRIES;
+    if ((firstState < STATE_TABLE_STATES) && (firstState + count > STATE_TABLE_STATES)) {
+        count = STATE_TABLE_STATES - firstState;
+    }
+
+    if (!table.set(firstState, values, count)) {
+        Serial.print(F("[ERROR] upload refused (bad state or save in progress): "));
+        Serial.println(firstState);
+        return;
+    }
+
+    serialPort.sendFrame(code);
+    serialPort.sendFrame(highByte(firstState));
+    serialPort.sendFrame(lowByte(firstState));
 }
 
 
+/**************************************************************************/
+/*!
+    @brief  Start a sweep of one channel defined in EZ: the start and end
+            states are those nearest the given EZ values in the calibration
+            table, and each state is held so the EZ changes at the given
+            rate (see OutputStateMachineBase::setEzRate()). The channel
+            jumps to the start state and sweeps. The dwell table is left
+            alone, so other channels timed from it are not disturbed.
+    @param  ch
+            channel to sweep
+    @param  startEz
+            EZ to start at, in EZ_UNITS_PER_EZ
+    @param  endEz
+            EZ to end at, in EZ_UNITS_PER_EZ
+    @param  ezPerSecond
+            rate of change, in EZ_UNITS_PER_EZ per second
+    @param  startState
+            set to the state the sweep starts at
+    @param  endState
+            set to the state the sweep ends at
+    @return false if there is no usable calibration or the sweep would
+            not move
+*/
+/**************************************************************************/
+bool startEzSweep(uint8_t ch, uint16_t startEz, uint16_t endEz, uint16_t ezPerSecond,
+                  uint16_t &startState, uint16_t &endState) {
+    const uint16_t numStates = ChannelStateMachine::numStates;
+
+    if (!ezTable.valid() || !ezTable.isMonotone(numStates) || (ezPerSecond == 0)) {
+        return false;
+    }
+
+    startState = ezTable.nearestState(startEz, numStates);
+    endState = ezTable.nearestState(endEz, numStates);
+    if (startState == endState) {
+        return false;
+    }
+
+    // state numbers rise as EZ falls (DECREASE_EZ steps up through the table)
+    bool decreasing = startState < endState;
+    uint16_t first = min(startState, endState);
+    uint16_t last = max(startState, endState);
+
+    outputSM[ch].beginTransaction();
+    outputSM[ch].setSweepBounds(first, last);
+    outputSM[ch].setEzRate(ezTable.values(), ezPerSecond);
+    outputSM[ch].restoreState(startState, decreasing ? DECREASE_EZ : INCREASE_EZ);
+    outputSM[ch].commitTransaction();
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Print the number of channels and the step tick cost per
+            channel, with the number of channels that would fit in half a
+            tick at that cost.
+    @return void
+*/
+/**************************************************************************/
+void reportChannels() {
+    uint16_t perChannelNs = stepTimer.meanHandlerNs() / NUM_CHANNELS;
+    uint16_t worstPerChannelUs = stepTimer.worstHandlerUs() / NUM_CHANNELS;
+
+    Serial.print(F("[CHANNELS] channels: "));
+    Serial.print(NUM_CHANNELS);
+    Serial.print(F(", tick cost per channel mean: "));
+    Serial.print(perChannelNs);
+    Serial.print(F(" ns, worst: "));
+    Serial.print(worstPerChannelUs);
+    Serial.print(F(" us, ceiling: "));
+    Serial.println((STEP_TICK_US / 2) / max(worstPerChannelUs, (uint16_t)1));
+}
+
+
+// ==================================================
+//                Command Handlers
+// ==================================================
+
+/**************************************************************************/
+/*!
+    @brief  Toggle the relay corresponding to the received action code.
+    @param  code
+            relay action code (indexes pinMappings)
+    @param  args
+            unused
+    @return void
+*/
+/**************************************************************************/
+void cmdRelayToggle(uint8_t code, const uint8_t *args) {
+    // toggle the output that corrsponds to the action-code recieved.
+    outputSM[selected_channel].toggleMask((ChannelMask)1 << (NUM_OF_PINS - 1 - code));
+}
+
+/**************************************************************************/
+/*!
+    @brief  Set every relay at once from a packed output mask.
+            Only allowed in MANUAL mode, and only for masks that match a
+            valid state.
+    @param  code
+            SET_RELAY_MASK
+    @param  args
+            mask, high byte first: one byte per 8 bits of ChannelMask
+            (output 1 in bit 0, on=1)
+    @return void
+*/
+/**************************************************************************/
+void cmdSetRelayMask(uint8_t code, const uint8_t *args) {
+    ChannelMask mask = 0;
+    for (uint8_t i = 0; i < sizeof(ChannelMask); i++) {
+        mask = (mask << 8) | args[i];
+    }
+
+    if (outputSM[selected_channel].getCycleMode() != MANUAL) {
+        Serial.println(F("[ERROR] relay mask can only be set in MANUAL mode"));
+        return;
+    }
+    if (!ChannelStateMachine::isLegalMask(mask)) {
+        Serial.print(F("[ERROR] illegal relay mask: "));
+        Serial.println(mask, BIN);
+        return;
+    }
+
+    outputSM[selected_channel].setMask(mask);
+}
+
+/**************************************************************************/
+/*!
+    @brief  Disable, force on, force off or release a single relay.
+    @param  code
+            RELAY_OVERRIDE
+    @param  args
+            args[0]: output number (1 to the output count, at most
+            CONFIG_OVERRIDE_OUTPUTS), args[1]: RelayOverride mode
+    @return void
+*/
+/**************************************************************************/
+void cmdRelayOverride(uint8_t code, const uint8_t *args) {
+    // refused rather than applied, as it would silently be lost at the next restart
+    if (args[0] > CONFIG_OVERRIDE_OUTPUTS) {
+        Serial.print(F("[ERROR] relay override can't be saved above output "));
+        Serial.print(CONFIG_OVERRIDE_OUTPUTS);
+        Serial.print(F(": "));
+        Serial.println(args[0]);
+        return;
+    }
+    if (!relayOutputs[selected_channel].setOverride(args[0], (RelayOverride)args[1])) {
+        Serial.print(F("[ERROR] invalid relay override: "));
+        Serial.print(args[0]);
+        Serial.print(F(", "));
+        Serial.println(args[1]);
+        return;
+    }
+    config.markDirty();
+
+    Serial.print(F("[RELAY OVERRIDE] "));
+    relayOutputs[selected_channel].reportOverrides();
+    Serial.println();
+}
+
+/**************************************************************************/
+/*!
+    @brief  Change the cycle mode of the state machine.
+    @param  code
+            new cycle mode (see CycleMode)
+    @param  args
+            unused
+    @return void
+*/
+/**************************************************************************/
+void cmdChangeMode(uint8_t code, const uint8_t *args) {
+    if (trainModel.drives(selected_channel)) {
+        trainModel.stop();
+    }
+    if (scenarioPlayer.drives(selected_channel)) {
+        scenarioPlayer.stop();
+    }
+    if (vm.drives(selected_channel)) {
+        vm.stop();
+    }
+    outputSM[selected_channel].changeCylceMode(code);
+    config.markDirty();
+}
+
+/**************************************************************************/
+/*!
+    @brief  Update the switching time.
+    @param  code
+            CHANGE_SWITCH_T
+    @param  args
+            args[0]: new switching time, in units of SWITCH_T_MULT ms
+    @return void
+*/
+/**************************************************************************/
+void cmdChangeSwitchTime(uint8_t code, const uint8_t *args) {
+    int switch_time = args[0] * SWITCH_T_MULT;
+    if (switch_time < SWITCH_T_MIN) switch_time = SWITCH_T_MIN;
+    outputSM[selected_channel].setPeriod(switch_time);
+    Serial.println("Updating Switching time to: " + String(switch_time) + " ms");
+    config.markDirty();
+}
+
+/**************************************************************************/
+/*!
+    @brief  Acknowledge the startup hello from the HMI, followed by the
+            capability block.
+    @return void
+*/
+/**************************************************************************/
+void cmdHmiHello(uint8_t code, const uint8_t *args) {
+    serialPort.sendFrame(HMI_ACK);
+    sendCapabilities();
+}
+
+/**************************************************************************/
+/*!
+    @brief  Report watchdog, step timer, scheduling and e-stop counters.
+    @return void
+*/
+/**************************************************************************/
+void cmdTimingReport(uint8_t code, const uint8_t *args) {
+    timingSupervisor.report();
+    stepTimer.report();
+    reportChannels();
+    scheduledCommands.report();
+    eStop.report();
+    syncLink.report();
+    dwellTable.report(F("[DWELL]"));
+    ezTable.report(F("[EZ]"));
+    trainModel.report();
+    scenarios.report();
+    scenarioPlayer.report();
+    vmProgram.report();
+    vm.report();
+}
+
+/**************************************************************************/
+/*!
+    @brief  Report per-task CPU utilisation.
+    @return void
+*/
+/**************************************************************************/
+void cmdTaskReport(uint8_t code, const uint8_t *args) {
+    scheduler.report();
+}
+
+/**************************************************************************/
+/*!
+    @brief  Turn periodic telemetry on or off.
+    @return void
+*/
+/**************************************************************************/
+void cmdTelemetryToggle(uint8_t code, const uint8_t *args) {
+    telemetry_enabled = !telemetry_enabled;
+}
+
+/**************************************************************************/
+/*!
+    @brief  Benchmark dispatch of an action code.
+    @param  code
+            DISPATCH_BENCH
+    @param  args
+            args[0]: action code to benchmark
+    @return void
+*/
+/**************************************************************************/
+void cmdDispatchBench(uint8_t code, const uint8_t *args) {
+    dispatcher.benchmark(args[0]);
+}
+
+/**************************************************************************/
+/*!
+    @brief  Set the states the EZ sweeps start and end at.
+    @param  code
+            SET_SWEEP_BOUNDS
+    @param  args
+            args[0..1]: sweep start state (high byte first),
+            args[2..3]: sweep end state (high byte first)
+    @return void
+*/
+/**************************************************************************/
+void cmdSetSweepBounds(uint8_t code, const uint8_t *args) {
+    int sweepMin = ((int)args[0] << 8) | args[1];
+    int sweepMax = ((int)args[2] << 8) | args[3];
+
+    if (!outputSM[selected_channel].setSweepBounds(sweepMin, sweepMax)) {
+        Serial.println(F("[ERROR] invalid sweep bounds"));
+        return;
+    }
+
+    config.markDirty();
+}
+
+/**************************************************************************/
+/*!
+    @brief  Start saving the current settings to EEPROM straight away
+            (written in the background).
+    @return void
+*/
+/**************************************************************************/
+void cmdConfigSave(uint8_t code, const uint8_t *args) {
+    syncConfig();
+    config.save();
+    scheduler.setPeriod(save_task_id, SAVE_TASK_PERIOD);
+    config.report();
+}
+
+/**************************************************************************/
+/*!
+    @brief  Restore and save the default settings.
+    @return void
+*/
+/**************************************************************************/
+void cmdConfigReset(uint8_t code, const uint8_t *args) {
+    config.data = defaultConfig;
+    restoreConfig(true);
+    config.save();
+    scheduler.setPeriod(save_task_id, SAVE_TASK_PERIOD);
+    config.report();
+}
+
+/**************************************************************************/
+/*!
+    @brief  Switch to the baud rate proposed by the HMI, pending
+            confirmation.
+    @param  code
+            BAUD_PROPOSE
+    @param  args
+            args[0]: rate index
+    @return void
+*/
+/**************************************************************************/
+void cmdBaudPropose(uint8_t code, const uint8_t *args) {
+    serialPort.proposeBaud(args[0]);
+}
+
+/**************************************************************************/
+/*!
+    @brief  Confirm the new baud rate using the test pattern.
+    @param  code
+            BAUD_CONFIRM
+    @param  args
+            test pattern received from the HMI
+    @return void
+*/
+/**************************************************************************/
+void cmdBaudConfirm(uint8_t code, const uint8_t *args) {
+    serialPort.confirmBaud(args);
+}
+
+/**************************************************************************/
+/*!
+    @brief  Enable sequenced frames and restart the sequence at 0.
+    @param  code
+            SEQ_RESET
+    @param  args
+            args[0]: window size (frames the HMI will keep in flight)
+    @return void
+*/
+/**************************************************************************/
+void cmdSeqReset(uint8_t code, const uint8_t *args) {
+    serialPort.resetSequence(args[0]);
+}
+
+/**************************************************************************/
+/*!
+    @brief  Do nothing. Used by the HMI to test the link.
+    @return void
+*/
+/**************************************************************************/
+void cmdNoOp(uint8_t code, const uint8_t *args) {
+}
+
+/**************************************************************************/
+/*!
+    @brief  Select the serial flow control mode.
+    @param  code
+            FLOW_CONTROL
+    @param  args
+            args[0]: FlowControlMode
+    @return void
+*/
+/**************************************************************************/
+void cmdFlowControl(uint8_t code, const uint8_t *args) {
+    serialPort.setFlowControl((FlowControlMode)args[0]);
+}
+
+/**************************************************************************/
+/*!
+    @brief  Send the received / dropped frame counters.
+    @return void
+*/
+/**************************************************************************/
+void cmdLinkStats(uint8_t code, const uint8_t *args) {
+    serialPort.sendLinkStats();
+}
+
+/**************************************************************************/
+/*!
+    @brief  Reply to a clock sync request with the time the request was
+            received and the time the reply is sent:
+            <CLOCK_SYNC><t2, 4 bytes><t3, 4 bytes>.
+            See Clock Sync in ComsAPI.h.
+    @return void
+*/
+/**************************************************************************/
+void cmdClockSync(uint8_t code, const uint8_t *args) {
+    unsigned long receivedUs = serialPort.getLastFrameTime();
+
+    serialPort.sendFrame(CLOCK_SYNC);
+    serialPort.sendTimestamp(receivedUs);
+    serialPort.sendTimestamp(micros());
+}
+
+/**************************************************************************/
+/*!
+    @brief  Queue an action code to run at a set time.
+    @param  code
+            SCHEDULE_AT
+    @param  args
+            args[0..3]: micros() time to run at (high byte first),
+            args[4]: action code (must take no arguments)
+    @return void
+*/
+/**************************************************************************/
+void cmdScheduleAt(uint8_t code, const uint8_t *args) {
+    unsigned long dueUs = ((unsigned long)args[0] << 24) | ((unsigned long)args[1] << 16) |
+                          ((unsigned long)args[2] << 8) | args[3];
+
+    if (dispatcher.argCount(args[4]) != 0) {
+        Serial.print(F("[ERROR] action code cannot be scheduled: "));
+        Serial.println(args[4]);
+        return;
+    }
+    if (!scheduledCommands.add(dueUs, args[4], selected_channel)) {
+        Serial.println(F("[ERROR] schedule queue full"));
+    }
+}
+
+/**************************************************************************/
+/*!
+    @brief  Release the emergency stop. The relays return to the current
+            state; the state machine stays IDLE until a new mode is sent.
+    @return void
+*/
+/**************************************************************************/
+void cmdEStopClear(uint8_t code, const uint8_t *args) {
+    for (uint8_t ch = 0; ch < NUM_CHANNELS; ch++) {
+        relayOutputs[ch].clearEmergencyStop();
+    }
+    Serial.println(F("[E-STOP] cleared"));
+}
+
+/**************************************************************************/
+/*!
+    @brief  Heartbeat from the HMI. Receiving the frame is all that
+            matters, so there is nothing to do.
+    @return void
+*/
+/**************************************************************************/
+void cmdHeartbeat(uint8_t code, const uint8_t *args) {
+}
+
+/**************************************************************************/
+/*!
+    @brief  Set the HMI link timeout and what happens when it expires.
+            An unknown action is rejected and leaves both unchanged.
+            Replies with <LINK_TIMEOUT><timeout><action>.
+    @param  code
+            LINK_TIMEOUT
+    @param  args
+            args[0]: timeout (x100 ms, 0 = off), args[1]: LinkLossAction
+    @return void
+*/
+/**************************************************************************/
+void cmdLinkTimeout(uint8_t code, const uint8_t *args) {
+    if (args[1] > LINK_LOSS_SAFE) {
+        Serial.print(F("[ERROR] invalid link loss action: "));
+        Serial.println(args[1]);
+    } else {
+        linkMonitor.setTimeout(args[0], (LinkLossAction)args[1]);
+        config.markDirty();
+    }
+
+    serialPort.sendFrame(LINK_TIMEOUT);
+    serialPort.sendFrame(linkMonitor.getTimeoutUnits());
+    serialPort.sendFrame(linkMonitor.getAction());
+}
+
+/**************************************************************************/
+/*!
+    @brief  Choose the channel that relay and state machine action codes
+            address. Replies with <CHANNEL_SELECT><channel>.
+    @param  code
+            CHANNEL_SELECT
+    @param  args
+            args[0]: channel (0 to NUM_CHANNELS - 1)
+    @return void
+*/
+/**************************************************************************/
+void cmdChannelSelect(uint8_t code, const uint8_t *args) {
+    if (args[0] < NUM_CHANNELS) {
+        selected_channel = args[0];
+    } else {
+        Serial.print(F("[ERROR] invalid channel: "));
+        Serial.println(args[0]);
+    }
+
+    serialPort.sendFrame(CHANNEL_SELECT);
+    serialPort.sendFrame(selected_channel);
+}
+
+/**************************************************************************/
+/*!
+    @brief  Time writes to the channel 0 output stage. Only runs with the
+            e-stop latched, as the writes still reach the output pins /
+            shift registers (held off by the latch).
+            Replies with <OUTPUT_BENCH><output count><write ns (2 bytes)>.
+    @param  code
+            OUTPUT_BENCH
+    @param  args
+            unused
+    @return void
+*/
+/**************************************************************************/
+void cmdOutputBench(uint8_t code, const uint8_t *args) {
+    ChannelOutputs &outputs = relayOutputs[0];
+    if (!outputs.isStopped()) {
+        Serial.println(F("[ERROR] output bench needs the e-stop latched"));
+        return;
+    }
+
+    ChannelMask mask = outputs.read();
+    unsigned long start = micros();
+    for (uint16_t i = 0; i < OUTPUT_BENCH_WRITES; i++) {
+        outputs.write((i & 1) ? (ChannelMask)~mask : mask);
+    }
+    unsigned long elapsed = micros() - start;
+    outputs.write(mask);
+
+    uint16_t writeNs = min(elapsed * 1000UL / OUTPUT_BENCH_WRITES, 65535UL);
+    serialPort.sendFrame(OUTPUT_BENCH);
+    serialPort.sendFrame(ChannelOutputs::numOutputs);
+    serialPort.sendFrame(highByte(writeNs));
+    serialPort.sendFrame(lowByte(writeNs));
+}
+
+/**************************************************************************/
+/*!
+    @brief  Take up a role on the sync line. Saved with the config.
+            Replies with <SYNC_ROLE><role>.
+    @param  code
+            SYNC_ROLE
+    @param  args
+            args[0]: SyncRole (0 standalone, 1 master, 2 follower)
+    @return void
+*/
+/**************************************************************************/
+void cmdSyncRole(uint8_t code, const uint8_t *args) {
+    if (args[0] > SYNC_FOLLOWER) {
+        Serial.print(F("[ERROR] invalid sync role: "));
+        Serial.println(args[0]);
+    } else {
+        syncLink.begin((SyncRole)args[0]);
+        eStop.stopOnSyncLink(syncLink.getRole() == SYNC_FOLLOWER);
+        config.markDirty();
+    }
+
+    serialPort.sendFrame(SYNC_ROLE);
+    serialPort.sendFrame(syncLink.getRole());
+}
+
+/**************************************************************************/
+/*!
+    @brief  Reply with the sync stats: <SYNC_REPORT><role>
+            <edge to outputs mean us (2 bytes)><worst us (2 bytes)>
+            <resyncs (2 bytes)><missed edges (2 bytes)><late codes (2 bytes)>.
+    @param  code
+            SYNC_REPORT
+    @param  args
+            unused
+    @return void
+*/
+/**************************************************************************/
+void cmdSyncReport(uint8_t code, const uint8_t *args) {
+    const uint16_t stats[] = {
+        syncLink.meanPulseToOutputsUs(),
+        syncLink.worstPulseToOutputsUs(),
+        syncLink.resyncs(),
+        stepTimer.missedEdges(),
+        syncLink.lateCommands()
+    };
+
+    serialPort.sendFrame(SYNC_REPORT);
+    serialPort.sendFrame(syncLink.getRole());
+    for (uint8_t i = 0; i < sizeof(stats) / sizeof(stats[0]); i++) {
+        serialPort.sendFrame(highByte(stats[i]));
+        serialPort.sendFrame(lowByte(stats[i]));
+    }
+}
+
+/**************************************************************************/
+/*!
+    @brief  Set a block of dwell table entries. Replies with
+            <DWELL_UPLOAD><first state (2 bytes)> so the HMI can pace a
+            bulk upload.
+    @param  code
+            DWELL_UPLOAD
+    @param  args
+            args[0..1]: first state, high byte first
+            args[2..]: STATE_TABLE_UPLOAD_ENTRIES dwell times in ms, high
+            byte first (0: use the switching time)
+    @return void
+*/
+/**************************************************************************/
+void cmdDwellUpload(uint8_t code, const uint8_t *args) {
+    uploadStateValues(dwellTable, code, args, true);
+}
+
+/**************************************************************************/
+/*!
+    @brief  Time the selected channel's sweeps from the dwell table, or go
+            back to the constant switching time. Replies with
+            <DWELL_ENABLE><setting in use>.
+    @param  code
+            DWELL_ENABLE
+    @param  args
+            args[0]: 1 dwell table, 0 switching time
+    @return void
+*/
+/**************************************************************************/
+void cmdDwellEnable(uint8_t code, const uint8_t *args) {
+    outputSM[selected_channel].setDwellTable(args[0] ? dwellTable.values() : NULL);
+    if (selected_channel == 0) {
+        config.markDirty();
+    }
+
+    serialPort.sendFrame(DWELL_ENABLE);
+    serialPort.sendFrame(args[0] ? 1 : 0);
+}
+
+/**************************************************************************/
+/*!
+    @brief  Start saving the dwell table to EEPROM. It is written a byte
+            at a time by the save task; TIMING_REPORT shows the
+            progress. Replies with <DWELL_SAVE><crc (2 bytes)>.
+    @param  code
+            DWELL_SAVE
+    @param  args
+            unused
+    @return void
+*/
+/**************************************************************************/
+void cmdDwellSave(uint8_t code, const uint8_t *args) {
+    uint16_t crc = dwellTable.save();
+    scheduler.setPeriod(save_task_id, SAVE_TASK_PERIOD);
+
+    serialPort.sendFrame(DWELL_SAVE);
+    serialPort.sendFrame(highByte(crc));
+    serialPort.sendFrame(lowByte(crc));
+}
+
+/**************************************************************************/
+/*!
+    @brief  Drop the dwell table. Channels timed from it go back to the
+            switching time for every state.
+    @param  code
+            DWELL_CLEAR
+    @param  args
+            unused
+    @return void
+*/
+/**************************************************************************/
+void cmdDwellClear(uint8_t code, const uint8_t *args) {
+    if (dwellTable.saving()) {
+        Serial.println(F("[ERROR] dwell table save in progress"));
+        return;
+    }
+    dwellTable.clear();
+    Serial.println(F("Dwell table cleared"));
+}
+
+/**************************************************************************/
+/*!
+    @brief  Set a block of EZ calibration table values. Replies with
+            <EZ_UPLOAD><first state (2 bytes)> so the HMI can pace a bulk
+            upload.
+    @param  code
+            EZ_UPLOAD
+    @param  args
+            args[0..1]: first state, high byte first
+            args[2..]: STATE_TABLE_UPLOAD_ENTRIES measured EZ values, in
+            EZ_UNITS_PER_EZ, high byte first
+    @return void
+*/
+/**************************************************************************/
+void cmdEzUpload(uint8_t code, const uint8_t *args) {
+    uploadStateValues(ezTable, code, args, false);
+}
+
+/**************************************************************************/
+/*!
+    @brief  Start saving the EZ calibration table to EEPROM. Replies with
+            <EZ_SAVE><crc (2 bytes)>, or an [ERROR] line if the table is not
+            monotone (it is saved anyway).
+    @param  code
+            EZ_SAVE
+    @param  args
+            unused
+    @return void
+*/
+/**************************************************************************/
+void cmdEzSave(uint8_t code, const uint8_t *args) {
+    if (!ezTable.isMonotone(ChannelStateMachine::numStates)) {
+        Serial.println(F("[ERROR] EZ table is not monotone, GOTO_EZ / EZ_SWEEP will refuse it"));
+    }
+    uint16_t crc = ezTable.save();
+    scheduler.setPeriod(save_task_id, SAVE_TASK_PERIOD);
+
+    serialPort.sendFrame(EZ_SAVE);
+    serialPort.sendFrame(highByte(crc));
+    serialPort.sendFrame(lowByte(crc));
+}
+
+/**************************************************************************/
+/*!
+    @brief  Jump the selected channel to the state whose calibrated EZ is
+            nearest the one requested, keeping its cycle mode. Replies with
+            <GOTO_EZ><state (2 bytes)><EZ of that state (2 bytes)>.
+    @param  code
+            GOTO_EZ
+    @param  args
+            args[0..1]: EZ, in EZ_UNITS_PER_EZ, high byte first
+    @return void
+*/
+/**************************************************************************/
+void cmdGotoEz(uint8_t code, const uint8_t *args) {
+    const uint16_t numStates = ChannelStateMachine::numStates;
+
+    if (!ezTable.valid() || !ezTable.isMonotone(numStates)) {
+        Serial.println(F("[ERROR] no usable EZ calibration table"));
+        return;
+    }
+
+    uint16_t state = ezTable.nearestState((args[0] << 8) | args[1], numStates);
+    outputSM[selected_channel].restoreState(state, outputSM[selected_channel].getCycleMode());
+    if (selected_channel == 0) {
+        config.markDirty();
+    }
+
+    uint16_t ez = ezTable.get(state);
+    serialPort.sendFrame(GOTO_EZ);
+    serialPort.sendFrame(highByte(state));
+    serialPort.sendFrame(lowByte(state));
+    serialPort.sendFrame(highByte(ez));
+    serialPort.sendFrame(lowByte(ez));
+}
+
+/**************************************************************************/
+/*!
+    @brief  Sweep the selected channel between two EZ values at a set rate
+            (see startEzSweep()). Replies with <EZ_SWEEP><start state
+            (2 bytes)><end state (2 bytes)>.
+    @param  code
+            EZ_SWEEP
+    @param  args
+            args[0..1]: start EZ, args[2..3]: end EZ, args[4..5]: EZ per
+            second; all in EZ_UNITS_PER_EZ, high byte first
+    @return void
+*/
+/**************************************************************************/
+void cmdEzSweep(uint8_t code, const uint8_t *args) {
+    uint16_t startEz = (args[0] << 8) | args[1];
+    uint16_t endEz = (args[2] << 8) | args[3];
+    uint16_t startState, endState;
+
+    if (!startEzSweep(selected_channel, startEz, endEz, (args[4] << 8) | args[5], startState, endState)) {
+        Serial.println(F("[ERROR] EZ sweep refused (no calibration, zero rate or length)"));
+        return;
+    }
+    if (selected_channel == 0) {
+        config.markDirty();
+    }
+
+    serialPort.sendFrame(EZ_SWEEP);
+    serialPort.sendFrame(highByte(startState));
+    serialPort.sendFrame(lowByte(startState));
+    serialPort.sendFrame(highByte(endState));
+    serialPort.sendFrame(lowByte(endState));
+}
+
+/**************************************************************************/
+/*!
+    @brief  Simulate a train approaching the crossing on the selected
+            channel (see TrainModel). The channel is put in MANUAL mode at
+            the state for the train's starting distance; TRAIN_DONE is sent
+            when the run ends. Replies with <TRAIN_START><start state
+            (2 bytes)>.
+    @param  code
+            TRAIN_START
+    @param  args
+            args[0..1]: speed in cm/s, args[2..3]: acceleration in mm/s^2
+            (signed), args[4..5]: distance from the crossing in dm,
+            args[6..7]: approach length in dm; all high byte first
+    @return void
+*/
+/**************************************************************************/
+void cmdTrainStart(uint8_t code, const uint8_t *args) {
+    uint16_t speedCmS = (args[0] << 8) | args[1];
+    int16_t accelMmS2 = (int16_t)((args[2] << 8) | args[3]);
+    uint16_t distanceDm = (args[4] << 8) | args[5];
+    uint16_t approachDm = (args[6] << 8) | args[7];
+
+    uint16_t numStates = ChannelStateMachine::numStates;
+    if (!ezTable.valid() || !ezTable.isMonotone(numStates)) {
+        Serial.println(F("[ERROR] no monotone EZ calibration"));
+        return;
+    }
+    TrainState train;
+    if (!TrainModel::initState(train, speedCmS, accelMmS2, distanceDm, approachDm)) {
+        Serial.println(F("[ERROR] train refused (approach 0, too fast or never moves)"));
+        return;
+    }
+
+    // hand the channel over in MANUAL before the model's first tick
+    trainModel.stop();
+    if (scenarioPlayer.drives(selected_channel)) {
+        scenarioPlayer.stop();
+    }
+    if (vm.drives(selected_channel)) {
+        vm.stop();
+    }
+    uint16_t state;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        state = trainModel.start(selected_channel, train, numStates);
+        outputSM[selected_channel].restoreState(state, MANUAL);
+    }
+
+    serialPort.sendFrame(TRAIN_START);
+    serialPort.sendFrame(highByte(state));
+    serialPort.sendFrame(lowByte(state));
+}
+
+/**************************************************************************/
+/*!
+    @brief  Time one update of the train model (kinematics, EZ and state
+            search). Replies with <TRAIN_BENCH><ns (2 bytes)>.
+    @param  code
+            TRAIN_BENCH
+    @param  args
+            unused
+    @return void
+*/
+/**************************************************************************/
+void cmdTrainBench(uint8_t code, const uint8_t *args) {
+    uint16_t updateNs = trainModel.benchNs(ChannelStateMachine::numStates);
+
+    serialPort.sendFrame(TRAIN_BENCH);
+    serialPort.sendFrame(highByte(updateNs));
+    serialPort.sendFrame(lowByte(updateNs));
+}
+
+/**************************************************************************/
+/*!
+    @brief  Upload the header or one phase of a scenario (see
+            ScenarioStore::set()). Replies with <SCENARIO_UPLOAD><slot>
+            <index> so the HMI can pace the upload.
+    @param  code
+            SCENARIO_UPLOAD
+    @param  args
+            args[0]: slot, args[1]: index (0 header, 1 to
+            SCENARIO_MAX_PHASES phase), args[2..]: SCENARIO_UPLOAD_SIZE
+            data bytes
+    @return void
+*/
+/**************************************************************************/
+void cmdScenarioUpload(uint8_t code, const uint8_t *args) {
+    if (!scenarios.set(args[0], args[1], args + 2)) {
+        Serial.println(F("[ERROR] scenario upload refused (slot, index or save in progress)"));
+        return;
+    }
+
+    serialPort.sendFrame(SCENARIO_UPLOAD);
+    serialPort.sendFrame(args[0]);
+    serialPort.sendFrame(args[1]);
+}
+
+/**************************************************************************/
+/*!
+    @brief  Start saving the uploaded scenario to EEPROM. Replies with
+            <SCENARIO_SAVE><slot><crc (2 bytes)>.
+    @param  code
+            SCENARIO_SAVE
+    @param  args
+            args[0]: slot
+    @return void
+*/
+/**************************************************************************/
+void cmdScenarioSave(uint8_t code, const uint8_t *args) {
+    uint16_t crc;
+    if (!scenarios.save(args[0], crc)) {
+        Serial.println(F("[ERROR] scenario not saved (not uploaded, not valid or save in progress)"));
+        return;
+    }
+    scheduler.setPeriod(save_task_id, SAVE_TASK_PERIOD);
+
+    serialPort.sendFrame(SCENARIO_SAVE);
+    serialPort.sendFrame(args[0]);
+    serialPort.sendFrame(highByte(crc));
+    serialPort.sendFrame(lowByte(crc));
+}
+
+/**************************************************************************/
+/*!
+    @brief  Play a scenario on the selected channel (see ScenarioPlayer),
+            or switch to it at the end of the current train. Progress is
+            sent as SCENARIO_EVENTs. Replies with <SCENARIO_START><slot>
+            <1 if the switch is pending, else 0>.
+    @param  code
+            SCENARIO_START
+    @param  args
+            args[0]: slot, args[1]: 1 to switch at the end of the current
+            train
+    @return void
+*/
+/**************************************************************************/
+void cmdScenarioStart(uint8_t code, const uint8_t *args) {
+    uint16_t numStates = ChannelStateMachine::numStates;
+    if (!ezTable.valid() || !ezTable.isMonotone(numStates)) {
+        Serial.println(F("[ERROR] no monotone EZ calibration"));
+        return;
+    }
+    Scenario scenario;
+    if (!scenarios.load(args[0], scenario)) {
+        Serial.println(F("[ERROR] no valid scenario in slot"));
+        return;
+    }
+
+    scenarioPlayer.prepare(scenario, args[0]);
+    bool deferred = args[1] && scenarioPlayer.drives(selected_channel) && scenarioPlayer.switchAtTrainEnd();
+    if (!deferred) {
+        // hand the channel over in MANUAL before the scenario's first tick
+        if (trainModel.drives(selected_channel)) {
+            trainModel.stop();
+        }
+        if (vm.drives(selected_channel)) {
+            vm.stop();
+        }
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            uint16_t state = scenarioPlayer.begin(selected_channel, numStates);
+            outputSM[selected_channel].restoreState(state, MANUAL);
+        }
+    }
+
+    serialPort.sendFrame(SCENARIO_START);
+    serialPort.sendFrame(args[0]);
+    serialPort.sendFrame(deferred);
+}
+
+/**************************************************************************/
+/*!
+    @brief  Upload a block of the bytecode program. Replies with
+            <VM_UPLOAD><offset (2 bytes)> so the HMI can pace the upload.
+    @param  code
+            VM_UPLOAD
+    @param  args
+            args[0..1]: offset, high byte first, args[2..]: VM_UPLOAD_SIZE
+            program bytes
+    @return void
+*/
+/**************************************************************************/
+void cmdVmUpload(uint8_t code, const uint8_t *args) {
+    uint16_t offset = (args[0] << 8) | args[1];
+    if (vm.running() || !vmProgram.set(offset, args + 2, VM_UPLOAD_SIZE)) {
+        Serial.println(F("[ERROR] VM upload refused (running, past the end or save in progress)"));
+        return;
+    }
+
+    serialPort.sendFrame(VM_UPLOAD);
+    serialPort.sendFrame(args[0]);
+    serialPort.sendFrame(args[1]);
+}
+
+/**************************************************************************/
+/*!
+    @brief  Start saving the bytecode program to EEPROM. Replies with
+            <VM_SAVE><length (2 bytes)><crc (2 bytes)>.
+    @param  code
+            VM_SAVE
+    @param  args
+            unused
+    @return void
+*/
+/**************************************************************************/
+void cmdVmSave(uint8_t code, const uint8_t *args) {
+    if (vmProgram.saving()) {
+        Serial.println(F("[ERROR] VM program save in progress"));
+        return;
+    }
+    uint16_t crc = vmProgram.save();
+    scheduler.setPeriod(save_task_id, SAVE_TASK_PERIOD);
+    uint16_t length = vmProgram.length();
+
+    serialPort.sendFrame(VM_SAVE);
+    serialPort.sendFrame(highByte(length));
+    serialPort.sendFrame(lowByte(length));
+    serialPort.sendFrame(highByte(crc));
+    serialPort.sendFrame(lowByte(crc));
+}
+
+/**************************************************************************/
+/*!
+    @brief  Run the bytecode program on the selected channel from its
+            start, or stop it. Events are sent by vmTask(). Replies with
+            <VM_RUN><arg>.
+    @param  code
+            VM_RUN
+    @param  args
+            args[0]: 1 to run, 0 to stop
+    @return void
+*/
+/**************************************************************************/
+void cmdVmRun(uint8_t code, const uint8_t *args) {
+    if (args[0]) {
+        if (vmProgram.length() == 0) {
+            Serial.println(F("[ERROR] no VM program"));
+            return;
+        }
+        if (trainModel.drives(selected_channel)) {
+            trainModel.stop();
+        }
+        if (scenarioPlayer.drives(selected_channel)) {
+            scenarioPlayer.stop();
+        }
+        vm.start(vmProgram.code(), vmProgram.length(), &outputSM[selected_channel], selected_channel,
+                 ChannelStateMachine::numStates);
+    } else {
+        vm.stop();
+    }
+    scheduler.setPeriod(vm_task_id, VM_TASK_PERIOD);
+
+    serialPort.sendFrame(VM_RUN);
+    serialPort.sendFrame(args[0]);
+}
+
+/**************************************************************************/
+/*!
+    @brief  Time the bytecode interpreter (see BytecodeVM::benchNs()).
+            Replies with <VM_BENCH><ns (2 bytes)>.
+    @param  code
+            VM_BENCH
+    @param  args
+            unused
+    @return void
+*/
+/**************************************************************************/
+void cmdVmBench(uint8_t code, const uint8_t *args) {
+    uint16_t instructionNs = BytecodeVM::benchNs();
+
+    serialPort.sendFrame(VM_BENCH);
+    serialPort.sendFrame(highByte(instructionNs));
+    serialPort.sendFrame(lowByte(instructionNs));
+}
@@ -0,0 +1,478 @@
+# Host-side link benchmark for the GCP simulator Mega.
+#
+# Reads the capability block returned with HMI_ACK, negotiates each supported
+# baud rate in turn through the BAUD_PROPOSE / BAUD_CONFIRM handshake, then
+# measures HMI_HELLO round-trip latency and sustained command throughput at
+# that rate. Sequenced (SEQ_RESET) throughput is measured with a window of 1,
+# i.e. one command per round trip, and with the window given by --window.
+# The overflow test bursts unsequenced frames with and without XON/XOFF flow
+# control and reports how many frames the Mega lost.
+# Finally the host clock is synchronised to the Mega's micros() with CLOCK_SYNC
+# exchanges, and NO_OPs scheduled with SCHEDULE_AT report their scheduling error.
+# The e-stop test sends the raw e-stop byte and reports the Mega's RX interrupt
+# to relays-off latency alongside the host round trip.
+# With the e-stop latched, OUTPUT_BENCH times writes to the output stage (relay
+# pins, or the 74HC595 chain in a SHIFT_REGISTER_OUTPUTS build).
+# TRAIN_BENCH times one update of the on-device train approach model, and
+# VM_BENCH one instruction of the bytecode VM.
+#
+# usage: python hmi_bench.py <port> [--boot-baud 9600] [--count 200]
+# requires: pyserial
+
+import argparse
+import re
+import time
+
+import serial
+
+HMI_ACK = 253
+HMI_HELLO = 254
+BAUD_PROPOSE = 225
+BAUD_CONFIRM = 226
+BAUD_REJECT = 255
+SEQ_RESET = 227
+NO_OP = 228
+FLOW_CONTROL = 229
+LINK_STATS = 230
+CLOCK_SYNC = 231
+SCHEDULE_AT = 232
+SCHEDULE_DONE = 233
+ESTOP_CLEAR = 234
+ESTOP_TRIPPED = 235
+OUTPUT_BENCH = 240
+TRAIN_BENCH = 246
+VM_BENCH = 219
+ESTOP_BYTE = b"!"
+SEQ_ACK = 252
+
+# must match baudRates in src/SerialPort.cpp
+BAUD_RATES = [9600, 19200, 38400, 57600, 115200, 250000, 500000, 1000000]
+BAUD_TEST_PATTERN = [0x55, 0xAA, 0x0F, 0xF0]
+
+frame_re = re.compile(rb"<(\d+)>")
+
+
+class Link:
+    def __init__(self, port: str, baud: int):
+        self.ser = serial.Serial(port, baud, timeout=0.05)
+        self.rx = b""
+
+    def send(self, *values: int):
+        self.ser.write(b"".join(f"<{v}>".encode() for v in values))
+
+    def read_frame(self, timeout: float = 1.0):
+        """Return the next <n> frame value, skipping debug text. None on timeout."""
+        deadline = time.perf_counter() + timeout
+        while True:
+            match = frame_re.search(self.rx)
+            if match:
+                self.rx = self.rx[match.end():]
+                return int(match.group(1))
+            if time.perf_counter() > deadline:
+                return None
+            self.rx += self.ser.read(self.ser.in_waiting or 1)
+
+    def expect(self, *values: int, timeout: float = 1.0) -> bool:
+        for value in values:
+            frame = self.read_frame(timeout)
+            while frame is not None and frame != value:
+                frame = self.read_frame(timeout)
+            if frame is None:
+                return False
+        return True
+
+    def set_baud(self, baud: int):
+        self.ser.baudrate = baud
+        self.rx = b""
+
+
+CAPABILITY_FIELDS = [
+    # (name, size in bytes) in the order of the capability block (see include/ComsAPI.h)
+    ("features", 2),
+    ("states", 2),
+    ("outputs", 1),
+    ("min_step_ms", 2),
+    ("step_unit_ms", 1),
+    ("step_resolution_us", 2),
+    ("rx_buffer", 1),
+    ("max_args", 1),
+    ("queue_depth", 1),
+    ("max_baud_index", 1),
+    ("schedule_depth", 1),
+    ("channels", 1),
+]
+
+
+def hello(link: Link, timeout: float = 1.0):
+    """Send HMI_HELLO and parse the capability block. Returns a dict, or None on timeout."""
+    link.send(HMI_HELLO)
+    if not link.expect(HMI_ACK, timeout=timeout):
+        return None
+
+    version = link.read_frame(timeout)
+    length = link.read_frame(timeout)
+    if version is None or length is None:
+        return None
+    block = [link.read_frame(timeout) for _ in range(length)]
+    if None in block:
+        return None
+
+    caps = {"protocol_version": version}
+    pos = 0
+    for name, size in CAPABILITY_FIELDS:
+        if pos + size > len(block):
+            break
+        value = 0
+        for byte in block[pos:pos + size]:
+            value = (value << 8) | byte
+        caps[name] = value
+        pos += size
+    return caps
+
+
+def negotiate(link: Link, rate_index: int) -> bool:
+    link.send(BAUD_PROPOSE, rate_index)
+    if not link.expect(BAUD_PROPOSE, rate_index):
+        return False
+
+    time.sleep(0.02)    # let the Mega restart its UART
+    link.set_baud(BAUD_RATES[rate_index])
+    link.send(BAUD_CONFIRM, *BAUD_TEST_PATTERN)
+    return link.expect(BAUD_CONFIRM, *BAUD_TEST_PATTERN)
+
+
+def measure_rtt(link: Link, count: int):
+    rtts = []
+    for _ in range(count):
+        start = time.perf_counter()
+        if hello(link) is None:
+            return None
+        rtts.append((time.perf_counter() - start) * 1000)
+    return sum(rtts) / len(rtts), max(rtts)
+
+
+def measure_throughput(link: Link, count: int):
+    start = time.perf_counter()
+    link.send(*([HMI_HELLO] * count))
+    received = 0
+    while received < count and link.expect(HMI_ACK):
+        received += 1
+    elapsed = time.perf_counter() - start
+    return received / elapsed, count - received
+
+
+def measure_pipelined(link: Link, count: int, window: int):
+    """Send count sequenced NO_OPs keeping up to window in flight (go-back-N).
+    Returns (commands per second, frames resent), or None if the link stalls."""
+    link.send(SEQ_RESET, window)
+    if not link.expect(SEQ_RESET):
+        return None
+    window = link.read_frame()
+
+    base = 0        # oldest unacknowledged command
+    next_cmd = 0    # next command to send
+    credits = window
+    resent = 0
+    stalls = 0
+    start = time.perf_counter()
+
+    while base < count:
+        while next_cmd < count and next_cmd - base < min(window, credits):
+            link.ser.write(f"<{next_cmd & 0xFF},{NO_OP}>".encode())
+            next_cmd += 1
+
+        acked = link.read_frame(0.5) if link.expect(SEQ_ACK, timeout=0.5) else None
+        new_credits = link.read_frame(0.5) if acked is not None else None
+        if new_credits is None:
+            stalls += 1
+            if stalls > 5:
+                return None
+            resent += next_cmd - base
+            next_cmd = base
+            continue
+
+        offset = (acked - base) & 0xFF
+        if offset < next_cmd - base:
+            base += offset + 1
+            credits = max(new_credits, 1)
+        else:
+            # repeated ACK: a frame was lost, resend everything after it
+            resent += next_cmd - base
+            next_cmd = base
+
+    return count / (time.perf_counter() - start), resent
+
+
+def overflow_test(link: Link, count: int, xonxoff: bool):
+    """Burst count unsequenced NO_OPs in one write and count how many the Mega kept.
+    Returns the number of frames lost, or None if the link stalls."""
+    link.send(FLOW_CONTROL, 1 if xonxoff else 0)
+    if not link.expect(FLOW_CONTROL):
+        return None
+    link.read_frame()
+    link.ser.xonxoff = xonxoff
+
+    link.send(SEQ_RESET, 1)     # also clears the frame counters
+    if not link.expect(SEQ_RESET):
+        return None
+    link.read_frame()
+
+    link.send(*([NO_OP] * count))
+    link.ser.flush()
+    time.sleep(0.5)
+
+    link.send(LINK_STATS)
+    if not link.expect(LINK_STATS, timeout=2.0):
+        return None
+    stats = [link.read_frame() for _ in range(4)]
+    link.ser.xonxoff = False
+    if None in stats:
+        return None
+
+    received = (stats[0] << 8) | stats[1]
+    return count + 1 - received     # LINK_STATS itself is counted
+
+
+def read_u32(link: Link, timeout: float = 1.0):
+    value = 0
+    for _ in range(4):
+        byte = link.read_frame(timeout)
+        if byte is None:
+            return None
+        value = (value << 8) | byte
+    return value
+
+
+def frame_time(link: Link, chars: int) -> float:
+    """Seconds to transmit chars characters (10 bits each) at the current baud rate."""
+    return chars * 10 / link.ser.baudrate
+
+
+class ClockSync:
+    """Maps host time (perf_counter seconds) to the Mega's micros() as
+    device = offset + (1 + drift) * host, fitted over CLOCK_SYNC exchanges."""
+
+    def __init__(self):
+        self.samples = []   # (host time us, offset us, round trip us)
+        self.offset = 0.0
+        self.drift = 0.0
+
+    def exchange(self, link: Link) -> bool:
+        request = f"<{CLOCK_SYNC}>".encode()
+        t1 = time.perf_counter()
+        link.ser.write(request)
+        if not link.expect(CLOCK_SYNC):
+            return False
+        t2 = read_u32(link)
+        t3 = read_u32(link)
+        t4 = time.perf_counter()
+        if t2 is None or t3 is None:
+            return False
+
+        # t2 is taken at the request's '>' and t3 before the reply is sent, so remove
+        # the time spent on the wire; the rest of the path is assumed symmetric
+        t1 = (t1 + frame_time(link, len(request))) * 1e6
+        reply_chars = len(f"<{CLOCK_SYNC}>") + sum(len(f"<{(t >> s) & 0xFF}>") for t in (t2, t3) for s in (24, 16, 8, 0))
+        t4 = (t4 - frame_time(link, reply_chars)) * 1e6
+
+        t3 = t2 + ((t3 - t2) & 0xFFFFFFFF)      # micros() may wrap between t2 and t3
+        offset = ((t2 - t1) + (t3 - t4)) / 2
+        round_trip = (t4 - t1) - (t3 - t2)
+        self.samples.append((t1, offset, round_trip))
+        return True
+
+    def fit(self):
+        """Least squares fit of offset against host time, over the half of the samples
+        with the shortest round trip. Returns the worst residual in us."""
+        best = sorted(self.samples, key=lambda s: s[2])[:max(2, len(self.samples) // 2)]
+        best.sort()
+        t0 = best[0][0]
+        offsets = [o for _, o, _ in best]
+        # unwrap micros() so the fit is continuous
+        for i in range(1, len(offsets)):
+            while offsets[i] - offsets[i - 1] > 2 ** 31:
+                offsets[i] -= 2 ** 32
+            while offsets[i] - offsets[i - 1] < -2 ** 31:
+                offsets[i] += 2 ** 32
+        xs = [t - t0 for t, _, _ in best]
+        mean_x = sum(xs) / len(xs)
+        mean_y = sum(offsets) / len(offsets)
+        var = sum((x - mean_x) ** 2 for x in xs)
+        self.drift = sum((x - mean_x) * (y - mean_y) for x, y in zip(xs, offsets)) / var if var else 0.0
+        self.offset = mean_y - self.drift * (mean_x + t0)
+        return max(abs(y - (self.offset + self.drift * (x + t0))) for x, y in zip(xs, offsets))
+
+    def to_device(self, host_s: float) -> int:
+        host_us = host_s * 1e6
+        return int(host_us + self.offset + self.drift * host_us) & 0xFFFFFFFF
+
+
+def measure_scheduling(link: Link, sync: ClockSync, count: int, lead: float = 0.05):
+    """Schedule count NO_OPs lead seconds ahead and collect the scheduling error
+    the Mega reports. Returns (mean error us, worst error us), or None on timeout."""
+    errors = []
+    for _ in range(count):
+        due = sync.to_device(time.perf_counter() + lead)
+        link.send(SCHEDULE_AT, *[(due >> s) & 0xFF for s in (24, 16, 8, 0)], NO_OP)
+        if not link.expect(SCHEDULE_DONE, NO_OP, timeout=lead + 1.0):
+            return None
+        hi, lo = link.read_frame(), link.read_frame()
+        if hi is None or lo is None:
+            return None
+        errors.append((hi << 8) | lo)
+    return sum(errors) / len(errors), max(errors)
+
+
+def measure_estop(link: Link, count: int):
+    """Trip and clear the e-stop count times. Returns (worst Mega latency us,
+    mean host round trip ms), or None on timeout."""
+    latencies = []
+    round_trips = []
+    for _ in range(count):
+        start = time.perf_counter()
+        link.ser.write(ESTOP_BYTE)
+        if not link.expect(ESTOP_TRIPPED):
+            return None
+        round_trips.append((time.perf_counter() - start) * 1000)
+        hi, lo = link.read_frame(), link.read_frame()
+        if hi is None or lo is None:
+            return None
+        latencies.append((hi << 8) | lo)
+        link.send(ESTOP_CLEAR)
+        time.sleep(0.01)
+    return max(latencies), sum(round_trips) / len(round_trips)
+
+
+def measure_output_update(link: Link):
+    """Latch the e-stop and time output writes on the Mega. Returns (output
+    count, mean write ns), or None on timeout."""
+    link.ser.write(ESTOP_BYTE)
+    if not link.expect(ESTOP_TRIPPED):
+        return None
+    link.read_frame()   # e-stop latency, 2 bytes
+    link.read_frame()
+    link.send(OUTPUT_BENCH)
+    result = None
+    if link.expect(OUTPUT_BENCH):
+        outputs, hi, lo = link.read_frame(), link.read_frame(), link.read_frame()
+        if None not in (outputs, hi, lo):
+            result = outputs, (hi << 8) | lo
+    link.send(ESTOP_CLEAR)
+    return result
+
+
+def measure_train_update(link: Link):
+    """Time one train model update on the Mega. Returns mean ns, or None on
+    timeout."""
+    link.send(TRAIN_BENCH)
+    if not link.expect(TRAIN_BENCH, timeout=2.0):
+        return None
+    hi, lo = link.read_frame(), link.read_frame()
+    if None in (hi, lo):
+        return None
+    return (hi << 8) | lo
+
+
+def measure_vm_instruction(link: Link):
+    """Time one bytecode VM instruction on the Mega. Returns mean ns, or None
+    on timeout."""
+    link.send(VM_BENCH)
+    if not link.expect(VM_BENCH, timeout=2.0):
+        return None
+    hi, lo = link.read_frame(), link.read_frame()
+    if None in (hi, lo):
+        return None
+    return (hi << 8) | lo
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("port")
+    parser.add_argument("--boot-baud", type=int, default=9600)
+    parser.add_argument("--count", type=int, default=200)
+    parser.add_argument("--window", type=int, default=8)
+    args = parser.parse_args()
+
+    link = Link(args.port, args.boot_baud)
+    time.sleep(2)   # Mega resets when the port opens
+    caps = hello(link, timeout=3)
+    if caps is None:
+        print("no HMI_ACK at boot baud rate")
+        return
+    print("capabilities: " + ", ".join(f"{k}={v}" for k, v in caps.items()))
+
+    max_index = caps.get("max_baud_index", len(BAUD_RATES) - 1)
+
+    print(f"{'baud':>8}  {'rtt avg ms':>10}  {'rtt max ms':>10}  {'cmds/s':>8}  {'lost':>5}"
+          f"  {'seq w=1':>8}  {'seq w=' + str(args.window):>8}  {'resent':>6}"
+          f"  {'ovf none':>8}  {'ovf xon':>8}")
+    for rate_index, baud in enumerate(BAUD_RATES[:max_index + 1]):
+        if not negotiate(link, rate_index):
+            print(f"{baud:>8}  negotiation failed, falling back")
+            time.sleep(1.2)     # Mega reverts to the previous rate after BAUD_CONFIRM_TIMEOUT_MS
+            link.set_baud(args.boot_baud)
+            continue
+
+        rtt = measure_rtt(link, args.count // 4)
+        if rtt is None:
+            print(f"{baud:>8}  link lost")
+            break
+        throughput, lost = measure_throughput(link, args.count)
+        single = measure_pipelined(link, args.count, 1)
+        windowed = measure_pipelined(link, args.count, args.window)
+        if single is None or windowed is None:
+            print(f"{baud:>8}  sequenced transfer stalled")
+            break
+        lost_none = overflow_test(link, args.count * 4, xonxoff=False)
+        lost_xon = overflow_test(link, args.count * 4, xonxoff=True)
+        print(f"{baud:>8}  {rtt[0]:>10.2f}  {rtt[1]:>10.2f}  {throughput:>8.0f}  {lost:>5}"
+              f"  {single[0]:>8.0f}  {windowed[0]:>8.0f}  {windowed[1]:>6}"
+              f"  {str(lost_none):>8}  {str(lost_xon):>8}")
+
+    sync = ClockSync()
+    for _ in range(args.count // 4):
+        if not sync.exchange(link):
+            print("clock sync failed")
+            break
+        time.sleep(0.01)
+    if len(sync.samples) >= 2:
+        residual = sync.fit()
+        print(f"clock sync: offset {sync.offset:.0f} us, drift {sync.drift * 1e6:.1f} ppm,"
+              f" worst residual {residual:.0f} us")
+        scheduled = measure_scheduling(link, sync, args.count // 4)
+        if scheduled is None:
+            print("scheduling: no SCHEDULE_DONE")
+        else:
+            print(f"scheduling error: mean {scheduled[0]:.0f} us, worst {scheduled[1]} us")
+
+    estop = measure_estop(link, 10)
+    if estop is None:
+        print("e-stop: no ESTOP_TRIPPED")
+    else:
+        print(f"e-stop: worst relay latency {estop[0]} us after RX interrupt, host round trip {estop[1]:.2f} ms")
+
+    update = measure_output_update(link)
+    if update is None:
+        print("output update: no OUTPUT_BENCH reply")
+    else:
+        print(f"output update: {update[1]} ns for {update[0]} outputs")
+
+    train = measure_train_update(link)
+    if train is None:
+        print("train model: no TRAIN_BENCH reply")
+    else:
+        print(f"train model: {train} ns per update")
+
+    instruction = measure_vm_instruction(link)
+    if instruction is None:
+        print("bytecode VM: no VM_BENCH reply")
+    else:
+        print(f"bytecode VM: {instruction} ns per instruction")
+
+    # leave the link at the boot rate
+    index = BAUD_RATES.index(args.boot_baud) if args.boot_baud in BAUD_RATES else 0
+    negotiate(link, index)
+
+
+if __name__ == "__main__":
+    main()
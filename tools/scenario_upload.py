@@ -0,0 +1,131 @@
+# Upload a train scenario to a slot of the GCP simulator Mega, save it, and
+# optionally play it on the selected channel, printing its progress events.
+#
+# The scenario is a text file (blank lines and text after # are skipped):
+#
+#   start 100           # EZ at the start of each train
+#   trains 2            # trains played back to back (0 = until stopped)
+#   approach 0 30000    # phase: label, end EZ, duration in ms
+#   island 0 20000
+#   receding 100 30000
+#   gap 100 10000
+#
+# Each phase moves the EZ in a straight line from where the last one ended
+# (a train at constant speed), or holds it. Labels are approach, island,
+# receding, gap, or a number; they only tag the progress events. EZ values may
+# have up to two decimals. --switch hands over at the end of the current train
+# of a scenario already playing.
+#
+# usage: python scenario_upload.py <port> <scenario file> --slot 0 [--baud 9600] [--play] [--switch]
+# requires: pyserial
+
+import argparse
+import time
+
+from hmi_bench import Link, hello
+from state_table_upload import crc_ccitt, EZ_UNITS_PER_EZ
+
+SCENARIO_UPLOAD = 247
+SCENARIO_SAVE = 248
+SCENARIO_START = 249
+SCENARIO_EVENT = 250
+SCENARIO_MAX_PHASES = 16            # must match include/ScenarioStore.h
+MAX_DURATION_MS = (1 << 24) - 1
+
+LABELS = {"other": 0, "approach": 1, "island": 2, "receding": 3, "gap": 4}
+LABEL_NAMES = {v: k for k, v in LABELS.items()}
+EVENTS = {1: "started", 2: "phase", 3: "switched", 4: "finished", 5: "cancelled"}
+
+
+def parse_ez(text: str) -> int:
+    ez = round(float(text) * EZ_UNITS_PER_EZ)
+    if not 0 <= ez <= 100 * EZ_UNITS_PER_EZ:
+        raise SystemExit(f"EZ out of range: {text}")
+    return ez
+
+
+def read_scenario(path: str):
+    start_ez, trains, phases = 100 * EZ_UNITS_PER_EZ, 1, []
+    with open(path) as f:
+        for line in f:
+            words = line.split("#")[0].split()
+            if not words:
+                continue
+            if words[0] == "start":
+                start_ez = parse_ez(words[1])
+            elif words[0] == "trains":
+                trains = int(words[1])
+            else:
+                label = LABELS[words[0]] if words[0] in LABELS else int(words[0])
+                duration = int(words[2])
+                if not 1 <= duration <= MAX_DURATION_MS:
+                    raise SystemExit(f"duration out of range: {duration}")
+                phases.append((label, parse_ez(words[1]), duration))
+    if not 1 <= len(phases) <= SCENARIO_MAX_PHASES:
+        raise SystemExit(f"{len(phases)} phases, 1 to {SCENARIO_MAX_PHASES} allowed")
+    return start_ez, trains, phases
+
+
+def record_crc(start_ez: int, trains: int, phases) -> int:
+    """CRC of the EEPROM record after its CRC field (see src/ScenarioStore.cpp)."""
+    data = bytes([len(phases), trains]) + start_ez.to_bytes(2, "little")
+    for label, end_ez, duration in phases + [(0, 0, 0)] * (SCENARIO_MAX_PHASES - len(phases)):
+        data += bytes([label]) + end_ez.to_bytes(2, "little") + duration.to_bytes(3, "little")
+    return crc_ccitt(data)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("port")
+    parser.add_argument("scenario_file")
+    parser.add_argument("--slot", type=int, required=True)
+    parser.add_argument("--baud", type=int, default=9600)
+    parser.add_argument("--play", action="store_true", help="play the scenario on the selected channel")
+    parser.add_argument("--switch", action="store_true", help="switch at the end of the current train")
+    args = parser.parse_args()
+    start_ez, trains, phases = read_scenario(args.scenario_file)
+
+    link = Link(args.port, args.baud)
+    time.sleep(2.0)     # the Mega resets when the port opens
+    if hello(link) is None:
+        raise SystemExit("no HMI_ACK")
+
+    # unused phases are zeroed, so the saved record matches the file
+    blocks = [[len(phases), trains, start_ez >> 8, start_ez & 0xFF, 0, 0]]
+    for label, end_ez, duration in phases + [(0, 0, 0)] * (SCENARIO_MAX_PHASES - len(phases)):
+        blocks.append([label, end_ez >> 8, end_ez & 0xFF, duration >> 16, (duration >> 8) & 0xFF, duration & 0xFF])
+    for index, block in enumerate(blocks):
+        link.send(SCENARIO_UPLOAD, args.slot, index, *block)
+        if not link.expect(SCENARIO_UPLOAD, args.slot, index):
+            raise SystemExit(f"no reply to block {index}")
+
+    link.send(SCENARIO_SAVE, args.slot)
+    if not link.expect(SCENARIO_SAVE, args.slot):
+        raise SystemExit("no reply to the save")
+    crc = (link.read_frame() << 8) | link.read_frame()
+    expected = record_crc(start_ez, trains, phases)
+    print(f"uploaded {len(phases)} phases x {trains or 'endless'} trains to slot {args.slot},"
+          f" crc {crc:04X} ({'ok' if crc == expected else f'expected {expected:04X}'})")
+
+    if not args.play:
+        return
+    link.send(SCENARIO_START, args.slot, int(args.switch))
+    if not link.expect(SCENARIO_START, args.slot):
+        raise SystemExit("scenario not started (EZ calibration?)")
+    print("switch pending" if link.read_frame() else "playing")
+
+    while True:
+        if not link.expect(SCENARIO_EVENT, timeout=MAX_DURATION_MS / 1000):
+            continue
+        kind, slot, train, phase, label = (link.read_frame() for _ in range(5))
+        elapsed = 0
+        for _ in range(4):
+            elapsed = (elapsed << 8) | link.read_frame()
+        print(f"{elapsed / 1000:10.3f} s  {EVENTS.get(kind, kind):>9}  slot {slot}  train {train}"
+              f"  phase {phase} ({LABEL_NAMES.get(label, label)})")
+        if kind in (4, 5) and slot == args.slot:
+            break
+
+
+if __name__ == "__main__":
+    main()
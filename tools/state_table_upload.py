@@ -0,0 +1,104 @@
+# Upload a per-state table to the GCP simulator Mega: the dwell table (one dwell
+# time in ms per state) or the EZ calibration table (the measured EZ of each state).
+#
+# The table is a text file with one value per line, for states 0, 1, 2... in
+# order (blank lines and lines starting with # are skipped). Dwell times are
+# whole ms, 0 keeping the switching time for that state; EZ values may have up
+# to two decimals. The values are sent STATE_TABLE_UPLOAD_ENTRIES at a time, each
+# block waiting for its reply, then the table is saved to EEPROM and the Mega's
+# CRC is checked against the file's. --enable times the selected channel's
+# sweeps from the dwell table.
+#
+# usage: python state_table_upload.py <port> <table file> --table dwell|ez [--baud 9600] [--enable]
+# requires: pyserial
+
+import argparse
+import time
+
+from hmi_bench import Link, hello
+
+DWELL_UPLOAD = 201
+DWELL_ENABLE = 202
+DWELL_SAVE = 203
+EZ_UPLOAD = 205
+EZ_SAVE = 206
+EZ_UNITS_PER_EZ = 100               # must match include/ComsAPI.h
+STATE_TABLE_UPLOAD_ENTRIES = 3      # must match include/StateValueTable.h
+STATE_TABLE_STATES = 306            # values in the Mega's tables (NUM_STATES), whatever the state count in use
+
+TABLES = {
+    # name: (upload code, save code, value parser)
+    "dwell": (DWELL_UPLOAD, DWELL_SAVE, int),
+    "ez": (EZ_UPLOAD, EZ_SAVE, lambda text: round(float(text) * EZ_UNITS_PER_EZ)),
+}
+
+
+def crc_ccitt(data: bytes) -> int:
+    """CRC-CCITT as computed by avr-libc _crc_ccitt_update, starting from 0xFFFF."""
+    crc = 0xFFFF
+    for byte in data:
+        byte ^= crc & 0xFF
+        byte = (byte ^ (byte << 4)) & 0xFF
+        crc = (((byte << 8) | (crc >> 8)) ^ (byte >> 4) ^ (byte << 3)) & 0xFFFF
+    return crc
+
+
+def read_table(path: str, parse):
+    values = []
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if line and not line.startswith("#"):
+                values.append(parse(line))
+    return values
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("port")
+    parser.add_argument("table_file")
+    parser.add_argument("--table", choices=TABLES.keys(), required=True)
+    parser.add_argument("--baud", type=int, default=9600)
+    parser.add_argument("--enable", action="store_true", help="time the selected channel from the dwell table")
+    args = parser.parse_args()
+    upload_code, save_code, parse = TABLES[args.table]
+
+    link = Link(args.port, args.baud)
+    time.sleep(2.0)     # the Mega resets when the port opens
+    caps = hello(link)
+    if caps is None:
+        raise SystemExit("no HMI_ACK")
+    states = caps.get("states", STATE_TABLE_STATES)
+
+    values = read_table(args.table_file, parse)
+    if len(values) > states:
+        raise SystemExit(f"table has {len(values)} values, the Mega has {states} states")
+    values += [0] * (states - len(values))
+
+    for first in range(0, states, STATE_TABLE_UPLOAD_ENTRIES):
+        block = values[first:first + STATE_TABLE_UPLOAD_ENTRIES]
+        block += [0] * (STATE_TABLE_UPLOAD_ENTRIES - len(block))
+        frames = [first >> 8, first & 0xFF]
+        for value in block:
+            frames += [value >> 8, value & 0xFF]
+        link.send(upload_code, *frames)
+        if not link.expect(upload_code, first >> 8, first & 0xFF):
+            raise SystemExit(f"no reply to the block at state {first}")
+
+    # dwell times are held in step timer ticks, which are 1 ms
+    table_bytes = b"".join(v.to_bytes(2, "little") for v in values + [0] * (STATE_TABLE_STATES - states))
+    link.send(save_code)
+    if not link.expect(save_code):
+        raise SystemExit("no reply to the save")
+    crc = (link.read_frame() << 8) | link.read_frame()
+    expected = crc_ccitt(table_bytes)
+    print(f"uploaded {states} values, crc {crc:04X} ({'ok' if crc == expected else f'expected {expected:04X}'})")
+
+    if args.enable and args.table == "dwell":
+        link.send(DWELL_ENABLE, 1)
+        link.expect(DWELL_ENABLE, 1)
+        print("dwell table enabled on the selected channel")
+
+
+if __name__ == "__main__":
+    main()
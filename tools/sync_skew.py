@@ -0,0 +1,91 @@
+# Inter-node skew report for GCP simulator Megas on a shared sync line.
+#
+# Connects to each Mega's USB port, optionally assigns roles with SYNC_ROLE
+# (the first port becomes the master, the rest followers), then reads
+# SYNC_REPORT from every node. Each node measures the time from the sync edge
+# to the end of its tick handler, where the outputs have been written; a
+# follower's skew is its edge-to-outputs time minus the master's.
+#
+# usage: python sync_skew.py <master port> <follower port>... [--assign]
+# requires: pyserial
+
+import argparse
+import time
+
+from hmi_bench import Link, hello
+
+SYNC_ROLE = 241
+SYNC_REPORT = 243
+
+SYNC_MASTER = 1
+SYNC_FOLLOWER = 2
+ROLE_NAMES = {0: "standalone", 1: "master", 2: "follower"}
+
+
+def read_u16(link: Link):
+    hi = link.read_frame()
+    lo = link.read_frame()
+    if hi is None or lo is None:
+        return None
+    return (hi << 8) | lo
+
+
+def sync_report(link: Link):
+    """Send SYNC_REPORT and parse the reply. Returns a dict, or None on timeout."""
+    link.send(SYNC_REPORT)
+    if not link.expect(SYNC_REPORT):
+        return None
+
+    role = link.read_frame()
+    stats = [read_u16(link) for _ in range(5)]
+    if role is None or None in stats:
+        return None
+    mean_us, worst_us, resyncs, missed_edges, late = stats
+    return {"role": role, "mean_us": mean_us, "worst_us": worst_us,
+            "resyncs": resyncs, "missed_edges": missed_edges, "late": late}
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("master")
+    parser.add_argument("followers", nargs="+")
+    parser.add_argument("--baud", type=int, default=9600)
+    parser.add_argument("--assign", action="store_true", help="set the roles with SYNC_ROLE first")
+    parser.add_argument("--settle", type=float, default=1.0, help="seconds to run before reading the stats")
+    args = parser.parse_args()
+
+    links = [Link(port, args.baud) for port in [args.master] + args.followers]
+    for port, link in zip([args.master] + args.followers, links):
+        time.sleep(2.0)     # the Mega resets when the port opens
+        if hello(link) is None:
+            raise SystemExit(f"{port}: no HMI_ACK")
+
+    if args.assign:
+        # followers first, so they are listening before the master starts the line
+        for link in links[1:]:
+            link.send(SYNC_ROLE, SYNC_FOLLOWER)
+            link.expect(SYNC_ROLE, SYNC_FOLLOWER)
+        links[0].send(SYNC_ROLE, SYNC_MASTER)
+        links[0].expect(SYNC_ROLE, SYNC_MASTER)
+        time.sleep(args.settle)
+
+    reports = [sync_report(link) for link in links]
+    if reports[0] is None:
+        raise SystemExit(f"{args.master}: no SYNC_REPORT")
+    master = reports[0]
+
+    print(f"{'port':<16} {'role':<10} {'mean us':>8} {'worst us':>9} {'skew us':>8} "
+          f"{'worst skew':>10} {'resyncs':>8} {'missed':>7} {'late':>5}")
+    for port, report in zip([args.master] + args.followers, reports):
+        if report is None:
+            print(f"{port:<16} no reply")
+            continue
+        skew = report["mean_us"] - master["mean_us"]
+        worst_skew = report["worst_us"] - master["worst_us"]
+        print(f"{port:<16} {ROLE_NAMES.get(report['role'], report['role']):<10} "
+              f"{report['mean_us']:>8} {report['worst_us']:>9} {skew:>8} {worst_skew:>10} "
+              f"{report['resyncs']:>8} {report['missed_edges']:>7} {report['late']:>5}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,178 @@
+# Assemble a bytecode test program for the GCP simulator Mega, upload and save
+# it, and optionally run it on the selected channel, printing its events.
+#
+# One instruction per line; text after # is a comment. Opcode names are those
+# of include/BytecodeVM.h in lower case, without VM_OP_. An opcode followed by
+# a number (or a mode name) pushes it first, so "wait_ms 500" is
+# "push 500" then "wait_ms". "name:" defines a label for jmp / jz. "loop" pops
+# its count and runs up to the matching "end_loop"; the assembler fills in its
+# exit address.
+#
+#   set_period 100
+#   loop 3                  # three sweeps down and back
+#       mode reset_high_ez
+#       mode decrease_ez
+#       wait_sweep
+#       emit 1
+#       mode increase_ez
+#       wait_sweep
+#   end_loop
+#   set_state 0
+#   wait_us 2500
+#   step 10
+#   emit 2
+#
+# usage: python vm_asm.py <port> <program file> [--baud 9600] [--run] [--no-save]
+#        python vm_asm.py <port> --bench
+#        python vm_asm.py - <program file>          (assemble and list only)
+# requires: pyserial
+
+import argparse
+import time
+
+from state_table_upload import crc_ccitt
+
+VM_UPLOAD = 215
+VM_SAVE = 216
+VM_RUN = 217
+VM_EVENT = 218
+VM_BENCH = 219
+VM_PROGRAM_SIZE = 256               # must match include/VMProgram.h
+VM_UPLOAD_SIZE = 6
+
+# must match include/BytecodeVM.h: name -> (opcode, operand bytes)
+OPCODES = {
+    "halt": (0x00, 0), "push8": (0x01, 1), "push16": (0x02, 2), "dup": (0x03, 0), "drop": (0x04, 0),
+    "add": (0x05, 0), "sub": (0x06, 0), "jmp": (0x07, 2), "jz": (0x08, 2), "loop": (0x09, 2),
+    "end_loop": (0x0A, 0), "set_state": (0x10, 0), "step": (0x11, 0), "get_state": (0x12, 0),
+    "set_period": (0x13, 0), "mode": (0x14, 0), "wait_sweep": (0x15, 0), "wait_us": (0x20, 0),
+    "wait_ms": (0x21, 0), "emit": (0x30, 0),
+}
+MODES = {"decrease_ez": 100, "increase_ez": 101, "reset_high_ez": 102, "reset_low_ez": 103,
+         "manual": 110, "idle": 111}
+STATUS = {3: "emit", 4: "halted", 5: "faulted", 6: "cancelled"}
+FAULTS = {1: "bad opcode", 2: "stack", 3: "address", 4: "loop", 5: "channel"}
+
+
+def push(value: int) -> bytes:
+    if 0 <= value <= 255:
+        return bytes([OPCODES["push8"][0], value])
+    if not -32768 <= value <= 65535:
+        raise SystemExit(f"value out of range: {value}")
+    return bytes([OPCODES["push16"][0]]) + (value & 0xFFFF).to_bytes(2, "big")
+
+
+def assemble(path: str) -> bytes:
+    code = bytearray()
+    labels, fixups, loops = {}, [], []
+    with open(path) as f:
+        for number, line in enumerate(f, 1):
+            words = line.split("#")[0].split()
+            if not words:
+                continue
+            name = words[0].lower()
+            if name.endswith(":"):
+                labels[name[:-1]] = len(code)
+                continue
+            if name == "push":
+                code += push(int(words[1], 0))
+                continue
+            if name not in OPCODES:
+                raise SystemExit(f"line {number}: unknown opcode {words[0]}")
+            opcode, operand_size = OPCODES[name]
+            arg = words[1] if len(words) > 1 else None
+
+            if name in ("jmp", "jz"):
+                code.append(opcode)
+                fixups.append((len(code), arg, number))
+                code += b"\0\0"
+                continue
+            if arg is not None:
+                code += push(MODES[arg.lower()] if arg.lower() in MODES else int(arg, 0))
+            code.append(opcode)
+            if name == "loop":
+                loops.append(len(code))
+                code += b"\0\0"
+            elif name == "end_loop":
+                if not loops:
+                    raise SystemExit(f"line {number}: end_loop without loop")
+                operand = loops.pop()
+                code[operand:operand + 2] = len(code).to_bytes(2, "big")
+            elif operand_size:
+                raise SystemExit(f"line {number}: use push / push16 for literals")
+    if loops:
+        raise SystemExit("loop without end_loop")
+    for pos, label, number in fixups:
+        if label not in labels:
+            raise SystemExit(f"line {number}: unknown label {label}")
+        code[pos:pos + 2] = labels[label].to_bytes(2, "big")
+    if len(code) > VM_PROGRAM_SIZE:
+        raise SystemExit(f"program is {len(code)} bytes, {VM_PROGRAM_SIZE} allowed")
+    return bytes(code)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("port", help="serial port, or - to only assemble")
+    parser.add_argument("program_file", nargs="?")
+    parser.add_argument("--baud", type=int, default=9600)
+    parser.add_argument("--run", action="store_true", help="run the program on the selected channel")
+    parser.add_argument("--no-save", action="store_true", help="leave the program in RAM only")
+    parser.add_argument("--bench", action="store_true", help="time the interpreter")
+    args = parser.parse_args()
+
+    code = assemble(args.program_file) if args.program_file else b""
+    if args.port == "-":
+        print(f"{len(code)} bytes, crc {crc_ccitt(code):04X}")
+        print(code.hex(" "))
+        return
+
+    from hmi_bench import Link, hello
+    link = Link(args.port, args.baud)
+    time.sleep(2.0)     # the Mega resets when the port opens
+    if hello(link) is None:
+        raise SystemExit("no HMI_ACK")
+
+    if args.bench:
+        link.send(VM_BENCH)
+        if not link.expect(VM_BENCH, timeout=2.0):
+            raise SystemExit("no VM_BENCH reply")
+        print(f"interpreter: {(link.read_frame() << 8) | link.read_frame()} ns per instruction")
+    if not code:
+        return
+
+    padded = code + bytes(-len(code) % VM_UPLOAD_SIZE)
+    for offset in range(0, len(padded), VM_UPLOAD_SIZE):
+        link.send(VM_UPLOAD, offset >> 8, offset & 0xFF, *padded[offset:offset + VM_UPLOAD_SIZE])
+        if not link.expect(VM_UPLOAD, offset >> 8, offset & 0xFF):
+            raise SystemExit(f"no reply to the block at {offset} (program running?)")
+
+    if not args.no_save:
+        link.send(VM_SAVE)
+        if not link.expect(VM_SAVE):
+            raise SystemExit("no reply to the save")
+        length = (link.read_frame() << 8) | link.read_frame()
+        crc = (link.read_frame() << 8) | link.read_frame()
+        expected = crc_ccitt(padded)
+        print(f"saved {length} bytes, crc {crc:04X} ({'ok' if crc == expected else f'expected {expected:04X}'})")
+
+    if not args.run:
+        return
+    link.send(VM_RUN, 1)
+    if not link.expect(VM_RUN, 1):
+        raise SystemExit("program not started")
+    start = time.perf_counter()
+    while True:
+        if not link.expect(VM_EVENT, timeout=60.0):
+            continue
+        status, pc_hi, pc_lo, hi, lo = (link.read_frame() for _ in range(5))
+        value = int.from_bytes(bytes([hi, lo]), "big", signed=True)
+        detail = FAULTS.get(value, value) if status == 5 else value
+        print(f"{time.perf_counter() - start:9.3f} s  {STATUS.get(status, status):>9}"
+              f"  at {(pc_hi << 8) | pc_lo:3}  {detail}")
+        if status != 3:
+            break
+
+
+if __name__ == "__main__":
+    main()